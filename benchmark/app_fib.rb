@@ -0,0 +1,12 @@
+# Same as bin/bm_app_fib.
+def script
+  fib(28)
+end
+
+def fib(n)
+  if n < 3
+    1
+  else
+    fib(n-1) + fib(n-2)
+  end
+end
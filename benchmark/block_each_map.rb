@@ -0,0 +1,9 @@
+# Nested blocks of Array#each and Array#map, capturing local variables of the method.
+def script
+  ary = (1..1000).to_a
+  sum = 0
+  100.times do
+    ary.map { |x| x * 2 }.each { |x| sum += x }
+  end
+  sum
+end
@@ -0,0 +1,8 @@
+# A hot block passed to a C method. Profiler compiles such blocks with the method.
+def script
+  sum = 0
+  1_000_000.times do |i|
+    sum += i
+  end
+  sum
+end
@@ -0,0 +1,14 @@
+# A method yielding to a block many times, with arguments.
+def each_pair_sum(n)
+  i = 0
+  while i < n
+    yield i, i + 1
+    i += 1
+  end
+end
+
+def script
+  sum = 0
+  each_pair_sum(2_000_000) { |a, b| sum += a + b }
+  sum
+end
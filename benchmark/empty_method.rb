@@ -0,0 +1,4 @@
+# Same as bin/bm_empty_method.
+def script
+  1
+end
@@ -0,0 +1,7 @@
+# Same as bin/bm_ivar_while.
+def script
+  @i = 0
+  while @i< 6_000_000
+    @i += 1
+  end
+end
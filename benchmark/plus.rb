@@ -0,0 +1,4 @@
+# Same as bin/bm_plus.
+def script
+  1 + 2 + 3 + 4 + 5
+end
@@ -0,0 +1,157 @@
+#!/usr/bin/env ruby
+# Runs benchmark/*.rb with and without LLRB, each in a fresh process, and reports speedup, compile time and memory.
+#
+#   ruby benchmark/runner.rb [--time SEC] [--pass-pipeline o3|lean] [--json PATH] [--baseline PATH]
+#                            [--threshold RATIO] [NAME...]
+#
+# A benchmark file defines `script` method and its helpers, which are evaluated in an anonymous module.
+# In LLRB mode, all methods defined in the module and classes nested in it are compiled before measurement.
+# With --baseline, it exits with 1 if any speedup drops by more than --threshold from the baseline JSON.
+
+require 'json'
+require 'optparse'
+require 'rbconfig'
+
+module LLRBBenchmark
+  MODES = %w[ruby llrb]
+
+  class << self
+    def run(argv)
+      options = { time: 3.0, warmup: 1.0, threshold: 0.05, pass_pipeline: 'o3' }
+      parser = OptionParser.new
+      parser.on('--time SEC', Float) { |v| options[:time] = v }
+      parser.on('--warmup SEC', Float) { |v| options[:warmup] = v }
+      parser.on('--pass-pipeline NAME', %w[o3 lean]) { |v| options[:pass_pipeline] = v }
+      parser.on('--json PATH') { |v| options[:json] = v }
+      parser.on('--baseline PATH') { |v| options[:baseline] = v }
+      parser.on('--threshold RATIO', Float) { |v| options[:threshold] = v }
+      parser.on('--child MODE', MODES) { |v| options[:child] = v }
+      names = parser.parse(argv)
+
+      if options[:child]
+        $stdout.puts JSON.dump(measure(options[:child], names.first, options))
+        return true
+      end
+
+      results = benchmark_files(names).map { |file| run_benchmark(file, options) }
+      report(results)
+      File.write(options[:json], JSON.pretty_generate(results)) if options[:json]
+      options[:baseline] ? check_regression(results, options[:baseline], options[:threshold]) : true
+    end
+
+    private
+
+    def benchmark_files(names)
+      files = Dir.glob(File.join(__dir__, '*.rb')).sort - [File.expand_path(__FILE__)]
+      return files if names.empty?
+      names.map do |name|
+        files.find { |f| File.basename(f, '.rb') == name } || abort("benchmark '#{name}' is not found")
+      end
+    end
+
+    def run_benchmark(file, options)
+      results = MODES.map do |mode|
+        args = [RbConfig.ruby, '-I', File.expand_path('../lib', __dir__), __FILE__, '--child', mode,
+                '--time', options[:time].to_s, '--warmup', options[:warmup].to_s,
+                '--pass-pipeline', options[:pass_pipeline], file]
+        output = IO.popen(args, &:read)
+        abort("benchmark '#{File.basename(file)}' failed in #{mode} mode") unless $?.success?
+        [mode, JSON.parse(output)]
+      end.to_h
+
+      {
+        'name' => File.basename(file, '.rb'),
+        'pass_pipeline' => options[:pass_pipeline],
+        'ruby_ips' => results['ruby']['ips'],
+        'llrb_ips' => results['llrb']['ips'],
+        'speedup' => results['llrb']['ips'] / results['ruby']['ips'],
+        'compiled' => results['llrb']['compiled'],
+        'compile_time_ms' => results['llrb']['compile_time_ms'],
+        'ruby_rss_kb' => results['ruby']['rss_kb'],
+        'llrb_rss_kb' => results['llrb']['rss_kb'],
+      }
+    end
+
+    def measure(mode, file, options)
+      mod = Module.new
+      mod.module_eval(File.read(file), file)
+      runner = Object.new.extend(mod)
+
+      compiled, compile_time = 0, 0.0
+      if mode == 'llrb'
+        require 'llrb'
+        LLRB::JIT.pass_pipeline = options[:pass_pipeline].to_sym
+        started_at = now
+        compiled = compile_methods(mod)
+        compile_time = now - started_at
+      end
+
+      iterate(runner, options[:warmup])
+      iterations, elapsed = iterate(runner, options[:time])
+      {
+        'ips' => iterations / elapsed,
+        'compiled' => compiled,
+        'compile_time_ms' => compile_time * 1000,
+        'rss_kb' => peak_rss_kb,
+      }
+    end
+
+    def compile_methods(mod)
+      classes = [mod] + mod.constants.map { |c| mod.const_get(c) }.grep(Module)
+      classes.sum do |klass|
+        names = klass.instance_methods(false) + klass.private_instance_methods(false)
+        names.count { |name| LLRB::JIT.compile_proc(klass.instance_method(name)) }
+      end
+    end
+
+    # Calls `script` until `time` seconds pass, at least once.
+    def iterate(runner, time)
+      iterations = 0
+      started_at = now
+      begin
+        runner.script
+        iterations += 1
+        elapsed = now - started_at
+      end while elapsed < time
+      [iterations, elapsed]
+    end
+
+    def peak_rss_kb
+      status = File.read('/proc/self/status') if File.exist?('/proc/self/status')
+      if status && (hwm = status[/^VmHWM:\s*(\d+) kB/, 1])
+        hwm.to_i
+      else
+        `ps -o rss= -p #{Process.pid}`.to_i # current RSS on platforms without procfs
+      end
+    end
+
+    def report(results)
+      puts format('%-22s %12s %12s %8s %9s %10s %10s', 'name', 'ruby i/s', 'llrb i/s', 'speedup',
+                  'compile', 'ruby RSS', 'llrb RSS')
+      results.each do |r|
+        puts format('%-22s %12.3f %12.3f %7.2fx %7.2fms %8dKB %8dKB', r['name'], r['ruby_ips'], r['llrb_ips'],
+                    r['speedup'], r['compile_time_ms'], r['ruby_rss_kb'], r['llrb_rss_kb'])
+      end
+    end
+
+    # Speedup is compared instead of i/s, so that the baseline taken on another machine is still meaningful.
+    def check_regression(results, baseline_path, threshold)
+      baseline = JSON.parse(File.read(baseline_path)).map { |r| [r['name'], r] }.to_h
+      regressions = results.select do |r|
+        base = baseline[r['name']]
+        base && r['speedup'] < base['speedup'] * (1 - threshold)
+      end
+      regressions.each do |r|
+        $stderr.puts format('Regression: %s speedup %.2fx < baseline %.2fx', r['name'], r['speedup'],
+                            baseline[r['name']]['speedup'])
+      end
+      regressions.empty?
+    end
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+  end
+end
+
+exit(LLRBBenchmark.run(ARGV)) if $0 == __FILE__
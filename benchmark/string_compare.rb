@@ -0,0 +1,13 @@
+# Comparing and hashing frozen strings.
+def script
+  a = 'foo'.freeze
+  b = 'bar'.freeze
+  hash = { a => 1, b => 2 }
+  count = 0
+  i = 0
+  while i < 1_000_000
+    count += hash[a] if a == 'foo' && b != a
+    i += 1
+  end
+  count
+end
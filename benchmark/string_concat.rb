@@ -0,0 +1,10 @@
+# Appending short strings to a buffer.
+def script
+  buf = String.new
+  i = 0
+  while i < 500_000
+    buf << 'abc' << 'def'
+    i += 1
+  end
+  buf.bytesize
+end
@@ -0,0 +1,10 @@
+# String interpolation of Integers and Strings, which allocates a String every iteration.
+def script
+  name = 'llrb'
+  i = 0
+  while i < 500_000
+    s = "#{name}-#{i}: #{name.size}"
+    i += 1
+  end
+  s
+end
@@ -0,0 +1,13 @@
+# Port of ruby/benchmark/bm_vm1_block.rb. It loops 3_000_000 times instead of 30_000_000, like other vm1_*.
+def m
+  yield
+end
+
+def script
+  i = 0
+  while i<3_000_000
+    i += 1
+    m{
+    }
+  end
+end
@@ -0,0 +1,11 @@
+# Port of ruby/benchmark/bm_vm1_const.rb.
+Const = 1
+
+def script
+  i = 0
+  while i<3_000_000
+    i += 1
+    j = Const
+    k = Const
+  end
+end
@@ -0,0 +1,13 @@
+# Port of ruby/benchmark/bm_vm1_ensure.rb.
+def script
+  i = 0
+  while i<3_000_000
+    i += 1
+    begin
+      begin
+      ensure
+      end
+    ensure
+    end
+  end
+end
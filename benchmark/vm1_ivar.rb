@@ -0,0 +1,11 @@
+# Port of ruby/benchmark/bm_vm1_ivar.rb.
+def script
+  @a = 1
+
+  i = 0
+  while i<3_000_000
+    i += 1
+    j = @a
+    k = @a
+  end
+end
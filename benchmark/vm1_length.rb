@@ -0,0 +1,11 @@
+# Port of ruby/benchmark/bm_vm1_length.rb.
+def script
+  a = 'abc'
+  b = [1, 2, 3]
+  i = 0
+  while i<3_000_000
+    i += 1
+    a.length
+    b.length
+  end
+end
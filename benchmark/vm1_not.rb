@@ -0,0 +1,9 @@
+# Port of ruby/benchmark/bm_vm1_not.rb.
+def script
+  i = 0
+  obj = Object.new
+  while i<3_000_000
+    i += 1
+    !obj
+  end
+end
@@ -0,0 +1,10 @@
+# Port of ruby/benchmark/bm_vm1_rescue.rb.
+def script
+  i = 0
+  while i<3_000_000
+    i += 1
+    begin
+    rescue
+    end
+  end
+end
@@ -0,0 +1,12 @@
+# Port of ruby/benchmark/bm_vm1_simplereturn.rb.
+def m
+  return 1
+end
+
+def script
+  i = 0
+  while i<3_000_000
+    i += 1
+    m
+  end
+end
@@ -0,0 +1,10 @@
+# Port of ruby/benchmark/bm_vm1_swap.rb.
+def script
+  a = 1
+  b = 2
+  i = 0
+  while i<3_000_000
+    i += 1
+    a, b = b, a
+  end
+end
@@ -0,0 +1,70 @@
+/*
+ * arena.h: Bump allocator for data living during one compilation, shared by parser.c and compiler.c.
+ *
+ * CFG, stack copies and argument buffers are allocated per edge or per insn. Allocating them by ruby_xmalloc
+ * may trigger GC in the middle of compilation, which can happen inside profiler's postponed job. Arena takes
+ * chunks by malloc(3) and all of them are released at once by `llrb_arena_free`.
+ */
+
+#ifndef LLRB_ARENA_H
+#define LLRB_ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "cruby.h"
+
+#define LLRB_ARENA_CHUNK_SIZE 4096
+#define LLRB_ARENA_ALIGN sizeof(VALUE)
+
+struct llrb_arena_chunk {
+  struct llrb_arena_chunk *next;
+  size_t used;
+  size_t capa;
+  char data[];
+};
+
+struct llrb_arena {
+  struct llrb_arena_chunk *chunk; // Chunk being used. Older chunks are linked by `next`.
+};
+
+#define LLRB_ARENA_INITIALIZER { .chunk = 0 }
+#define LLRB_ARENA_ALLOC_N(arena, type, n) ((type *)llrb_arena_alloc((arena), sizeof(type) * (n)))
+#define LLRB_ARENA_ZALLOC_N(arena, type, n) ((type *)llrb_arena_zalloc((arena), sizeof(type) * (n)))
+
+static void *
+llrb_arena_alloc(struct llrb_arena *arena, size_t size)
+{
+  size = (size + LLRB_ARENA_ALIGN - 1) & ~(size_t)(LLRB_ARENA_ALIGN - 1);
+  struct llrb_arena_chunk *chunk = arena->chunk;
+  if (chunk == 0 || chunk->capa - chunk->used < size) {
+    size_t capa = size > LLRB_ARENA_CHUNK_SIZE ? size : LLRB_ARENA_CHUNK_SIZE;
+    chunk = (struct llrb_arena_chunk *)malloc(sizeof(struct llrb_arena_chunk) + capa);
+    if (chunk == 0) rb_memerror();
+    *chunk = (struct llrb_arena_chunk){ .next = arena->chunk, .used = 0, .capa = capa };
+    arena->chunk = chunk;
+  }
+
+  void *ptr = chunk->data + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+static inline void *
+llrb_arena_zalloc(struct llrb_arena *arena, size_t size)
+{
+  return memset(llrb_arena_alloc(arena, size), 0, size);
+}
+
+static void
+llrb_arena_free(struct llrb_arena *arena)
+{
+  struct llrb_arena_chunk *chunk = arena->chunk;
+  while (chunk) {
+    struct llrb_arena_chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena->chunk = 0;
+}
+
+#endif // LLRB_ARENA_H
@@ -7,25 +7,30 @@
 
 #include <stdbool.h>
 #include "llvm-c/Core.h"
+#include "arena.h"
 
 struct llrb_basic_block {
   // Fields set by parser:
   unsigned int start;            // Start index of ISeq body's iseq_encoded.
   unsigned int end;              // End index of ISeq body's iseq_encoded.
   unsigned int incoming_size;    // Size of incoming_starts.
-  unsigned int *incoming_starts; // Start indices of incoming basic blocks. This buffer is freed by llrb_destruct_cfg.
+  unsigned int *incoming_starts; // Start indices of incoming basic blocks, or catch table entry's start for `catch_cont`. This buffer is allocated by `arena`.
+  unsigned int stack_size;       // YARV stack size at `start`, computed by stack effects of insns. Same for all incoming basic blocks.
+  bool catch_cont;               // true if YARV continues at `start` after catching rescue, break or next. This counts as an incoming.
   bool traversed;                // Prevents infinite loop in `llrb_set_incoming_blocks_by` and used by compiler to judge reachable or not.
 
   // Fields set by compiler:
   LLVMBasicBlockRef ref;         // LLVM's actual BasicBlock reference. This value is always available after `llrb_init_cfg_for_compile` is called.
-  LLVMValueRef phi;              // Phi node to collect incoming values. This will be created if incoming_size > 1 and compiled time's stack size > 0.
+  LLVMValueRef *phis;            // Phi nodes to collect incoming values, one per stack slot. Created if incoming_size > 1 and stack_size > 0, or 0.
   bool compiled;                 // Prevents infinite loop in `llrb_compile_basic_block`.
 };
 
 // Holds Control-Flow-Graph-like data structure. Actually it's a buffer of graph nodes.
 struct llrb_cfg {
-  struct llrb_basic_block* blocks; // This buffer is freed by llrb_destruct_cfg.
+  struct llrb_basic_block* blocks; // This buffer is allocated by `arena`.
   unsigned int size;
+  unsigned int *block_index;       // block_index[pos] is 1 + index of the block starting at pos, or 0. Its size is iseq_size.
+  struct llrb_arena *arena;        // Allocates buffers of parser and compiler. Released after one compilation.
 };
 
 // Used by llrb_dump_cfg.
@@ -33,14 +38,16 @@ struct llrb_cfg {
 #include "cruby_extra/insns.inc"
 #include "cruby_extra/insns_info.inc"
 
-// Not using `rb_iseq_original_iseq` to avoid unnecessary memory allocation.
+// Not using `rb_iseq_original_iseq` to avoid unnecessary memory allocation. Used for ISeqs other than the
+// compiled one, whose insns are decoded in `llrb_iseq_snapshot`.
 extern int rb_vm_insn_addr2insn(const void *addr);
 
+// `body` is a snapshot's one, whose insns are decoded.
 static void
 llrb_disasm_insns(const struct rb_iseq_constant_body *body, unsigned int start, unsigned int end)
 {
   for (unsigned int i = start; i <= end;) {
-    int insn = rb_vm_insn_addr2insn((void *)body->iseq_encoded[i]);
+    int insn = (int)body->iseq_encoded[i];
     fprintf(stderr, "  %04d %-27s [%-4s] ", i, insn_name(insn), insn_op_types(insn));
 
     for (int j = 1; j < insn_len(insn); j++) {
@@ -104,7 +111,7 @@ llrb_dump_cfg(const struct rb_iseq_constant_body *body, const struct llrb_cfg *c
   fprintf(stderr, "\n== LLRB: cfg ================================\n");
   for (unsigned int i = 0; i < cfg->size; i++) {
     struct llrb_basic_block *block = cfg->blocks + i;
-    fprintf(stderr, "BasicBlock[%d-%d]", block->start, block->end);
+    fprintf(stderr, "BasicBlock[%d-%d] stack=%d", block->start, block->end, block->stack_size);
 
     if (block->incoming_size > 0) fprintf(stderr, " <- ");
     if (!block->traversed) fprintf(stderr, " UNREACHABLE");
@@ -9,8 +9,28 @@
 #include "llvm-c/Core.h"
 #include "cfg.h"
 #include "cruby.h"
+#include "jit.h"
+#include "pic.h"
+#include "snapshot.h"
+#include "usdt.h"
 
 static VALUE rb_eCompileError;
+
+// Context of the module being built, selected by `llrb_compile_iseq`. IR is built only by Ruby thread holding GVL,
+// so one context is used at a time here. Contexts are created lazily and never disposed.
+static LLVMContextRef llrb_contexts[LLRB_CONTEXT_SIZE];
+static unsigned int llrb_ctx_index = LLRB_CONTEXT_RUBY;
+static LLVMContextRef llrb_ctx = 0;
+
+static LLVMContextRef
+llrb_get_context(unsigned int index)
+{
+  if (!llrb_contexts[index]) {
+    llrb_contexts[index] = (index == LLRB_CONTEXT_RUBY) ? LLVMGetGlobalContext() : LLVMContextCreate();
+  }
+  return llrb_contexts[index];
+}
+
 #include "compiler/funcs.h"
 #include "compiler/stack.h"
 
@@ -22,12 +42,25 @@ struct llrb_compiler {
   LLVMValueRef func;
   LLVMBuilderRef builder;
   LLVMModuleRef mod;
+  struct llrb_deopt *deopt; // Speculation failures written by deoptimization. 0 if speculation is disabled.
+  struct llrb_assumption *assumption; // VM state assumed by this compilation. 0 if it's not recorded.
+  LLVMValueRef *locals;     // Allocas of level-0 locals indexed by lindex_t. 0 if locals may escape.
+  bool *written_locals;     // written_locals[idx] is true if local of idx is set by this ISeq.
+  LLVMValueRef *outer_eps;  // outer_eps[level] is ep of outer scope computed on entry. 0 if locals may escape.
+  rb_num_t outer_ep_levels; // The number of levels in `outer_eps`, including level 0 which is not used.
+  bool drop_trace;          // trace insns are not compiled because no event hook or DTrace probe was enabled.
+  rb_serial_t ivar_serial;  // Class serial of self speculated by ivar insns specialized by index. 0 if not specialized.
+  LLVMValueRef ivar_guard;  // i1 computed on function entry. true if self has the class of `ivar_serial`.
+  const VALUE *osr_iseq_encoded; // Insns interpreted by frames which may enter this function by OSR. 0 if disabled.
+  struct llrb_osr *osr;          // OSR entries found by this compilation.
+  LLVMBasicBlockRef *catch_entries; // catch_entries[i] is the entry block for osr->catch_conts[i].
+  bool *catch_patched;              // catch_patched[pos] is true if new_iseq_encoded[pos] is patched for a catch entry.
 };
 
 static inline LLVMValueRef
 llrb_value(VALUE value)
 {
-  return LLVMConstInt(LLVMInt64Type(), value, false); // TODO: support 32bit for VALUE type
+  return LLVMConstInt(LLVMInt64TypeInContext(llrb_ctx), value, false); // TODO: support 32bit for VALUE type
 }
 
 static inline LLVMValueRef
@@ -53,7 +86,7 @@ llrb_build_rtest(LLVMBuilderRef builder, LLVMValueRef value)
 static LLVMValueRef
 llrb_call_func(const struct llrb_compiler *c, const char *funcname, unsigned argc, ...)
 {
-  LLVMValueRef *args = ALLOC_N(LLVMValueRef, argc); // `xfree`d in the end of this function.
+  LLVMValueRef *args = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, argc);
 
   va_list ar;
   va_start(ar, argc);
@@ -63,7 +96,6 @@ llrb_call_func(const struct llrb_compiler *c, const char *funcname, unsigned arg
   va_end(ar);
 
   LLVMValueRef ret = LLVMBuildCall(c->builder, llrb_get_function(c->mod, funcname), args, argc, "");
-  xfree(args);
   return ret;
 }
 
@@ -73,88 +105,155 @@ llrb_get_self(const struct llrb_compiler *c)
   return llrb_call_func(c, "llrb_self_from_cfp", 1, llrb_get_cfp(c));
 }
 
-static LLVMValueRef
-llrb_compile_funcall(const struct llrb_compiler *c, struct llrb_stack *stack, ID mid, int argc)
-{
-  LLVMValueRef func = llrb_get_function(c->mod, "rb_funcall");
-  LLVMValueRef *args = ALLOC_N(LLVMValueRef, 3+argc); // 3 is recv, mid, n
-
-  for (int i = argc-1; 0 <= i; i--) {
-    args[3+i] = llrb_stack_pop(stack); // 3 is recv, mid, n
-  }
-  args[0] = llrb_stack_pop(stack);
-  args[1] = llrb_value(mid);
-  args[2] = LLVMConstInt(LLVMInt32Type(), argc, false);
-
-  return LLVMBuildCall(c->builder, func, args, 3+argc, "rb_funcall");
-}
-
-// Must call `llrb_destruct_stack` after usage of return value.
+// Returned stack is allocated by compilation's arena.
 // TODO: Using `memcpy` would be faster.
 static struct llrb_stack *
-llrb_copy_stack(const struct llrb_stack *stack)
+llrb_copy_stack(const struct llrb_compiler *c, const struct llrb_stack *stack)
 {
-  struct llrb_stack *ret = ALLOC_N(struct llrb_stack, 1); // `xfree`d by `llrb_destruct_stack`.
+  struct llrb_stack *ret = LLRB_ARENA_ALLOC_N(c->cfg->arena, struct llrb_stack, 1);
   ret->size = stack->size;
   ret->max  = stack->max;
-  ret->body = ALLOC_N(LLVMValueRef, ret->max); // `xfree`d by `llrb_destruct_stack`.
+  ret->body = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, ret->max);
   for (unsigned int i = 0; i < stack->size; i++) {
     ret->body[i] = stack->body[i];
   }
   return ret;
 }
 
-static void
-llrb_destruct_stack(struct llrb_stack *stack)
-{
-  xfree(stack->body);
-  xfree(stack);
-}
-
 static struct llrb_basic_block *
-llrb_find_block(struct llrb_cfg *cfg, unsigned int start)
+llrb_find_block(const struct llrb_compiler *c, unsigned int start)
 {
-  for (unsigned int i = 0; i < cfg->size; i++) {
-    struct llrb_basic_block *block = cfg->blocks + i;
-    if (block->start == start) return block;
+  if (start < c->body->iseq_size && c->cfg->block_index[start]) {
+    return c->cfg->blocks + (c->cfg->block_index[start] - 1);
   }
   rb_raise(rb_eCompileError, "BasicBlock (start = %d) was not found in llrb_find_block", start);
 }
 
+// Adds all values of `stack` to phi nodes of `block` as incomings from `current_ref`. The stack is not popped,
+// because `llrb_compile_basic_block` replaces it with the phi nodes. Phis of the same incoming values are folded by LLVM.
 static void
-llrb_push_incoming_things(const struct llrb_compiler *c, struct llrb_basic_block *block, LLVMBasicBlockRef current_ref, LLVMValueRef incoming_value)
+llrb_push_incoming_things(const struct llrb_compiler *c, struct llrb_basic_block *block, LLVMBasicBlockRef current_ref, const struct llrb_stack *stack)
 {
-  // Ensure phi node existence here.
-  if (block->phi == 0) {
-    // Phi node should be created before its basic block's compilation...
-    if (block->compiled) {
-      rb_raise(rb_eCompileError, "Already compiled BasicBlock (start = %d) didn't have phi and was requested to push incoming value", block->start);
-    }
-    LLVMPositionBuilderAtEnd(c->builder, block->ref);
-    block->phi = LLVMBuildPhi(c->builder, LLVMInt64Type(), ""); // TODO: Support 32bit
-    LLVMPositionBuilderAtEnd(c->builder, current_ref);
+  if (block->phis == 0) return;
+  if (stack->size != block->stack_size) {
+    rb_raise(rb_eCompileError, "Stack size (%d) didn't match BasicBlock (start = %d, stack_size = %d) on pushing incoming values",
+        stack->size, block->start, block->stack_size);
   }
 
-  LLVMValueRef values[] = { incoming_value };
-  LLVMBasicBlockRef blocks[] = { current_ref };
-  LLVMAddIncoming(block->phi, values, blocks, 1);
+  for (unsigned int i = 0; i < stack->size; i++) {
+    LLVMValueRef values[] = { stack->body[i] };
+    LLVMBasicBlockRef blocks[] = { current_ref };
+    LLVMAddIncoming(block->phis[i], values, blocks, 1);
+  }
 }
 
 static LLVMValueRef
 llrb_compile_newarray(const struct llrb_compiler *c, struct llrb_stack *stack, long num)
 {
-  LLVMValueRef *args = ALLOC_N(LLVMValueRef, num+1); // `xfree`d in the end of this function.
-  args[0] = LLVMConstInt(LLVMInt64Type(), num, true); // TODO: support 32bit
+  LLVMValueRef *args = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, num+1);
+  args[0] = LLVMConstInt(LLVMInt64TypeInContext(llrb_ctx), num, true); // TODO: support 32bit
   for (long i = num; 1 <= i; i--) {
     args[i] = llrb_stack_pop(stack);
   }
 
   LLVMValueRef func = llrb_get_function(c->mod, "rb_ary_new_from_args");
   LLVMValueRef ret = LLVMBuildCall(c->builder, func, args, num+1, "newarray");
-  xfree(args);
   return ret;
 }
 
+// Pops `num` values into a buffer on native stack, instead of allocating Array for them. GC marks them there
+// as machine stack. Returns the buffer's address as VALUE-sized integer, for runtime functions taking `const VALUE *`.
+static LLVMValueRef
+llrb_compile_stack_buffer(const struct llrb_compiler *c, struct llrb_stack *stack, long num)
+{
+  LLVMTypeRef value_type = LLVMInt64TypeInContext(llrb_ctx);
+  if (num == 0) return llrb_value(0);
+
+  // Alloca must be in function's entry block, not to grow native stack in a loop.
+  LLVMBuilderRef builder = LLVMCreateBuilderInContext(llrb_ctx);
+  LLVMBasicBlockRef entry = LLVMGetEntryBasicBlock(c->func);
+  LLVMValueRef first = LLVMGetFirstInstruction(entry);
+  if (first) {
+    LLVMPositionBuilderBefore(builder, first);
+  } else {
+    LLVMPositionBuilderAtEnd(builder, entry);
+  }
+  LLVMValueRef buf = LLVMBuildArrayAlloca(builder, value_type, LLVMConstInt(value_type, num, false), "stack_buffer");
+  LLVMDisposeBuilder(builder);
+
+  for (long i = num - 1; 0 <= i; i--) {
+    LLVMValueRef index = LLVMConstInt(value_type, i, false);
+    LLVMBuildStore(c->builder, llrb_stack_pop(stack), LLVMBuildGEP(c->builder, buf, &index, 1, ""));
+  }
+  return LLVMBuildPtrToInt(c->builder, buf, value_type, "");
+}
+
+// Escape analysis of a temporary Array. If `value` is built by newarray or duparray, and nothing but the insn being
+// compiled uses it, returns its elements as (num, ptr) arguments of runtime functions and removes the allocation.
+// Uses in IR and copies left on YARV stack are both checked, so it can't be seen by others later.
+static bool
+llrb_eliminate_temporary_array(const struct llrb_compiler *c, const struct llrb_stack *stack, LLVMValueRef value,
+    LLVMValueRef *num, LLVMValueRef *ptr)
+{
+  if (!LLVMIsACallInst(value) || LLVMGetFirstUse(value)) return false;
+  for (unsigned int i = 0; i < stack->size; i++) {
+    if (stack->body[i] == value) return false;
+  }
+
+  LLVMValueRef callee = LLVMGetOperand(value, LLVMGetNumOperands(value) - 1);
+  if (callee == LLVMGetNamedFunction(c->mod, "rb_ary_new_from_args")) {
+    long size = (long)LLVMConstIntGetSExtValue(LLVMGetOperand(value, 0));
+    LLVMValueRef *args = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, size);
+    for (long i = 0; i < size; i++) {
+      args[i] = LLVMGetOperand(value, i + 1);
+    }
+    // Values are stored where the removed call was, as insns after newarray may have created other blocks.
+    LLVMBasicBlockRef current = LLVMGetInsertBlock(c->builder);
+    LLVMPositionBuilderBefore(c->builder, value);
+    struct llrb_stack elements = (struct llrb_stack){ .body = args, .size = size, .max = size };
+    *num = llrb_value((VALUE)size);
+    *ptr = llrb_compile_stack_buffer(c, &elements, size);
+    LLVMPositionBuilderAtEnd(c->builder, current);
+  } else if (callee == LLVMGetNamedFunction(c->mod, "rb_ary_resurrect")) {
+    // Literal Array is frozen and kept alive by ISeq, so its elements are read in place.
+    VALUE ary = (VALUE)LLVMConstIntGetZExtValue(LLVMGetOperand(value, 0));
+    *num = llrb_value((VALUE)RARRAY_LEN(ary));
+    *ptr = llrb_value((VALUE)RARRAY_CONST_PTR(ary));
+  } else {
+    return false;
+  }
+  LLVMInstructionEraseFromParent(value);
+  return true;
+}
+
+// If `value` is tostring's String and nothing but the concatstrings being compiled uses it, replaces the conversion
+// with `llrb_tostring_fragment` at the same place, which leaves Symbol and Fixnum for concatstrings to write directly.
+// `fragments` are concatstrings' operands already popped from `stack`.
+static LLVMValueRef
+llrb_defer_tostring(const struct llrb_compiler *c, const struct llrb_stack *stack, LLVMValueRef *fragments,
+    long num, long index)
+{
+  LLVMValueRef value = fragments[index];
+  if (!LLVMIsACallInst(value) || LLVMGetFirstUse(value)) return value;
+  if (LLVMGetOperand(value, LLVMGetNumOperands(value) - 1) != LLVMGetNamedFunction(c->mod, "rb_obj_as_string")) {
+    return value;
+  }
+  for (unsigned int i = 0; i < stack->size; i++) {
+    if (stack->body[i] == value) return value;
+  }
+  for (long i = 0; i < num; i++) {
+    if (i != index && fragments[i] == value) return value;
+  }
+
+  // Program counter is already set for the removed call, which may call #to_s.
+  LLVMBasicBlockRef current = LLVMGetInsertBlock(c->builder);
+  LLVMPositionBuilderBefore(c->builder, value);
+  LLVMValueRef fragment = llrb_call_func(c, "llrb_tostring_fragment", 1, LLVMGetOperand(value, 0));
+  LLVMPositionBuilderAtEnd(c->builder, current);
+  LLVMInstructionEraseFromParent(value);
+  return fragment;
+}
+
 // If insn can call any method, it is throwable and needs to change program counter. Or it may rb_raise.
 static bool
 llrb_pc_change_required(const int insn)
@@ -163,6 +262,8 @@ llrb_pc_change_required(const int insn)
     case YARVINSN_tostring:
     case YARVINSN_freezestring:
     case YARVINSN_checkmatch:
+    case YARVINSN_expandarray:
+    case YARVINSN_once:
     case YARVINSN_send:
     case YARVINSN_opt_str_freeze:
     case YARVINSN_opt_newarray_max:
@@ -202,65 +303,990 @@ llrb_pc_change_required(const int insn)
   }
 }
 
-// Catch table checks program counter to decide catch it or not. So we need to set program counter before method call or throw insn.
-static void
-llrb_increment_pc(const struct llrb_compiler *c, const unsigned int pos, const int insn)
+// These insns don't call any method in their bitcode. Only their slow path, which is method dispatch or
+// deoptimization, sets program counter. So fast path doesn't have a store of program counter.
+static bool
+llrb_pc_change_deferred(const int insn)
+{
+  switch (insn) {
+    case YARVINSN_opt_plus:
+    case YARVINSN_opt_minus:
+    case YARVINSN_opt_mult:
+    case YARVINSN_opt_div:
+    case YARVINSN_opt_mod:
+    case YARVINSN_opt_eq:
+    case YARVINSN_opt_lt:
+    case YARVINSN_opt_le:
+    case YARVINSN_opt_gt:
+    case YARVINSN_opt_ge:
+    case YARVINSN_opt_length:
+    case YARVINSN_opt_size:
+    case YARVINSN_opt_empty_p:
+    case YARVINSN_opt_succ:
+    case YARVINSN_opt_not:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Catch table checks program counter to decide catch it or not. So we need to set program counter before method call or throw insn.
+static void
+llrb_increment_pc(const struct llrb_compiler *c, const unsigned int pos, const int insn)
+{
+  if (pos == 0) return; // Skip. 0 would be opt_call_c_function and there's no need to change.
+
+  if (llrb_pc_change_required(insn) && !llrb_pc_change_deferred(insn)) {
+    // This case should be rejected to compile by `llrb_check_not_compilable`.
+    if (pos == 1) rb_raise(rb_eCompileError, "program counter is set to 1 from iseq_encoded");
+
+    // `pos` MUST NOT be 0 (it causes stack level too deep) or 1 (funcptr is considered as insn and it's invalid as insn).
+    const VALUE *pc = c->new_iseq_encoded + pos; // This must be `new_iseq_encoded` to get proper `epc` in `vm_exec`.
+    llrb_call_func(c, "llrb_set_pc", 2, llrb_get_cfp(c), llrb_value((VALUE)pc));
+  }
+}
+
+// LLVM value name for an insn function, e.g. "opt_plus" for "llrb_insn_opt_plus".
+static inline const char *
+llrb_insn_value_name(const char *funcname)
+{
+  return funcname + (sizeof("llrb_insn_") - 1);
+}
+
+// `funcname` is a bitcode function name like "llrb_insn_opt_plus".
+static void
+llrb_compile_opt_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const char *funcname, int argc)
+{
+  LLVMValueRef *args = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, argc);
+  for (int i = argc-1; i >= 0; i--) {
+    args[i] = llrb_stack_pop(stack);
+  }
+  llrb_stack_push(stack, LLVMBuildCall(c->builder, llrb_get_function(c->mod, funcname), args, argc,
+        llrb_insn_value_name(funcname)));
+}
+
+// Returns true if insn at pos can be compiled speculatively, i.e. with a guard deoptimizing to YARV.
+static bool
+llrb_speculatable(const struct llrb_compiler *c, const unsigned int pos)
+{
+  // Deoptimization restarts YARV at `pos`. new_iseq_encoded[0..1] and catch entries are opt_call_c_function.
+  if (c->catch_patched && c->catch_patched[pos]) return false;
+  return c->deopt && pos >= 2 && !c->deopt->failed[pos];
+}
+
+// Gives a branch weights so that `deopt_ref`, a guard failure or a slow path like a cache miss, is laid out as cold code.
+static LLVMValueRef
+llrb_build_guard(const struct llrb_compiler *c, LLVMValueRef cond, LLVMBasicBlockRef then_ref, LLVMBasicBlockRef deopt_ref)
+{
+  LLVMValueRef br = LLVMBuildCondBr(c->builder, cond, then_ref, deopt_ref);
+  LLVMValueRef weights[] = {
+    LLVMMDStringInContext(llrb_ctx, "branch_weights", strlen("branch_weights")),
+    LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), 2000, false),
+    LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), 1, false),
+  };
+  LLVMSetMetadata(br, LLVMGetMDKindIDInContext(llrb_ctx, "prof", strlen("prof")),
+      LLVMMDNodeInContext(llrb_ctx, weights, 3));
+  return br;
+}
+
+// Locals in allocas are promoted to registers by LLVM. They must be written back to env before
+// YARV or event hooks may see them.
+static void
+llrb_write_back_locals(const struct llrb_compiler *c)
+{
+  if (!c->locals) return;
+  for (unsigned int idx = 0; idx < c->body->local_table_size + VM_ENV_DATA_SIZE; idx++) {
+    if (!c->written_locals[idx]) continue;
+    llrb_call_func(c, "llrb_insn_setlocal_level0", 3, llrb_get_cfp(c), llrb_value((lindex_t)idx),
+        LLVMBuildLoad(c->builder, c->locals[idx], ""));
+  }
+}
+
+// Deoptimizes to YARV to run insn at `pos`: flushes emulated stack to cfp->sp, sets program counter to the insn,
+// and returns cfp. Then opt_call_c_function restores registers from cfp and YARV continues from the insn.
+// @param operands - values already popped for the insn. They are pushed after `stack`.
+static void
+llrb_compile_deopt(const struct llrb_compiler *c, const struct llrb_stack *stack, const unsigned int pos,
+    LLVMValueRef *operands, unsigned int operand_size)
+{
+  LLVMTypeRef bool_ptr = LLVMPointerType(LLVMInt8TypeInContext(llrb_ctx), 0);
+  LLVMValueRef flag = LLVMConstInt(LLVMInt8TypeInContext(llrb_ctx), 1, false);
+  LLVMBuildStore(c->builder, flag, LLVMConstIntToPtr(llrb_value((VALUE)&c->deopt->failed[pos]), bool_ptr));
+  LLVMBuildStore(c->builder, flag, LLVMConstIntToPtr(llrb_value((VALUE)&c->deopt->deopted), bool_ptr));
+  llrb_write_back_locals(c);
+
+  for (unsigned int i = 0; i < stack->size; i++) {
+    llrb_call_func(c, "llrb_push_result", 2, llrb_get_cfp(c), stack->body[i]);
+  }
+  for (unsigned int i = 0; i < operand_size; i++) {
+    llrb_call_func(c, "llrb_push_result", 2, llrb_get_cfp(c), operands[i]);
+  }
+  llrb_call_func(c, "llrb_set_pc", 2, llrb_get_cfp(c), llrb_value((VALUE)(c->new_iseq_encoded + pos)));
+  LLVMBuildRet(c->builder, llrb_get_cfp(c));
+}
+
+static LLVMValueRef
+llrb_get_overflow_intrinsic(LLVMModuleRef mod, const char *name)
+{
+  LLVMValueRef func = LLVMGetNamedFunction(mod, name);
+  if (func) return func;
+
+  LLVMTypeRef fields[] = { LLVMInt64TypeInContext(llrb_ctx), LLVMInt1TypeInContext(llrb_ctx) };
+  LLVMTypeRef args[] = { LLVMInt64TypeInContext(llrb_ctx), LLVMInt64TypeInContext(llrb_ctx) };
+  return LLVMAddFunction(mod, name, LLVMFunctionType(LLVMStructTypeInContext(llrb_ctx, fields, 2, false), args, 2, false));
+}
+
+// Speculates that both operands are Fixnum and Integer's method is not redefined. On guard failure or
+// overflow, it deoptimizes to YARV. Both of them share one deoptimization block.
+static void
+llrb_compile_fixnum_opt_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const unsigned int pos, const int insn)
+{
+  LLVMValueRef operands[2];
+  operands[1] = llrb_stack_pop(stack);
+  operands[0] = llrb_stack_pop(stack);
+  LLVMValueRef recv = operands[0], obj = operands[1];
+
+  int bop;
+  switch (insn) {
+    case YARVINSN_opt_plus:  bop = BOP_PLUS;  break;
+    case YARVINSN_opt_minus: bop = BOP_MINUS; break;
+    case YARVINSN_opt_lt:    bop = BOP_LT;    break;
+    case YARVINSN_opt_le:    bop = BOP_LE;    break;
+    case YARVINSN_opt_gt:    bop = BOP_GT;    break;
+    case YARVINSN_opt_ge:    bop = BOP_GE;    break;
+    default:
+      rb_raise(rb_eCompileError, "Unexpected insn at llrb_compile_fixnum_opt_insn: %s", insn_name(insn));
+  }
+
+  LLVMBasicBlockRef current_ref = LLVMGetInsertBlock(c->builder);
+  LLVMBasicBlockRef deopt_ref   = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "deopt");
+  LLVMBasicBlockRef fixnum_ref  = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "fixnum");
+  LLVMPositionBuilderAtEnd(c->builder, deopt_ref);
+  llrb_compile_deopt(c, stack, pos, operands, 2);
+
+  LLVMPositionBuilderAtEnd(c->builder, current_ref);
+  LLVMValueRef guard = llrb_call_func(c, "llrb_fixnum_guard", 3, recv, obj, llrb_value((VALUE)bop));
+  if (c->assumption) c->assumption->integer_bops |= 1U << bop;
+  llrb_build_guard(c, llrb_build_rtest(c->builder, guard), fixnum_ref, deopt_ref);
+  LLVMPositionBuilderAtEnd(c->builder, fixnum_ref);
+
+  switch (insn) {
+    case YARVINSN_opt_plus:
+    case YARVINSN_opt_minus: {
+      // Fixnum is tagged as 2n+1. (2a+1) + 2b = 2(a+b)+1 and (2a+1) - 2b = 2(a-b)+1. Overflow goes to Bignum in YARV.
+      const char *intrinsic = (insn == YARVINSN_opt_plus) ? "llvm.sadd.with.overflow.i64" : "llvm.ssub.with.overflow.i64";
+      LLVMValueRef args[] = { recv, LLVMBuildSub(c->builder, obj, llrb_value(1), "untag") };
+      LLVMValueRef result = LLVMBuildCall(c->builder, llrb_get_overflow_intrinsic(c->mod, intrinsic), args, 2, "");
+
+      LLVMBasicBlockRef no_overflow_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "no_overflow");
+      LLVMValueRef overflow = LLVMBuildExtractValue(c->builder, result, 1, "overflow");
+      llrb_build_guard(c, LLVMBuildNot(c->builder, overflow, ""), no_overflow_ref, deopt_ref);
+      LLVMPositionBuilderAtEnd(c->builder, no_overflow_ref);
+      llrb_stack_push(stack, LLVMBuildExtractValue(c->builder, result, 0, insn_name(insn)));
+      break;
+    }
+    default: {
+      // Tagging keeps order of Fixnum.
+      LLVMIntPredicate pred;
+      switch (insn) {
+        case YARVINSN_opt_lt: pred = LLVMIntSLT; break;
+        case YARVINSN_opt_le: pred = LLVMIntSLE; break;
+        case YARVINSN_opt_gt: pred = LLVMIntSGT; break;
+        default:              pred = LLVMIntSGE; break;
+      }
+      LLVMValueRef cmp = LLVMBuildICmp(c->builder, pred, recv, obj, "");
+      llrb_stack_push(stack, LLVMBuildSelect(c->builder, cmp, llrb_value(Qtrue), llrb_value(Qfalse), insn_name(insn)));
+      break;
+    }
+  }
+}
+
+// Speculates that receiver is Array and index is Fixnum for opt_aref and opt_aset, deoptimizing to YARV otherwise.
+// Runtime functions after the guard are inlined, so opt_aref is loads from RARRAY_CONST_PTR with a bounds check.
+// A receiver which is Hash or else fails the guard once, and the ISeq is recompiled with the generic insn.
+static void
+llrb_compile_array_opt_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const unsigned int pos, const int insn)
+{
+  unsigned int argc = (insn == YARVINSN_opt_aset) ? 3 : 2;
+  LLVMValueRef operands[3];
+  for (int i = (int)argc - 1; 0 <= i; i--) {
+    operands[i] = llrb_stack_pop(stack);
+  }
+  int bop = (insn == YARVINSN_opt_aset) ? BOP_ASET : BOP_AREF;
+
+  LLVMBasicBlockRef current_ref = LLVMGetInsertBlock(c->builder);
+  LLVMBasicBlockRef deopt_ref   = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "deopt");
+  LLVMBasicBlockRef array_ref   = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "array");
+  LLVMPositionBuilderAtEnd(c->builder, deopt_ref);
+  llrb_compile_deopt(c, stack, pos, operands, argc);
+
+  LLVMPositionBuilderAtEnd(c->builder, current_ref);
+  LLVMValueRef guard = llrb_call_func(c, "llrb_array_guard", 3, operands[0], operands[1], llrb_value((VALUE)bop));
+  if (c->assumption) c->assumption->array_bops |= 1U << bop;
+  llrb_build_guard(c, llrb_build_rtest(c->builder, guard), array_ref, deopt_ref);
+  LLVMPositionBuilderAtEnd(c->builder, array_ref);
+
+  if (insn == YARVINSN_opt_aset) {
+    llrb_stack_push(stack, llrb_call_func(c, "llrb_ary_store", 3, operands[0], operands[1], operands[2]));
+  } else {
+    llrb_stack_push(stack, llrb_call_func(c, "llrb_ary_entry", 2, operands[0], operands[1]));
+  }
+}
+
+// Returns the address of a zero-initialized global of `size` bytes for a call site's cache. It's freed with the module.
+static LLVMValueRef
+llrb_compile_site_cache(const struct llrb_compiler *c, const char *name, size_t size)
+{
+  LLVMTypeRef type = LLVMArrayType(LLVMInt8TypeInContext(llrb_ctx), size);
+  LLVMValueRef global = LLVMAddGlobal(c->mod, type, name);
+  LLVMSetLinkage(global, LLVMInternalLinkage);
+  LLVMSetInitializer(global, LLVMConstNull(type));
+  LLVMSetAlignment(global, sizeof(VALUE));
+  return LLVMBuildPtrToInt(c->builder, global, LLVMInt64TypeInContext(llrb_ctx), "");
+}
+
+// Returns call cache for `recv` from a polymorphic inline cache of this call site, instead of the insn's monomorphic
+// `cc` which would be refilled on every call of a polymorphic site. See pic.h.
+static LLVMValueRef
+llrb_compile_call_cache(const struct llrb_compiler *c, CALL_INFO ci, CALL_CACHE cc, LLVMValueRef recv)
+{
+  extern struct llrb_pic_stats *llrb_stats_pic(void);
+  return llrb_call_func(c, "llrb_pic_search", 5, llrb_value((VALUE)ci), llrb_value((VALUE)cc),
+      llrb_compile_site_cache(c, "pic", sizeof(struct llrb_pic)), llrb_value((VALUE)llrb_stats_pic()), recv);
+}
+
+// For insns in `llrb_pc_change_deferred`. Their bitcode returns Qundef instead of calling method, and the method
+// call is compiled here in a cold block with program counter set. It's the same as CALL_SIMPLE_METHOD in YARV.
+// `obj` is the argument of binary operator, or 0 for unary one.
+static void
+llrb_compile_normal_dispatch(const struct llrb_compiler *c, struct llrb_stack *stack, const unsigned int pos,
+    const char *name, ID mid, LLVMValueRef val, LLVMValueRef recv, LLVMValueRef obj)
+{
+  LLVMBasicBlockRef fast_ref     = LLVMGetInsertBlock(c->builder);
+  LLVMBasicBlockRef dispatch_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "normal_dispatch");
+  LLVMBasicBlockRef merge_ref    = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, name);
+  llrb_build_guard(c, LLVMBuildICmp(c->builder, LLVMIntNE, val, llrb_value(Qundef), ""), merge_ref, dispatch_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, dispatch_ref);
+  llrb_call_func(c, "llrb_set_pc", 2, llrb_get_cfp(c), llrb_value((VALUE)(c->new_iseq_encoded + pos)));
+  LLVMValueRef result;
+  if (obj) {
+    result = llrb_call_func(c, "rb_funcall", 4, recv, llrb_value(mid), LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), 1, false), obj);
+  } else {
+    result = llrb_call_func(c, "rb_funcall", 3, recv, llrb_value(mid), LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), 0, false));
+  }
+  LLVMBuildBr(c->builder, merge_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, merge_ref);
+  LLVMValueRef phi = LLVMBuildPhi(c->builder, LLVMInt64TypeInContext(llrb_ctx), name);
+  LLVMValueRef values[] = { val, result };
+  LLVMBasicBlockRef blocks[] = { fast_ref, dispatch_ref };
+  LLVMAddIncoming(phi, values, blocks, 2);
+  llrb_stack_push(stack, phi);
+}
+
+static void
+llrb_compile_opt_insn_with_dispatch(const struct llrb_compiler *c, struct llrb_stack *stack, const unsigned int pos,
+    const char *funcname, ID mid)
+{
+  LLVMValueRef recv = llrb_stack_topn(stack, 1);
+  LLVMValueRef obj  = llrb_stack_topn(stack, 0);
+  llrb_compile_opt_insn(c, stack, funcname, 2);
+  llrb_compile_normal_dispatch(c, stack, pos, llrb_insn_value_name(funcname), mid, llrb_stack_pop(stack), recv, obj);
+}
+
+// Same as `llrb_compile_opt_insn_with_dispatch` for unary operator. `operands` are passed to bitcode after receiver.
+static void
+llrb_compile_unary_opt_insn_with_dispatch(const struct llrb_compiler *c, struct llrb_stack *stack, const unsigned int pos,
+    const char *funcname, ID mid, const VALUE *operands, int operand_num)
+{
+  LLVMValueRef recv = llrb_stack_pop(stack);
+  llrb_stack_push(stack, recv);
+  for (int i = 0; i < operand_num; i++) {
+    llrb_stack_push(stack, llrb_value(operands[i]));
+  }
+  llrb_compile_opt_insn(c, stack, funcname, 1 + operand_num);
+  llrb_compile_normal_dispatch(c, stack, pos, llrb_insn_value_name(funcname), mid, llrb_stack_pop(stack), recv, 0);
+}
+
+// Push receiver and arguments for method call
+static void
+llrb_compile_args(const struct llrb_compiler *c, struct llrb_stack *stack, const int argc)
+{
+  int stack_top = (int)stack->size - 1;
+  for (int i = (int)argc; i >= 0; i--) {
+    llrb_call_func(c, "llrb_push_result", 2, llrb_get_cfp(c), stack->body[stack_top-i]);
+  }
+  stack->size -= argc + 1;
+}
+
+// Records method state of a call cache which JIT-ed code relies on. The oldest one is kept, so that any method
+// definition after it invalidates the ISeq.
+static void
+llrb_assume_method_state(const struct llrb_compiler *c, CALL_CACHE cc)
+{
+  if (!c->assumption) return;
+  if (c->assumption->method_state == 0 || cc->method_state < c->assumption->method_state) {
+    c->assumption->method_state = cc->method_state;
+  }
+}
+
+// Max iseq_size of callee ISeq inlined by `llrb_compile_inlined_send`.
+#define LLRB_INLINE_MAX_ISEQ_SIZE 32
+
+// Returns true if callee ISeq consists only of straight-line insns which never push a frame or see it.
+static bool
+llrb_inlinable_iseq_p(const rb_iseq_t *iseq, const VALUE *iseq_encoded, unsigned int argc)
+{
+  const struct rb_iseq_constant_body *body = iseq->body;
+  if (body->type != ISEQ_TYPE_METHOD || body->iseq_size > LLRB_INLINE_MAX_ISEQ_SIZE) return false;
+  if (body->catch_table && body->catch_table->size > 0) return false;
+  if (body->param.flags.has_opt || body->param.flags.has_rest || body->param.flags.has_post
+      || body->param.flags.has_kw || body->param.flags.has_kwrest || body->param.flags.has_block) return false;
+  if (body->param.lead_num != (int)argc || body->local_table_size != argc) return false;
+
+  for (unsigned int i = 0; i < body->iseq_size;) {
+    int insn = rb_vm_insn_addr2insn((void *)iseq_encoded[i]);
+    switch (insn) {
+      case YARVINSN_nop:
+      case YARVINSN_trace:
+      case YARVINSN_getlocal_OP__WC__0:
+      case YARVINSN_getinstancevariable:
+      case YARVINSN_putnil:
+      case YARVINSN_putself:
+      case YARVINSN_putobject:
+      case YARVINSN_putobject_OP_INT2FIX_O_0_C_:
+      case YARVINSN_putobject_OP_INT2FIX_O_1_C_:
+      case YARVINSN_putstring:
+      case YARVINSN_pop:
+      case YARVINSN_dup:
+      case YARVINSN_opt_plus:
+      case YARVINSN_opt_minus:
+      case YARVINSN_opt_mult:
+      case YARVINSN_opt_div:
+      case YARVINSN_opt_mod:
+      case YARVINSN_opt_eq:
+      case YARVINSN_opt_lt:
+      case YARVINSN_opt_le:
+      case YARVINSN_opt_gt:
+      case YARVINSN_opt_ge:
+        break;
+      case YARVINSN_leave:
+        return i + insn_len(insn) == body->iseq_size; // Only the last insn can leave.
+      default:
+        return false;
+    }
+    i += insn_len(insn);
+  }
+  return false;
+}
+
+// Returns method entry to be inlined for opt_send_without_block, or 0 if it can't be inlined.
+// Only a call site whose call cache is warm and still valid is inlined.
+static const rb_callable_method_entry_t *
+llrb_inlined_method_entry(const struct llrb_compiler *c, CALL_INFO ci, CALL_CACHE cc)
+{
+  extern rb_serial_t ruby_vm_global_method_state;
+  extern const VALUE *llrb_original_iseq_encoded(const rb_iseq_t *iseq);
+
+  // Inlined method doesn't fire its own trace events. `llrb_compile_event_guard` covers them.
+  if (!c->drop_trace) return 0;
+  if (ci->flag & (VM_CALL_ARGS_SPLAT | VM_CALL_ARGS_BLOCKARG | VM_CALL_KWARG | VM_CALL_KW_SPLAT)) return 0;
+  if (cc->me == 0 || cc->class_serial == 0 || cc->method_state != ruby_vm_global_method_state) return 0;
+
+  const rb_callable_method_entry_t *me = cc->me;
+  if (METHOD_ENTRY_VISI(me) != METHOD_VISI_PUBLIC && !(ci->flag & VM_CALL_FCALL)) return 0;
+
+  switch (me->def->type) {
+    case VM_METHOD_TYPE_IVAR:
+      return ci->orig_argc == 0 ? me : 0;
+    case VM_METHOD_TYPE_ISEQ: {
+      const rb_iseq_t *iseq = me->def->body.iseq.iseqptr;
+      return llrb_inlinable_iseq_p(iseq, llrb_original_iseq_encoded(iseq), (unsigned int)ci->orig_argc) ? me : 0;
+    }
+    default:
+      return 0;
+  }
+}
+
+// Compiles callee ISeq's insns with its self and args, without pushing a frame. `iseq` must satisfy `llrb_inlinable_iseq_p`.
+// Method calls by opt insns in it are dispatched with caller's program counter at `pos`.
+static LLVMValueRef
+llrb_compile_inlined_iseq(const struct llrb_compiler *c, const rb_iseq_t *iseq, const unsigned int pos,
+    LLVMValueRef recv, LLVMValueRef *args)
+{
+  extern const VALUE *llrb_original_iseq_encoded(const rb_iseq_t *iseq);
+  const struct rb_iseq_constant_body *body = iseq->body;
+  const VALUE *iseq_encoded = llrb_original_iseq_encoded(iseq);
+
+  struct llrb_stack stack = (struct llrb_stack){ .size = 0, .max = body->stack_max };
+  stack.body = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, stack.max);
+
+  LLVMValueRef ret = 0;
+  for (unsigned int i = 0; ret == 0;) {
+    int insn = rb_vm_insn_addr2insn((void *)iseq_encoded[i]);
+    const VALUE *operands = iseq_encoded + (i+1);
+    switch (insn) {
+      case YARVINSN_nop:
+      case YARVINSN_trace:
+        break;
+      case YARVINSN_getlocal_OP__WC__0: // ep[-idx] is local_table[local_table_size - (idx - VM_ENV_DATA_SIZE + 1)]
+        llrb_stack_push(&stack, args[body->local_table_size + VM_ENV_DATA_SIZE - 1 - (lindex_t)operands[0]]);
+        break;
+      case YARVINSN_getinstancevariable:
+        llrb_stack_push(&stack, llrb_call_func(c, "llrb_insn_getinstancevariable", 3,
+              recv, llrb_value(operands[0]), llrb_value(operands[1])));
+        break;
+      case YARVINSN_putnil:
+        llrb_stack_push(&stack, llrb_value(Qnil));
+        break;
+      case YARVINSN_putself:
+        llrb_stack_push(&stack, recv);
+        break;
+      case YARVINSN_putobject:
+        llrb_stack_push(&stack, llrb_value(operands[0]));
+        break;
+      case YARVINSN_putobject_OP_INT2FIX_O_0_C_:
+        llrb_stack_push(&stack, llrb_value(INT2FIX(0)));
+        break;
+      case YARVINSN_putobject_OP_INT2FIX_O_1_C_:
+        llrb_stack_push(&stack, llrb_value(INT2FIX(1)));
+        break;
+      case YARVINSN_putstring:
+        llrb_stack_push(&stack, llrb_call_func(c, "rb_str_resurrect", 1, llrb_value(operands[0])));
+        break;
+      case YARVINSN_pop:
+        llrb_stack_pop(&stack);
+        break;
+      case YARVINSN_dup:
+        llrb_stack_push(&stack, llrb_stack_topn(&stack, 0));
+        break;
+      case YARVINSN_opt_plus:
+        llrb_compile_opt_insn_with_dispatch(c, &stack, pos, "llrb_insn_opt_plus", '+');
+        break;
+      case YARVINSN_opt_minus:
+        llrb_compile_opt_insn_with_dispatch(c, &stack, pos, "llrb_insn_opt_minus", '-');
+        break;
+      case YARVINSN_opt_mult:
+        llrb_compile_opt_insn_with_dispatch(c, &stack, pos, "llrb_insn_opt_mult", '*');
+        break;
+      case YARVINSN_opt_div:
+        llrb_compile_opt_insn_with_dispatch(c, &stack, pos, "llrb_insn_opt_div", '/');
+        break;
+      case YARVINSN_opt_mod:
+        llrb_compile_opt_insn_with_dispatch(c, &stack, pos, "llrb_insn_opt_mod", '%');
+        break;
+      case YARVINSN_opt_eq:
+        llrb_compile_opt_insn_with_dispatch(c, &stack, pos, "llrb_insn_opt_eq", idEq);
+        break;
+      case YARVINSN_opt_lt:
+        llrb_compile_opt_insn_with_dispatch(c, &stack, pos, "llrb_insn_opt_lt", '<');
+        break;
+      case YARVINSN_opt_le:
+        llrb_compile_opt_insn_with_dispatch(c, &stack, pos, "llrb_insn_opt_le", rb_intern("<="));
+        break;
+      case YARVINSN_opt_gt:
+        llrb_compile_opt_insn_with_dispatch(c, &stack, pos, "llrb_insn_opt_gt", '>');
+        break;
+      case YARVINSN_opt_ge:
+        llrb_compile_opt_insn_with_dispatch(c, &stack, pos, "llrb_insn_opt_ge", rb_intern(">="));
+        break;
+      case YARVINSN_leave:
+        ret = llrb_stack_pop(&stack);
+        break;
+      default:
+        rb_raise(rb_eCompileError, "Unexpected insn at llrb_compile_inlined_iseq: %s", insn_name(insn));
+    }
+    i += insn_len(insn);
+  }
+
+  return ret;
+}
+
+// Compiles opt_send_without_block whose method is inlined. It's guarded by the same check as vm_search_method's
+// cache hit, with method state and class serial at compilation. If it fails, the method is called normally.
+static void
+llrb_compile_inlined_send(const struct llrb_compiler *c, struct llrb_stack *stack, const unsigned int pos,
+    CALL_INFO ci, CALL_CACHE cc, const rb_callable_method_entry_t *me)
+{
+  const int argc = ci->orig_argc;
+  LLVMValueRef recv = stack->body[stack->size - argc - 1];
+  LLVMValueRef *args = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, argc + 1);
+  for (int i = 0; i < argc; i++) {
+    args[i] = stack->body[stack->size - argc + i];
+  }
+
+  LLVMBasicBlockRef inline_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "inlined_method");
+  LLVMBasicBlockRef send_ref   = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "opt_send_without_block");
+  LLVMBasicBlockRef merge_ref  = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "opt_send_without_block_merge");
+  LLVMValueRef hit = llrb_call_func(c, "llrb_method_cache_hit_p", 3, recv,
+      llrb_value((VALUE)cc->method_state), llrb_value((VALUE)cc->class_serial));
+  llrb_assume_method_state(c, cc);
+  llrb_build_guard(c, llrb_build_rtest(c->builder, hit), inline_ref, send_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, inline_ref);
+  LLVMValueRef inlined;
+  if (me->def->type == VM_METHOD_TYPE_IVAR) { // rb_attr_get doesn't warn uninitialized ivar, like attr_reader.
+    inlined = llrb_call_func(c, "rb_attr_get", 2, recv, llrb_value((VALUE)me->def->body.attr.id));
+  } else {
+    inlined = llrb_compile_inlined_iseq(c, me->def->body.iseq.iseqptr, pos, recv, args);
+  }
+  LLVMBasicBlockRef inlined_end_ref = LLVMGetInsertBlock(c->builder);
+  LLVMBuildBr(c->builder, merge_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, send_ref);
+  llrb_compile_args(c, stack, argc);
+  LLVMValueRef sent = llrb_call_func(c, "llrb_insn_opt_send_without_block", 5,
+      llrb_get_thread(c), llrb_get_cfp(c), llrb_value((VALUE)ci), llrb_value((VALUE)cc), recv);
+  LLVMBuildBr(c->builder, merge_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, merge_ref);
+  LLVMValueRef phi = LLVMBuildPhi(c->builder, LLVMInt64TypeInContext(llrb_ctx), "opt_send_without_block");
+  LLVMValueRef values[] = { inlined, sent };
+  LLVMBasicBlockRef blocks[] = { inlined_end_ref, send_ref };
+  LLVMAddIncoming(phi, values, blocks, 2);
+  llrb_stack_push(stack, phi);
+}
+
+// Returns index of keyword `id` in call info's kw_arg, or -1 if it's not passed.
+static int
+llrb_kw_arg_index(const struct rb_call_info_kw_arg *kw_arg, ID id)
+{
+  for (int i = 0; i < kw_arg->keyword_len; i++) {
+    if (kw_arg->keywords[i] == ID2SYM(id)) return i;
+  }
+  return -1;
+}
+
+// Same as vm_args.c. Beyond it, args_setup_kw_parameters passes unspecified_bits as a Hash.
+#define KW_SPECIFIED_BITS_MAX (32-1)
+
+// Returns method entry of an ISeq method called with keywords by opt_send_without_block, or 0 if the call needs
+// setup_parameters_complex. The callee must take only leading parameters and keywords, and the passed keywords must
+// be exactly accepted without an error. Call cache must be warm and still valid like `llrb_inlined_method_entry`.
+static const rb_callable_method_entry_t *
+llrb_kw_method_entry(CALL_INFO ci, CALL_CACHE cc)
+{
+  extern rb_serial_t ruby_vm_global_method_state;
+
+  if (!(ci->flag & VM_CALL_KWARG)) return 0;
+  if (ci->flag & (VM_CALL_ARGS_SPLAT | VM_CALL_ARGS_BLOCKARG | VM_CALL_KW_SPLAT | VM_CALL_TAILCALL)) return 0;
+  if (cc->me == 0 || cc->class_serial == 0 || cc->method_state != ruby_vm_global_method_state) return 0;
+
+  const rb_callable_method_entry_t *me = cc->me;
+  if (METHOD_ENTRY_VISI(me) != METHOD_VISI_PUBLIC && !(ci->flag & VM_CALL_FCALL)) return 0;
+  if (me->def->type != VM_METHOD_TYPE_ISEQ) return 0;
+
+  const struct rb_iseq_constant_body *body = me->def->body.iseq.iseqptr->body;
+  if (!body->param.flags.has_kw || body->param.flags.has_opt || body->param.flags.has_rest
+      || body->param.flags.has_post || body->param.flags.has_kwrest || body->param.flags.has_block) return 0;
+
+  const struct rb_call_info_kw_arg *kw_arg = ((struct rb_call_info_with_kwarg *)ci)->kw_arg;
+  const struct rb_iseq_param_keyword *keyword = body->param.keyword;
+  if (body->param.lead_num != ci->orig_argc - kw_arg->keyword_len) return 0;
+  // Keywords follow leading parameters, and unspecified_bits follows them as the last parameter.
+  if (keyword->bits_start != body->param.lead_num + keyword->num || (int)body->param.size != keyword->bits_start + 1) {
+    return 0;
+  }
+  if (keyword->num > KW_SPECIFIED_BITS_MAX) return 0; // unspecified_bits may be a Hash.
+
+  int found = 0;
+  for (int i = 0; i < keyword->num; i++) {
+    if (llrb_kw_arg_index(kw_arg, keyword->table[i]) >= 0) {
+      found++;
+    } else if (i < keyword->required_num) {
+      return 0; // ArgumentError for missing keyword
+    }
+  }
+  return found == kw_arg->keyword_len ? me : 0; // ArgumentError for unknown or duplicated keyword otherwise
+}
+
+// Compiles opt_send_without_block with keywords to a callee satisfying `llrb_kw_method_entry`. Keyword values are
+// pushed in callee's local order, and defaults which are constant and unspecified_bits are resolved at compilation,
+// like args_setup_kw_parameters. Then `llrb_call_iseq_method` pushes the frame without setting up parameters.
+// It's guarded like `llrb_compile_inlined_send`, and the method is called normally if the guard fails.
+static void
+llrb_compile_kw_send(const struct llrb_compiler *c, struct llrb_stack *stack, CALL_INFO ci, CALL_CACHE cc,
+    const rb_callable_method_entry_t *me)
+{
+  const struct rb_iseq_param_keyword *keyword = me->def->body.iseq.iseqptr->body->param.keyword;
+  const struct rb_call_info_kw_arg *kw_arg = ((struct rb_call_info_with_kwarg *)ci)->kw_arg;
+  const unsigned int argc = (unsigned int)ci->orig_argc;
+  const unsigned int kw_len = (unsigned int)kw_arg->keyword_len;
+  LLVMValueRef recv = stack->body[stack->size - argc - 1];
+  LLVMValueRef *kw_values = stack->body + (stack->size - kw_len);
+
+  LLVMBasicBlockRef kw_ref    = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "kw_send");
+  LLVMBasicBlockRef send_ref  = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "opt_send_without_block");
+  LLVMBasicBlockRef merge_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "opt_send_without_block_merge");
+  LLVMValueRef hit = llrb_call_func(c, "llrb_method_cache_hit_p", 3, recv,
+      llrb_value((VALUE)cc->method_state), llrb_value((VALUE)cc->class_serial));
+  llrb_assume_method_state(c, cc);
+  llrb_build_guard(c, llrb_build_rtest(c->builder, hit), kw_ref, send_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, kw_ref);
+  for (unsigned int i = stack->size - argc - 1; i < stack->size - kw_len; i++) { // recv + leading args
+    llrb_call_func(c, "llrb_push_result", 2, llrb_get_cfp(c), stack->body[i]);
+  }
+  int unspecified_bits = 0;
+  for (int i = 0; i < keyword->num; i++) {
+    int index = llrb_kw_arg_index(kw_arg, keyword->table[i]);
+    LLVMValueRef val;
+    if (index >= 0) {
+      val = kw_values[index];
+    } else {
+      int di = i - keyword->required_num;
+      if (keyword->default_values[di] == Qundef) { // Not constant. checkkeyword in callee evaluates it.
+        val = llrb_value(Qnil);
+        unspecified_bits |= 0x01 << di;
+      } else {
+        val = llrb_value(keyword->default_values[di]);
+      }
+    }
+    llrb_call_func(c, "llrb_push_result", 2, llrb_get_cfp(c), val);
+  }
+  llrb_call_func(c, "llrb_push_result", 2, llrb_get_cfp(c), llrb_value(INT2FIX(unspecified_bits)));
+  LLVMValueRef called = llrb_call_func(c, "llrb_call_iseq_method", 4,
+      llrb_get_thread(c), llrb_get_cfp(c), llrb_value((VALUE)me), recv);
+  LLVMBuildBr(c->builder, merge_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, send_ref);
+  llrb_compile_args(c, stack, (int)argc);
+  LLVMValueRef sent = llrb_call_func(c, "llrb_insn_opt_send_without_block", 5, llrb_get_thread(c), llrb_get_cfp(c),
+      llrb_value((VALUE)ci), llrb_compile_call_cache(c, ci, cc, recv), recv);
+  LLVMBuildBr(c->builder, merge_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, merge_ref);
+  LLVMValueRef phi = LLVMBuildPhi(c->builder, LLVMInt64TypeInContext(llrb_ctx), "opt_send_without_block");
+  LLVMValueRef values[] = { called, sent };
+  LLVMBasicBlockRef blocks[] = { kw_ref, send_ref };
+  LLVMAddIncoming(phi, values, blocks, 2);
+  llrb_stack_push(stack, phi);
+}
+
+// Loads ivar from ROBJECT_IVPTR(self) by the index cached in IC at compilation. Self's type and class are checked
+// only once by `llrb_compile_ivar_guard`. If the guard failed or ivar is not set, it uses IC as YARV does.
+static LLVMValueRef
+llrb_compile_getivar_index(const struct llrb_compiler *c, const VALUE *operands)
+{
+  LLVMBasicBlockRef index_ref    = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "getivar_index");
+  LLVMBasicBlockRef fallback_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "getinstancevariable");
+  LLVMBasicBlockRef merge_ref    = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "getinstancevariable_merge");
+  llrb_build_guard(c, c->ivar_guard, index_ref, fallback_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, index_ref);
+  LLVMValueRef loaded = llrb_call_func(c, "llrb_getivar_index", 2,
+      llrb_get_self(c), llrb_value((VALUE)((IC)operands[1])->ic_value.index));
+  llrb_build_guard(c, LLVMBuildICmp(c->builder, LLVMIntNE, loaded, llrb_value(Qundef), ""), merge_ref, fallback_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, fallback_ref);
+  LLVMValueRef cached = llrb_call_func(c, "llrb_insn_getinstancevariable", 3,
+      llrb_get_self(c), llrb_value(operands[0]), llrb_value(operands[1]));
+  LLVMBuildBr(c->builder, merge_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, merge_ref);
+  LLVMValueRef phi = LLVMBuildPhi(c->builder, LLVMInt64TypeInContext(llrb_ctx), "getinstancevariable");
+  LLVMValueRef values[] = { loaded, cached };
+  LLVMBasicBlockRef blocks[] = { index_ref, fallback_ref };
+  LLVMAddIncoming(phi, values, blocks, 2);
+  return phi;
+}
+
+// Stores ivar to ROBJECT_IVPTR(self) like `llrb_compile_getivar_index`. Frozen self and a new ivar exceeding
+// ROBJECT_NUMIV are handled by IC version.
+static void
+llrb_compile_setivar_index(const struct llrb_compiler *c, const VALUE *operands, LLVMValueRef val)
+{
+  LLVMBasicBlockRef index_ref    = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "setivar_index");
+  LLVMBasicBlockRef fallback_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "setinstancevariable");
+  LLVMBasicBlockRef merge_ref    = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "setinstancevariable_merge");
+  llrb_build_guard(c, c->ivar_guard, index_ref, fallback_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, index_ref);
+  LLVMValueRef stored = llrb_call_func(c, "llrb_setivar_index", 3,
+      llrb_get_self(c), llrb_value((VALUE)((IC)operands[1])->ic_value.index), val);
+  llrb_build_guard(c, llrb_build_rtest(c->builder, stored), merge_ref, fallback_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, fallback_ref);
+  llrb_call_func(c, "llrb_insn_setinstancevariable", 4, llrb_get_self(c),
+      llrb_value(operands[0]), val, llrb_value(operands[1]));
+  LLVMBuildBr(c->builder, merge_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, merge_ref);
+}
+
+static void llrb_compile_basic_block(const struct llrb_compiler *c, struct llrb_basic_block *block, struct llrb_stack *stack);
+
+struct llrb_case_dispatch_dest {
+  long offset;
+  bool by_key; // true if `key_switch` jumps to this destination too.
+};
+
+struct llrb_case_dispatch {
+  const struct llrb_compiler *c;
+  unsigned int base;                     // Position which CDHASH offsets are relative to.
+  LLVMValueRef key_switch;               // `switch` on key's VALUE. Only Fixnum and static Symbol keys are added.
+  LLVMValueRef offset_switch;            // `switch` on offset returned by llrb_insn_opt_case_dispatch.
+  struct llrb_case_dispatch_dest *dests; // Unique destinations of `offset_switch`.
+  unsigned int dest_size;
+};
+
+static struct llrb_case_dispatch_dest *
+llrb_add_case_dispatch_dest(struct llrb_case_dispatch *dispatch, long offset)
+{
+  for (unsigned int i = 0; i < dispatch->dest_size; i++) {
+    if (dispatch->dests[i].offset == offset) return dispatch->dests + i;
+  }
+
+  struct llrb_basic_block *dest_block = llrb_find_block(dispatch->c, dispatch->base + offset);
+  LLVMAddCase(dispatch->offset_switch, llrb_value((VALUE)offset), dest_block->ref);
+
+  struct llrb_case_dispatch_dest *dest = dispatch->dests + dispatch->dest_size;
+  dispatch->dest_size++;
+  *dest = (struct llrb_case_dispatch_dest){ .offset = offset, .by_key = false };
+  return dest;
+}
+
+static int
+llrb_add_case_dispatch_i(VALUE key, VALUE offset, VALUE arg)
+{
+  struct llrb_case_dispatch *dispatch = (struct llrb_case_dispatch *)arg;
+  struct llrb_case_dispatch_dest *dest = llrb_add_case_dispatch_dest(dispatch, FIX2LONG(offset));
+
+  // Other keys can't be compared by VALUE. They are looked up in CDHASH.
+  if (FIXNUM_P(key) || STATIC_SYM_P(key)) {
+    struct llrb_basic_block *dest_block = llrb_find_block(dispatch->c, dispatch->base + dest->offset);
+    LLVMAddCase(dispatch->key_switch, llrb_value(key), dest_block->ref);
+    dest->by_key = true;
+  }
+  return ST_CONTINUE;
+}
+
+// Compiles opt_case_dispatch to LLVM `switch`. While `===` is not redefined, Fixnum and static Symbol keys are
+// dispatched by their VALUE and other keys are looked up in CDHASH. Otherwise it falls through to checkmatch insns.
+// Like `jump`, successor blocks are compiled here instead of the caller.
+static void
+llrb_compile_case_dispatch(const struct llrb_compiler *c, struct llrb_stack *stack, const unsigned int pos, const VALUE *operands)
+{
+  CDHASH hash = operands[0];
+  OFFSET else_offset = (OFFSET)operands[1];
+  unsigned int base = pos + insn_len(YARVINSN_opt_case_dispatch);
+  struct llrb_basic_block *fallthrough_block = llrb_find_block(c, base);
+  LLVMValueRef key = llrb_stack_pop(stack);
+
+  LLVMBasicBlockRef key_ref    = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "case_dispatch_key");
+  LLVMBasicBlockRef lookup_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "case_dispatch_lookup");
+  llrb_build_guard(c, llrb_build_rtest(c->builder, llrb_call_func(c, "llrb_opt_case_dispatch_p", 0)), key_ref, lookup_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, key_ref);
+  LLVMValueRef key_switch = LLVMBuildSwitch(c->builder, key, lookup_ref, (unsigned)RHASH_SIZE(hash));
+
+  LLVMPositionBuilderAtEnd(c->builder, lookup_ref);
+  LLVMValueRef offset = llrb_call_func(c, "llrb_insn_opt_case_dispatch", 3, llrb_value(hash), llrb_value((VALUE)else_offset), key);
+  LLVMValueRef offset_switch = LLVMBuildSwitch(c->builder, offset, fallthrough_block->ref, (unsigned)RHASH_SIZE(hash) + 1);
+
+  struct llrb_case_dispatch dispatch = (struct llrb_case_dispatch){
+    .c = c,
+    .base = base,
+    .key_switch = key_switch,
+    .offset_switch = offset_switch,
+    .dests = LLRB_ARENA_ALLOC_N(c->cfg->arena, struct llrb_case_dispatch_dest, RHASH_SIZE(hash) + 1),
+    .dest_size = 0,
+  };
+  rb_hash_foreach(hash, llrb_add_case_dispatch_i, (VALUE)&dispatch);
+  llrb_add_case_dispatch_dest(&dispatch, (long)else_offset);
+
+  for (unsigned int i = 0; i < dispatch.dest_size; i++) {
+    struct llrb_basic_block *dest_block = llrb_find_block(c, base + dispatch.dests[i].offset);
+    struct llrb_stack *dest_stack = llrb_copy_stack(c, stack);
+    if (dispatch.dests[i].by_key) llrb_push_incoming_things(c, dest_block, key_ref, dest_stack);
+    llrb_push_incoming_things(c, dest_block, lookup_ref, dest_stack);
+    llrb_compile_basic_block(c, dest_block, dest_stack);
+  }
+
+  // Fallthrough block's predecessor is not the current block but `lookup_ref`. So the caller can't compile it.
+  llrb_push_incoming_things(c, fallthrough_block, lookup_ref, stack);
+  llrb_compile_basic_block(c, fallthrough_block, stack);
+}
+
+// Level-0 locals of `while i < n; s += a[i]; i += 1; end`, or `s += a[i] * b[i]` for dot product. `limit` is 0 if
+// the condition is `i < a.length` or `i < a.size`, and `ary2` is 0 for sum. Index 0 is never a local's.
+struct llrb_reduction {
+  lindex_t sum, ary, ary2, index, limit;
+  const char *limit_func; // "llrb_insn_opt_length" or "llrb_insn_opt_size" if `limit` is 0.
+};
+
+// Returns the insn at `*pos` skipping nop and trace, and moves `*pos` after it. Operands are set to `*operands`.
+static int
+llrb_next_reduction_insn(const struct rb_iseq_constant_body *body, unsigned int *pos, const VALUE **operands)
+{
+  while (*pos < body->iseq_size) {
+    int insn = (int)body->iseq_encoded[*pos];
+    *operands = body->iseq_encoded + (*pos + 1);
+    *pos += insn_len(insn);
+    if (insn != YARVINSN_nop && insn != YARVINSN_trace) return insn;
+  }
+  return -1;
+}
+
+static bool
+llrb_match_getlocal(const struct rb_iseq_constant_body *body, unsigned int *pos, lindex_t *idx)
 {
-  if (pos == 0) return; // Skip. 0 would be opt_call_c_function and there's no need to change.
+  const VALUE *operands;
+  if (llrb_next_reduction_insn(body, pos, &operands) != YARVINSN_getlocal_OP__WC__0) return false;
+  if (*idx != 0 && *idx != (lindex_t)operands[0]) return false;
+  *idx = (lindex_t)operands[0];
+  return true;
+}
 
-  if (llrb_pc_change_required(insn)) {
-    // This case should be rejected to compile by `llrb_check_not_compilable`.
-    if (pos == 1) rb_raise(rb_eCompileError, "program counter is set to 1 from iseq_encoded");
+static bool
+llrb_match_insn(const struct rb_iseq_constant_body *body, unsigned int *pos, int insn)
+{
+  const VALUE *operands;
+  return llrb_next_reduction_insn(body, pos, &operands) == insn;
+}
 
-    // `pos` MUST NOT be 0 (it causes stack level too deep) or 1 (funcptr is considered as insn and it's invalid as insn).
-    const VALUE *pc = c->new_iseq_encoded + pos; // This must be `new_iseq_encoded` to get proper `epc` in `vm_exec`.
-    llrb_call_func(c, "llrb_set_pc", 2, llrb_get_cfp(c), llrb_value((VALUE)pc));
+// Matches a reduction loop whose condition starts at `cond`, the destination of `jump` insn at `pos`. Its body must be
+// straight-line insns between the two, so that nothing but the condition's branchif enters it.
+static bool
+llrb_match_reduction_loop(const struct rb_iseq_constant_body *body, const unsigned int pos, const unsigned int cond,
+    struct llrb_reduction *r)
+{
+  *r = (struct llrb_reduction){ 0 };
+  const VALUE *operands;
+
+  // i < n, or i < a.length. `a` is checked to be the body's Array later.
+  unsigned int i = cond;
+  lindex_t limit_ary = 0;
+  if (!llrb_match_getlocal(body, &i, &r->index) || !llrb_match_getlocal(body, &i, &r->limit)) return false;
+  int insn = llrb_next_reduction_insn(body, &i, &operands);
+  if (insn == YARVINSN_opt_length || insn == YARVINSN_opt_size) {
+    limit_ary = r->limit;
+    r->limit = 0;
+    r->limit_func = (insn == YARVINSN_opt_length) ? "llrb_insn_opt_length" : "llrb_insn_opt_size";
+    insn = llrb_next_reduction_insn(body, &i, &operands);
   }
+  if (insn != YARVINSN_opt_lt) return false;
+  if (llrb_next_reduction_insn(body, &i, &operands) != YARVINSN_branchif) return false;
+  unsigned int start = i + (unsigned int)operands[0];
+  if (start <= pos || cond <= start) return false;
+
+  // s += a[i] or s += a[i] * b[i]
+  i = start;
+  if (!llrb_match_getlocal(body, &i, &r->sum) || !llrb_match_getlocal(body, &i, &r->ary)
+      || !llrb_match_getlocal(body, &i, &r->index) || !llrb_match_insn(body, &i, YARVINSN_opt_aref)) return false;
+  insn = llrb_next_reduction_insn(body, &i, &operands);
+  if (insn == YARVINSN_getlocal_OP__WC__0) {
+    r->ary2 = (lindex_t)operands[0];
+    if (!llrb_match_getlocal(body, &i, &r->index) || !llrb_match_insn(body, &i, YARVINSN_opt_aref)
+        || !llrb_match_insn(body, &i, YARVINSN_opt_mult)) return false;
+    insn = llrb_next_reduction_insn(body, &i, &operands);
+  }
+  if (insn != YARVINSN_opt_plus || llrb_next_reduction_insn(body, &i, &operands) != YARVINSN_setlocal_OP__WC__0
+      || (lindex_t)operands[0] != r->sum) return false;
+
+  // i += 1
+  if (!llrb_match_getlocal(body, &i, &r->index)) return false;
+  insn = llrb_next_reduction_insn(body, &i, &operands);
+  if (insn != YARVINSN_putobject_OP_INT2FIX_O_1_C_ && !(insn == YARVINSN_putobject && operands[0] == INT2FIX(1))) return false;
+  if (!llrb_match_insn(body, &i, YARVINSN_opt_plus) || llrb_next_reduction_insn(body, &i, &operands) != YARVINSN_setlocal_OP__WC__0
+      || (lindex_t)operands[0] != r->index) return false;
+  if (i != cond) return false;
+
+  // Only `s` and `i` are written, and the limit is not one of them.
+  if (r->sum == r->index || r->sum == r->ary || r->index == r->ary) return false;
+  if (r->ary2 == r->sum || r->ary2 == r->index) return false;
+  if (limit_ary != 0 && limit_ary != r->ary) return false;
+  if (r->limit == r->sum || r->limit == r->index) return false;
+  return true;
+}
+
+static LLVMValueRef
+llrb_compile_getlocal_level0(const struct llrb_compiler *c, lindex_t idx)
+{
+  if (c->locals) return LLVMBuildLoad(c->builder, c->locals[idx], "getlocal");
+  return llrb_call_func(c, "llrb_insn_getlocal_level0", 2, llrb_get_cfp(c), llrb_value(idx));
 }
 
 static void
-llrb_compile_opt_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const char *name, int argc)
+llrb_compile_setlocal_level0(const struct llrb_compiler *c, lindex_t idx, LLVMValueRef value)
 {
-  LLVMValueRef *args = ALLOC_N(LLVMValueRef, argc); // `xfree`d in this function.
-  for (int i = argc-1; i >= 0; i--) {
-    args[i] = llrb_stack_pop(stack);
+  if (c->locals) {
+    LLVMBuildStore(c->builder, value, c->locals[idx]);
+    return;
   }
+  llrb_call_func(c, "llrb_insn_setlocal_level0", 3, llrb_get_cfp(c), llrb_value(idx), value);
+}
 
-  char *funcname = ZALLOC_N(char, strlen("llrb_insn_") + strlen(name) + 1); // `xfree`d in this function.
-  strcat(funcname, "llrb_insn_");
-  strcat(funcname, name);
-  llrb_stack_push(stack, LLVMBuildCall(c->builder, llrb_get_function(c->mod, funcname), args, argc, name));
-
-  xfree(funcname);
-  xfree(args);
+// Locals of outer scopes are read from ep computed on function entry, instead of following the chain each time.
+static LLVMValueRef
+llrb_compile_getlocal_outer(const struct llrb_compiler *c, lindex_t idx, rb_num_t level)
+{
+  if (c->outer_eps && level < c->outer_ep_levels) {
+    return llrb_call_func(c, "llrb_env_read", 2, c->outer_eps[level], llrb_value(idx));
+  }
+  if (level == 1) return llrb_call_func(c, "llrb_insn_getlocal_level1", 2, llrb_get_cfp(c), llrb_value(idx));
+  return llrb_call_func(c, "llrb_insn_getlocal", 3, llrb_get_cfp(c), llrb_value(idx), llrb_value(level));
 }
 
-// Push receiver and arguments for method call
 static void
-llrb_compile_args(const struct llrb_compiler *c, struct llrb_stack *stack, const int argc)
+llrb_compile_setlocal_outer(const struct llrb_compiler *c, lindex_t idx, rb_num_t level, LLVMValueRef value)
 {
-  int stack_top = (int)stack->size - 1;
-  for (int i = (int)argc; i >= 0; i--) {
-    llrb_call_func(c, "llrb_push_result", 2, llrb_get_cfp(c), stack->body[stack_top-i]);
+  if (c->outer_eps && level < c->outer_ep_levels) {
+    llrb_call_func(c, "llrb_env_write", 3, c->outer_eps[level], llrb_value(idx), value);
+  } else if (level == 1) {
+    llrb_call_func(c, "llrb_insn_setlocal_level1", 3, llrb_get_cfp(c), llrb_value(idx), value);
+  } else {
+    llrb_call_func(c, "llrb_insn_setlocal", 4, llrb_get_cfp(c), llrb_value(idx), llrb_value(level), value);
   }
-  stack->size -= argc + 1;
 }
 
-static void llrb_compile_basic_block(const struct llrb_compiler *c, struct llrb_basic_block *block, struct llrb_stack *stack);
+// Sum and dot product loops over an Array are run by `llrb_vector_reduce` before entering the loop. If it succeeds,
+// the loop's locals are set to the values after it, and its condition is false at the first check. Otherwise the loop
+// runs as it is. Trace events in the loop would be skipped, so it's done only when trace insns are dropped.
+static void
+llrb_compile_reduction_loop(const struct llrb_compiler *c, const unsigned int pos, const unsigned int cond)
+{
+  struct llrb_reduction r;
+  if (!c->drop_trace || !llrb_match_reduction_loop(c->body, pos, cond, &r)) return;
+
+  LLVMValueRef ary = llrb_compile_getlocal_level0(c, r.ary);
+  LLVMValueRef ary2 = r.ary2 ? llrb_compile_getlocal_level0(c, r.ary2) : llrb_value(Qundef);
+  LLVMValueRef index = llrb_compile_getlocal_level0(c, r.index);
+  LLVMValueRef limit = r.limit ? llrb_compile_getlocal_level0(c, r.limit)
+    : llrb_call_func(c, r.limit_func, 1, ary); // Qundef if it's dispatched, which makes the reduction fail.
+  LLVMValueRef sum = llrb_call_func(c, "llrb_vector_reduce", 5, ary, ary2, index, limit,
+      llrb_compile_getlocal_level0(c, r.sum));
+
+  LLVMBasicBlockRef reduced_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "vector_reduced");
+  LLVMBasicBlockRef loop_ref    = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "vector_loop");
+  LLVMValueRef cond_value = LLVMBuildICmp(c->builder, LLVMIntNE, sum, llrb_value(Qundef), "vector_reduce_p");
+  LLVMBuildCondBr(c->builder, cond_value, reduced_ref, loop_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, reduced_ref);
+  llrb_compile_setlocal_level0(c, r.sum, sum);
+  llrb_compile_setlocal_level0(c, r.index, limit);
+  LLVMBuildBr(c->builder, loop_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, loop_ref);
+}
+
+// Returns true if backward branch at `pos` can be an OSR entry. YARV stack must be empty after the branch, because
+// an interpreted frame entering there gives only its locals in env. `stack_size` includes branch's condition.
+// Position 0 is never patched, to keep `llrb_check_already_compiled` working.
+static bool
+llrb_osr_entry_p(const struct llrb_compiler *c, const unsigned int pos, const int insn, long offset, unsigned int stack_size)
+{
+  if (!c->osr || pos < 2 || offset >= 0) return false;
+  return stack_size == (insn == YARVINSN_jump ? 0 : 1);
+}
 
-// opt TODO:
-// YARVINSN_opt_newarray_max:
-// YARVINSN_opt_newarray_min:
-// YARVINSN_opt_aset:
-// YARVINSN_opt_aset_with:
-// YARVINSN_opt_aref_with:
-// YARVINSN_opt_length:
-// YARVINSN_opt_size:
-// YARVINSN_opt_empty_p:
-// YARVINSN_opt_succ:
-// YARVINSN_opt_not:
-// YARVINSN_opt_regexpmatch1:
-// YARVINSN_opt_regexpmatch2:
+static void
+llrb_add_osr_entry(const struct llrb_compiler *c, const unsigned int pos)
+{
+  REALLOC_N(c->osr->entries, unsigned int, c->osr->size + 1);
+  c->osr->entries[c->osr->size++] = pos;
+}
 
 // @param created_br is set true if conditional branch is created. In that case, br for next block isn't created in `llrb_compile_basic_block`.
 // @return true if the IR compiled from given insn includes `ret` instruction. In that case, next block won't be compiled in `llrb_compile_basic_block`.
@@ -276,13 +1302,11 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
     case YARVINSN_nop:
       break; // nop
     case YARVINSN_getlocal: {
-      llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_getlocal", 3, llrb_get_cfp(c),
-            llrb_value((lindex_t)operands[0]), llrb_value((rb_num_t)operands[1])));
+      llrb_stack_push(stack, llrb_compile_getlocal_outer(c, (lindex_t)operands[0], (rb_num_t)operands[1]));
       break;
     }
     case YARVINSN_setlocal: {
-      llrb_call_func(c, "llrb_insn_setlocal", 4, llrb_get_cfp(c),
-          llrb_value((lindex_t)operands[0]), llrb_value((rb_num_t)operands[1]), llrb_stack_pop(stack));
+      llrb_compile_setlocal_outer(c, (lindex_t)operands[0], (rb_num_t)operands[1], llrb_stack_pop(stack));
       break;
     }
     case YARVINSN_getspecial: {
@@ -294,10 +1318,18 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       break;
     }
     case YARVINSN_getinstancevariable:
+      if (c->ivar_serial && ((IC)operands[1])->ic_serial == c->ivar_serial) {
+        llrb_stack_push(stack, llrb_compile_getivar_index(c, operands));
+        break;
+      }
       llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_getinstancevariable", 3,
             llrb_get_self(c), llrb_value(operands[0]), llrb_value(operands[1])));
       break;
     case YARVINSN_setinstancevariable:
+      if (c->ivar_serial && ((IC)operands[1])->ic_serial == c->ivar_serial) {
+        llrb_compile_setivar_index(c, operands, llrb_stack_pop(stack));
+        break;
+      }
       llrb_call_func(c, "llrb_insn_setinstancevariable", 4, llrb_get_self(c),
           llrb_value(operands[0]), llrb_stack_pop(stack), llrb_value(operands[1]));
       break;
@@ -311,7 +1343,7 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
     }
     case YARVINSN_getconstant: {
       llrb_stack_push(stack, llrb_call_func(c, "vm_get_ev_const", 4, llrb_get_thread(c),
-            llrb_stack_pop(stack), llrb_value(operands[0]), LLVMConstInt(LLVMInt32Type(), 0, true)));
+            llrb_stack_pop(stack), llrb_value(operands[0]), LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), 0, true)));
       break;
     }
     case YARVINSN_setconstant: {
@@ -348,13 +1380,17 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       break;
     }
     case YARVINSN_concatstrings: {
-      LLVMValueRef *args = ALLOC_N(LLVMValueRef, operands[0] + 1); // `xfree`d in this block.
-      args[0] = llrb_value(operands[0]); // function is in size_t. correct?
-      for (long i = (long)operands[0]-1; 0 <= i; i--) {
-        args[1+i] = llrb_stack_pop(stack);
+      long num = (long)operands[0];
+      LLVMValueRef *fragments = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, num);
+      for (long i = num - 1; 0 <= i; i--) {
+        fragments[i] = llrb_stack_pop(stack);
       }
-      llrb_stack_push(stack, LLVMBuildCall(c->builder, llrb_get_function(c->mod, "llrb_insn_concatstrings"), args, operands[0] + 1, "concatstrings"));
-      xfree(args);
+      for (long i = 0; i < num; i++) {
+        fragments[i] = llrb_defer_tostring(c, stack, fragments, num, i);
+      }
+      struct llrb_stack popped = (struct llrb_stack){ .body = fragments, .size = num, .max = num };
+      LLVMValueRef ptr = llrb_compile_stack_buffer(c, &popped, num);
+      llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_concatstrings", 2, llrb_value(operands[0]), ptr));
       break;
     }
     case YARVINSN_tostring: {
@@ -374,15 +1410,14 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
     }
     case YARVINSN_toregexp: {
       rb_num_t cnt = operands[1];
-      LLVMValueRef *args1 = ALLOC_N(LLVMValueRef, cnt+1); // `xfree`d in this block.
-      args1[0] = LLVMConstInt(LLVMInt64Type(), (long)cnt, true);
+      LLVMValueRef *args1 = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, cnt+1);
+      args1[0] = LLVMConstInt(LLVMInt64TypeInContext(llrb_ctx), (long)cnt, true);
       for (rb_num_t i = 0; i < cnt; i++) {
         args1[1+i] = llrb_stack_pop(stack);
       }
       LLVMValueRef ary = LLVMBuildCall(c->builder, llrb_get_function(c->mod, "rb_ary_new_from_args"), args1, 1+cnt, "toregexp");
-      xfree(args1);
 
-      llrb_stack_push(stack, llrb_call_func(c, "rb_reg_new_ary", 2, ary, LLVMConstInt(LLVMInt32Type(), (int)operands[0], true)));
+      llrb_stack_push(stack, llrb_call_func(c, "rb_reg_new_ary", 2, ary, LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), (int)operands[0], true)));
 
       llrb_call_func(c, "rb_ary_clear", 1, ary);
       break;
@@ -394,13 +1429,19 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       llrb_stack_push(stack, llrb_call_func(c, "rb_ary_resurrect", 1, llrb_value(operands[0]))); // TODO: inline rb_ary_resurrect?
       break;
     }
-    //case YARVINSN_expandarray: {
-    //  rb_num_t flag = (rb_num_t)operands[1];
-    //  if (flag & 0x02) { // for postarg
-    //  } else {
-    //  }
-    //  break;
-    //}
+    case YARVINSN_expandarray: {
+      rb_num_t space_size = (rb_num_t)operands[0] + ((rb_num_t)operands[1] & 0x01);
+      LLVMValueRef base = llrb_call_func(c, "llrb_insn_expandarray", 4, llrb_get_cfp(c), llrb_stack_pop(stack),
+          llrb_value(operands[0]), llrb_value(operands[1]));
+
+      // Values are loaded from cfp->sp immediately, before anything else can overwrite it.
+      LLVMValueRef ptr = LLVMBuildIntToPtr(c->builder, base, LLVMPointerType(LLVMInt64TypeInContext(llrb_ctx), 0), "expandarray");
+      for (rb_num_t i = 0; i < space_size; i++) {
+        LLVMValueRef index = LLVMConstInt(LLVMInt64TypeInContext(llrb_ctx), i, false);
+        llrb_stack_push(stack, LLVMBuildLoad(c->builder, LLVMBuildGEP(c->builder, ptr, &index, 1, ""), ""));
+      }
+      break;
+    }
     case YARVINSN_concatarray: {
       LLVMValueRef ary2st = llrb_stack_pop(stack);
       LLVMValueRef ary1   = llrb_stack_pop(stack);
@@ -412,8 +1453,8 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       break;
     }
     case YARVINSN_newhash: {
-      LLVMValueRef *values = ALLOC_N(LLVMValueRef, operands[0] / 2);
-      LLVMValueRef *keys   = ALLOC_N(LLVMValueRef, operands[0] / 2);
+      LLVMValueRef *values = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, operands[0] / 2);
+      LLVMValueRef *keys   = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, operands[0] / 2);
       for (int i = 0; i < (int)operands[0] / 2; i++) {
         values[i] = llrb_stack_pop(stack);
         keys[i]   = llrb_stack_pop(stack);
@@ -431,7 +1472,7 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
     case YARVINSN_newrange: {
       LLVMValueRef high = llrb_stack_pop(stack);
       LLVMValueRef low  = llrb_stack_pop(stack);
-      LLVMValueRef flag = LLVMConstInt(LLVMInt64Type(), operands[0], false);
+      LLVMValueRef flag = LLVMConstInt(LLVMInt64TypeInContext(llrb_ctx), operands[0], false);
       llrb_stack_push(stack, llrb_call_func(c, "rb_range_new", 3, low, high, flag));
       break;
     }
@@ -445,7 +1486,7 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       break;
     }
     case YARVINSN_dupn: {
-      LLVMValueRef *values = ALLOC_N(LLVMValueRef, operands[0]); // `xfree`d in this block.
+      LLVMValueRef *values = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, operands[0]);
       for (rb_num_t i = 0; i < (rb_num_t)operands[0]; i++) {
         values[i] = llrb_stack_pop(stack); // TODO: obviously no need to pop
       }
@@ -456,7 +1497,6 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       for (rb_num_t i = 0; i < (rb_num_t)operands[0]; i++) {
         llrb_stack_push(stack, values[operands[0] - 1 - i]);
       }
-      xfree(values);
       break;
     }
     case YARVINSN_swap: {
@@ -466,21 +1506,21 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       llrb_stack_push(stack, second);
       break;
     }
-    //case YARVINSN_reverse: {
-    //  rb_num_t n = (rb_num_t)operands[0];
-    //  unsigned int last = stack->size - 1;
-    //  unsigned int top_i = last - n;
-
-    //  for (rb_num_t i = 0; i < n/2; i++) {
-    //    LLVMValueRef v0 = stack->body[top_i+i];
-    //    LLVMValueRef v1 = stack->body[last-i];
-    //    stack->body[top_i+i] = v1;
-    //    stack->body[last-i]  = v0;
-    //  }
-    //  break;
-    //}
-    //case YARVINSN_reput:
-    //  break; // none
+    case YARVINSN_reverse: {
+      rb_num_t n = (rb_num_t)operands[0];
+      unsigned int last = stack->size - 1;
+      unsigned int top_i = stack->size - (unsigned int)n;
+
+      for (rb_num_t i = 0; i < n/2; i++) {
+        LLVMValueRef v0 = stack->body[top_i+i];
+        LLVMValueRef v1 = stack->body[last-i];
+        stack->body[top_i+i] = v1;
+        stack->body[last-i]  = v0;
+      }
+      break;
+    }
+    case YARVINSN_reput:
+      break; // none
     case YARVINSN_topn: {
       llrb_stack_push(stack, llrb_stack_topn(stack, (unsigned int)operands[0]));
       break;
@@ -504,7 +1544,7 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
     case YARVINSN_checkmatch: {
       LLVMValueRef pattern = llrb_stack_pop(stack);
       LLVMValueRef target =llrb_stack_pop(stack);
-      LLVMValueRef flag = LLVMConstInt(LLVMInt64Type(), operands[0], false);
+      LLVMValueRef flag = LLVMConstInt(LLVMInt64TypeInContext(llrb_ctx), operands[0], false);
       llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_checkmatch", 3, target, pattern, flag));
       break;
     }
@@ -514,9 +1554,11 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       break;
     }
     case YARVINSN_trace: {
+      if (c->drop_trace) break; // `llrb_compile_event_guard` invalidates this function instead.
       rb_event_flag_t flag = (rb_event_flag_t)((rb_num_t)operands[0]);
       LLVMValueRef val = (flag & (RUBY_EVENT_RETURN | RUBY_EVENT_B_RETURN)) ? stack->body[stack->size-1] : llrb_value(Qundef);
-      llrb_call_func(c, "llrb_insn_trace", 4, llrb_get_thread(c), llrb_get_cfp(c), LLVMConstInt(LLVMInt32Type(), flag, false), val);
+      llrb_write_back_locals(c); // TracePoint#binding may read them.
+      llrb_call_func(c, "llrb_insn_trace", 4, llrb_get_thread(c), llrb_get_cfp(c), LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), flag, false), val);
       break;
     }
     //case YARVINSN_defineclass: {
@@ -529,72 +1571,102 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       if (ci->flag & VM_CALL_ARGS_BLOCKARG) stack_size++; // push `&block`
 
       unsigned int arg_size = 6 + stack_size;
-      LLVMValueRef *args = ALLOC_N(LLVMValueRef, arg_size);
+      LLVMValueRef *args = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, arg_size);
       args[0] = llrb_get_thread(c);
       args[1] = llrb_get_cfp(c);
       args[2] = llrb_value((VALUE)ci);
-      args[3] = llrb_value((VALUE)((CALL_CACHE)operands[1]));
       args[4] = llrb_value((VALUE)((ISEQ)operands[2]));
-      args[5] = LLVMConstInt(LLVMInt32Type(), stack_size, false);
+      args[5] = LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), stack_size, false);
       for (int i = (int)stack_size - 1; 0 <= i; i--) { // recv + argc
         args[6 + i] = llrb_stack_pop(stack);
       }
+      args[3] = llrb_compile_call_cache(c, ci, (CALL_CACHE)operands[1], args[6]);
 
       llrb_stack_push(stack, LLVMBuildCall(c->builder, llrb_get_function(c->mod, "llrb_insn_send"), args, arg_size, "send"));
       break;
     }
     case YARVINSN_opt_str_freeze: { // TODO: optimize
       llrb_stack_push(stack, llrb_value(operands[0]));
-      llrb_compile_opt_insn(c, stack, "opt_str_freeze", 1);
+      llrb_compile_opt_insn(c, stack, "llrb_insn_opt_str_freeze", 1);
       break;
     }
-    case YARVINSN_opt_newarray_max: // TODO: optimize
-      llrb_stack_push(stack, llrb_compile_newarray(c, stack, (long)operands[0]));
-      llrb_stack_push(stack, llrb_compile_funcall(c, stack, rb_intern("max"), 0));
+    case YARVINSN_opt_newarray_max: {
+      LLVMValueRef ptr = llrb_compile_stack_buffer(c, stack, (long)operands[0]);
+      llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_opt_newarray_max", 2, llrb_value(operands[0]), ptr));
       break;
-    case YARVINSN_opt_newarray_min: // TODO: optimize
-      llrb_stack_push(stack, llrb_compile_newarray(c, stack, (long)operands[0]));
-      llrb_stack_push(stack, llrb_compile_funcall(c, stack, rb_intern("min"), 0));
+    }
+    case YARVINSN_opt_newarray_min: {
+      LLVMValueRef ptr = llrb_compile_stack_buffer(c, stack, (long)operands[0]);
+      llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_opt_newarray_min", 2, llrb_value(operands[0]), ptr));
       break;
+    }
     case YARVINSN_opt_send_without_block: {
       CALL_INFO ci = (CALL_INFO)operands[0];
+      if (ci->mid == rb_intern("include?") && ci->orig_argc == 1 && (ci->flag & VM_CALL_ARGS_SIMPLE)) {
+        LLVMValueRef obj  = llrb_stack_pop(stack);
+        LLVMValueRef recv = llrb_stack_pop(stack);
+        LLVMValueRef num, ptr;
+        if (recv != obj && llrb_eliminate_temporary_array(c, stack, recv, &num, &ptr)) {
+          llrb_stack_push(stack, llrb_call_func(c, "llrb_newarray_include_p", 3, num, ptr, obj));
+          break;
+        }
+        llrb_stack_push(stack, recv);
+        llrb_stack_push(stack, obj);
+      }
+
+      const rb_callable_method_entry_t *me = llrb_inlined_method_entry(c, ci, (CALL_CACHE)operands[1]);
+      if (me) {
+        llrb_compile_inlined_send(c, stack, pos, ci, (CALL_CACHE)operands[1], me);
+        break;
+      }
+      me = llrb_kw_method_entry(ci, (CALL_CACHE)operands[1]);
+      if (me) {
+        llrb_compile_kw_send(c, stack, ci, (CALL_CACHE)operands[1], me);
+        break;
+      }
+
       LLVMValueRef recv = stack->body[stack->size - ci->orig_argc - 1];
 
       llrb_compile_args(c, stack, ci->orig_argc);
+      LLVMValueRef cc = llrb_compile_call_cache(c, ci, (CALL_CACHE)operands[1], recv);
       llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_opt_send_without_block", 5,
             llrb_get_thread(c),
             llrb_get_cfp(c),
             llrb_value((VALUE)ci),
-            llrb_value((VALUE)((CALL_CACHE)operands[1])),
+            cc,
             recv));
       break;
     }
     case YARVINSN_invokesuper: { // TODO: refactor with opt_send_without_block
+      extern struct llrb_pic_stats *llrb_stats_pic(void);
       CALL_INFO ci = (CALL_INFO)operands[0];
       unsigned int stack_size = ci->orig_argc + 1;
+      if (ci->flag & VM_CALL_ARGS_BLOCKARG) stack_size++; // push `&block`
 
-      LLVMValueRef *args = ALLOC_N(LLVMValueRef, 5 + stack_size);
+      LLVMValueRef *args = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, 8 + stack_size);
       args[0] = llrb_get_thread(c);
       args[1] = llrb_get_cfp(c);
       args[2] = llrb_value((VALUE)ci);
       args[3] = llrb_value((VALUE)((CALL_CACHE)operands[1]));
       args[4] = llrb_value((VALUE)((ISEQ)operands[2]));
-      args[5] = LLVMConstInt(LLVMInt32Type(), stack_size, false);
+      args[5] = llrb_compile_site_cache(c, "super_cache", sizeof(struct llrb_super_cache));
+      args[6] = llrb_value((VALUE)llrb_stats_pic());
+      args[7] = LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), stack_size, false);
       for (int i = (int)stack_size - 1; 0 <= i; i--) { // recv + argc
-        args[6 + i] = llrb_stack_pop(stack);
+        args[8 + i] = llrb_stack_pop(stack);
       }
-      llrb_stack_push(stack, LLVMBuildCall(c->builder, llrb_get_function(c->mod, "llrb_insn_invokesuper"), args, 6 + stack_size, "invokesuper"));
+      llrb_stack_push(stack, LLVMBuildCall(c->builder, llrb_get_function(c->mod, "llrb_insn_invokesuper"), args, 8 + stack_size, "invokesuper"));
       break;
     }
     case YARVINSN_invokeblock: {
       CALL_INFO ci = (CALL_INFO)operands[0];
       unsigned int stack_size = ci->orig_argc;
 
-      LLVMValueRef *args = ALLOC_N(LLVMValueRef, 4 + stack_size);
+      LLVMValueRef *args = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, 4 + stack_size);
       args[0] = llrb_get_thread(c);
       args[1] = llrb_get_cfp(c);
       args[2] = llrb_value((VALUE)ci);
-      args[3] = LLVMConstInt(LLVMInt32Type(), stack_size, false);
+      args[3] = LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), stack_size, false);
       for (int i = (int)stack_size - 1; 0 <= i; i--) { // recv + argc
         args[4 + i] = llrb_stack_pop(stack);
       }
@@ -611,6 +1683,7 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       LLVMBuildRet(c->builder, llrb_get_cfp(c));
       return true;
     case YARVINSN_throw: {
+      llrb_write_back_locals(c);
       llrb_call_func(c, "llrb_insn_throw", 4, llrb_get_thread(c), llrb_get_cfp(c),
           llrb_value((rb_num_t)operands[0]), llrb_stack_pop(stack));
 
@@ -620,61 +1693,55 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       return true;
     }
     case YARVINSN_jump: {
+      if (llrb_osr_entry_p(c, pos, insn, (long)operands[0], stack->size)) llrb_add_osr_entry(c, pos);
       unsigned dest = pos + (unsigned)insn_len(insn) + operands[0];
-      struct llrb_basic_block *next_block = llrb_find_block(c->cfg, dest);
+      struct llrb_basic_block *next_block = llrb_find_block(c, dest);
+      if ((long)operands[0] > 0) llrb_compile_reduction_loop(c, pos, dest);
 
       LLVMBuildBr(c->builder, next_block->ref);
       *created_br = true;
 
-      if (next_block->incoming_size > 1 && stack->size > 0) {
-        llrb_push_incoming_things(c, next_block, LLVMGetInsertBlock(c->builder), llrb_stack_pop(stack));
-      }
+      llrb_push_incoming_things(c, next_block, LLVMGetInsertBlock(c->builder), stack);
       llrb_compile_basic_block(c, next_block, stack);
       return true;
     }
     case YARVINSN_branchif: { // TODO: refactor with other branch insns
+      if (llrb_osr_entry_p(c, pos, insn, (long)operands[0], stack->size)) llrb_add_osr_entry(c, pos);
       unsigned branch_dest = pos + (unsigned)insn_len(insn) + operands[0];
       unsigned fallthrough = pos + (unsigned)insn_len(insn);
-      struct llrb_basic_block *branch_dest_block = llrb_find_block(c->cfg, branch_dest);
-      struct llrb_basic_block *fallthrough_block = llrb_find_block(c->cfg, fallthrough);
+      struct llrb_basic_block *branch_dest_block = llrb_find_block(c, branch_dest);
+      struct llrb_basic_block *fallthrough_block = llrb_find_block(c, fallthrough);
 
       LLVMValueRef cond = llrb_stack_pop(stack);
       LLVMBuildCondBr(c->builder, llrb_build_rtest(c->builder, cond), branch_dest_block->ref, fallthrough_block->ref);
       *created_br = true;
 
-      struct llrb_stack *branch_dest_stack = llrb_copy_stack(stack); // `llrb_destruct_stack`ed in this block.
-      if (branch_dest_block->incoming_size > 1 && branch_dest_stack->size > 0) {
-        llrb_push_incoming_things(c, branch_dest_block,
-            LLVMGetInsertBlock(c->builder), llrb_stack_pop(branch_dest_stack));
-      }
+      struct llrb_stack *branch_dest_stack = llrb_copy_stack(c, stack);
+      llrb_push_incoming_things(c, branch_dest_block, LLVMGetInsertBlock(c->builder), branch_dest_stack);
       llrb_compile_basic_block(c, branch_dest_block, branch_dest_stack);
-      llrb_destruct_stack(branch_dest_stack);
-      break; // caller `compile_basic_block` compiles fallthrough_block and pushes incoming things to its phi node.
+      break; // caller `compile_basic_block` compiles fallthrough_block and pushes incoming things to its phi nodes.
     }
     case YARVINSN_branchunless: { // TODO: refactor with other branch insns
+      if (llrb_osr_entry_p(c, pos, insn, (long)operands[0], stack->size)) llrb_add_osr_entry(c, pos);
       unsigned branch_dest = pos + (unsigned)insn_len(insn) + operands[0];
       unsigned fallthrough = pos + (unsigned)insn_len(insn);
-      struct llrb_basic_block *branch_dest_block = llrb_find_block(c->cfg, branch_dest);
-      struct llrb_basic_block *fallthrough_block = llrb_find_block(c->cfg, fallthrough);
+      struct llrb_basic_block *branch_dest_block = llrb_find_block(c, branch_dest);
+      struct llrb_basic_block *fallthrough_block = llrb_find_block(c, fallthrough);
 
       LLVMValueRef cond = llrb_stack_pop(stack);
       LLVMBuildCondBr(c->builder, llrb_build_rtest(c->builder, cond), fallthrough_block->ref, branch_dest_block->ref);
       *created_br = true;
 
-      struct llrb_stack *branch_dest_stack = llrb_copy_stack(stack); // `llrb_destruct_stack`ed in this block.
-      if (branch_dest_block->incoming_size > 1 && branch_dest_stack->size > 0) {
-        llrb_push_incoming_things(c, branch_dest_block,
-            LLVMGetInsertBlock(c->builder), llrb_stack_pop(branch_dest_stack));
-      }
+      struct llrb_stack *branch_dest_stack = llrb_copy_stack(c, stack);
+      llrb_push_incoming_things(c, branch_dest_block, LLVMGetInsertBlock(c->builder), branch_dest_stack);
       llrb_compile_basic_block(c, branch_dest_block, branch_dest_stack);
-      llrb_destruct_stack(branch_dest_stack);
-      break; // caller `compile_basic_block` compiles fallthrough_block and pushes incoming things to its phi node.
+      break; // caller `compile_basic_block` compiles fallthrough_block and pushes incoming things to its phi nodes.
     }
     case YARVINSN_branchnil: { // TODO: refactor with other branch insns
       unsigned branch_dest = pos + (unsigned)insn_len(insn) + operands[0];
       unsigned fallthrough = pos + (unsigned)insn_len(insn);
-      struct llrb_basic_block *branch_dest_block = llrb_find_block(c->cfg, branch_dest);
-      struct llrb_basic_block *fallthrough_block = llrb_find_block(c->cfg, fallthrough);
+      struct llrb_basic_block *branch_dest_block = llrb_find_block(c, branch_dest);
+      struct llrb_basic_block *fallthrough_block = llrb_find_block(c, fallthrough);
 
       LLVMValueRef cond = llrb_stack_pop(stack);
       LLVMBuildCondBr(c->builder,
@@ -682,44 +1749,69 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
           fallthrough_block->ref, branch_dest_block->ref);
       *created_br = true;
 
-      struct llrb_stack *branch_dest_stack = llrb_copy_stack(stack); // `llrb_destruct_stack`ed in this block.
-      if (branch_dest_block->incoming_size > 1 && branch_dest_stack->size > 0) {
-        llrb_push_incoming_things(c, branch_dest_block,
-            LLVMGetInsertBlock(c->builder), llrb_stack_pop(branch_dest_stack));
-      }
+      struct llrb_stack *branch_dest_stack = llrb_copy_stack(c, stack);
+      llrb_push_incoming_things(c, branch_dest_block, LLVMGetInsertBlock(c->builder), branch_dest_stack);
       llrb_compile_basic_block(c, branch_dest_block, branch_dest_stack);
-      llrb_destruct_stack(branch_dest_stack);
-      break; // caller `compile_basic_block` compiles fallthrough_block and pushes incoming things to its phi node.
+      break; // caller `compile_basic_block` compiles fallthrough_block and pushes incoming things to its phi nodes.
+    }
+    case YARVINSN_getinlinecache: { // Branches to `dst` on cache hit, or falls through to constant lookup and setinlinecache.
+      unsigned branch_dest = pos + (unsigned)insn_len(insn) + operands[0];
+      unsigned fallthrough = pos + (unsigned)insn_len(insn);
+      struct llrb_basic_block *branch_dest_block = llrb_find_block(c, branch_dest);
+      struct llrb_basic_block *fallthrough_block = llrb_find_block(c, fallthrough);
+
+      LLVMValueRef val = llrb_call_func(c, "llrb_insn_getinlinecache", 2, llrb_get_cfp(c), llrb_value(operands[1]));
+      llrb_build_guard(c, LLVMBuildICmp(c->builder, LLVMIntNE, val, llrb_value(Qundef), "ic_hit"),
+          branch_dest_block->ref, fallthrough_block->ref);
+      *created_br = true;
+
+      struct llrb_stack *branch_dest_stack = llrb_copy_stack(c, stack);
+      llrb_stack_push(branch_dest_stack, val);
+      llrb_push_incoming_things(c, branch_dest_block, LLVMGetInsertBlock(c->builder), branch_dest_stack);
+      llrb_compile_basic_block(c, branch_dest_block, branch_dest_stack);
+
+      llrb_stack_push(stack, llrb_value(Qnil)); // YARV pushes nil on cache miss.
+      break; // caller `compile_basic_block` compiles fallthrough_block and pushes incoming things to its phi nodes.
     }
-    case YARVINSN_getinlinecache:
-      llrb_stack_push(stack, llrb_value(Qnil)); // TODO: implement
-      break;
     case YARVINSN_setinlinecache:
-      break; // TODO: implement
-    //case YARVINSN_once:
-    case YARVINSN_opt_case_dispatch: // Use `switch` instruction
-      llrb_stack_pop(stack); // TODO: implement
+      llrb_call_func(c, "llrb_insn_setinlinecache", 3, llrb_get_cfp(c), llrb_value(operands[0]), llrb_stack_topn(stack, 0));
+      break;
+    case YARVINSN_once:
+      llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_once", 4, llrb_get_thread(c), llrb_get_cfp(c),
+            llrb_value(operands[0]), llrb_value(operands[1])));
       break;
+    case YARVINSN_opt_case_dispatch:
+      llrb_compile_case_dispatch(c, stack, pos, operands);
+      *created_br = true;
+      return true;
     case YARVINSN_opt_plus:
-      llrb_compile_opt_insn(c, stack, "opt_plus", 2);
+      if (llrb_speculatable(c, pos)) {
+        llrb_compile_fixnum_opt_insn(c, stack, pos, insn);
+      } else {
+        llrb_compile_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_plus", '+');
+      }
       break;
     case YARVINSN_opt_minus:
-      llrb_compile_opt_insn(c, stack, "opt_minus", 2);
+      if (llrb_speculatable(c, pos)) {
+        llrb_compile_fixnum_opt_insn(c, stack, pos, insn);
+      } else {
+        llrb_compile_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_minus", '-');
+      }
       break;
     case YARVINSN_opt_mult:
-      llrb_compile_opt_insn(c, stack, "opt_mult", 2);
+      llrb_compile_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_mult", '*');
       break;
     case YARVINSN_opt_div:
-      llrb_compile_opt_insn(c, stack, "opt_div", 2);
+      llrb_compile_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_div", '/');
       break;
     case YARVINSN_opt_mod:
-      llrb_compile_opt_insn(c, stack, "opt_mod", 2);
+      llrb_compile_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_mod", '%');
       break;
     case YARVINSN_opt_eq:
-      llrb_compile_opt_insn(c, stack, "opt_eq", 2);
+      llrb_compile_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_eq", idEq);
       break;
     case YARVINSN_opt_neq: {
-      LLVMValueRef *args = ALLOC_N(LLVMValueRef, 6); // `xfree`d in this block.
+      LLVMValueRef *args = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMValueRef, 6);
       args[1] = llrb_stack_pop(stack);
       args[0] = llrb_stack_pop(stack);
       args[2] = llrb_value(operands[0]);
@@ -727,90 +1819,104 @@ llrb_compile_insn(const struct llrb_compiler *c, struct llrb_stack *stack, const
       args[4] = llrb_value(operands[2]);
       args[5] = llrb_value(operands[3]);
       llrb_stack_push(stack, LLVMBuildCall(c->builder, llrb_get_function(c->mod, "llrb_insn_opt_neq"), args, 6, ""));
-      xfree(args);
       break;
     }
     case YARVINSN_opt_lt:
-      llrb_compile_opt_insn(c, stack, "opt_lt", 2);
+      if (llrb_speculatable(c, pos)) {
+        llrb_compile_fixnum_opt_insn(c, stack, pos, insn);
+      } else {
+        llrb_compile_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_lt", '<');
+      }
       break;
     case YARVINSN_opt_le:
-      llrb_compile_opt_insn(c, stack, "opt_le", 2);
+      if (llrb_speculatable(c, pos)) {
+        llrb_compile_fixnum_opt_insn(c, stack, pos, insn);
+      } else {
+        llrb_compile_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_le", rb_intern("<="));
+      }
       break;
     case YARVINSN_opt_gt:
-      llrb_compile_opt_insn(c, stack, "opt_gt", 2);
+      if (llrb_speculatable(c, pos)) {
+        llrb_compile_fixnum_opt_insn(c, stack, pos, insn);
+      } else {
+        llrb_compile_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_gt", '>');
+      }
       break;
     case YARVINSN_opt_ge:
-      llrb_compile_opt_insn(c, stack, "opt_ge", 2);
+      if (llrb_speculatable(c, pos)) {
+        llrb_compile_fixnum_opt_insn(c, stack, pos, insn);
+      } else {
+        llrb_compile_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_ge", rb_intern(">="));
+      }
       break;
     case YARVINSN_opt_ltlt:
-      llrb_compile_opt_insn(c, stack, "opt_ltlt", 2);
+      llrb_compile_opt_insn(c, stack, "llrb_insn_opt_ltlt", 2);
       break;
     case YARVINSN_opt_aref:
-      llrb_compile_opt_insn(c, stack, "opt_aref", 2);
+      if (llrb_speculatable(c, pos)) {
+        llrb_compile_array_opt_insn(c, stack, pos, insn);
+      } else {
+        llrb_compile_opt_insn(c, stack, "llrb_insn_opt_aref", 2);
+      }
       break;
     case YARVINSN_opt_aset:
-      llrb_compile_opt_insn(c, stack, "opt_aset", 3);
+      if (llrb_speculatable(c, pos)) {
+        llrb_compile_array_opt_insn(c, stack, pos, insn);
+      } else {
+        llrb_compile_opt_insn(c, stack, "llrb_insn_opt_aset", 3);
+      }
       break;
     case YARVINSN_opt_aset_with: {
       LLVMValueRef value = llrb_stack_pop(stack);
       LLVMValueRef recv  = llrb_stack_pop(stack);
-      LLVMValueRef str   = llrb_call_func(c, "rb_str_resurrect", 1, llrb_value(operands[2]));
-
-      // Not using llrb_compile_funcall to prevent stack overflow
-      llrb_stack_push(stack, llrb_call_func(c, "rb_funcall", 5, recv,
-            llrb_value(rb_intern("[]=")), LLVMConstInt(LLVMInt32Type(), 2, true), str, value));
+      llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_opt_aset_with", 3, recv, llrb_value(operands[2]), value));
       break;
     }
     case YARVINSN_opt_aref_with: {
-      LLVMValueRef str = llrb_call_func(c, "rb_str_resurrect", 1, llrb_value(operands[2]));
-
-      // Not using llrb_compile_funcall to prevent stack overflow
-      llrb_stack_push(stack, llrb_call_func(c, "rb_funcall", 4, llrb_stack_pop(stack),
-            llrb_value(rb_intern("[]")), LLVMConstInt(LLVMInt32Type(), 1, true), str));
+      LLVMValueRef recv = llrb_stack_pop(stack);
+      llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_opt_aref_with", 2, recv, llrb_value(operands[2])));
       break;
     }
     case YARVINSN_opt_length:
-      llrb_stack_push(stack, llrb_compile_funcall(c, stack, rb_intern("length"), 0));
+      llrb_compile_unary_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_length", rb_intern("length"), operands, 0);
       break;
     case YARVINSN_opt_size:
-      llrb_stack_push(stack, llrb_compile_funcall(c, stack, rb_intern("size"), 0));
+      llrb_compile_unary_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_size", rb_intern("size"), operands, 0);
       break;
     case YARVINSN_opt_empty_p:
-      llrb_stack_push(stack, llrb_compile_funcall(c, stack, rb_intern("empty?"), 0));
+      llrb_compile_unary_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_empty_p", rb_intern("empty?"), operands, 0);
       break;
     case YARVINSN_opt_succ:
-      llrb_stack_push(stack, llrb_compile_funcall(c, stack, rb_intern("succ"), 0));
+      llrb_compile_unary_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_succ", rb_intern("succ"), operands, 0);
       break;
-    case YARVINSN_opt_not:
-      llrb_stack_push(stack, llrb_compile_funcall(c, stack, '!', 0));
+    case YARVINSN_opt_not: // ci and cc are used to check `!` is BasicObject#!.
+      llrb_compile_unary_opt_insn_with_dispatch(c, stack, pos, "llrb_insn_opt_not", '!', operands, 2);
       break;
-    case YARVINSN_opt_regexpmatch1: {
-      // Not using llrb_compile_funcall to prevent stack overflow
-      llrb_stack_push(stack, llrb_call_func(c, "rb_funcall", 4, llrb_stack_pop(stack),
-            llrb_value(rb_intern("=~")), LLVMConstInt(LLVMInt32Type(), 1, true), llrb_value(operands[0])));
+    case YARVINSN_opt_regexpmatch1: { // Regexp#=~ may raise, so program counter is set and bitcode calls method.
+      LLVMValueRef obj = llrb_stack_pop(stack);
+      llrb_stack_push(stack, llrb_value(operands[0]));
+      llrb_stack_push(stack, obj);
+      llrb_compile_opt_insn(c, stack, "llrb_insn_opt_regexpmatch1", 2);
       break;
     }
-    case YARVINSN_opt_regexpmatch2: {
-      llrb_stack_push(stack, llrb_compile_funcall(c, stack, rb_intern("=~"), 1));
+    case YARVINSN_opt_regexpmatch2:
+      llrb_compile_opt_insn(c, stack, "llrb_insn_opt_regexpmatch2", 2);
       break;
-    }
     //case YARVINSN_opt_call_c_function:
     case YARVINSN_getlocal_OP__WC__0: {
-      llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_getlocal_level0", 2, llrb_get_cfp(c), llrb_value((lindex_t)operands[0])));
+      llrb_stack_push(stack, llrb_compile_getlocal_level0(c, (lindex_t)operands[0]));
       break;
     }
     case YARVINSN_getlocal_OP__WC__1: {
-      llrb_stack_push(stack, llrb_call_func(c, "llrb_insn_getlocal_level1", 2, llrb_get_cfp(c), llrb_value((lindex_t)operands[0])));
+      llrb_stack_push(stack, llrb_compile_getlocal_outer(c, (lindex_t)operands[0], 1));
       break;
     }
     case YARVINSN_setlocal_OP__WC__0: {
-      LLVMValueRef idx = llrb_value((lindex_t)operands[0]);
-      llrb_call_func(c, "llrb_insn_setlocal_level0", 3, llrb_get_cfp(c), idx, llrb_stack_pop(stack));
+      llrb_compile_setlocal_level0(c, (lindex_t)operands[0], llrb_stack_pop(stack));
       break;
     }
     case YARVINSN_setlocal_OP__WC__1: {
-      LLVMValueRef idx = llrb_value((lindex_t)operands[0]);
-      llrb_call_func(c, "llrb_insn_setlocal_level1", 3, llrb_get_cfp(c), idx, llrb_stack_pop(stack));
+      llrb_compile_setlocal_outer(c, (lindex_t)operands[0], 1, llrb_stack_pop(stack));
       break;
     }
     case YARVINSN_putobject_OP_INT2FIX_O_0_C_:
@@ -834,18 +1940,23 @@ llrb_compile_basic_block(const struct llrb_compiler *c, struct llrb_basic_block
   if (block->compiled) return;
   block->compiled = true;
 
-  // If phi node is created for this block, push it to stack.
-  if (block->phi) {
-    llrb_stack_push(stack, block->phi);
+  // If phi nodes are created for this block, they replace the whole stack of the first incoming block.
+  if (block->phis) {
+    stack->size = 0;
+    for (unsigned int i = 0; i < block->stack_size; i++) {
+      llrb_stack_push(stack, block->phis[i]);
+    }
   }
 
   // Here is the actual compilation of block specified in arguments.
   bool returned = false, created_br = false;
   unsigned int pos = block->start;
+  LLVMBasicBlockRef current_ref = block->ref; // Insn with a guard continues compilation in another LLVM BasicBlock.
   while (pos <= block->end) {
-    LLVMPositionBuilderAtEnd(c->builder, block->ref); // Reset everytime to allow recursive compilation.
-    int insn = rb_vm_insn_addr2insn((void *)c->body->iseq_encoded[pos]);
+    LLVMPositionBuilderAtEnd(c->builder, current_ref); // Reset everytime to allow recursive compilation.
+    int insn = (int)c->body->iseq_encoded[pos];
     returned = llrb_compile_insn(c, stack, pos, insn, c->body->iseq_encoded + (pos+1), &created_br);
+    if (!returned && !created_br) current_ref = LLVMGetInsertBlock(c->builder);
     pos += insn_len(insn);
   }
 
@@ -856,13 +1967,11 @@ llrb_compile_basic_block(const struct llrb_compiler *c, struct llrb_basic_block
       rb_raise(rb_eCompileError, "Compiler compiled the end of function but the function was not returned");
     }
 
-    struct llrb_basic_block *next_block = llrb_find_block(c->cfg, pos);
-    LLVMPositionBuilderAtEnd(c->builder, block->ref); // Reset to allow recursive compilation.
+    struct llrb_basic_block *next_block = llrb_find_block(c, pos);
+    LLVMPositionBuilderAtEnd(c->builder, current_ref); // Reset to allow recursive compilation.
     if (!created_br) LLVMBuildBr(c->builder, next_block->ref);
 
-    if (next_block->incoming_size > 1 && stack->size > 0) {
-      llrb_push_incoming_things(c, next_block, block->ref, llrb_stack_pop(stack));
-    }
+    llrb_push_incoming_things(c, next_block, current_ref, stack);
     llrb_compile_basic_block(c, next_block, stack);
   }
 }
@@ -873,7 +1982,7 @@ llrb_build_basic_block_ref(const struct llrb_compiler *c, const struct llrb_basi
   VALUE label = rb_str_new_cstr("label_"); // `rb_str_free`d in the end of this function.
   rb_str_catf(label, "%d", block->start);
 
-  LLVMBasicBlockRef ref = LLVMAppendBasicBlock(c->func, RSTRING_PTR(label));
+  LLVMBasicBlockRef ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, RSTRING_PTR(label));
   rb_str_free(label);
   return ref;
 }
@@ -887,107 +1996,603 @@ llrb_init_cfg_for_compile(const struct llrb_compiler *c, struct llrb_cfg *cfg)
     if (!block->traversed) continue;
 
     block->ref = llrb_build_basic_block_ref(c, block);
-    block->phi = 0;
+    block->phis = 0;
+
+    // Every stack slot at a merge point has its phi node, so that values pushed before a branch and merged after
+    // it (ternary, `&&`, `||`, `case`) stay in registers. Created before compilation for incomings from back edges.
+    if (block->incoming_size > 1 && block->stack_size > 0) {
+      block->phis = LLRB_ARENA_ALLOC_N(cfg->arena, LLVMValueRef, block->stack_size);
+      LLVMPositionBuilderAtEnd(c->builder, block->ref);
+      for (unsigned int j = 0; j < block->stack_size; j++) {
+        block->phis[j] = LLVMBuildPhi(c->builder, LLVMInt64TypeInContext(llrb_ctx), ""); // TODO: Support 32bit
+      }
+    }
+  }
+}
+
+// Returns true if level-0 locals may be read or written by others than this ISeq's insns.
+// They are captured by blocks and rescue/ensure ISeqs, and methods like `binding` and `eval` read caller's env.
+// Those may be called by a name given at runtime too, so any call by reflection like `send(:binding)` or
+// `method(:binding).call` is conservatively treated as an escape.
+static bool
+llrb_locals_escape(const struct rb_iseq_constant_body *body)
+{
+  if (body->catch_table) {
+    for (unsigned int i = 0; i < body->catch_table->size; i++) {
+      if (body->catch_table->entries[i].iseq) return true;
+    }
+  }
+
+  const ID escaping_mids[] = {
+    rb_intern("binding"), rb_intern("eval"), rb_intern("local_variables"),
+    rb_intern("instance_eval"), rb_intern("class_eval"), rb_intern("module_eval"),
+    rb_intern("send"), rb_intern("__send__"), rb_intern("public_send"),
+    rb_intern("method"), rb_intern("public_method"), rb_intern("instance_method"),
+  };
+  for (unsigned int i = 0; i < body->iseq_size;) {
+    int insn = (int)body->iseq_encoded[i];
+    switch (insn) {
+      case YARVINSN_send:
+      case YARVINSN_invokesuper:
+        if (body->iseq_encoded[i+3]) return true; // blockiseq
+        // fall through
+      case YARVINSN_opt_send_without_block: {
+        CALL_INFO ci = (CALL_INFO)body->iseq_encoded[i+1];
+        for (size_t j = 0; j < sizeof(escaping_mids) / sizeof(ID); j++) {
+          if (ci->mid == escaping_mids[j]) return true;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    i += insn_len(insn);
+  }
+  return false;
+}
+
+// Creates allocas of locals in function's entry block, and loads their initial values from env. Values
+// are kept in allocas and written back by `llrb_write_back_locals`, only when something may see env.
+static void
+llrb_init_locals(struct llrb_compiler *c)
+{
+  unsigned int size = c->body->local_table_size + VM_ENV_DATA_SIZE;
+  c->locals = LLRB_ARENA_ZALLOC_N(c->cfg->arena, LLVMValueRef, size);
+  c->written_locals = LLRB_ARENA_ZALLOC_N(c->cfg->arena, bool, size);
+
+  for (unsigned int i = 0; i < c->body->iseq_size;) {
+    int insn = (int)c->body->iseq_encoded[i];
+    if (insn == YARVINSN_setlocal_OP__WC__0) {
+      c->written_locals[(lindex_t)c->body->iseq_encoded[i+1]] = true;
+    }
+    i += insn_len(insn);
+  }
+
+  // Allocas must be in function's entry block to be promoted.
+  LLVMBasicBlockRef first = LLVMGetEntryBasicBlock(c->func);
+  LLVMBasicBlockRef entry = LLVMInsertBasicBlockInContext(llrb_ctx, first, "entry");
+  LLVMPositionBuilderAtEnd(c->builder, entry);
+  for (unsigned int idx = VM_ENV_DATA_SIZE; idx < size; idx++) {
+    c->locals[idx] = LLVMBuildAlloca(c->builder, LLVMInt64TypeInContext(llrb_ctx), "local");
+    LLVMBuildStore(c->builder,
+        llrb_call_func(c, "llrb_insn_getlocal_level0", 2, llrb_get_cfp(c), llrb_value((lindex_t)idx)), c->locals[idx]);
+  }
+  LLVMBuildBr(c->builder, first);
+}
+
+// Computes ep of each outer scope accessed by this ISeq on entry. While level-0 locals don't escape, cfp->ep is not
+// moved to heap during the frame, and neither is the chain of previous eps it has. This is called before
+// `llrb_init_locals`, whose block is inserted before this one, so that allocas stay in function's entry block.
+static void
+llrb_init_outer_eps(struct llrb_compiler *c)
+{
+  rb_num_t levels = 0;
+  for (unsigned int i = 0; i < c->body->iseq_size;) {
+    int insn = (int)c->body->iseq_encoded[i];
+    rb_num_t level = 0;
+    switch (insn) {
+      case YARVINSN_getlocal:
+      case YARVINSN_setlocal:
+        level = (rb_num_t)c->body->iseq_encoded[i+2];
+        break;
+      case YARVINSN_getlocal_OP__WC__1:
+      case YARVINSN_setlocal_OP__WC__1:
+        level = 1;
+        break;
+      default:
+        break;
+    }
+    if (level + 1 > levels) levels = level + 1;
+    i += insn_len(insn);
+  }
+  if (levels < 2) return;
+
+  c->outer_eps = LLRB_ARENA_ZALLOC_N(c->cfg->arena, LLVMValueRef, levels);
+  c->outer_ep_levels = levels;
+  LLVMBasicBlockRef first = LLVMGetEntryBasicBlock(c->func);
+  LLVMBasicBlockRef entry = LLVMInsertBasicBlockInContext(llrb_ctx, first, "outer_eps");
+  LLVMPositionBuilderAtEnd(c->builder, entry);
+  for (rb_num_t level = 1; level < levels; level++) {
+    c->outer_eps[level] = llrb_call_func(c, "llrb_outer_ep", 2, llrb_get_cfp(c), llrb_value(level));
+  }
+  LLVMBuildBr(c->builder, first);
+}
+
+// When trace insns are dropped, function checks event hooks and DTrace probes on its entry. If some hook has been
+// registered or probe enabled after compilation, the iseq is invalidated and YARV runs it with trace insns from the
+// beginning.
+static void
+llrb_compile_event_guard(const struct llrb_compiler *c)
+{
+  extern void llrb_invalidate_by_event_hook(VALUE cfp_v);
+  extern int llrb_dtrace_enabled_p(void);
+
+  LLVMBasicBlockRef first = LLVMGetEntryBasicBlock(c->func);
+  LLVMBasicBlockRef guard_ref = LLVMInsertBasicBlockInContext(llrb_ctx, first, "event_guard");
+  LLVMBasicBlockRef invalidate_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "invalidate");
+
+  LLVMPositionBuilderAtEnd(c->builder, guard_ref);
+  LLVMValueRef flags_ptr = LLVMConstIntToPtr(llrb_value((VALUE)&ruby_vm_event_flags), LLVMPointerType(LLVMInt32TypeInContext(llrb_ctx), 0));
+  LLVMValueRef flags = LLVMBuildLoad(c->builder, flags_ptr, "ruby_vm_event_flags");
+  LLVMTypeRef dtrace_type = LLVMFunctionType(LLVMInt32TypeInContext(llrb_ctx), 0, 0, false);
+  LLVMValueRef dtrace_func = LLVMConstIntToPtr(llrb_value((VALUE)llrb_dtrace_enabled_p), LLVMPointerType(dtrace_type, 0));
+  LLVMValueRef dtrace = LLVMBuildCall(c->builder, dtrace_func, 0, 0, "dtrace_enabled");
+  LLVMValueRef zero = LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), 0, false);
+  LLVMValueRef no_hook = LLVMBuildAnd(c->builder, LLVMBuildICmp(c->builder, LLVMIntEQ, flags, zero, ""),
+      LLVMBuildICmp(c->builder, LLVMIntEQ, dtrace, zero, ""), "no_hook");
+  llrb_build_guard(c, no_hook, first, invalidate_ref);
+
+  LLVMPositionBuilderAtEnd(c->builder, invalidate_ref);
+  LLVMTypeRef arg_types[] = { LLVMInt64TypeInContext(llrb_ctx) };
+  LLVMTypeRef func_type = LLVMFunctionType(LLVMVoidTypeInContext(llrb_ctx), arg_types, 1, false);
+  LLVMValueRef func = LLVMConstIntToPtr(llrb_value((VALUE)llrb_invalidate_by_event_hook), LLVMPointerType(func_type, 0));
+  LLVMValueRef args[] = { llrb_get_cfp(c) };
+  LLVMBuildCall(c->builder, func, args, 1, "");
+  LLVMBuildRet(c->builder, llrb_get_cfp(c));
+}
+
+// Counts an entry by calling stats.c from JIT-ed code.
+static void
+llrb_compile_stats_increment(const struct llrb_compiler *c, enum llrb_stats_counter counter)
+{
+  extern void llrb_stats_increment(enum llrb_stats_counter counter);
+  LLVMTypeRef arg_types[] = { LLVMInt32TypeInContext(llrb_ctx) };
+  LLVMTypeRef func_type = LLVMFunctionType(LLVMVoidTypeInContext(llrb_ctx), arg_types, 1, false);
+  LLVMValueRef func = LLVMConstIntToPtr(llrb_value((VALUE)llrb_stats_increment), LLVMPointerType(func_type, 0));
+  LLVMValueRef args[] = { LLVMConstInt(LLVMInt32TypeInContext(llrb_ctx), counter, false) };
+  LLVMBuildCall(c->builder, func, args, 1, "");
+}
+
+// Returns true if YARV can resume the frame at `block` from new_iseq_encoded patched with opt_call_c_function.
+// The patch overwrites 2 words, so neither of them may be an insn to which this function returns, i.e. leave, or
+// another block's start. Deoptimization to them is prevented by `catch_patched`.
+static bool
+llrb_catch_entry_p(const struct llrb_compiler *c, const struct llrb_basic_block *block)
+{
+  if (!block->catch_cont || !block->traversed || block->start < 2 || block->start + 2 > c->body->iseq_size) return false;
+  if (block->stack_size != 1) return false; // Only the caught value is on YARV stack.
+  int insn = (int)c->body->iseq_encoded[block->start];
+  if (insn == YARVINSN_leave) return false;
+  if (insn_len(insn) >= 2) return true;
+
+  unsigned int next = block->start + 1;
+  return !c->cfg->block_index[next] && (int)c->body->iseq_encoded[next] != YARVINSN_leave;
+}
+
+// After YARV runs a rescue clause or catches break/next thrown by a block, it resumes the frame at `cont` with the
+// value pushed on YARV stack. Without patching it, the rest of the frame would be interpreted. The entry blocks are
+// built before compiling CFG, because the value is an incoming of `cont` block's phi.
+static void
+llrb_compile_catch_entries(struct llrb_compiler *c)
+{
+  c->catch_entries = LLRB_ARENA_ALLOC_N(c->cfg->arena, LLVMBasicBlockRef, c->cfg->size);
+  c->catch_patched = LLRB_ARENA_ZALLOC_N(c->cfg->arena, bool, c->body->iseq_size);
+  for (unsigned int i = 0; i < c->cfg->size; i++) {
+    struct llrb_basic_block *block = c->cfg->blocks + i;
+    if (!llrb_catch_entry_p(c, block)) continue;
+    c->catch_patched[block->start] = true;
+    c->catch_patched[block->start + 1] = true;
+
+    LLVMBasicBlockRef entry_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "catch_entry");
+    LLVMPositionBuilderAtEnd(c->builder, entry_ref);
+    llrb_compile_stats_increment(c, LLRB_STATS_CATCH_ENTRIES);
+    LLVMValueRef value = llrb_call_func(c, "llrb_pop_result", 1, llrb_get_cfp(c));
+    LLVMBuildBr(c->builder, block->ref);
+    struct llrb_stack entry_stack = (struct llrb_stack){ .body = &value, .size = 1, .max = 1 };
+    llrb_push_incoming_things(c, block, entry_ref, &entry_stack);
+
+    REALLOC_N(c->osr->catch_conts, unsigned int, c->osr->catch_size + 1);
+    c->catch_entries[c->osr->catch_size] = entry_ref;
+    c->osr->catch_conts[c->osr->catch_size++] = block->start;
+  }
+}
+
+// A frame which has been interpreting `osr_iseq_encoded` calls this function from a patched backward branch, with
+// program counter after the branch. It's dispatched to the branch's destinations after entry guards, and its locals
+// are loaded from env by "entry" block as usual. Condition of branchif and branchunless is still on YARV stack.
+// Catch entries are dispatched by program counter after the patched `cont` in new_iseq_encoded.
+static void
+llrb_compile_osr_dispatch(const struct llrb_compiler *c, LLVMBasicBlockRef dispatch_ref, LLVMBasicBlockRef first)
+{
+  LLVMPositionBuilderAtEnd(c->builder, dispatch_ref);
+  if (c->osr->size == 0 && c->osr->catch_size == 0) {
+    LLVMBuildBr(c->builder, first);
+    return;
+  }
+  LLVMValueRef pc_switch = LLVMBuildSwitch(c->builder, llrb_call_func(c, "llrb_get_pc", 1, llrb_get_cfp(c)),
+      first, c->osr->size + c->osr->catch_size);
+  for (unsigned int i = 0; i < c->osr->catch_size; i++) {
+    LLVMAddCase(pc_switch, llrb_value((VALUE)(c->new_iseq_encoded + c->osr->catch_conts[i] + 2)), c->catch_entries[i]);
+  }
+
+  for (unsigned int i = 0; i < c->osr->size; i++) {
+    unsigned int pos = c->osr->entries[i];
+    int insn = (int)c->body->iseq_encoded[pos];
+    unsigned fallthrough = pos + (unsigned)insn_len(insn);
+    struct llrb_basic_block *branch_dest_block = llrb_find_block(c, fallthrough + c->body->iseq_encoded[pos+1]);
+
+    LLVMBasicBlockRef entry_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "osr_entry");
+    LLVMAddCase(pc_switch, llrb_value((VALUE)(c->osr_iseq_encoded + fallthrough)), entry_ref);
+    LLVMPositionBuilderAtEnd(c->builder, entry_ref);
+    llrb_compile_stats_increment(c, LLRB_STATS_OSR_ENTRIES);
+    if (insn == YARVINSN_jump) {
+      LLVMBuildBr(c->builder, branch_dest_block->ref);
+      continue;
+    }
+
+    struct llrb_basic_block *fallthrough_block = llrb_find_block(c, fallthrough);
+    LLVMValueRef cond = llrb_build_rtest(c->builder, llrb_call_func(c, "llrb_pop_result", 1, llrb_get_cfp(c)));
+    if (insn == YARVINSN_branchif) {
+      LLVMBuildCondBr(c->builder, cond, branch_dest_block->ref, fallthrough_block->ref);
+    } else {
+      LLVMBuildCondBr(c->builder, cond, fallthrough_block->ref, branch_dest_block->ref);
+    }
+  }
+}
+
+// Returns the class serial cached by the first ivar insn having a filled IC, and sets its position to `guard_pos`.
+// Returns 0 if YARV hasn't run any ivar insn of the ISeq.
+static rb_serial_t
+llrb_find_ivar_serial(const struct rb_iseq_constant_body *body, unsigned int *guard_pos)
+{
+  for (unsigned int i = 0; i < body->iseq_size;) {
+    int insn = (int)body->iseq_encoded[i];
+    if ((insn == YARVINSN_getinstancevariable || insn == YARVINSN_setinstancevariable)
+        && ((IC)body->iseq_encoded[i+2])->ic_serial != 0) {
+      *guard_pos = i;
+      return ((IC)body->iseq_encoded[i+2])->ic_serial;
+    }
+    i += insn_len(insn);
+  }
+  return 0;
+}
+
+// Checks self's type and class serial for ivar insns specialized by index, once on function entry. Self doesn't change
+// in a frame, so the result is loop-invariant. If the guard fails, the failure is recorded at the first ivar insn
+// and the next compilation doesn't specialize them.
+static void
+llrb_compile_ivar_guard(struct llrb_compiler *c, const unsigned int guard_pos)
+{
+  LLVMBasicBlockRef first = LLVMGetEntryBasicBlock(c->func);
+  LLVMBasicBlockRef guard_ref = LLVMInsertBasicBlockInContext(llrb_ctx, first, "ivar_guard");
+  LLVMPositionBuilderAtEnd(c->builder, guard_ref);
+  c->ivar_guard = llrb_build_rtest(c->builder,
+      llrb_call_func(c, "llrb_ivar_guard", 2, llrb_get_self(c), llrb_value((VALUE)c->ivar_serial)));
+  if (!c->deopt) {
+    LLVMBuildBr(c->builder, first);
+    return;
   }
+
+  LLVMBasicBlockRef failed_ref = LLVMAppendBasicBlockInContext(llrb_ctx, c->func, "ivar_guard_failed");
+  llrb_build_guard(c, c->ivar_guard, first, failed_ref);
+  LLVMPositionBuilderAtEnd(c->builder, failed_ref);
+  LLVMTypeRef bool_ptr = LLVMPointerType(LLVMInt8TypeInContext(llrb_ctx), 0);
+  LLVMValueRef flag = LLVMConstInt(LLVMInt8TypeInContext(llrb_ctx), 1, false);
+  LLVMBuildStore(c->builder, flag, LLVMConstIntToPtr(llrb_value((VALUE)&c->deopt->failed[guard_pos]), bool_ptr));
+  LLVMBuildStore(c->builder, flag, LLVMConstIntToPtr(llrb_value((VALUE)&c->deopt->deopted), bool_ptr));
+  LLVMBuildBr(c->builder, first);
+}
+
+// YARV can't run from 1 after deoptimization, because new_iseq_encoded[1] is funcptr.
+static bool
+llrb_deoptimizable(const struct llrb_cfg *cfg)
+{
+  for (unsigned int i = 0; i < cfg->size; i++) {
+    if (cfg->blocks[i].start == 1) return false;
+  }
+  return true;
 }
 
 // Compiles Control Flow Graph having encoded YARV instructions to LLVM IR.
 static LLVMValueRef
-llrb_compile_cfg(LLVMModuleRef mod, const struct rb_iseq_constant_body *body, const VALUE *new_iseq_encoded, struct llrb_cfg *cfg, const char* funcname)
+llrb_compile_cfg(LLVMModuleRef mod, const struct rb_iseq_constant_body *body, const VALUE *new_iseq_encoded,
+    struct llrb_deopt *deopt, struct llrb_assumption *assumption, const VALUE *osr_iseq_encoded, struct llrb_osr *osr,
+    struct llrb_cfg *cfg, const char* funcname)
 {
-  LLVMTypeRef args[] = { LLVMInt64Type(), LLVMInt64Type() };
+  extern int llrb_dtrace_enabled_p(void);
+  LLVMTypeRef args[] = { LLVMInt64TypeInContext(llrb_ctx), LLVMInt64TypeInContext(llrb_ctx) };
   LLVMValueRef func = LLVMAddFunction(mod, funcname,
-      LLVMFunctionType(LLVMInt64Type(), args, 2, false));
+      LLVMFunctionType(LLVMInt64TypeInContext(llrb_ctx), args, 2, false));
 
-  const struct llrb_compiler compiler = (struct llrb_compiler){
+  struct llrb_compiler compiler = (struct llrb_compiler){
     .body = body,
     .new_iseq_encoded = new_iseq_encoded,
     .cfg = cfg,
     .func = func,
-    .builder = LLVMCreateBuilder(),
+    .builder = LLVMCreateBuilderInContext(llrb_ctx),
     .mod = mod,
+    .deopt = llrb_deoptimizable(cfg) ? deopt : 0,
+    .assumption = assumption,
+    .locals = 0,
+    .written_locals = 0,
+    .outer_eps = 0,
+    .outer_ep_levels = 0,
+    .drop_trace = (ruby_vm_event_flags == 0 && !llrb_dtrace_enabled_p()),
+    .ivar_serial = 0,
+    .ivar_guard = 0,
+    .osr_iseq_encoded = osr_iseq_encoded,
+    .osr = osr_iseq_encoded ? osr : 0,
+    .catch_entries = 0,
+    .catch_patched = 0,
   };
   llrb_init_cfg_for_compile(&compiler, cfg);
+  // Entry guards and "entry" block are inserted before this, so that OSR entries run them too.
+  LLVMBasicBlockRef dispatch_ref = 0;
+  if (compiler.osr) {
+    compiler.osr->size = 0;
+    compiler.osr->catch_size = 0;
+    dispatch_ref = LLVMInsertBasicBlockInContext(llrb_ctx, LLVMGetEntryBasicBlock(func), "osr_dispatch");
+    llrb_compile_catch_entries(&compiler);
+  }
+  if (assumption) {
+    *assumption = (struct llrb_assumption){ .no_event_hook = compiler.drop_trace, .integer_bops = 0, .array_bops = 0,
+      .method_state = 0 };
+  }
+  unsigned int ivar_guard_pos;
+  rb_serial_t ivar_serial = llrb_find_ivar_serial(body, &ivar_guard_pos);
+  if (ivar_serial && (!compiler.deopt || !compiler.deopt->failed[ivar_guard_pos])) {
+    compiler.ivar_serial = ivar_serial;
+    llrb_compile_ivar_guard(&compiler, ivar_guard_pos);
+  }
+  if (compiler.drop_trace) llrb_compile_event_guard(&compiler);
+  if (!llrb_locals_escape(body)) {
+    llrb_init_outer_eps(&compiler);
+    if (body->local_table_size > 0) llrb_init_locals(&compiler);
+  }
 
   // To simulate YARV stack, we need to traverse CFG again here instead of loop from start to end.
   struct llrb_stack stack = (struct llrb_stack){
-    .body = ALLOC_N(LLVMValueRef, body->stack_max), // `xfree`d in the end of this function.
+    .body = LLRB_ARENA_ALLOC_N(cfg->arena, LLVMValueRef, body->stack_max),
     .size = 0,
     .max  = body->stack_max,
   };
   llrb_compile_basic_block(&compiler, cfg->blocks, &stack);
-
-  xfree(stack.body);
+  if (dispatch_ref) llrb_compile_osr_dispatch(&compiler, dispatch_ref, cfg->blocks[0].ref);
   return func;
 }
 
-// This sweaps memory `xmalloc`ed by llrb_create_basic_blocks.
-static void
-llrb_destruct_cfg(struct llrb_cfg *cfg)
-{
-  for (unsigned int i = 0; i < cfg->size; i++) {
-    struct llrb_basic_block *block = cfg->blocks + i;
-    xfree(block->incoming_starts);
-  }
-  xfree(cfg->blocks);
-}
+// For LLRB::JIT.rejection_stats. The number of ISeqs checked by `llrb_check_not_compilable`,
+// and the number of ISeqs rejected because of each unsupported insn.
+static size_t llrb_checked_iseqs = 0;
+static size_t llrb_rejected_iseqs_by_insn[VM_INSTRUCTION_SIZE];
 
 static bool
 llrb_includes_unsupported_insn(const rb_iseq_t *iseq)
 {
+  bool found[VM_INSTRUCTION_SIZE] = { false };
+  bool unsupported = false;
+
   unsigned int i = 0;
   while (i < iseq->body->iseq_size) {
     int insn = rb_vm_insn_addr2insn((void *)iseq->body->iseq_encoded[i]);
     switch (insn) {
-      case YARVINSN_expandarray:
-      case YARVINSN_reverse:
-      case YARVINSN_reput:
-      case YARVINSN_defineclass:
-      case YARVINSN_once:
+      case YARVINSN_defineclass: // Class body needs a frame pushed by vm_push_frame with cref.
       case YARVINSN_opt_call_c_function:
-        return true;
+        if (!found[insn]) llrb_rejected_iseqs_by_insn[insn]++;
+        found[insn] = true;
+        unsupported = true;
+        break;
       default:
         break;
     }
     i += insn_len(insn);
   }
-  return false;
+  return unsupported;
 }
 
 bool
 llrb_check_not_compilable(const rb_iseq_t *iseq)
 {
+  extern void llrb_stats_increment(enum llrb_stats_counter counter);
+  llrb_checked_iseqs++;
   // At least 3 is needed: opt_call_c_function + funcptr + leave
-  return iseq->body->iseq_size < 3
+  bool not_compilable = iseq->body->iseq_size < 3
     // We don't want to set pc to index 1. It will be funcptr. So we don't compile for such case.
     || (insn_len(rb_vm_insn_addr2insn((void *)iseq->body->iseq_encoded[0])) == 1 &&
         llrb_pc_change_required(rb_vm_insn_addr2insn((void *)iseq->body->iseq_encoded[1])))
     || llrb_includes_unsupported_insn(iseq);
+  if (not_compilable) {
+    llrb_stats_increment(LLRB_STATS_NOT_COMPILABLE);
+    LLRB_PROBE_REJECT(iseq->body, "not_compilable");
+  }
+  return not_compilable;
+}
+
+static bool
+llrb_funcname_included_p(const char *name, const char *const *funcnames, unsigned int size)
+{
+  for (unsigned int i = 0; i < size; i++) {
+    if (!strcmp(name, funcnames[i])) return true;
+  }
+  return false;
+}
+
+// Used by llrb.c too. All compiled modules share one JIT symbol table, and linked bitcode functions would conflict
+// among them. Making them internal also lets optimizer remove them after they are inlined. Only compiled functions
+// named `funcnames` are left external.
+void
+llrb_internalize_module(LLVMModuleRef mod, const char *const *funcnames, unsigned int size)
+{
+  for (LLVMValueRef func = LLVMGetFirstFunction(mod); func; func = LLVMGetNextFunction(func)) {
+    if (LLVMIsDeclaration(func) || llrb_funcname_included_p(LLVMGetValueName(func), funcnames, size)) continue;
+    if (LLVMGetLinkage(func) == LLVMAvailableExternallyLinkage) continue; // Its address should be CRuby's one.
+    LLVMSetLinkage(func, LLVMInternalLinkage);
+  }
+  for (LLVMValueRef global = LLVMGetFirstGlobal(mod); global; global = LLVMGetNextGlobal(global)) {
+    if (LLVMIsDeclaration(global)) continue;
+    LLVMSetLinkage(global, LLVMInternalLinkage);
+  }
 }
 
 // llrb_create_native_func() uses a LLVM function named as `funcname` defined in returned LLVM module.
-LLVMModuleRef
-llrb_compile_iseq(const struct rb_iseq_constant_body *body, const VALUE *new_iseq_encoded, const char* funcname, bool enable_stats)
+// Returned module is not optimized yet. Optimization is done by caller with `llrb_optimize_function`
+// because it can run without touching Ruby VM (see worker.c).
+// If `deopt` is given, some insns are specialized with guards and JIT-ed code writes guard failures to it.
+// If `assumption` is given, VM state which the JIT-ed code depends on is written to it.
+// If `osr_iseq_encoded` is given, backward branches in it which can enter the function are written to `osr`.
+// If `mod` is given, the function is added to it instead of a new module. Runtime functions linked for the other
+// functions are reused, and caller must call `llrb_internalize_module` after all functions are added.
+// `context` is one of LLRB_CONTEXT_* in jit.h. Given `mod` must be created in the same context.
+// `snapshot` is captured by `llrb_capture_iseq`, and the compiled ISeq is read only from it.
+struct llrb_compile_iseq_args {
+  LLVMModuleRef mod;
+  bool batch; // true if `mod` is given by caller.
+  const struct llrb_iseq_snapshot *snapshot;
+  const VALUE *new_iseq_encoded;
+  struct llrb_deopt *deopt;
+  struct llrb_assumption *assumption;
+  const VALUE *osr_iseq_encoded;
+  struct llrb_osr *osr;
+  const char* funcname;
+  struct llrb_arena *arena; // Released by `llrb_compile_iseq` even if compilation raises.
+};
+
+static VALUE
+llrb_compile_iseq_i(VALUE arg)
 {
-  extern void llrb_parse_iseq(const struct rb_iseq_constant_body *body, struct llrb_cfg *result);
+  extern void llrb_parse_iseq(const struct rb_iseq_constant_body *body, struct llrb_cfg *result, struct llrb_arena *arena);
+  extern double llrb_stats_now(void);
+  extern void llrb_stats_add_time(enum llrb_stats_phase phase, double sec);
+  const struct llrb_compile_iseq_args *args = (const struct llrb_compile_iseq_args *)arg;
+
+  double started_at = llrb_stats_now();
   struct llrb_cfg cfg;
-  llrb_parse_iseq(body, &cfg);
+  llrb_parse_iseq(&args->snapshot->body, &cfg, args->arena);
+  double parsed_at = llrb_stats_now();
+  llrb_stats_add_time(LLRB_STATS_PARSE, parsed_at - started_at);
+
+  llrb_compile_cfg(args->mod, &args->snapshot->body, args->new_iseq_encoded, args->deopt, args->assumption,
+      args->osr_iseq_encoded, args->osr, &cfg, args->funcname);
+  if (!args->batch) llrb_internalize_module(args->mod, &args->funcname, 1);
+  llrb_stats_add_time(LLRB_STATS_IR, llrb_stats_now() - parsed_at);
+
+  if (0) llrb_dump_cfg(&args->snapshot->body, &cfg);
+  if (0) LLVMDumpModule(args->mod);
+  return Qnil;
+}
+
+LLVMModuleRef
+llrb_compile_iseq(unsigned int context, LLVMModuleRef mod, const struct llrb_iseq_snapshot *snapshot,
+    const VALUE *new_iseq_encoded, struct llrb_deopt *deopt, struct llrb_assumption *assumption,
+    const VALUE *osr_iseq_encoded, struct llrb_osr *osr, const char* funcname)
+{
+  extern void llrb_stats_increment(enum llrb_stats_counter counter);
+  llrb_ctx_index = context;
+  llrb_ctx = llrb_get_context(context);
+  struct llrb_arena arena = LLRB_ARENA_INITIALIZER;
+  struct llrb_compile_iseq_args args = (struct llrb_compile_iseq_args){
+    .mod = mod ? mod : LLVMModuleCreateWithNameInContext("llrb", llrb_ctx),
+    .batch = mod != 0,
+    .snapshot = snapshot,
+    .new_iseq_encoded = new_iseq_encoded,
+    .deopt = deopt,
+    .assumption = assumption,
+    .osr_iseq_encoded = osr_iseq_encoded,
+    .osr = osr,
+    .funcname = funcname,
+    .arena = &arena,
+  };
+
+  int state = 0;
+  rb_protect(llrb_compile_iseq_i, (VALUE)&args, &state);
+  llrb_arena_free(&arena);
+  if (state) {
+    // A batch's module is still used for other functions, so only the half-built function is removed.
+    LLVMValueRef func = LLVMGetNamedFunction(args.mod, funcname);
+    if (args.batch && func) LLVMDeleteFunction(func);
+    if (!args.batch) LLVMDisposeModule(args.mod);
+    llrb_stats_increment(LLRB_STATS_COMPILE_ERROR);
+    LLRB_PROBE_REJECT(&snapshot->body, "compile_error");
+    rb_jump_tag(state);
+  }
+  return args.mod;
+}
+
+// Used by profiler.c. Returns loops made by backward branches in `xmalloc`ed buffer, or 0 if there's none.
+struct llrb_loop *
+llrb_find_loops(const rb_iseq_t *iseq, unsigned int *size)
+{
+  extern const VALUE *llrb_original_iseq_encoded(const rb_iseq_t *iseq);
+  const VALUE *iseq_encoded = llrb_original_iseq_encoded(iseq);
+  struct llrb_loop *loops = 0;
+  *size = 0;
 
-  LLVMModuleRef mod = LLVMModuleCreateWithName("llrb");
-  LLVMValueRef func = llrb_compile_cfg(mod, body, new_iseq_encoded, &cfg, funcname);
+  for (unsigned int i = 0; i < iseq->body->iseq_size;) {
+    int insn = rb_vm_insn_addr2insn((void *)iseq_encoded[i]);
+    switch (insn) {
+      case YARVINSN_jump:
+      case YARVINSN_branchif:
+      case YARVINSN_branchunless:
+      case YARVINSN_branchnil: {
+        long offset = (long)iseq_encoded[i+1];
+        if (offset >= 0) break;
+        REALLOC_N(loops, struct llrb_loop, *size + 1);
+        loops[*size] = (struct llrb_loop){ .start = (unsigned int)(i + insn_len(insn) + offset), .end = i };
+        (*size)++;
+        break;
+      }
+      default:
+        break;
+    }
+    i += insn_len(insn);
+  }
+  return loops;
+}
 
-  extern void llrb_optimize_function(LLVMModuleRef cmod, LLVMValueRef cfunc, bool enable_stats);
-  if (1) llrb_optimize_function(mod, func, enable_stats);
+// Used by stats.c too. Returns { String => Integer } having insn names as keys.
+VALUE
+llrb_rejected_insns(void)
+{
+  VALUE rejected = rb_hash_new();
+  for (int insn = 0; insn < VM_INSTRUCTION_SIZE; insn++) {
+    if (llrb_rejected_iseqs_by_insn[insn] == 0) continue;
+    rb_hash_aset(rejected, rb_str_new_cstr(insn_name(insn)), SIZET2NUM(llrb_rejected_iseqs_by_insn[insn]));
+  }
+  return rejected;
+}
 
-  if (0) llrb_dump_cfg(body, &cfg);
-  if (0) LLVMDumpModule(mod);
+// Used by stats.c.
+size_t
+llrb_checked_iseqs_count(void)
+{
+  return llrb_checked_iseqs;
+}
 
-  llrb_destruct_cfg(&cfg);
-  return mod;
+// LLRB::JIT.rejection_stats
+// @return [Hash] { checked: Integer, rejected: { String => Integer } }. `rejected` has insn names as keys.
+static VALUE
+rb_jit_rejection_stats(RB_UNUSED_VAR(VALUE self))
+{
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("checked")), SIZET2NUM(llrb_checked_iseqs));
+  rb_hash_aset(stats, ID2SYM(rb_intern("rejected")), llrb_rejected_insns());
+  return stats;
 }
 
 void
 Init_compiler(VALUE rb_mJIT)
 {
   rb_eCompileError = rb_define_class_under(rb_mJIT, "CompileError", rb_eStandardError);
+  rb_define_singleton_method(rb_mJIT, "rejection_stats", RUBY_METHOD_FUNC(rb_jit_rejection_stats), 0);
+  llrb_init_extern_funcs();
 }
@@ -1,7 +1,6 @@
 /*
  * compiler/funcs.h: External function declaration called by JIT-ed code.
- * This header is used only by compiler.c.
- * TODO: Automatically generate this from something.
+ * This header is used only by compiler.c. extconf.rb checks that every bitcode function file is listed here.
  */
 
 #ifndef LLRB_COMPILER_FUNCS_H
@@ -11,8 +10,10 @@
 #include "ruby.h"
 #include "llvm-c/BitReader.h"
 #include "llvm-c/Linker.h"
+#include "llvm-c/Transforms/IPO.h"
+#include "llrb_runtime_bc.h" // Generated by extconf.rb. Has all bitcode functions linked and optimized.
 
-#define LLRB_EXTERN_FUNC_MAX_ARGC 6
+#define LLRB_EXTERN_FUNC_MAX_ARGC 8
 struct llrb_extern_func {
   unsigned int return_type; // 0 = void, 32 = 32bit int, 64 = 64bit int
   unsigned int argc;
@@ -20,13 +21,24 @@ struct llrb_extern_func {
   bool unlimited;
   const char *name;
   bool has_bc;
+  // `has_bc` function extracted from runtime bitcode, per LLVM context. Lazily loaded by `llrb_link_module` and
+  // never disposed.
+  LLVMModuleRef bc_mods[LLRB_CONTEXT_SIZE];
 };
 
 // TODO: support 32bit environment
 static struct llrb_extern_func llrb_extern_funcs[] = {
+  { 64, 0, { 0  }, false, "llrb_opt_case_dispatch_p", true },
   { 64, 0, { 0  }, false, "rb_hash_new", false },
   { 64, 1, { 64 }, false, "llrb_insn_opt_str_freeze", true },
+  { 64, 1, { 64 }, false, "llrb_insn_opt_length", true },
+  { 64, 1, { 64 }, false, "llrb_insn_opt_size", true },
+  { 64, 1, { 64 }, false, "llrb_insn_opt_empty_p", true },
+  { 64, 1, { 64 }, false, "llrb_insn_opt_succ", true },
   { 64, 1, { 64 }, false, "llrb_insn_putspecialobject", true },
+  { 64, 1, { 64 }, false, "llrb_tostring_fragment", true },
+  { 64, 1, { 64 }, false, "llrb_get_pc", true },
+  { 64, 1, { 64 }, false, "llrb_pop_result", true },
   { 64, 1, { 64 }, false, "llrb_self_from_cfp", true },
   { 64, 1, { 64 }, false, "rb_ary_clear", false },
   { 64, 1, { 64 }, false, "rb_ary_resurrect", false },
@@ -34,7 +46,6 @@ static struct llrb_extern_func llrb_extern_funcs[] = {
   { 64, 1, { 64 }, false, "rb_obj_as_string", false },
   { 64, 1, { 64 }, false, "rb_str_freeze", false },
   { 64, 1, { 64 }, false, "rb_str_resurrect", false },
-  { 64, 1, { 64 }, true,  "llrb_insn_concatstrings", true },
   { 64, 1, { 64 }, true,  "rb_ary_new_from_args", false },
   { 0,  2, { 64, 64 }, false, "llrb_insn_setspecial", true },
   { 0,  2, { 64, 64 }, false, "llrb_push_result", true },
@@ -44,9 +55,16 @@ static struct llrb_extern_func llrb_extern_funcs[] = {
   { 64, 2, { 64, 64 }, false, "llrb_insn_getclassvariable", true },
   { 64, 2, { 64, 64 }, false, "llrb_insn_getlocal_level0", true },
   { 64, 2, { 64, 64 }, false, "llrb_insn_getlocal_level1", true },
+  { 64, 2, { 64, 64 }, false, "llrb_outer_ep", true },
+  { 64, 2, { 64, 64 }, false, "llrb_env_read", true },
+  { 64, 2, { 64, 64 }, false, "llrb_insn_getinlinecache", true },
   { 64, 2, { 64, 64 }, false, "llrb_insn_getspecial", true },
-  //{ 64, 2, { 64, 64 }, false, "llrb_insn_opt_newarray_max", true },
-  //{ 64, 2, { 64, 64 }, false, "llrb_insn_opt_newarray_min", true },
+  { 64, 2, { 64, 64 }, false, "llrb_ivar_guard", true },
+  { 64, 2, { 64, 64 }, false, "llrb_ary_entry", true },
+  { 64, 2, { 64, 64 }, false, "llrb_getivar_index", true },
+  { 64, 2, { 64, 64 }, false, "llrb_insn_concatstrings", true },
+  { 64, 2, { 64, 64 }, false, "llrb_insn_opt_newarray_max", true },
+  { 64, 2, { 64, 64 }, false, "llrb_insn_opt_newarray_min", true },
   { 64, 2, { 64, 64 }, false, "llrb_insn_opt_mult", true },
   { 64, 2, { 64, 64 }, false, "llrb_insn_opt_div", true },
   { 64, 2, { 64, 64 }, false, "llrb_insn_opt_mod", true },
@@ -56,8 +74,12 @@ static struct llrb_extern_func llrb_extern_funcs[] = {
   { 64, 2, { 64, 64 }, false, "llrb_insn_opt_gt", true },
   { 64, 2, { 64, 64 }, false, "llrb_insn_opt_ge", true },
   { 64, 2, { 64, 64 }, false, "llrb_insn_opt_ltlt", true },
+  { 64, 2, { 64, 64 }, false, "llrb_insn_opt_regexpmatch1", true },
+  { 64, 2, { 64, 64 }, false, "llrb_insn_opt_regexpmatch2", true },
   { 64, 2, { 64, 64 }, false, "llrb_insn_opt_aref", true },
+  { 64, 2, { 64, 64 }, false, "llrb_insn_opt_aref_with", true },
   { 64, 3, { 64, 64, 64 }, false, "llrb_insn_opt_aset", true },
+  { 64, 3, { 64, 64, 64 }, false, "llrb_insn_opt_aset_with", true },
   { 64, 3, { 64, 64, 64 }, false, "llrb_insn_getinstancevariable", true },
   { 0,  4, { 64, 64, 64, 64 }, false, "llrb_insn_setinstancevariable", true },
   { 64, 2, { 64, 64 }, false, "llrb_insn_opt_lt", true },
@@ -65,100 +87,195 @@ static struct llrb_extern_func llrb_extern_funcs[] = {
   { 64, 2, { 64, 64 }, false, "llrb_insn_opt_plus", true },
   { 64, 2, { 64, 64 }, false, "llrb_insn_splatarray", true },
   { 64, 2, { 64, 64 }, false, "rb_gvar_set", false },
+  { 64, 2, { 64, 64 }, false, "rb_attr_get", false },
   { 64, 2, { 64, 64 }, false, "rb_ivar_get", false },
   { 64, 2, { 64, 64 }, true,  "llrb_insn_toregexp", false },
   { 64, 2, { 64, 64 }, true,  "rb_funcall", false },
   { 0,  3, { 64, 64, 64 }, false, "llrb_insn_setclassvariable", true },
+  { 0,  3, { 64, 64, 64 }, false, "llrb_insn_setinlinecache", true },
   { 0,  3, { 64, 64, 64 }, false, "llrb_insn_setlocal_level0", true },
   { 0,  3, { 64, 64, 64 }, false, "llrb_insn_setlocal_level1", true },
+  { 0,  3, { 64, 64, 64 }, false, "llrb_env_write", true },
+  { 64, 3, { 64, 64, 64 }, false, "llrb_fixnum_guard", true },
+  { 64, 3, { 64, 64, 64 }, false, "llrb_array_guard", true },
+  { 64, 3, { 64, 64, 64 }, false, "llrb_ary_store", true },
+  { 64, 3, { 64, 64, 64 }, false, "llrb_method_cache_hit_p", true },
+  { 64, 3, { 64, 64, 64 }, false, "llrb_newarray_include_p", true },
+  { 64, 3, { 64, 64, 64 }, false, "llrb_setivar_index", true },
   { 64, 3, { 64, 64, 64 }, false, "llrb_insn_checkkeyword", true },
   { 64, 3, { 64, 64, 64 }, false, "llrb_insn_checkmatch", true },
   { 64, 3, { 64, 64, 64 }, false, "llrb_insn_getlocal", true },
+  { 64, 3, { 64, 64, 64 }, false, "llrb_insn_opt_case_dispatch", true },
+  { 64, 3, { 64, 64, 64 }, false, "llrb_insn_opt_not", true },
   { 64, 3, { 64, 64, 64 }, false, "rb_hash_aset", false },
   { 64, 3, { 64, 64, 64 }, false, "rb_ivar_set", false },
   { 64, 3, { 64, 64, 64 }, false, "rb_range_new", false },
   { 0,  4, { 64, 64, 32, 64 }, false, "llrb_insn_trace", true },
+  { 64, 4, { 64, 64, 64, 64 }, false, "llrb_insn_expandarray", true },
+  { 64, 4, { 64, 64, 64, 64 }, false, "llrb_insn_once", true },
   { 0,  4, { 64, 64, 64, 64 }, false, "llrb_insn_setconstant", true },
   { 0,  4, { 64, 64, 64, 64 }, false, "llrb_insn_setlocal", true },
   { 0,  4, { 64, 64, 64, 64 }, false, "llrb_insn_throw", true },
   { 64, 4, { 64, 64, 64, 32 }, false, "vm_get_ev_const", false },
   { 64, 4, { 64, 64, 64, 32 }, true,  "llrb_insn_invokeblock", true },
   { 64, 4, { 64, 64, 64, 64 }, false, "llrb_insn_defined", true },
+  { 64, 4, { 64, 64, 64, 64 }, false, "llrb_call_iseq_method", true },
   { 64, 5, { 64, 64, 64, 64, 64 }, false, "llrb_insn_opt_send_without_block", true },
-  { 64, 6, { 64, 64, 64, 64, 64, 32 }, true, "llrb_insn_invokesuper", true },
+  { 64, 5, { 64, 64, 64, 64, 64 }, false, "llrb_pic_search", true },
+  { 64, 5, { 64, 64, 64, 64, 64 }, false, "llrb_vector_reduce", true },
   { 64, 6, { 64, 64, 64, 64, 64, 32 }, true, "llrb_insn_send", true },
+  { 64, 8, { 64, 64, 64, 64, 64, 64, 64, 32 }, true, "llrb_insn_invokesuper", true },
 };
 static size_t llrb_extern_func_num = sizeof(llrb_extern_funcs) / sizeof(struct llrb_extern_func);
 
+// Functions called only by slow paths: method dispatch fallbacks, Bignum allocation, warnings, exceptions and
+// interrupts. They're declared `cold` in runtime bitcode and JIT-ed modules. Then branch probability makes blocks
+// calling them unlikely, and machine block placement moves those blocks out of hot code.
+static const char *llrb_cold_funcs[] = {
+  "rb_funcall",
+  "rb_funcallv",
+  "rb_int2big",
+  "rb_dbl2big",
+  "rb_warning",
+  "rb_warn",
+  "rb_raise",
+  "rb_bug",
+  "rb_error_frozen",
+  "rb_error_frozen_object",
+  "rb_thread_schedule",
+  "rb_threadptr_execute_interrupts",
+};
+
+static void
+llrb_set_cold_attribute(LLVMValueRef func)
+{
+  const char *name = LLVMGetValueName(func);
+  for (size_t i = 0; i < sizeof(llrb_cold_funcs) / sizeof(const char *); i++) {
+    if (strcmp(name, llrb_cold_funcs[i]) == 0) {
+      unsigned int kind = LLVMGetEnumAttributeKindForName("cold", strlen("cold"));
+      LLVMAddAttributeAtIndex(func, LLVMAttributeFunctionIndex, LLVMCreateEnumAttribute(llrb_ctx, kind, 0));
+      return;
+    }
+  }
+}
+
+// Index from function name to `llrb_extern_funcs` entry. Built once by `llrb_init_extern_funcs`.
+static st_table *llrb_extern_func_index = 0;
+
+static void
+llrb_init_extern_funcs(void)
+{
+  llrb_extern_func_index = st_init_strtable_with_size(llrb_extern_func_num);
+  for (size_t i = 0; i < llrb_extern_func_num; i++) {
+    st_insert(llrb_extern_func_index, (st_data_t)llrb_extern_funcs[i].name, (st_data_t)&llrb_extern_funcs[i]);
+  }
+}
+
 static inline LLVMTypeRef
 llrb_num_to_type(unsigned int num)
 {
   switch (num) {
     case 64:
-      return LLVMInt64Type();
+      return LLVMInt64TypeInContext(llrb_ctx);
     case 32:
-      return LLVMInt32Type();
+      return LLVMInt32TypeInContext(llrb_ctx);
     case 0:
-      return LLVMVoidType();
+      return LLVMVoidTypeInContext(llrb_ctx);
     default:
       rb_raise(rb_eCompileError, "'%d' is unexpected for llrb_num_to_type", num);
   }
 }
 
-static void
-llrb_link_module(LLVMModuleRef mod, const char *funcname)
+// Parsed `llrb_runtime_bc`. It's parsed only once per process and context, and never disposed.
+static LLVMModuleRef llrb_runtime_mods[LLRB_CONTEXT_SIZE];
+
+static LLVMModuleRef
+llrb_parse_runtime_bitcode(void)
 {
-  char *bc_name = ZALLOC_N(char, strlen(LLRB_BITCODE_DIR "/") + strlen(funcname) + strlen(".bc") + 1); // freed in this function
-  strcat(bc_name, LLRB_BITCODE_DIR "/");
-  strcat(bc_name, funcname);
-  strcat(bc_name, ".bc");
-
-  LLVMMemoryBufferRef buf;
-  char *err;
-  if (LLVMCreateMemoryBufferWithContentsOfFile(bc_name, &buf, &err)) {
-    fprintf(stderr, "Failed to load func bitcode: '%s'\n", bc_name);
-    rb_raise(rb_eCompileError, "LLVMCreateMemoryBufferWithContentsOfFile Error: %s", err);
+  LLVMMemoryBufferRef buf = LLVMCreateMemoryBufferWithMemoryRange(
+      (const char *)llrb_runtime_bc, llrb_runtime_bc_size, "llrb_runtime", false);
+  LLVMModuleRef mod;
+  if (LLVMParseBitcodeInContext2(llrb_ctx, buf, &mod)) {
+    rb_raise(rb_eCompileError, "LLVMParseBitcodeInContext2 Failed!");
   }
-  xfree(bc_name);
+  LLVMDisposeMemoryBuffer(buf);
 
-  LLVMModuleRef func_mod;
-  if (LLVMParseBitcode2(buf, &func_mod)) {
-    rb_raise(rb_eCompileError, "LLVMParseBitcode2 Failed!");
+  for (LLVMValueRef func = LLVMGetFirstFunction(mod); func; func = LLVMGetNextFunction(func)) {
+    if (LLVMIsDeclaration(func)) llrb_set_cold_attribute(func);
   }
-  LLVMDisposeMemoryBuffer(buf);
+  return mod;
+}
+
+// Clones runtime module having only `funcname` as external. Other bitcode functions are internalized, and ones
+// not called by `funcname` are removed. So modules of different functions can be linked to the same module.
+static LLVMModuleRef
+llrb_extract_bitcode(const char *funcname)
+{
+  if (!llrb_runtime_mods[llrb_ctx_index]) llrb_runtime_mods[llrb_ctx_index] = llrb_parse_runtime_bitcode();
+  LLVMModuleRef func_mod = LLVMCloneModule(llrb_runtime_mods[llrb_ctx_index]);
 
-  LLVMLinkModules2(mod, func_mod);
+  for (LLVMValueRef func = LLVMGetFirstFunction(func_mod); func; func = LLVMGetNextFunction(func)) {
+    if (LLVMIsDeclaration(func) || strcmp(LLVMGetValueName(func), funcname) == 0) continue;
+    LLVMSetLinkage(func, LLVMInternalLinkage);
+  }
+  for (LLVMValueRef global = LLVMGetFirstGlobal(func_mod); global; global = LLVMGetNextGlobal(global)) {
+    if (!LLVMIsDeclaration(global)) LLVMSetLinkage(global, LLVMInternalLinkage);
+  }
+
+  LLVMPassManagerRef pm = LLVMCreatePassManager();
+  LLVMAddGlobalDCEPass(pm);
+  LLVMRunPassManager(pm, func_mod);
+  LLVMDisposePassManager(pm);
+  return func_mod;
 }
 
+// Each function is extracted only once per process and context. Linking consumes the source module,
+// so each compilation links a clone of the cached one.
+static void
+llrb_link_module(LLVMModuleRef mod, struct llrb_extern_func *extern_func)
+{
+  if (!extern_func->bc_mods[llrb_ctx_index]) {
+    extern double llrb_stats_now(void);
+    extern void llrb_stats_add_time(enum llrb_stats_phase phase, double sec);
+    double started_at = llrb_stats_now();
+    extern_func->bc_mods[llrb_ctx_index] = llrb_extract_bitcode(extern_func->name);
+    llrb_stats_add_time(LLRB_STATS_BITCODE_LOAD, llrb_stats_now() - started_at);
+  }
+  LLVMLinkModules2(mod, LLVMCloneModule(extern_func->bc_mods[llrb_ctx_index]));
+}
+
+// A function already declared or linked in `mod` is found by LLVM's symbol table. Otherwise it's looked up
+// in `llrb_extern_func_index`, so that each call site doesn't scan `llrb_extern_funcs`.
 static LLVMValueRef
 llrb_get_function(LLVMModuleRef mod, const char *name)
 {
   LLVMValueRef func = LLVMGetNamedFunction(mod, name);
   if (func) return func;
 
-  for (size_t i = 0; i < llrb_extern_func_num; i++) {
-    if (strcmp(name, llrb_extern_funcs[i].name)) continue;
-
-    if (llrb_extern_funcs[i].has_bc) {
-      llrb_link_module(mod, llrb_extern_funcs[i].name);
-      func = LLVMGetNamedFunction(mod, name);
-      if (func) {
-        return func;
-      } else {
-        rb_raise(rb_eCompileError, "'%s' was not found in bitcode file", name);
-      }
-    }
+  st_data_t val;
+  if (!st_lookup(llrb_extern_func_index, (st_data_t)name, &val)) {
+    rb_raise(rb_eCompileError, "'%s' is not defined in llrb_extern_funcs", name);
+  }
+  struct llrb_extern_func *extern_func = (struct llrb_extern_func *)val;
 
-    LLVMTypeRef arg_types[LLRB_EXTERN_FUNC_MAX_ARGC];
-    for (unsigned int j = 0; j < llrb_extern_funcs[i].argc; j++) {
-      arg_types[j] = llrb_num_to_type(llrb_extern_funcs[i].argv[j]);
+  if (extern_func->has_bc) {
+    llrb_link_module(mod, extern_func);
+    func = LLVMGetNamedFunction(mod, name);
+    if (func) {
+      return func;
+    } else {
+      rb_raise(rb_eCompileError, "'%s' was not found in runtime bitcode", name);
     }
-    return LLVMAddFunction(mod, llrb_extern_funcs[i].name, LLVMFunctionType(
-          llrb_num_to_type(llrb_extern_funcs[i].return_type), arg_types,
-          llrb_extern_funcs[i].argc, llrb_extern_funcs[i].unlimited));
   }
 
-  rb_raise(rb_eCompileError, "'%s' is not defined in llrb_extern_funcs", name);
+  LLVMTypeRef arg_types[LLRB_EXTERN_FUNC_MAX_ARGC];
+  for (unsigned int j = 0; j < extern_func->argc; j++) {
+    arg_types[j] = llrb_num_to_type(extern_func->argv[j]);
+  }
+  func = LLVMAddFunction(mod, extern_func->name, LLVMFunctionType(
+        llrb_num_to_type(extern_func->return_type), arg_types, extern_func->argc, extern_func->unlimited));
+  llrb_set_cold_attribute(func);
+  return func;
 }
 
 #endif // LLRB_COMPILER_FUNCS_H
@@ -39,4 +39,16 @@
 
 /* end vm_insnhelper.h */
 
+// vm_env_write of vm_insnhelper.c. Exported rb_vm_env_write is called only when env needs write barrier.
+void rb_vm_env_write(const VALUE *ep, int index, VALUE v);
+static inline void
+llrb_vm_env_write(const VALUE *ep, int index, VALUE v)
+{
+  if (LIKELY((ep[VM_ENV_DATA_INDEX_FLAGS] & VM_ENV_FLAG_WB_REQUIRED) == 0)) {
+    VM_STACK_ENV_WRITE(ep, index, v);
+  } else {
+    rb_vm_env_write(ep, index, v);
+  }
+}
+
 #endif // LLRB_CRUBY_H
@@ -7,12 +7,25 @@ module LLRBExtconf
       remove_warnflags_for_llvm
       add_cflags
       link_llvm
+      check_thread_timer
+      check_usdt
     end
 
     def compile_bitcodes
-      Dir.chdir(extdir) { Dir.glob('*.c') }.each do |c_file|
-        compile_bitcode(c_file, c_file.sub(/\.c\z/, '.bc'))
+      bc_files = Dir.chdir(extdir) { Dir.glob('*.c') }.sort.map do |c_file|
+        c_file.sub(/\.c\z/, '.bc').tap { |bc_file| compile_bitcode(c_file, bc_file) }
       end
+      link_runtime(bc_files)
+    end
+
+    # compiler/funcs.h has argument types which can't be derived from C signature reliably (e.g. variadic
+    # functions and 32bit int arguments), so it's written by hand. This ensures no bitcode file is missing there.
+    def check_extern_funcs
+      funcs_h = File.read(File.join(__dir__, 'compiler', 'funcs.h'))
+      listed = funcs_h.scan(/^\s*\{[^}]*\},\s*\w+,\s*"(\w+)",\s*true\s*\}/).flatten
+      missing = Dir.chdir(extdir) { Dir.glob('*.c') }.map { |f| File.basename(f, '.c') } - listed
+      return if missing.empty?
+      raise "#{missing.join(', ')} must be listed in llrb_extern_funcs of compiler/funcs.h"
     end
 
     private
@@ -54,8 +67,7 @@ module LLRBExtconf
       # To include ccan/*, add ext/llrb/cruby under include path. "cruby_extra" dir has CRuby's dynamic headers.
       $INCFLAGS = "#{$INCFLAGS} -I$(srcdir)/cruby -I$(srcdir)/cruby_extra"
 
-      bitcode_dir = File.expand_path("#{__dir__}/..")
-      $CFLAGS = "#{$CFLAGS} -DLLRB_BITCODE_DIR='\"#{bitcode_dir}\"' -Wall -Werror -W" # remove -Werror later
+      $CFLAGS = "#{$CFLAGS} -Wall -Werror -W" # remove -Werror later
       $CXXFLAGS = "#{$CXXFLAGS} -Wall -Werror -W" # remove -Werror later
     end
 
@@ -66,7 +78,46 @@ module LLRBExtconf
 
       $CFLAGS = "#{$CFLAGS} #{`llvm-config --cflags`.rstrip}"
       $CXXFLAGS = "#{$CXXFLAGS} #{`llvm-config --cxxflags`.rstrip}"
-      $LDFLAGS = "#{$LDFLAGS} #{`llvm-config --ldflags`.rstrip} #{`llvm-config --libs core engine passes`}"
+      $LDFLAGS = "#{$LDFLAGS} #{`llvm-config --ldflags`.rstrip} #{`llvm-config --libs core engine orcjit passes`}"
+    end
+
+    # Profiler uses per-thread CPU-time timers if available (Linux). glibc before 2.17 has them in librt.
+    def check_thread_timer
+      have_library('rt', 'timer_create')
+      have_func('timer_create', 'time.h')
+    end
+
+    # usdt.h defines USDT probes only if <sys/sdt.h> is available (e.g. systemtap-sdt-dev). No library is needed.
+    def check_usdt
+      have_header('sys/sdt.h')
+    end
+
+    # Links all bitcode files into one module and embeds it to llrb.so, so that it's parsed once at runtime without
+    # reading files. Functions other than ones in llrb_extern_funcs are internalized and inlined ahead of time.
+    def link_runtime(bc_files)
+      linked_file = "#{extdir}/llrb_runtime.linked.bc"
+      runtime_file = "#{extdir}/llrb_runtime.bc"
+      public_funcs = bc_files.map { |f| File.basename(f, '.bc') }
+
+      sh "llvm-link -o #{linked_file} #{bc_files.map { |f| "#{extdir}/#{f}" }.join(' ')}"
+      sh "opt -internalize -internalize-public-api-list=#{public_funcs.join(',')} -O2 -o #{runtime_file} #{linked_file}"
+      embed_bitcode(runtime_file, "#{__dir__}/llrb_runtime_bc.h")
+    end
+
+    def embed_bitcode(bc_file, header_file)
+      bytes = File.binread(bc_file).unpack('C*').each_slice(16).map do |slice|
+        "  #{slice.map { |b| format('0x%02x', b) }.join(', ')},"
+      end
+      File.write(header_file, <<-HEADER)
+// Generated by extconf.rb from #{File.basename(bc_file)}. Don't edit this manually.
+#ifndef LLRB_RUNTIME_BC_H
+#define LLRB_RUNTIME_BC_H
+static const unsigned char llrb_runtime_bc[] __attribute__((aligned(4))) = {
+#{bytes.join("\n")}
+};
+static const size_t llrb_runtime_bc_size = sizeof(llrb_runtime_bc);
+#endif // LLRB_RUNTIME_BC_H
+      HEADER
     end
 
     def compile_bitcode(c_file, bc_file)
@@ -109,6 +160,7 @@ module LLRBExtconf
   end
 end
 
+LLRBExtconf.check_extern_funcs
 LLRBExtconf.compile_bitcodes
 LLRBExtconf.configure
 
@@ -0,0 +1,48 @@
+/*
+ * float_ops.h: Float operands check for bitcode of opt insns.
+ */
+
+#ifndef LLRB_FLOAT_OPS_H
+#define LLRB_FLOAT_OPS_H
+
+#include "cruby.h"
+
+// 2**53. Fixnum whose absolute value is under this is exactly represented by double.
+#define LLRB_FIXNUM_EXACT_DOUBLE_MAX (1L << 53)
+
+static inline int
+llrb_float_or_fixnum_to_double(VALUE v, int exact, double *d)
+{
+  if (RB_FLOAT_TYPE_P(v)) {
+    *d = RFLOAT_VALUE(v);
+    return 1;
+  }
+  if (FIXNUM_P(v)) {
+    long l = FIX2LONG(v);
+    if (exact && (l >= LLRB_FIXNUM_EXACT_DOUBLE_MAX || l <= -LLRB_FIXNUM_EXACT_DOUBLE_MAX)) return 0;
+    *d = (double)l;
+    return 1;
+  }
+  return 0;
+}
+
+// Returns true if `recv` and `obj` are Float and Float, Float and Fixnum, or Fixnum and Float, and receiver's
+// operator for `bop` is not redefined. Then their values are set to `a` and `b`. It's what Float's and Integer's
+// methods do for such operands. If `exact` is true, Fixnum which may lose precision as double is rejected,
+// because CRuby compares Integer and Float exactly.
+static inline int
+llrb_float_operands_p(VALUE recv, VALUE obj, int bop, int exact, double *a, double *b)
+{
+  if (RB_FLOAT_TYPE_P(recv)) {
+    if (!BASIC_OP_UNREDEFINED_P(bop, FLOAT_REDEFINED_OP_FLAG)) return 0;
+  }
+  else if (FIXNUM_P(recv)) {
+    if (!RB_FLOAT_TYPE_P(obj) || !BASIC_OP_UNREDEFINED_P(bop, INTEGER_REDEFINED_OP_FLAG)) return 0;
+  }
+  else {
+    return 0;
+  }
+  return llrb_float_or_fixnum_to_double(recv, exact, a) && llrb_float_or_fixnum_to_double(obj, exact, b);
+}
+
+#endif // LLRB_FLOAT_OPS_H
@@ -0,0 +1,105 @@
+/*
+ * jit.h: Has definitions shared by llrb.c, compiler.c, profiler.c, worker.c and optimizer.cc.
+ */
+
+#ifndef LLRB_JIT_H
+#define LLRB_JIT_H
+
+#include <stdbool.h>
+
+// Compilation tier. Profiler compiles a hot ISeq in baseline tier first to reduce warm-up time,
+// and recompiles it in optimized tier only when it's still hot after that.
+enum llrb_tier {
+  LLRB_TIER_NONE      = 0, // Not compiled. Interpreted by YARV.
+  LLRB_TIER_BASELINE  = 1, // Minimal LLVM passes and fast instruction selection.
+  LLRB_TIER_OPTIMIZED = 2, // Full LLVM passes at O3 and aggressive code generation.
+  LLRB_TIER_MAX       = LLRB_TIER_OPTIMIZED,
+};
+
+// LLVM pass pipeline of optimized tier. Baseline tier always uses minimal passes.
+enum llrb_pass_pipeline {
+  LLRB_PIPELINE_O3   = 0, // PassManagerBuilder's passes at O3.
+  LLRB_PIPELINE_LEAN = 1, // Curated passes for YARV-shaped IR, with LLRB-specific ones. Less compile time.
+};
+
+// LLVM contexts used by compiler.c. Ruby thread builds and optimizes modules in LLRB_CONTEXT_RUBY. A module enqueued
+// to worker i of worker.c is built in LLRB_CONTEXT_WORKER(i), so that threads never share a context.
+#define LLRB_WORKER_MAX 8
+#define LLRB_CONTEXT_RUBY 0
+#define LLRB_CONTEXT_WORKER(i) ((i) + 1)
+#define LLRB_CONTEXT_SIZE (LLRB_WORKER_MAX + 1)
+
+// Speculation failures of a compiled ISeq. JIT-ed code writes them when its guard fails and it deoptimizes
+// to YARV. Next compilation of the ISeq doesn't speculate for failed insns.
+struct llrb_deopt {
+  bool deopted; // true if any guard has failed after the last compilation. Profiler recompiles the ISeq then.
+  bool *failed; // failed[pos] is true if the guard for insn at pos has failed. Its size is iseq_size.
+};
+
+// Elapsed time measured by stats.c for LLRB::JIT.stats.
+enum llrb_stats_phase {
+  LLRB_STATS_PARSE,        // ISeq -> Control Flow Graph by parser.c.
+  LLRB_STATS_IR,           // Control Flow Graph -> LLVM IR by compiler.c, including bitcode loading.
+  LLRB_STATS_OPT,          // LLVM passes by optimizer.cc.
+  LLRB_STATS_FUNC_PASSES,  // Function passes in LLRB_STATS_OPT.
+  LLRB_STATS_MODULE_PASSES, // Module passes in LLRB_STATS_OPT.
+  LLRB_STATS_CODEGEN,      // Native code generation.
+  LLRB_STATS_BITCODE_LOAD, // Extracting insn functions from embedded runtime bitcode. Done once per function.
+  LLRB_STATS_PROFILE,      // Profiler's postponed job, excluding compilation.
+  LLRB_STATS_PHASE_SIZE,
+};
+
+// Sizes measured for LLRB::JIT.compile(..., profile: true), in addition to its phases.
+enum llrb_stats_size {
+  LLRB_STATS_IR_INSNS,  // LLVM instructions of the compiled function before LLVM passes.
+  LLRB_STATS_OPT_INSNS, // LLVM instructions of the compiled function after LLVM passes.
+  LLRB_STATS_CODE_SIZE, // Bytes of machine code and data of the module.
+  LLRB_STATS_SIZE_SIZE,
+};
+
+// Seconds of LLRB_STATS_FUNC_PASSES and LLRB_STATS_MODULE_PASSES measured by optimizer.cc. It may run without GVL,
+// so its caller adds them to stats.
+struct llrb_opt_time {
+  double func_passes;
+  double module_passes;
+};
+
+// Counters incremented by stats.c for LLRB::JIT.stats.
+enum llrb_stats_counter {
+  LLRB_STATS_COMPILED,       // Native functions installed, including recompilation.
+  LLRB_STATS_NOT_COMPILABLE, // Rejections by `llrb_check_not_compilable`.
+  LLRB_STATS_COMPILE_ERROR,  // Exceptions raised while building LLVM IR.
+  LLRB_STATS_SAMPLED_FRAMES, // Frames sampled by profiler.
+  LLRB_STATS_OSR_ENTRIES,    // Interpreted frames which entered JIT-ed code from a backward branch.
+  LLRB_STATS_CATCH_ENTRIES,  // Frames which got back to JIT-ed code after YARV caught rescue, break or next.
+  LLRB_STATS_EVICTED,        // Compiled ISeqs reverted to YARV and freed by code size limit.
+  LLRB_STATS_COUNTER_SIZE,
+};
+
+// VM state which JIT-ed code of an ISeq assumes to be kept since compilation. Compiler writes it, and llrb.c
+// un-publishes the code to let YARV interpret the ISeq again once the state has changed.
+struct llrb_assumption {
+  bool no_event_hook;              // trace insns are dropped because no event hook or DTrace probe was enabled.
+  unsigned int integer_bops;       // Bit (1 << BOP_*) is set if Integer's operation is speculated not to be redefined.
+  unsigned int array_bops;         // Bit (1 << BOP_*) is set if Array's operation is speculated not to be redefined.
+  unsigned long long method_state; // ruby_vm_global_method_state when some method is inlined. 0 otherwise.
+};
+
+// Range of iseq positions covered by a backward branch. Profiler counts samples taken inside it.
+struct llrb_loop {
+  unsigned int start; // Destination of the backward branch.
+  unsigned int end;   // Position of the backward branch insn.
+};
+
+// Insns compiled as extra entries of a JIT-ed function. llrb.c patches them with opt_call_c_function, so that a frame
+// interpreting them jumps into the function. Buffers are written by compiler and `xfree`d by llrb.c.
+struct llrb_osr {
+  // Backward branches in insns interpreted by frames started before installation (on-stack replacement).
+  unsigned int *entries;
+  unsigned int size;
+  // Continuations in new_iseq_encoded, where YARV resumes the frame after catching rescue, break or next.
+  unsigned int *catch_conts;
+  unsigned int catch_size;
+};
+
+#endif // LLRB_JIT_H
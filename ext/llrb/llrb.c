@@ -2,64 +2,363 @@
  * llrb.c: Has Ruby interface and native code generation.
  *
  * LLRB's internal design:
- *   parser.c:     llrb_parse_iseq()         # ISeq -> Control Flow Graph
+ *   llrb.c:       llrb_capture_iseq()       # ISeq -> Snapshot of its insns (snapshot.h), with GVL
+ *   parser.c:     llrb_parse_iseq()         # Snapshot -> Control Flow Graph
  *   compiler.c:   llrb_compile_cfg()        # Control Flow Graph -> LLVM IR
  *   optimizer.cc: llrb_optimize_function()  # LLVM IR -> optimized LLVM IR
  *   llrb.c:       llrb_create_native_func() # optimized LLVM IR -> Native code
+ *
+ * worker.c:       llrb_worker_enqueue()     # Runs optimizer.cc and llrb_create_native_func() on a thread pool
+ * stats.c:        rb_jit_stats()            # LLRB::JIT.stats
  */
 #include <stdbool.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "llvm-c/Core.h"
-#include "llvm-c/ExecutionEngine.h"
+#include "llvm-c/Object.h"
+#include "llvm-c/OrcBindings.h"
+#include "llvm-c/Support.h"
+#include "llvm-c/TargetMachine.h"
 #include "cruby.h"
 #include "cruby_extra/insns.inc"
+#include "cruby_extra/insns_info.inc"
+#include "cruby/probes_helper.h"
+#include "jit.h"
+#include "snapshot.h"
+#include "usdt.h"
+
+// All compiled methods are added to these JIT stacks. They share target machine, symbol resolution and
+// code memory among methods. Their compile layer emits machine code eagerly and doesn't keep LLVM IR.
+// Target machine's code generation level is different per tier.
+static LLVMOrcJITStackRef llrb_jits[LLRB_TIER_MAX+1]; // Index 0 (LLRB_TIER_NONE) is not used.
+
+// JIT stacks are not thread-safe, and workers of worker.c generate code in parallel. So every access to them
+// except initialization takes this lock. Symbol resolution runs inside LLVMOrcAddEagerlyCompiledIR with it held.
+static pthread_mutex_t llrb_jit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Opt-in /tmp/perf-<pid>.map for perf and bpftrace. LLVM 4's Orc C bindings can't register JITEventListener, so
+// function sizes are taken from an object file emitted from a clone of the module by a target machine of the same
+// options, while addresses are looked up in `llrb_jits`. The functions to be written are labeled by
+// `llrb_perf_map_label` while building IR.
+#define LLRB_PERF_LABEL_ATTR "llrb-perf-label"
+static struct {
+  bool enabled; // Set by LLRB::JIT.perf_map= with GVL while worker is idle.
+  FILE *file;   // Opened lazily. Protected by `llrb_measure_lock`.
+  LLVMTargetMachineRef tms[LLRB_TIER_MAX+1]; // Used only for sizes. Created when enabled, and used with `llrb_measure_lock`.
+} llrb_perf_map;
+
+// Measuring a module emits it again, which takes as long as its code generation. It takes this lock instead of
+// `llrb_jit_lock`, so that other workers' code generation isn't blocked meanwhile. Taken before `llrb_jit_lock`.
+static pthread_mutex_t llrb_measure_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Budget of machine code set by LLRB::JIT.code_size_limit=. While it's set, modules are measured like perf map, and
+// least recently sampled ISeqs are evicted to YARV when installed modules exceed it.
+static struct {
+  size_t limit; // 0 if unlimited. Workers read it without GVL, so it's changed only while they're idle.
+  size_t size;  // Sum of `code_size` of installed modules. Updated with GVL.
+} llrb_code_cache;
+
+// Functions in `llrb_jits` share one symbol namespace. So each compiled function needs a unique name.
+#define LLRB_FUNCNAME_SIZE 32
+static unsigned long llrb_funcname_serial = 0;
 
-static const char *llrb_funcname = "llrb_exec";
+// Machine code of a module added to `llrb_jits`. LLRB::JIT.compile_all compiles functions of multiple ISeqs into
+// one module, so it's removed after all the ISeqs installing its functions are freed.
+struct llrb_native_module {
+  LLVMOrcModuleHandle handle;
+  enum llrb_tier tier;
+  unsigned int refs; // The number of llrb_native_code referring to this.
+  size_t code_size;  // Bytes of machine code and data. 0 if neither code size limit nor perf map was enabled.
+};
 
-LLVMModuleRef llrb_compile_iseq(const struct rb_iseq_constant_body *body, const VALUE *new_iseq_encoded, const char* funcname, bool enable_stats);
+// Native function installed to an ISeq. A replaced one may still be running on some thread or fiber,
+// so it's kept until the ISeq is freed.
+struct llrb_native_code {
+  struct llrb_native_module *module;
+  struct llrb_native_code *next;
+};
+
+// Holds data of ISeq whose iseq_encoded is replaced by LLRB.
+// This is created when an ISeq is compiled first time, and its native function is installed later.
+// All of them are freed by `llrb_free_iseq` after the ISeq is freed by GC.
+struct llrb_compiled_iseq {
+  VALUE *orig_iseq_encoded; // iseq_encoded before replacement. Frames started before installation interpret it.
+  VALUE *new_iseq_encoded;  // Replaced iseq_encoded. Recompiled function is installed to this too.
+  enum llrb_tier tier;      // LLRB_TIER_NONE until native function is installed, or after it's reverted.
+  bool replaced;            // true if iseq_encoded is new_iseq_encoded. It's kept after reverted to YARV.
+  struct llrb_deopt deopt;  // Written by JIT-ed code on speculation failure.
+  struct llrb_assumption assumption; // Written by compiler. Checked by `llrb_invalidate_stale_iseqs`.
+  struct llrb_native_code *codes;    // Installed native functions, newest first.
+  struct llrb_osr osr;               // Written by compiler. Patched to orig_iseq_encoded by `llrb_patch_osr_entries`.
+  VALUE *unpatched_iseq_encoded;     // orig_iseq_encoded before the first patch. Used for recompilation. 0 if not patched.
+};
+static st_table *llrb_compiled_iseqs; // { iseq => llrb_compiled_iseq }
+static VALUE llrb_preloaded_failures; // { String => [Integer] } given by LLRB::JIT.preload_guard_failures, or Qnil.
+
+static void
+llrb_generate_funcname(char *funcname)
+{
+  snprintf(funcname, LLRB_FUNCNAME_SIZE, "llrb_exec_%lu", llrb_funcname_serial++);
+}
+
+LLVMModuleRef llrb_compile_iseq(unsigned int context, LLVMModuleRef mod, const struct llrb_iseq_snapshot *snapshot,
+    const VALUE *new_iseq_encoded, struct llrb_deopt *deopt, struct llrb_assumption *assumption,
+    const VALUE *osr_iseq_encoded, struct llrb_osr *osr, const char* funcname);
+void llrb_internalize_module(LLVMModuleRef mod, const char *const *funcnames, unsigned int size);
+void llrb_optimize_function(LLVMModuleRef cmod, LLVMValueRef cfunc, enum llrb_tier tier, bool enable_stats,
+    bool time_passes, struct llrb_opt_time *time);
 const rb_iseq_t *rb_iseqw_to_iseq(VALUE iseqw);
 
+// Resolves functions in other compiled modules first, and then CRuby's symbols.
 static uint64_t
-llrb_create_native_func(LLVMModuleRef mod, const char *funcname)
+llrb_resolve_symbol(const char *name, RB_UNUSED_VAR(void *ctx))
 {
-  LLVMExecutionEngineRef engine;
+  for (int tier = LLRB_TIER_BASELINE; tier <= LLRB_TIER_MAX; tier++) {
+    uint64_t addr = LLVMOrcGetSymbolAddress(llrb_jits[tier], name);
+    if (addr) return addr;
+  }
+
+#ifdef __APPLE__
+  if (name[0] == '_') name++; // Strip global prefix from mangled name for dlsym.
+#endif
+  return (uint64_t)LLVMSearchForAddressOfSymbol(name);
+}
+
+static LLVMTargetMachineRef
+llrb_create_target_machine(LLVMCodeGenOptLevel level)
+{
+  extern char *llrb_host_cpu_name(void);
+  extern char *llrb_host_cpu_features(void);
+
+  char *triple = LLVMGetDefaultTargetTriple();
+  LLVMTargetRef target;
   char *error;
-  if (LLVMCreateJITCompilerForModule(&engine, mod, LLVMCodeGenLevelAggressive, &error) != 0) {
-    fprintf(stderr, "Failed to create JIT compiler...\n");
+  if (LLVMGetTargetFromTriple(triple, &target, &error)) {
+    fprintf(stderr, "LLVMGetTargetFromTriple: %s\n", error);
+    LLVMDisposeMessage(error);
+    rb_raise(rb_eRuntimeError, "Failed to find native target for '%s'", triple);
+  }
+
+  char *cpu = llrb_host_cpu_name(), *features = llrb_host_cpu_features(); // `free`d in this function.
+  LLVMTargetMachineRef tm = LLVMCreateTargetMachine(target, triple, cpu, features,
+      level, LLVMRelocDefault, LLVMCodeModelJITDefault);
+  free(cpu);
+  free(features);
+  LLVMDisposeMessage(triple);
+  return tm;
+}
+
+// Returns address of a function in modules added to `llrb_jits[tier]`, or 0 if it's not found.
+static uint64_t
+llrb_native_func_address(const char *funcname, enum llrb_tier tier)
+{
+  pthread_mutex_lock(&llrb_jit_lock);
+  char *mangled; // `LLVMOrcDisposeMangledSymbol`ed in this function.
+  LLVMOrcGetMangledSymbol(llrb_jits[tier], &mangled, funcname);
+  uint64_t func = LLVMOrcGetSymbolAddress(llrb_jits[tier], mangled);
+  LLVMOrcDisposeMangledSymbol(mangled);
+  pthread_mutex_unlock(&llrb_jit_lock);
+  return func;
+}
+
+// Called with GVL after a function of `iseq` is added to `mod`. Its label is kept in LLVM IR, so that code generation
+// without GVL can write it to perf map.
+static void
+llrb_perf_map_label(LLVMModuleRef mod, const char *funcname, const rb_iseq_t *iseq)
+{
+  if (!llrb_perf_map.enabled) return;
+  VALUE label = rb_sprintf("%"PRIsVALUE"@%"PRIsVALUE":%d", iseq->body->location.label, iseq->body->location.path,
+      FIX2INT(iseq->body->location.first_lineno));
+  LLVMAddTargetDependentFunctionAttr(LLVMGetNamedFunction(mod, funcname), LLRB_PERF_LABEL_ATTR,
+      StringValueCStr(label));
+}
 
-    if (error) {
-      fprintf(stderr, "LLVMCreateJITCompilerForModule: %s\n", error);
-      LLVMDisposeMessage(error);
-      return 0;
+static uint64_t
+llrb_object_symbol_size(LLVMObjectFileRef obj, const char *name)
+{
+  uint64_t size = 0;
+  LLVMSymbolIteratorRef sym = LLVMGetSymbols(obj);
+  for (; !LLVMIsSymbolIteratorAtEnd(obj, sym); LLVMMoveToNextSymbol(sym)) {
+    if (strcmp(LLVMGetSymbolName(sym), name) == 0) {
+      size = LLVMGetSymbolSize(sym);
+      break;
     }
   }
-  return LLVMGetFunctionAddress(engine, funcname);
+  LLVMDisposeSymbolIterator(sym);
+  return size;
+}
+
+// Sections which JIT's memory manager allocates, i.e. not relocations, symbols or debug info.
+static bool
+llrb_loaded_section_p(const char *name)
+{
+  const char *prefixes[] = { ".text", ".rodata", ".data", ".bss", ".eh_frame", "__text", "__const", "__data" };
+  for (size_t i = 0; i < sizeof(prefixes) / sizeof(const char *); i++) {
+    if (strncmp(name, prefixes[i], strlen(prefixes[i])) == 0) return true;
+  }
+  return false;
+}
+
+static size_t
+llrb_object_code_size(LLVMObjectFileRef obj)
+{
+  size_t size = 0;
+  LLVMSectionIteratorRef section = LLVMGetSections(obj);
+  for (; !LLVMIsSectionIteratorAtEnd(obj, section); LLVMMoveToNextSection(section)) {
+    const char *name = LLVMGetSectionName(section);
+    if (name && llrb_loaded_section_p(name)) size += (size_t)LLVMGetSectionSize(section);
+  }
+  LLVMDisposeSectionIterator(section);
+  return size;
 }
 
 static void
-llrb_replace_iseq_with_cfunc(const rb_iseq_t *iseq, VALUE *new_iseq_encoded, rb_insn_func_t funcptr)
+llrb_perf_map_write(LLVMObjectFileRef obj, LLVMModuleRef clone, enum llrb_tier tier)
 {
-  new_iseq_encoded[0] = (VALUE)rb_vm_get_insns_address_table()[YARVINSN_opt_call_c_function];
-  new_iseq_encoded[1] = (VALUE)funcptr;
+  if (!llrb_perf_map.file) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    llrb_perf_map.file = fopen(path, "a");
+  }
+  if (!llrb_perf_map.file) return;
+
+  for (LLVMValueRef func = LLVMGetFirstFunction(clone); func; func = LLVMGetNextFunction(func)) {
+    LLVMAttributeRef attr = LLVMGetStringAttributeAtIndex(func, LLVMAttributeFunctionIndex, LLRB_PERF_LABEL_ATTR,
+        strlen(LLRB_PERF_LABEL_ATTR));
+    if (!attr) continue;
 
-  // JIT code may change program counter to address after `new_iseq_encoded[2]` to get `catch_table` work.
-  // So filling "leave" insns is necessary here.
-  for (unsigned int i = 2; i < iseq->body->iseq_size; i++) {
-    // Is there a case that last insn is not "leave"?
-    new_iseq_encoded[i] = (VALUE)rb_vm_get_insns_address_table()[YARVINSN_leave];
+    unsigned int len;
+    const char *label = LLVMGetStringAttributeValue(attr, &len);
+    char *mangled; // `LLVMOrcDisposeMangledSymbol`ed in this function.
+    pthread_mutex_lock(&llrb_jit_lock);
+    LLVMOrcGetMangledSymbol(llrb_jits[tier], &mangled, LLVMGetValueName(func));
+    uint64_t addr = LLVMOrcGetSymbolAddress(llrb_jits[tier], mangled);
+    pthread_mutex_unlock(&llrb_jit_lock);
+    uint64_t size = llrb_object_symbol_size(obj, mangled);
+    LLVMOrcDisposeMangledSymbol(mangled);
+    if (addr && size) fprintf(llrb_perf_map.file, "%"PRIx64" %"PRIx64" %.*s\n", addr, size, (int)len, label);
   }
+  fflush(llrb_perf_map.file);
+}
+
+// Used by worker.c too. Called after `clone`'s original is added to `llrb_jits[tier]`, and `clone` is disposed here.
+// Writes perf map if it's enabled, and returns the size of sections loaded for the module. 0 if `clone` is 0 or it's
+// not emitted. LLVM 4's Orc doesn't expose the object it has loaded, so the size is an estimate by the same options.
+size_t
+llrb_measure_native_code(LLVMModuleRef clone, enum llrb_tier tier)
+{
+  if (!clone) return 0;
+
+  pthread_mutex_lock(&llrb_measure_lock);
+  char *error = 0;
+  LLVMMemoryBufferRef buf;
+  if (LLVMTargetMachineEmitToMemoryBuffer(llrb_perf_map.tms[tier], clone, LLVMObjectFile, &error, &buf)) {
+    pthread_mutex_unlock(&llrb_measure_lock);
+    if (error) LLVMDisposeMessage(error);
+    LLVMDisposeModule(clone);
+    return 0;
+  }
+  LLVMObjectFileRef obj = LLVMCreateObjectFile(buf); // Takes `buf`.
+
+  if (llrb_perf_map.enabled) llrb_perf_map_write(obj, clone, tier);
+  pthread_mutex_unlock(&llrb_measure_lock);
+  size_t size = llrb_object_code_size(obj);
+  LLVMDisposeObjectFile(obj);
+  LLVMDisposeModule(clone);
+  return size;
+}
+
+// Used by worker.c too. This function doesn't touch Ruby VM, so it can be called without GVL.
+// Ownership of `mod` is moved to `llrb_jits[tier]`, and it's removed with `handle` by `llrb_remove_native_func`.
+// With `measure`, or while perf map or code size limit is enabled, `clone` is set to a copy of `mod` to be passed to
+// `llrb_measure_native_code`. Otherwise it's 0.
+uint64_t
+llrb_create_native_func(LLVMModuleRef mod, const char *funcname, enum llrb_tier tier, bool measure,
+    LLVMOrcModuleHandle *handle, LLVMModuleRef *clone)
+{
+  // `mod` is in the caller's own context, so it's cloned without the lock.
+  *clone = (measure || llrb_perf_map.enabled || llrb_code_cache.limit > 0) ? LLVMCloneModule(mod) : 0;
+  pthread_mutex_lock(&llrb_jit_lock);
+  *handle = LLVMOrcAddEagerlyCompiledIR(llrb_jits[tier], mod, llrb_resolve_symbol, 0);
+  pthread_mutex_unlock(&llrb_jit_lock);
+  return llrb_native_func_address(funcname, tier);
+}
+
+// Used by worker.c too. Frees machine code of a module. Other workers may be generating code meanwhile.
+void
+llrb_remove_native_func(LLVMOrcModuleHandle handle, enum llrb_tier tier)
+{
+  pthread_mutex_lock(&llrb_jit_lock);
+  LLVMOrcRemoveModule(llrb_jits[tier], handle);
+  pthread_mutex_unlock(&llrb_jit_lock);
+}
+
+// Used by worker.c. A worker may have held the lock at fork. Child writes perf map of its own pid.
+void
+llrb_jit_atfork_child(void)
+{
+  pthread_mutex_init(&llrb_jit_lock, NULL);
+  pthread_mutex_init(&llrb_measure_lock, NULL);
+  if (llrb_perf_map.file) fclose(llrb_perf_map.file);
+  llrb_perf_map.file = 0;
+}
+
+// Copies insns after new_iseq_encoded[0..1], which are opt_call_c_function and funcptr.
+static void
+llrb_copy_rest_insns(const rb_iseq_t *iseq, VALUE *new_iseq_encoded, const VALUE *orig_iseq_encoded)
+{
+  extern int rb_vm_insn_addr2insn(const void *addr);
+
+  // JIT code may change program counter to address after `new_iseq_encoded[2]` to get `catch_table` work,
+  // or to deoptimize. Then YARV continues the original insns from there. JIT code returns by setting program
+  // counter to the original "leave" insn.
+  MEMCPY(new_iseq_encoded + 2, orig_iseq_encoded + 2, VALUE, iseq->body->iseq_size - 2);
+
+  // If original insn at 0 has no operand, insn at 1 was overwritten by funcptr. Its operands are never
+  // executed, but they are filled with "nop" to keep iseq_encoded decodable.
+  int first_insn = rb_vm_insn_addr2insn((void *)orig_iseq_encoded[0]);
+  if (insn_len(first_insn) == 1) {
+    int second_insn = rb_vm_insn_addr2insn((void *)orig_iseq_encoded[1]);
+    for (unsigned int i = 2; i < 1 + (unsigned int)insn_len(second_insn); i++) {
+      new_iseq_encoded[i] = (VALUE)rb_vm_get_insns_address_table()[YARVINSN_nop];
+    }
+  }
+}
+
+static void
+llrb_replace_iseq_with_cfunc(const rb_iseq_t *iseq, struct llrb_compiled_iseq *compiled, rb_insn_func_t funcptr)
+{
+  VALUE *new_iseq_encoded = compiled->new_iseq_encoded;
+  new_iseq_encoded[0] = (VALUE)rb_vm_get_insns_address_table()[YARVINSN_opt_call_c_function];
+  new_iseq_encoded[1] = (VALUE)funcptr;
+  llrb_copy_rest_insns(iseq, new_iseq_encoded, compiled->orig_iseq_encoded);
 
   // Changing iseq->body->iseq_encoded will not break threads executing old iseq_encoded
   // because program counter will still point to old iseq's address. This operation is considered safe.
-  // But in the same time it's hard to free memory of old iseq_encoded.
+  // Old iseq_encoded is kept in llrb_compiled_iseq and freed only after the ISeq is freed.
   iseq->body->iseq_encoded = new_iseq_encoded;
+  compiled->replaced = true;
+}
+
+// Makes new_iseq_encoded run the original insns again. iseq_encoded is not swapped back, because native frames are
+// running with program counters in new_iseq_encoded, and CRuby finds catch table entries and line numbers of them by
+// the offset from iseq_encoded. Frames deoptimized or caught after this continue the same insns by the same offset.
+static void
+llrb_restore_original_insns(const rb_iseq_t *iseq, struct llrb_compiled_iseq *compiled)
+{
+  llrb_unpatch_osr_entries(iseq, compiled);
+  MEMCPY(compiled->new_iseq_encoded, compiled->orig_iseq_encoded, VALUE, iseq->body->iseq_size);
 }
 
 static bool
 llrb_check_already_compiled(const rb_iseq_t *iseq)
 {
+  // YARV compiler never emits opt_call_c_function.
   return iseq->body->iseq_size >= 3
-    && iseq->body->iseq_encoded[0] == (VALUE)rb_vm_get_insns_address_table()[YARVINSN_opt_call_c_function]
-    && iseq->body->iseq_encoded[2] == (VALUE)rb_vm_get_insns_address_table()[YARVINSN_leave];
+    && iseq->body->iseq_encoded[0] == (VALUE)rb_vm_get_insns_address_table()[YARVINSN_opt_call_c_function];
 }
 
 static bool
@@ -69,6 +368,373 @@ llrb_should_not_compile(const rb_iseq_t *iseq)
   return llrb_check_already_compiled(iseq) || llrb_check_not_compilable(iseq);
 }
 
+// ISeq is freed between GC's sweep and its finalizer. Its body must not be touched then.
+static inline bool
+llrb_iseq_alive_p(const rb_iseq_t *iseq)
+{
+  return BUILTIN_TYPE((VALUE)iseq) == T_IMEMO;
+}
+
+static struct llrb_compiled_iseq *
+llrb_find_compiled_iseq(const rb_iseq_t *iseq)
+{
+  st_data_t val;
+  if (st_lookup(llrb_compiled_iseqs, (st_data_t)iseq, &val)) {
+    return (struct llrb_compiled_iseq *)val;
+  }
+  return 0;
+}
+
+// Returns insns before replacement and OSR patches. Compiler reads them to inline a method which may be already compiled.
+const VALUE *
+llrb_original_iseq_encoded(const rb_iseq_t *iseq)
+{
+  struct llrb_compiled_iseq *compiled = llrb_find_compiled_iseq(iseq);
+  if (!compiled) return iseq->body->iseq_encoded;
+  return compiled->unpatched_iseq_encoded ? compiled->unpatched_iseq_encoded : compiled->orig_iseq_encoded;
+}
+
+// Restores insns patched by `llrb_patch_osr_entries`, in both orig_iseq_encoded and new_iseq_encoded.
+static void
+llrb_unpatch_osr_entries(const rb_iseq_t *iseq, struct llrb_compiled_iseq *compiled)
+{
+  if (!compiled->unpatched_iseq_encoded) return;
+  MEMCPY(compiled->orig_iseq_encoded, compiled->unpatched_iseq_encoded, VALUE, iseq->body->iseq_size);
+  llrb_copy_rest_insns(iseq, compiled->new_iseq_encoded, compiled->unpatched_iseq_encoded);
+}
+
+// Only Ruby threads holding GVL read insns, so the two words can't be seen half-written.
+static void
+llrb_patch_insn(VALUE *insn, rb_insn_func_t funcptr)
+{
+  insn[0] = (VALUE)rb_vm_get_insns_address_table()[YARVINSN_opt_call_c_function];
+  insn[1] = (VALUE)funcptr;
+}
+
+// On-stack replacement. A frame which started before installation keeps interpreting orig_iseq_encoded and never
+// calls funcptr at new_iseq_encoded[0], i.e. a long loop called once isn't JIT-ed. So compiled backward branches in it
+// are replaced with opt_call_c_function, which has the same length, and the native function continues the loop.
+// new_iseq_encoded's branches are not patched. A frame deoptimized to it doesn't enter the function again by them.
+// But its catch continuations are, because YARV resumes a JIT-ed frame there after a rescue clause, break or next.
+static void
+llrb_patch_osr_entries(const rb_iseq_t *iseq, struct llrb_compiled_iseq *compiled, rb_insn_func_t funcptr)
+{
+  llrb_unpatch_osr_entries(iseq, compiled); // Entries of the previous compilation may be different.
+  if (compiled->osr.size == 0 && compiled->osr.catch_size == 0) return;
+
+  if (!compiled->unpatched_iseq_encoded) {
+    compiled->unpatched_iseq_encoded = ALLOC_N(VALUE, iseq->body->iseq_size); // Freed by `llrb_free_iseq`.
+    MEMCPY(compiled->unpatched_iseq_encoded, compiled->orig_iseq_encoded, VALUE, iseq->body->iseq_size);
+  }
+  for (unsigned int i = 0; i < compiled->osr.size; i++) {
+    llrb_patch_insn(compiled->orig_iseq_encoded + compiled->osr.entries[i], funcptr);
+  }
+  for (unsigned int i = 0; i < compiled->osr.catch_size; i++) {
+    llrb_patch_insn(compiled->new_iseq_encoded + compiled->osr.catch_conts[i], funcptr);
+  }
+}
+
+// Used by profiler.c too. Identifies an ISeq across processes by its location and insns. Operands are not hashed
+// because they have addresses in this process.
+VALUE
+llrb_iseq_profile_key(const rb_iseq_t *iseq)
+{
+  const VALUE *iseq_encoded = llrb_original_iseq_encoded(iseq);
+  unsigned long long hash = 14695981039346656037ULL; // FNV-1a
+  for (unsigned int i = 0; i < iseq->body->iseq_size;) {
+    int insn = rb_vm_insn_addr2insn((void *)iseq_encoded[i]);
+    hash = (hash ^ (unsigned long long)insn) * 1099511628211ULL;
+    i += insn_len(insn);
+  }
+  return rb_sprintf("%"PRIsVALUE":%d:%"PRIsVALUE":%u:%016llx", iseq->body->location.path,
+      FIX2INT(iseq->body->location.first_lineno), iseq->body->location.label, iseq->body->iseq_size, hash);
+}
+
+// Reverts iseq to be interpreted by YARV. Threads running its native function keep running it,
+// so the llrb_compiled_iseq and new_iseq_encoded are kept until the ISeq is freed. It's marked as deoptimized to be
+// compiled again by profiler, and the next installation writes the same new_iseq_encoded again.
+static void
+llrb_invalidate_compiled_iseq(const rb_iseq_t *iseq, struct llrb_compiled_iseq *compiled)
+{
+  llrb_restore_original_insns(iseq, compiled);
+  compiled->tier = LLRB_TIER_NONE;
+  compiled->deopt.deopted = true;
+  LLRB_PROBE_DEOPT(iseq->body, "assumption");
+}
+
+static void
+llrb_invalidate_iseq(const rb_iseq_t *iseq)
+{
+  struct llrb_compiled_iseq *compiled = llrb_find_compiled_iseq(iseq);
+  if (compiled && compiled->tier != LLRB_TIER_NONE) llrb_invalidate_compiled_iseq(iseq, compiled);
+}
+
+// Used by compiler.c and JIT-ed code too. Returns nonzero if a DTrace probe fired by trace insns is enabled.
+// Like an event hook, it needs the trace insns which JIT-ed code may drop.
+int
+llrb_dtrace_enabled_p(void)
+{
+  return RUBY_DTRACE_METHOD_ENTRY_ENABLED() || RUBY_DTRACE_METHOD_RETURN_ENABLED() ||
+    RUBY_DTRACE_CMETHOD_ENTRY_ENABLED() || RUBY_DTRACE_CMETHOD_RETURN_ENABLED();
+}
+
+// Returns false if VM state has been changed from what JIT-ed code assumed at compilation.
+static bool
+llrb_assumption_valid_p(const struct llrb_assumption *assumption)
+{
+  extern rb_serial_t ruby_vm_global_method_state;
+
+  if (assumption->no_event_hook && (ruby_vm_event_flags != 0 || llrb_dtrace_enabled_p())) return false;
+  if (assumption->method_state && assumption->method_state != ruby_vm_global_method_state) return false;
+  for (int bop = 0; bop < BOP_LAST_; bop++) {
+    if ((assumption->integer_bops & (1U << bop)) && !BASIC_OP_UNREDEFINED_P(bop, INTEGER_REDEFINED_OP_FLAG)) return false;
+    if ((assumption->array_bops & (1U << bop)) && !BASIC_OP_UNREDEFINED_P(bop, ARRAY_REDEFINED_OP_FLAG)) return false;
+  }
+  return true;
+}
+
+static int
+llrb_invalidate_stale_iseq_i(st_data_t key, st_data_t val, RB_UNUSED_VAR(st_data_t arg))
+{
+  const rb_iseq_t *iseq = (const rb_iseq_t *)key;
+  struct llrb_compiled_iseq *compiled = (struct llrb_compiled_iseq *)val;
+  if (compiled->tier != LLRB_TIER_NONE && llrb_iseq_alive_p(iseq) && !llrb_assumption_valid_p(&compiled->assumption)) {
+    llrb_invalidate_compiled_iseq(iseq, compiled);
+  }
+  return ST_CONTINUE;
+}
+
+// Used by profiler.c. Un-publishes JIT-ed code whose assumption is broken by method redefinition, redefinition of
+// basic operations, an event hook or a DTrace probe. Its guards would fail on every call, so YARV interprets it until
+// recompilation.
+// The iseqs are checked only when VM state is changed since the last call.
+void
+llrb_invalidate_stale_iseqs(void)
+{
+  extern rb_serial_t ruby_vm_global_method_state;
+  static rb_serial_t last_method_state = 0;
+  static rb_event_flag_t last_event_flags = 0;
+  static int last_dtrace_enabled = 0;
+  static short last_redefined_flag[BOP_LAST_];
+
+  const short *redefined_flag = GET_VM()->redefined_flag;
+  int dtrace_enabled = llrb_dtrace_enabled_p();
+  if (last_method_state == ruby_vm_global_method_state && last_event_flags == ruby_vm_event_flags
+      && last_dtrace_enabled == dtrace_enabled
+      && memcmp(last_redefined_flag, redefined_flag, sizeof(last_redefined_flag)) == 0) return;
+  last_method_state = ruby_vm_global_method_state;
+  last_event_flags = ruby_vm_event_flags;
+  last_dtrace_enabled = dtrace_enabled;
+  MEMCPY(last_redefined_flag, redefined_flag, short, BOP_LAST_);
+
+  st_foreach(llrb_compiled_iseqs, llrb_invalidate_stale_iseq_i, 0);
+}
+
+// Called by JIT-ed function compiled without trace insns, when it finds an event hook registered after
+// compilation. After this, opt_call_c_function runs the original insns from the beginning, with trace.
+// A frame entered from a patched insn runs the insn again instead, which is restored by the invalidation.
+void
+llrb_invalidate_by_event_hook(VALUE cfp_v)
+{
+  rb_control_frame_t *cfp = (rb_control_frame_t *)cfp_v;
+  const struct llrb_compiled_iseq *compiled = llrb_find_compiled_iseq(cfp->iseq);
+  bool osr_entered = compiled && cfp->pc != compiled->new_iseq_encoded + 2;
+  llrb_invalidate_iseq(cfp->iseq);
+  cfp->pc = osr_entered ? cfp->pc - 2 : cfp->iseq->body->iseq_encoded;
+}
+
+static VALUE llrb_iseq_finalizer; // Method object of LLRB::JIT.free_iseq. It's called with object id of freed ISeq.
+
+// Used by profiler.c too. Lets `rb_jit_free_iseq` free LLRB's data for iseq after GC frees iseq.
+void
+llrb_watch_iseq(const rb_iseq_t *iseq)
+{
+  if (!FL_TEST((VALUE)iseq, FL_FINALIZE)) rb_define_finalizer((VALUE)iseq, llrb_iseq_finalizer);
+}
+
+static void
+llrb_free_native_module(struct llrb_native_module *module)
+{
+  llrb_remove_native_func(module->handle, module->tier);
+  llrb_code_cache.size -= module->code_size;
+  xfree(module);
+}
+
+// Drops the ISeq's references to native modules. Modules which no other ISeq refers to are freed.
+static void
+llrb_free_native_codes(struct llrb_compiled_iseq *compiled)
+{
+  for (struct llrb_native_code *code = compiled->codes; code;) {
+    struct llrb_native_code *next = code->next;
+    if (--code->module->refs == 0) llrb_free_native_module(code->module);
+    xfree(code);
+    code = next;
+  }
+  compiled->codes = 0;
+}
+
+// No frame can run native functions of a freed ISeq, because a frame marks its iseq. rb_iseq_free has freed
+// the iseq_encoded which was current, so the other one is freed here.
+static void
+llrb_free_compiled_iseq(struct llrb_compiled_iseq *compiled)
+{
+  llrb_free_native_codes(compiled);
+  xfree(compiled->replaced ? compiled->orig_iseq_encoded : compiled->new_iseq_encoded);
+  xfree(compiled->unpatched_iseq_encoded);
+  xfree(compiled->osr.entries);
+  xfree(compiled->osr.catch_conts);
+  xfree(compiled->deopt.failed);
+  xfree(compiled);
+}
+
+// LLRB::JIT.free_iseq (private). Finalizer of ISeq registered by `llrb_watch_iseq`.
+// @param [Integer] object_id - rb_obj_id of non-special object is its address tagged as Fixnum.
+static VALUE
+rb_jit_free_iseq(RB_UNUSED_VAR(VALUE self), VALUE object_id)
+{
+  extern void llrb_worker_cancel(const rb_iseq_t *iseq);
+  extern void llrb_profiler_free_sample(const rb_iseq_t *iseq);
+  const rb_iseq_t *iseq = (const rb_iseq_t *)(object_id ^ FIXNUM_FLAG);
+
+  // On process exit, finalizers are called for living objects too. Their native functions may still be called
+  // by other finalizers.
+  if (llrb_iseq_alive_p(iseq)) return Qnil;
+
+  llrb_worker_cancel(iseq); // No job for the iseq is installed after this.
+  llrb_profiler_free_sample(iseq);
+
+  st_data_t key = (st_data_t)iseq, val;
+  if (st_delete(llrb_compiled_iseqs, &key, &val)) {
+    llrb_free_compiled_iseq((struct llrb_compiled_iseq *)val);
+  }
+  return Qnil;
+}
+
+// Return true if iseq can be compiled in given tier. Compiled iseq can be recompiled only in higher tier,
+// or in the same tier if its speculation has failed.
+static bool
+llrb_compilable_in(const rb_iseq_t *iseq, enum llrb_tier tier)
+{
+  const struct llrb_compiled_iseq *compiled = llrb_find_compiled_iseq(iseq);
+  if (compiled) return compiled->tier < tier || (compiled->tier == tier && compiled->deopt.deopted);
+  return !llrb_should_not_compile(iseq);
+}
+
+// Captures what parser.c and compiler.c read from `iseq`. This must be called with GVL. Insns before replacement and
+// OSR patches are decoded, and objects in operands and catch table are pinned by `snapshot->pins`.
+static void
+llrb_capture_iseq(const rb_iseq_t *iseq, struct llrb_iseq_snapshot *snapshot)
+{
+  const VALUE *iseq_encoded = llrb_original_iseq_encoded(iseq);
+  const struct iseq_catch_table *ct = iseq->body->catch_table;
+  size_t insns_bytes = sizeof(VALUE) * iseq->body->iseq_size;
+  size_t ct_bytes = ct ? iseq_catch_table_bytes(ct->size) : 0;
+
+  VALUE buf = rb_str_tmp_new(insns_bytes + ct_bytes);
+  snapshot->pins = rb_ary_tmp_new(0);
+  rb_ary_push(snapshot->pins, buf);
+
+  VALUE *insns = (VALUE *)RSTRING_PTR(buf);
+  for (unsigned int i = 0; i < iseq->body->iseq_size;) {
+    int insn = rb_vm_insn_addr2insn((void *)iseq_encoded[i]);
+    insns[i] = (VALUE)insn;
+    for (int j = 1; j < insn_len(insn); j++) {
+      VALUE op = iseq_encoded[i+j];
+      insns[i+j] = op;
+      switch (insn_op_type(insn, j-1)) {
+        case TS_VALUE:
+        case TS_ISEQ:
+        case TS_CDHASH:
+          if (op && !SPECIAL_CONST_P(op)) rb_ary_push(snapshot->pins, op);
+          break;
+      }
+    }
+    i += insn_len(insn);
+  }
+
+  struct iseq_catch_table *catch_table = 0;
+  if (ct) {
+    catch_table = (struct iseq_catch_table *)(RSTRING_PTR(buf) + insns_bytes);
+    MEMCPY((char *)catch_table, (const char *)ct, char, ct_bytes);
+    for (unsigned int i = 0; i < ct->size; i++) {
+      if (ct->entries[i].iseq) rb_ary_push(snapshot->pins, (VALUE)ct->entries[i].iseq);
+    }
+  }
+
+  snapshot->body = *iseq->body;
+  snapshot->body.iseq_encoded = insns;
+  snapshot->body.catch_table = catch_table;
+}
+
+// Guards which failed in a previous process are not speculated in the first compilation either.
+static void
+llrb_apply_preloaded_failures(const rb_iseq_t *iseq, struct llrb_compiled_iseq *compiled)
+{
+  if (NIL_P(llrb_preloaded_failures) || RHASH_SIZE(llrb_preloaded_failures) == 0) return;
+  VALUE positions = rb_hash_lookup(llrb_preloaded_failures, llrb_iseq_profile_key(iseq));
+  if (!RB_TYPE_P(positions, T_ARRAY)) return;
+
+  for (long i = 0; i < RARRAY_LEN(positions); i++) {
+    VALUE pos = RARRAY_AREF(positions, i);
+    if (FIXNUM_P(pos) && FIX2LONG(pos) >= 0 && FIX2LONG(pos) < (long)iseq->body->iseq_size) {
+      compiled->deopt.failed[FIX2LONG(pos)] = true;
+    }
+  }
+}
+
+// Captures ISeq to be compiled and returns its llrb_compiled_iseq, whose new_iseq_encoded is program counter's
+// base address for the compilation. On recompilation, original iseq_encoded is compiled for the same
+// new_iseq_encoded. Then threads running an old native function or interpreting its insns are not broken.
+static struct llrb_compiled_iseq *
+llrb_prepare_snapshot(const rb_iseq_t *iseq, struct llrb_iseq_snapshot *snapshot)
+{
+  struct llrb_compiled_iseq *compiled = llrb_find_compiled_iseq(iseq);
+  if (!compiled) {
+    compiled = ALLOC(struct llrb_compiled_iseq); // Freed by `llrb_free_iseq`.
+    *compiled = (struct llrb_compiled_iseq){
+      .orig_iseq_encoded = iseq->body->iseq_encoded,
+      // Creating new_iseq_encoded before compilation to calculate program counter.
+      .new_iseq_encoded = ALLOC_N(VALUE, iseq->body->iseq_size), // Freed by `llrb_free_iseq`.
+      .tier = LLRB_TIER_NONE,
+      .replaced = false,
+      .deopt = (struct llrb_deopt){
+        .deopted = false,
+        .failed = ZALLOC_N(bool, iseq->body->iseq_size), // Freed by `llrb_free_iseq`. JIT-ed code may write it anytime.
+      },
+      .codes = 0,
+      .osr = (struct llrb_osr){ .entries = 0, .size = 0, .catch_conts = 0, .catch_size = 0 },
+      .unpatched_iseq_encoded = 0,
+    };
+    st_insert(llrb_compiled_iseqs, (st_data_t)iseq, (st_data_t)compiled);
+    llrb_watch_iseq(iseq);
+    llrb_apply_preloaded_failures(iseq, compiled);
+  }
+
+  // Guards fail in JIT-ed code, which can't fire probes. So it's reported when the ISeq is recompiled for that.
+  if (compiled->deopt.deopted && compiled->tier != LLRB_TIER_NONE) LLRB_PROBE_DEOPT(iseq->body, "guard_failed");
+  llrb_capture_iseq(iseq, snapshot);
+  compiled->deopt.deopted = false; // Failed guards are not speculated in this compilation.
+  return compiled;
+}
+
+// Return tier to compile iseq next time. Used for the iseqs selected by profiler.
+static enum llrb_tier
+llrb_next_tier(const rb_iseq_t *iseq)
+{
+  const struct llrb_compiled_iseq *compiled = llrb_find_compiled_iseq(iseq);
+  if (compiled && compiled->deopt.deopted && compiled->tier != LLRB_TIER_NONE) return compiled->tier;
+  if (compiled && compiled->tier < LLRB_TIER_MAX) return compiled->tier + 1;
+  return LLRB_TIER_BASELINE;
+}
+
+// Used by profiler.c to recompile iseq whose speculation has failed.
+bool
+llrb_deopted_p(const rb_iseq_t *iseq)
+{
+  const struct llrb_compiled_iseq *compiled = llrb_find_compiled_iseq(iseq);
+  return compiled && compiled->deopt.deopted;
+}
+
 // LLRB::JIT.preview_iseq
 // @param  [Array]   iseqw - RubyVM::InstructionSequence instance
 // @return [Boolean] return true if compiled
@@ -78,48 +744,757 @@ rb_jit_preview_iseq(RB_UNUSED_VAR(VALUE self), VALUE iseqw)
   const rb_iseq_t *iseq = rb_iseqw_to_iseq(iseqw);
   if (llrb_should_not_compile(iseq)) return Qfalse;
 
-  LLVMModuleRef mod = llrb_compile_iseq(iseq->body, iseq->body->iseq_encoded, llrb_funcname, false);
+  extern void llrb_worker_flush(void);
+  llrb_worker_flush(); // Dumped IR must not be mixed with worker's output.
+
+  char funcname[LLRB_FUNCNAME_SIZE];
+  llrb_generate_funcname(funcname);
+
+  struct llrb_iseq_snapshot snapshot;
+  llrb_capture_iseq(iseq, &snapshot);
+  LLVMModuleRef mod = llrb_compile_iseq(LLRB_CONTEXT_RUBY, 0, &snapshot, iseq->body->iseq_encoded, 0, 0, 0, 0,
+      funcname);
+  RB_GC_GUARD(snapshot.pins);
+  llrb_optimize_function(mod, LLVMGetNamedFunction(mod, funcname), LLRB_TIER_OPTIMIZED, false, false, NULL);
   LLVMDumpModule(mod);
   LLVMDisposeModule(mod);
   return Qtrue;
 }
 
-// Used by profiler.c too
-VALUE
-llrb_compile_iseq_to_method(const rb_iseq_t *iseq, bool enable_stats)
+static bool
+llrb_install_native_func_in(const rb_iseq_t *iseq, VALUE *new_iseq_encoded, uint64_t func, enum llrb_tier tier)
 {
-  if (llrb_should_not_compile(iseq)) return Qfalse;
-
-  // Creating new_iseq_encoded before compilation to calculate program counter.
-  VALUE *new_iseq_encoded = ALLOC_N(VALUE, iseq->body->iseq_size); // Never freed.
-  LLVMModuleRef mod = llrb_compile_iseq(iseq->body, new_iseq_encoded, llrb_funcname, enable_stats);
-
-  uint64_t func = llrb_create_native_func(mod, llrb_funcname);
-  //LLVMDisposeModule(mod); // This causes SEGV: "corrupted double-linked list".
   if (!func) {
     fprintf(stderr, "Failed to create native function...\n");
-    return Qfalse;
+    return false;
   }
 
-  llrb_replace_iseq_with_cfunc(iseq, new_iseq_encoded, (rb_insn_func_t)func);
-  return Qtrue;
+  if (llrb_dumping_iseq) return false;
+  // While worker is compiling, the iseq may be compiled by LLRB::JIT.compile, or freed by GC.
+  struct llrb_compiled_iseq *compiled = llrb_find_compiled_iseq(iseq);
+  if (!compiled || compiled->tier > tier || compiled->new_iseq_encoded != new_iseq_encoded) return false;
+  if (!llrb_iseq_alive_p(iseq)) return false;
+  if (!llrb_assumption_valid_p(&compiled->assumption)) return false; // VM state has changed while worker compiled it.
+
+  if (compiled->tier == LLRB_TIER_NONE) {
+    if (llrb_check_already_compiled(iseq)) return false;
+    llrb_replace_iseq_with_cfunc(iseq, compiled, (rb_insn_func_t)func);
+  } else {
+    // Recompilation. Threads running old native function keep running it, and next calls run new one.
+    new_iseq_encoded[1] = (VALUE)func;
+  }
+  llrb_patch_osr_entries(iseq, compiled, (rb_insn_func_t)func);
+  compiled->tier = tier;
+  return true;
 }
 
+// Installs a function of `module`, which is referred by the ISeq after this. Caller frees `module` if no function
+// of it is installed.
+static bool
+llrb_install_module_func(const rb_iseq_t *iseq, VALUE *new_iseq_encoded, uint64_t func,
+    struct llrb_native_module *module)
+{
+  if (!llrb_install_native_func_in(iseq, new_iseq_encoded, func, module->tier)) return false;
+
+  struct llrb_compiled_iseq *compiled = llrb_find_compiled_iseq(iseq);
+  struct llrb_native_code *code = ALLOC(struct llrb_native_code); // Freed by `llrb_free_iseq`.
+  *code = (struct llrb_native_code){ .module = module, .next = compiled->codes };
+  compiled->codes = code;
+  module->refs++;
+
+  extern void llrb_stats_increment(enum llrb_stats_counter counter);
+  llrb_stats_increment(LLRB_STATS_COMPILED);
+  return true;
+}
+
+static struct llrb_native_module *
+llrb_create_native_module(LLVMOrcModuleHandle handle, enum llrb_tier tier, size_t code_size)
+{
+  struct llrb_native_module *module = ALLOC(struct llrb_native_module); // Freed by `llrb_free_native_module`.
+  *module = (struct llrb_native_module){ .handle = handle, .tier = tier, .refs = 0, .code_size = code_size };
+  llrb_code_cache.size += code_size;
+  return module;
+}
+
+// Removes `module` if no function of it has been installed.
+static void
+llrb_release_unused_module(struct llrb_native_module *module)
+{
+  if (module->refs == 0) llrb_free_native_module(module);
+}
+
+// Returns true if some frame may be running native code of `iseq`. A fiber suspended in it has a VM stack which is
+// not reachable from threads, so nothing is assumed to be free once any thread has switched fibers.
+static bool
+llrb_iseq_running_p(const rb_iseq_t *iseq)
+{
+  rb_thread_t *th = 0;
+  list_for_each(&GET_VM()->living_threads, th, vmlt_node) {
+    if (th->root_fiber) return true;
+    const rb_control_frame_t *end_cfp = RUBY_VM_END_CONTROL_FRAME(th);
+    for (const rb_control_frame_t *cfp = th->cfp; RUBY_VM_VALID_CONTROL_FRAME_P(cfp, end_cfp);
+        cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp)) {
+      if (cfp->iseq == iseq) return true;
+    }
+  }
+  return false;
+}
+
+// Reverts iseq to YARV like `llrb_invalidate_compiled_iseq`, but its native code is freed too. Caller checks that
+// no frame runs it. It isn't marked as deoptimized, and profiler compiles it again only if it gets hot again.
+static void
+llrb_evict_compiled_iseq(const rb_iseq_t *iseq, struct llrb_compiled_iseq *compiled)
+{
+  extern void llrb_profiler_reset_sample(const rb_iseq_t *iseq);
+  extern void llrb_stats_increment(enum llrb_stats_counter counter);
+
+  llrb_restore_original_insns(iseq, compiled);
+  compiled->tier = LLRB_TIER_NONE;
+  llrb_free_native_codes(compiled);
+  llrb_profiler_reset_sample(iseq);
+  llrb_stats_increment(LLRB_STATS_EVICTED);
+  LLRB_PROBE_DEOPT(iseq->body, "evicted");
+}
+
+struct llrb_eviction_candidate {
+  const rb_iseq_t *iseq;
+  struct llrb_compiled_iseq *compiled;
+  size_t last_sampled;
+};
+
+struct llrb_eviction_candidates {
+  struct llrb_eviction_candidate *body;
+  size_t size;
+};
+
+static int
+llrb_eviction_candidate_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+  extern size_t llrb_profiler_last_sampled(const rb_iseq_t *iseq);
+  const rb_iseq_t *iseq = (const rb_iseq_t *)key;
+  struct llrb_compiled_iseq *compiled = (struct llrb_compiled_iseq *)val;
+  struct llrb_eviction_candidates *candidates = (struct llrb_eviction_candidates *)arg;
+  if (compiled->tier != LLRB_TIER_NONE && compiled->codes && llrb_iseq_alive_p(iseq)) {
+    candidates->body[candidates->size++] = (struct llrb_eviction_candidate){
+      .iseq = iseq, .compiled = compiled, .last_sampled = llrb_profiler_last_sampled(iseq),
+    };
+  }
+  return ST_CONTINUE;
+}
+
+static int
+llrb_eviction_candidate_cmp(const void *a, const void *b)
+{
+  size_t x = ((const struct llrb_eviction_candidate *)a)->last_sampled;
+  size_t y = ((const struct llrb_eviction_candidate *)b)->last_sampled;
+  return (x > y) - (x < y);
+}
+
+// Evicts least recently sampled ISeqs until installed code and `incoming` bytes fit in the limit, and returns false
+// if they still don't. This must be called with GVL. ISeqs whose frames exist are skipped, because their code is
+// freed. Once a thread has switched fibers nothing is evicted, and the limit is enforced only by the refusal.
+static bool
+llrb_reserve_code_size(size_t incoming)
+{
+  if (llrb_code_cache.limit == 0) return true;
+  if (incoming > llrb_code_cache.limit) return false;
+  if (llrb_code_cache.size + incoming <= llrb_code_cache.limit) return true;
+  if (llrb_dumping_iseq) return false;
+
+  VALUE buf; // `ALLOCV_END`ed in this function.
+  struct llrb_eviction_candidates candidates = { .size = 0 };
+  candidates.body = ALLOCV_N(struct llrb_eviction_candidate, buf, llrb_compiled_iseqs->num_entries);
+  st_foreach(llrb_compiled_iseqs, llrb_eviction_candidate_i, (st_data_t)&candidates);
+  qsort(candidates.body, candidates.size, sizeof(struct llrb_eviction_candidate), llrb_eviction_candidate_cmp);
+
+  for (size_t i = 0; i < candidates.size && llrb_code_cache.size + incoming > llrb_code_cache.limit; i++) {
+    if (llrb_iseq_running_p(candidates.body[i].iseq)) continue;
+    llrb_evict_compiled_iseq(candidates.body[i].iseq, candidates.body[i].compiled);
+  }
+  ALLOCV_END(buf);
+  return llrb_code_cache.size + incoming <= llrb_code_cache.limit;
+}
+
+// Used by worker.c too. This must be called with GVL. Native function which is not installed is removed here.
+// A module which doesn't fit in the code size limit after eviction is not installed.
+bool
+llrb_install_native_func(const rb_iseq_t *iseq, VALUE *new_iseq_encoded, uint64_t func, LLVMOrcModuleHandle handle,
+    enum llrb_tier tier, size_t code_size)
+{
+  if (!llrb_reserve_code_size(code_size)) {
+    llrb_remove_native_func(handle, tier);
+    return false;
+  }
+  struct llrb_native_module *module = llrb_create_native_module(handle, tier, code_size);
+  bool installed = llrb_install_module_func(iseq, new_iseq_encoded, func, module);
+  llrb_release_unused_module(module);
+  return installed;
+}
+
+static size_t
+llrb_function_insns(LLVMValueRef func)
+{
+  size_t insns = 0;
+  for (LLVMBasicBlockRef block = LLVMGetFirstBasicBlock(func); block; block = LLVMGetNextBasicBlock(block)) {
+    for (LLVMValueRef insn = LLVMGetFirstInstruction(block); insn; insn = LLVMGetNextInstruction(insn)) {
+      insns++;
+    }
+  }
+  return insns;
+}
+
+// With `time_passes`, LLVM's timing report of each pass is printed to stderr, and sizes are recorded to the profile.
+static VALUE
+llrb_compile_iseq_to_method(const rb_iseq_t *iseq, enum llrb_tier tier, bool enable_stats, bool time_passes)
+{
+  extern void llrb_worker_flush(void);
+  llrb_worker_flush(); // A job in flight may be for the same ISeq. It's installed before this compilation.
+  llrb_invalidate_stale_iseqs();
+
+  if (!llrb_compilable_in(iseq, tier)) return Qfalse;
+
+  char funcname[LLRB_FUNCNAME_SIZE];
+  llrb_generate_funcname(funcname);
+
+  extern double llrb_stats_now(void);
+  extern void llrb_stats_add_time(enum llrb_stats_phase phase, double sec);
+  extern void llrb_stats_set_size(enum llrb_stats_size size, size_t value);
+  struct llrb_iseq_snapshot snapshot;
+  struct llrb_compiled_iseq *compiled = llrb_prepare_snapshot(iseq, &snapshot);
+  LLRB_PROBE_COMPILE_START(iseq->body, tier);
+  double ir_started_at = llrb_stats_now();
+  LLVMModuleRef mod = llrb_compile_iseq(LLRB_CONTEXT_RUBY, 0, &snapshot, compiled->new_iseq_encoded, &compiled->deopt,
+      &compiled->assumption, compiled->orig_iseq_encoded, &compiled->osr, funcname);
+  RB_GC_GUARD(snapshot.pins);
+  llrb_perf_map_label(mod, funcname, iseq);
+  if (time_passes) llrb_stats_set_size(LLRB_STATS_IR_INSNS, llrb_function_insns(LLVMGetNamedFunction(mod, funcname)));
+
+  double started_at = llrb_stats_now();
+  struct llrb_opt_time passes_time;
+  llrb_optimize_function(mod, LLVMGetNamedFunction(mod, funcname), tier, enable_stats, time_passes, &passes_time);
+  double optimized_at = llrb_stats_now();
+  if (time_passes) llrb_stats_set_size(LLRB_STATS_OPT_INSNS, llrb_function_insns(LLVMGetNamedFunction(mod, funcname)));
+  llrb_stats_add_time(LLRB_STATS_OPT, optimized_at - started_at);
+  llrb_stats_add_time(LLRB_STATS_FUNC_PASSES, passes_time.func_passes);
+  llrb_stats_add_time(LLRB_STATS_MODULE_PASSES, passes_time.module_passes);
+
+  // Profiled module is measured like perf map and code size limit, after its codegen time.
+  double codegen_started_at = llrb_stats_now();
+  LLVMOrcModuleHandle handle;
+  LLVMModuleRef clone;
+  uint64_t func = llrb_create_native_func(mod, funcname, tier, time_passes, &handle, &clone);
+  double codegen_time = llrb_stats_now() - codegen_started_at;
+  llrb_stats_add_time(LLRB_STATS_CODEGEN, codegen_time);
+  size_t code_size = llrb_measure_native_code(clone, tier);
+  if (time_passes) llrb_stats_set_size(LLRB_STATS_CODE_SIZE, code_size);
+  bool installed = llrb_install_native_func(iseq, compiled->new_iseq_encoded, func, handle, tier, code_size);
+  LLRB_PROBE_COMPILE_DONE(iseq->body, tier, started_at - ir_started_at, optimized_at - started_at, codegen_time,
+      installed);
+  return installed ? Qtrue : Qfalse;
+}
+
+static VALUE llrb_compile_iseq_with_blocks(const rb_iseq_t *iseq, enum llrb_tier tier);
+
+struct llrb_block_compilation {
+  const rb_iseq_t *blockiseq;
+  enum llrb_tier tier;
+};
+
+static VALUE
+llrb_compile_block_i(VALUE arg)
+{
+  const struct llrb_block_compilation *block = (const struct llrb_block_compilation *)arg;
+  return llrb_compile_iseq_with_blocks(block->blockiseq, block->tier);
+}
+
+// Compiles iseq and blocks passed by its send insns in the same tier. Loops like `Integer#times` and `Array#each`
+// spend most of the time in their blocks, and the profiler would find them only after the method is compiled.
+// Blocks which can't be compiled, or are already compiled in the tier, are just skipped.
+static VALUE
+llrb_compile_iseq_with_blocks(const rb_iseq_t *iseq, enum llrb_tier tier)
+{
+  VALUE result = llrb_compile_iseq_to_method(iseq, tier, false, false);
+  if (result != Qtrue) return result;
+
+  const VALUE *iseq_encoded = llrb_original_iseq_encoded(iseq);
+  for (unsigned int i = 0; i < iseq->body->iseq_size;) {
+    int insn = rb_vm_insn_addr2insn((void *)iseq_encoded[i]);
+    if ((insn == YARVINSN_send || insn == YARVINSN_invokesuper) && iseq_encoded[i+3]) {
+      struct llrb_block_compilation block = { .blockiseq = (const rb_iseq_t *)iseq_encoded[i+3], .tier = tier };
+      int state = 0;
+      rb_protect(llrb_compile_block_i, (VALUE)&block, &state);
+      if (state) rb_set_errinfo(Qnil);
+    }
+    i += insn_len(insn);
+  }
+  return result;
+}
+
+// Used by profiler.c. Iseq is compiled in baseline tier first, and recompiled in higher tier
+// if it's selected by profiler again.
 VALUE
-llrb_compile_iseq_to_method_without_stats(const rb_iseq_t *iseq)
+llrb_compile_iseq_by_profiler(const rb_iseq_t *iseq)
 {
-  return llrb_compile_iseq_to_method(iseq, false);
+  return llrb_compile_iseq_with_blocks(iseq, llrb_next_tier(iseq));
 }
 
+// Used by profiler.c for LLRB::JIT.compile_hot_methods. Compiles iseq in the highest tier directly, because no more
+// samples will be taken to tier it up in the process.
+VALUE
+llrb_compile_hot_iseq(const rb_iseq_t *iseq)
+{
+  return llrb_compile_iseq_with_blocks(iseq, LLRB_TIER_MAX);
+}
+
+// Used by profiler.c. Builds LLVM IR here, and leaves optimization and code generation to worker.c.
+// The result is installed by `llrb_worker_install` later.
+// @return [Boolean] return true if enqueued
+VALUE
+llrb_enqueue_iseq_by_profiler(const rb_iseq_t *iseq)
+{
+  extern int llrb_worker_reserve(void);
+  extern bool llrb_worker_has_job(const rb_iseq_t *iseq);
+  extern void llrb_worker_enqueue(int worker, const rb_iseq_t *iseq, VALUE *new_iseq_encoded, LLVMModuleRef mod,
+      const char *funcname, enum llrb_tier tier, double ir_time);
+  extern double llrb_stats_now(void);
+
+  // Compiler writes deopt, assumption and osr of the compiled ISeq, which a job not installed yet depends on.
+  if (llrb_worker_has_job(iseq)) return Qfalse;
+  enum llrb_tier tier = llrb_next_tier(iseq);
+  int worker = llrb_worker_reserve();
+  if (worker < 0) return Qfalse;
+  if (!llrb_compilable_in(iseq, tier)) return Qfalse;
+
+  char funcname[LLRB_FUNCNAME_SIZE]; // Copied by `llrb_worker_enqueue`.
+  llrb_generate_funcname(funcname);
+
+  struct llrb_iseq_snapshot snapshot;
+  struct llrb_compiled_iseq *compiled = llrb_prepare_snapshot(iseq, &snapshot);
+  LLRB_PROBE_COMPILE_START(iseq->body, tier);
+  double started_at = llrb_stats_now();
+  LLVMModuleRef mod = llrb_compile_iseq(LLRB_CONTEXT_WORKER(worker), 0, &snapshot, compiled->new_iseq_encoded,
+      &compiled->deopt, &compiled->assumption, compiled->orig_iseq_encoded, &compiled->osr, funcname);
+  RB_GC_GUARD(snapshot.pins);
+  llrb_perf_map_label(mod, funcname, iseq);
+  llrb_worker_enqueue(worker, iseq, compiled->new_iseq_encoded, mod, funcname, tier, llrb_stats_now() - started_at);
+
+  // Like `llrb_compile_iseq_with_blocks`, but the blocks are enqueued by next jobs since this worker is busy.
+  extern void llrb_profiler_queue_block(const rb_iseq_t *blockiseq, enum llrb_tier tier);
+  const VALUE *iseq_encoded = llrb_original_iseq_encoded(iseq);
+  for (unsigned int i = 0; i < iseq->body->iseq_size;) {
+    int insn = rb_vm_insn_addr2insn((void *)iseq_encoded[i]);
+    if ((insn == YARVINSN_send || insn == YARVINSN_invokesuper) && iseq_encoded[i+3]) {
+      llrb_profiler_queue_block((const rb_iseq_t *)iseq_encoded[i+3], tier);
+    }
+    i += insn_len(insn);
+  }
+  return Qtrue;
+}
+
+struct llrb_profiled_compile_args {
+  const rb_iseq_t *iseq;
+  bool enable_stats;
+};
+
+static VALUE
+llrb_profiled_compile_i(VALUE arg)
+{
+  const struct llrb_profiled_compile_args *args = (const struct llrb_profiled_compile_args *)arg;
+  return llrb_compile_iseq_to_method(args->iseq, LLRB_TIER_OPTIMIZED, args->enable_stats, true);
+}
+
+static VALUE
+llrb_finish_profile_i(VALUE arg)
+{
+  extern VALUE llrb_stats_finish_profile(void);
+  *(VALUE *)arg = llrb_stats_finish_profile();
+  return Qnil;
+}
+
+static void llrb_create_measuring_target_machines(void);
+
 // LLRB::JIT.compile_iseq
 // @param  [Array]   iseqw - RubyVM::InstructionSequence instance
 // @param  [Boolean] enable_stats - Enable LLVM Pass statistics
-// @return [Boolean] return true if compiled
+// @param  [Boolean] profile - Measure phases of this compilation, and print LLVM's timing report of each pass
+// @return [Boolean,Hash] return true if compiled. With `profile`, seconds of each phase and sizes are returned instead.
 static VALUE
-rb_jit_compile_iseq(RB_UNUSED_VAR(VALUE self), VALUE iseqw, VALUE enable_stats)
+rb_jit_compile_iseq(RB_UNUSED_VAR(VALUE self), VALUE iseqw, VALUE enable_stats, VALUE profile)
 {
   const rb_iseq_t *iseq = rb_iseqw_to_iseq(iseqw);
-  return llrb_compile_iseq_to_method(iseq, RTEST(enable_stats));
+  if (!RTEST(profile)) return llrb_compile_iseq_to_method(iseq, LLRB_TIER_OPTIMIZED, RTEST(enable_stats), false);
+
+  extern void llrb_worker_flush(void);
+  extern void llrb_stats_start_profile(void);
+  llrb_worker_flush(); // Worker's job installed here must not be counted in the profile.
+  llrb_stats_start_profile();
+  llrb_create_measuring_target_machines();
+
+  VALUE phases = Qnil;
+  struct llrb_profiled_compile_args args = { .iseq = iseq, .enable_stats = RTEST(enable_stats) };
+  VALUE compiled = rb_ensure(llrb_profiled_compile_i, (VALUE)&args, llrb_finish_profile_i, (VALUE)&phases);
+  return RTEST(compiled) ? phases : Qfalse;
+}
+
+// A function of LLRB::JIT.compile_iseqs' module.
+struct llrb_batch_func {
+  const rb_iseq_t *iseq;
+  struct llrb_compiled_iseq *compiled;
+  LLVMModuleRef mod;
+  char funcname[LLRB_FUNCNAME_SIZE];
+  double ir_time; // Seconds to build this function's LLVM IR. Reported by USDT probe.
+};
+
+// Snapshot is taken here, so that its pins are on this stack while compiling.
+static VALUE
+llrb_compile_batch_func_i(VALUE arg)
+{
+  extern double llrb_stats_now(void);
+  struct llrb_batch_func *func = (struct llrb_batch_func *)arg;
+  struct llrb_iseq_snapshot snapshot;
+  struct llrb_compiled_iseq *compiled = func->compiled = llrb_prepare_snapshot(func->iseq, &snapshot);
+  LLRB_PROBE_COMPILE_START(func->iseq->body, LLRB_TIER_OPTIMIZED);
+  double started_at = llrb_stats_now();
+  llrb_compile_iseq(LLRB_CONTEXT_RUBY, func->mod, &snapshot, compiled->new_iseq_encoded, &compiled->deopt,
+      &compiled->assumption, compiled->orig_iseq_encoded, &compiled->osr, func->funcname);
+  func->ir_time = llrb_stats_now() - started_at;
+  RB_GC_GUARD(snapshot.pins);
+  llrb_perf_map_label(func->mod, func->funcname, func->iseq);
+  return Qnil;
+}
+
+static bool
+llrb_batch_includes_p(const struct llrb_batch_func *funcs, unsigned int size, const rb_iseq_t *iseq)
+{
+  for (unsigned int i = 0; i < size; i++) {
+    if (funcs[i].iseq == iseq) return true;
+  }
+  return false;
+}
+
+// LLRB::JIT.compile_iseqs
+// All ISeqs are compiled into one LLVM module in optimized tier. So runtime functions are linked only once for them,
+// and module passes and code generation run once. ISeqs which can't be compiled are just skipped.
+// @param  [Array]   iseqws - RubyVM::InstructionSequence instances
+// @return [Integer] the number of installed native functions
+static VALUE
+rb_jit_compile_iseqs(RB_UNUSED_VAR(VALUE self), VALUE iseqws)
+{
+  extern void llrb_worker_flush(void);
+  extern double llrb_stats_now(void);
+  extern void llrb_stats_add_time(enum llrb_stats_phase phase, double sec);
+
+  Check_Type(iseqws, T_ARRAY);
+  long len = RARRAY_LEN(iseqws);
+  VALUE funcs_buf, funcnames_buf; // `ALLOCV_END`ed in this function.
+  struct llrb_batch_func *funcs = ALLOCV_N(struct llrb_batch_func, funcs_buf, len);
+  const char **funcnames = ALLOCV_N(const char *, funcnames_buf, len);
+  for (long i = 0; i < len; i++) {
+    funcs[i].iseq = rb_iseqw_to_iseq(RARRAY_AREF(iseqws, i)); // Raising TypeError before creating a module.
+  }
+
+  llrb_worker_flush(); // A job in flight may be for the same ISeq. It's installed before this compilation.
+  llrb_invalidate_stale_iseqs();
+
+  LLVMModuleRef mod = LLVMModuleCreateWithName("llrb"); // In global context, which is LLRB_CONTEXT_RUBY.
+  unsigned int size = 0;
+  for (long i = 0; i < len; i++) {
+    const rb_iseq_t *iseq = funcs[i].iseq;
+    if (llrb_batch_includes_p(funcs, size, iseq) || !llrb_compilable_in(iseq, LLRB_TIER_OPTIMIZED)) continue;
+
+    struct llrb_batch_func *func = funcs + size;
+    func->iseq = iseq;
+    func->mod = mod;
+    llrb_generate_funcname(func->funcname);
+
+    int state = 0;
+    rb_protect(llrb_compile_batch_func_i, (VALUE)func, &state);
+    if (state) {
+      rb_set_errinfo(Qnil);
+      continue;
+    }
+    funcnames[size++] = func->funcname;
+  }
+
+  unsigned int installed = 0;
+  if (size > 0) {
+    llrb_internalize_module(mod, funcnames, size);
+    double started_at = llrb_stats_now();
+    struct llrb_opt_time passes_time;
+    llrb_optimize_function(mod, LLVMGetNamedFunction(mod, funcnames[0]), LLRB_TIER_OPTIMIZED, false, false, &passes_time);
+    double optimized_at = llrb_stats_now();
+    llrb_stats_add_time(LLRB_STATS_OPT, optimized_at - started_at);
+    llrb_stats_add_time(LLRB_STATS_FUNC_PASSES, passes_time.func_passes);
+    llrb_stats_add_time(LLRB_STATS_MODULE_PASSES, passes_time.module_passes);
+
+    LLVMOrcModuleHandle handle;
+    LLVMModuleRef clone;
+    llrb_create_native_func(mod, funcnames[0], LLRB_TIER_OPTIMIZED, false, &handle, &clone);
+    double codegen_time = llrb_stats_now() - optimized_at;
+    llrb_stats_add_time(LLRB_STATS_CODEGEN, codegen_time);
+    size_t code_size = llrb_measure_native_code(clone, LLRB_TIER_OPTIMIZED);
+
+    // Passes and code generation are shared, so each function's probe reports the whole module's time.
+    bool fits = llrb_reserve_code_size(code_size);
+    struct llrb_native_module *module = llrb_create_native_module(handle, LLRB_TIER_OPTIMIZED, fits ? code_size : 0);
+    for (unsigned int i = 0; i < size; i++) {
+      uint64_t func = fits ? llrb_native_func_address(funcs[i].funcname, LLRB_TIER_OPTIMIZED) : 0;
+      bool func_installed = fits && llrb_install_module_func(funcs[i].iseq, funcs[i].compiled->new_iseq_encoded, func,
+          module);
+      if (func_installed) installed++;
+      LLRB_PROBE_COMPILE_DONE(funcs[i].iseq->body, LLRB_TIER_OPTIMIZED, funcs[i].ir_time, optimized_at - started_at,
+          codegen_time, func_installed);
+    }
+    llrb_release_unused_module(module);
+  } else {
+    LLVMDisposeModule(mod);
+  }
+
+  ALLOCV_END(funcs_buf);
+  ALLOCV_END(funcnames_buf);
+  return UINT2NUM(installed);
+}
+
+static int
+llrb_compiled_profile_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+  const rb_iseq_t *iseq = (const rb_iseq_t *)key;
+  const struct llrb_compiled_iseq *compiled = (const struct llrb_compiled_iseq *)val;
+  if (compiled->tier != LLRB_TIER_NONE && llrb_iseq_alive_p(iseq)) {
+    rb_hash_aset((VALUE)arg, llrb_iseq_profile_key(iseq), INT2FIX(compiled->tier));
+  }
+  return ST_CONTINUE;
+}
+
+// LLRB::JIT.compiled_profile
+// @return [Hash] { String => Integer }. Tiers of compiled ISeqs keyed by `llrb_iseq_profile_key`.
+static VALUE
+rb_jit_compiled_profile(RB_UNUSED_VAR(VALUE self))
+{
+  VALUE profile = rb_hash_new();
+  st_foreach(llrb_compiled_iseqs, llrb_compiled_profile_i, (st_data_t)profile);
+  return profile;
+}
+
+static int
+llrb_guard_failures_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+  const rb_iseq_t *iseq = (const rb_iseq_t *)key;
+  const struct llrb_compiled_iseq *compiled = (const struct llrb_compiled_iseq *)val;
+  if (!llrb_iseq_alive_p(iseq)) return ST_CONTINUE;
+
+  VALUE positions = rb_ary_new();
+  for (unsigned int pos = 0; pos < iseq->body->iseq_size; pos++) {
+    if (compiled->deopt.failed[pos]) rb_ary_push(positions, UINT2NUM(pos));
+  }
+  if (RARRAY_LEN(positions) > 0) rb_hash_aset((VALUE)arg, llrb_iseq_profile_key(iseq), positions);
+  return ST_CONTINUE;
+}
+
+// LLRB::JIT.guard_failures
+// @return [Hash] { String => [Integer] }. Positions of failed guards of compiled ISeqs keyed by `llrb_iseq_profile_key`.
+static VALUE
+rb_jit_guard_failures(RB_UNUSED_VAR(VALUE self))
+{
+  VALUE failures = rb_hash_new();
+  st_foreach(llrb_compiled_iseqs, llrb_guard_failures_i, (st_data_t)failures);
+  return failures;
+}
+
+// LLRB::JIT.preload_guard_failures
+// @param [Hash] failures - { String => [Integer] } returned by LLRB::JIT.guard_failures in a previous process.
+static VALUE
+rb_jit_preload_guard_failures(RB_UNUSED_VAR(VALUE self), VALUE failures)
+{
+  llrb_preloaded_failures = rb_hash_dup(rb_convert_type(failures, T_HASH, "Hash", "to_hash"));
+  return Qnil;
+}
+
+// LLRB::JIT.profile_key
+// @param  [RubyVM::InstructionSequence] iseqw
+// @return [String] key of the ISeq in LLRB::JIT.compiled_profile and LLRB::JIT.guard_failures
+static VALUE
+rb_jit_profile_key(RB_UNUSED_VAR(VALUE self), VALUE iseqw)
+{
+  return llrb_iseq_profile_key(rb_iseqw_to_iseq(iseqw));
+}
+
+// True while `rb_jit_iseq_binary` has swapped iseq_encoded of live ISeqs. Nothing is installed or evicted then, and
+// profiler doesn't take samples, so that the swapped pointers stay the ones to restore.
+static bool llrb_dumping_iseq = false;
+
+// Used by profiler.c to skip a sample in the dump's window.
+bool
+llrb_dumping_iseq_p(void)
+{
+  return llrb_dumping_iseq;
+}
+
+// ISeqs whose iseq_encoded is swapped by `rb_jit_iseq_binary`.
+struct llrb_binary_dump {
+  VALUE iseqw;
+  const rb_iseq_t **iseqs;
+  VALUE **iseq_encodeds; // iseq_encoded of `iseqs` before the swap.
+  unsigned int size;
+  unsigned int capa;
+};
+
+// Makes `iseq` and its blocks have insns before replacement and OSR patches. Otherwise ISeq#to_binary would dump
+// opt_call_c_function with an address of this process. Original insns cached by CRuby are dropped too.
+static void
+llrb_unpatch_for_dump(struct llrb_binary_dump *dump, const rb_iseq_t *iseq)
+{
+  const VALUE *iseq_encoded = llrb_original_iseq_encoded(iseq);
+  if (iseq_encoded != iseq->body->iseq_encoded) {
+    if (dump->size == dump->capa) {
+      dump->capa = dump->capa ? dump->capa * 2 : 4;
+      REALLOC_N(dump->iseqs, const rb_iseq_t *, dump->capa);
+      REALLOC_N(dump->iseq_encodeds, VALUE *, dump->capa);
+    }
+    dump->iseqs[dump->size] = iseq;
+    dump->iseq_encodeds[dump->size] = iseq->body->iseq_encoded;
+    dump->size++;
+    iseq->body->iseq_encoded = (VALUE *)iseq_encoded;
+    ISEQ_ORIGINAL_ISEQ_CLEAR(iseq);
+  }
+
+  for (unsigned int i = 0; i < iseq->body->iseq_size;) {
+    int insn = rb_vm_insn_addr2insn((void *)iseq_encoded[i]);
+    if ((insn == YARVINSN_send || insn == YARVINSN_invokesuper) && iseq_encoded[i+3]) {
+      llrb_unpatch_for_dump(dump, (const rb_iseq_t *)iseq_encoded[i+3]);
+    }
+    i += insn_len(insn);
+  }
+}
+
+// Calls the dumper of ISeq#to_binary directly. Unlike a method call, it never checks interrupts, so no other Ruby
+// thread and no postponed job runs with the swapped insns.
+static VALUE
+llrb_binary_dump_i(VALUE arg)
+{
+  extern VALUE iseq_ibf_dump(const rb_iseq_t *iseq, VALUE opt);
+  struct llrb_binary_dump *dump = (struct llrb_binary_dump *)arg;
+  const rb_iseq_t *iseq = rb_iseqw_to_iseq(dump->iseqw);
+  llrb_dumping_iseq = true;
+  llrb_unpatch_for_dump(dump, iseq);
+  return iseq_ibf_dump(iseq, Qnil);
+}
+
+static VALUE
+llrb_binary_restore_i(VALUE arg)
+{
+  struct llrb_binary_dump *dump = (struct llrb_binary_dump *)arg;
+  for (unsigned int i = dump->size; i > 0; i--) {
+    dump->iseqs[i-1]->body->iseq_encoded = dump->iseq_encodeds[i-1];
+    ISEQ_ORIGINAL_ISEQ_CLEAR(dump->iseqs[i-1]);
+  }
+  llrb_dumping_iseq = false;
+  xfree(dump->iseqs);
+  xfree(dump->iseq_encodeds);
+  return Qnil;
+}
+
+// LLRB::JIT.iseq_binary
+// Same as RubyVM::InstructionSequence#to_binary, but insns of compiled ISeqs are dumped as they were before
+// compilation. Insns are swapped back before any other Ruby thread or profiler's job can run, see `llrb_dumping_iseq`.
+// @param  [RubyVM::InstructionSequence] iseqw
+// @return [String]
+static VALUE
+rb_jit_iseq_binary(RB_UNUSED_VAR(VALUE self), VALUE iseqw)
+{
+  struct llrb_binary_dump dump = { .iseqw = iseqw, .iseqs = 0, .iseq_encodeds = 0, .size = 0, .capa = 0 };
+  return rb_ensure(llrb_binary_dump_i, (VALUE)&dump, llrb_binary_restore_i, (VALUE)&dump);
+}
+
+// LLRB::JIT.pass_pipeline=
+// @param [Symbol] pipeline - :o3 or :lean. Used by compilation in optimized tier after this.
+static VALUE
+rb_jit_set_pass_pipeline(RB_UNUSED_VAR(VALUE self), VALUE pipeline)
+{
+  extern void llrb_set_pass_pipeline(enum llrb_pass_pipeline pipeline);
+  extern void llrb_worker_flush(void);
+
+  enum llrb_pass_pipeline value;
+  if (pipeline == ID2SYM(rb_intern("o3"))) {
+    value = LLRB_PIPELINE_O3;
+  } else if (pipeline == ID2SYM(rb_intern("lean"))) {
+    value = LLRB_PIPELINE_LEAN;
+  } else {
+    rb_raise(rb_eArgError, "pass pipeline must be :o3 or :lean but got %"PRIsVALUE, rb_inspect(pipeline));
+  }
+  llrb_worker_flush(); // Worker reads the pipeline without GVL.
+  llrb_set_pass_pipeline(value);
+  return pipeline;
+}
+
+// LLRB::JIT.pass_pipeline
+// @return [Symbol] :o3 or :lean
+static VALUE
+rb_jit_pass_pipeline(RB_UNUSED_VAR(VALUE self))
+{
+  extern enum llrb_pass_pipeline llrb_get_pass_pipeline(void);
+  return ID2SYM(rb_intern(llrb_get_pass_pipeline() == LLRB_PIPELINE_LEAN ? "lean" : "o3"));
+}
+
+// Target machines to measure functions are shared by perf map, code size limit and profiled compilation.
+static void
+llrb_create_measuring_target_machines(void)
+{
+  if (llrb_perf_map.tms[LLRB_TIER_BASELINE]) return;
+  llrb_perf_map.tms[LLRB_TIER_BASELINE] = llrb_create_target_machine(LLVMCodeGenLevelLess);
+  llrb_perf_map.tms[LLRB_TIER_OPTIMIZED] = llrb_create_target_machine(LLVMCodeGenLevelAggressive);
+}
+
+// LLRB::JIT.perf_map=
+// @param [Boolean] enabled - Write functions compiled after this to /tmp/perf-<pid>.map
+static VALUE
+rb_jit_set_perf_map(RB_UNUSED_VAR(VALUE self), VALUE enabled)
+{
+  extern void llrb_worker_flush(void);
+  llrb_worker_flush(); // Worker reads the flag without GVL.
+
+  if (RTEST(enabled)) llrb_create_measuring_target_machines();
+  llrb_perf_map.enabled = RTEST(enabled);
+  return enabled;
+}
+
+// LLRB::JIT.perf_map
+// @return [Boolean] true if perf map is written
+static VALUE
+rb_jit_perf_map(RB_UNUSED_VAR(VALUE self))
+{
+  return llrb_perf_map.enabled ? Qtrue : Qfalse;
+}
+
+// LLRB::JIT.code_size_limit=
+// @param [Integer,nil] limit - Bytes of native code modules compiled after this can take. nil for unlimited.
+static VALUE
+rb_jit_set_code_size_limit(RB_UNUSED_VAR(VALUE self), VALUE limit)
+{
+  extern void llrb_worker_flush(void);
+  size_t value = NIL_P(limit) ? 0 : NUM2SIZET(limit);
+  if (!NIL_P(limit) && value == 0) rb_raise(rb_eArgError, "code size limit must be positive or nil");
+
+  llrb_worker_flush(); // Worker reads the limit without GVL.
+  if (value > 0) llrb_create_measuring_target_machines();
+  llrb_code_cache.limit = value;
+  llrb_reserve_code_size(0);
+  return limit;
+}
+
+// LLRB::JIT.code_size_limit
+// @return [Integer,nil] nil if unlimited
+static VALUE
+rb_jit_code_size_limit(RB_UNUSED_VAR(VALUE self))
+{
+  return llrb_code_cache.limit == 0 ? Qnil : SIZET2NUM(llrb_code_cache.limit);
+}
+
+// Used by stats.c. Bytes of installed modules measured while perf map or code size limit is enabled.
+size_t
+llrb_code_size(void)
+{
+  return llrb_code_cache.size;
 }
 
 static VALUE
@@ -136,13 +1511,33 @@ Init_llrb(void)
   LLVMInitializeNativeTarget();
   LLVMInitializeNativeAsmPrinter();
   LLVMInitializeNativeAsmParser();
-  LLVMLinkInMCJIT();
+  LLVMLoadLibraryPermanently(NULL); // Make CRuby's symbols visible to `llrb_resolve_symbol`.
+  llrb_jits[LLRB_TIER_BASELINE] = LLVMOrcCreateInstance(llrb_create_target_machine(LLVMCodeGenLevelLess));
+  llrb_jits[LLRB_TIER_OPTIMIZED] = LLVMOrcCreateInstance(llrb_create_target_machine(LLVMCodeGenLevelAggressive));
+  llrb_compiled_iseqs = st_init_numtable();
 
   VALUE rb_mLLRB = rb_define_module("LLRB");
   VALUE rb_mJIT = rb_define_module_under(rb_mLLRB, "JIT");
   rb_define_singleton_method(rb_mJIT, "preview_iseq", RUBY_METHOD_FUNC(rb_jit_preview_iseq), 1);
-  rb_define_singleton_method(rb_mJIT, "compile_iseq", RUBY_METHOD_FUNC(rb_jit_compile_iseq), 2);
+  rb_define_singleton_method(rb_mJIT, "compile_iseq", RUBY_METHOD_FUNC(rb_jit_compile_iseq), 3);
+  rb_define_singleton_method(rb_mJIT, "compile_iseqs", RUBY_METHOD_FUNC(rb_jit_compile_iseqs), 1);
   rb_define_singleton_method(rb_mJIT, "is_compiled",  RUBY_METHOD_FUNC(rb_jit_is_compiled), 1);
+  rb_define_singleton_method(rb_mJIT, "compiled_profile", RUBY_METHOD_FUNC(rb_jit_compiled_profile), 0);
+  rb_define_singleton_method(rb_mJIT, "guard_failures", RUBY_METHOD_FUNC(rb_jit_guard_failures), 0);
+  rb_define_singleton_method(rb_mJIT, "preload_guard_failures", RUBY_METHOD_FUNC(rb_jit_preload_guard_failures), 1);
+  rb_define_singleton_method(rb_mJIT, "profile_key", RUBY_METHOD_FUNC(rb_jit_profile_key), 1);
+  rb_define_singleton_method(rb_mJIT, "iseq_binary", RUBY_METHOD_FUNC(rb_jit_iseq_binary), 1);
+  rb_define_singleton_method(rb_mJIT, "pass_pipeline=", RUBY_METHOD_FUNC(rb_jit_set_pass_pipeline), 1);
+  rb_define_singleton_method(rb_mJIT, "pass_pipeline", RUBY_METHOD_FUNC(rb_jit_pass_pipeline), 0);
+  rb_define_singleton_method(rb_mJIT, "perf_map=", RUBY_METHOD_FUNC(rb_jit_set_perf_map), 1);
+  rb_define_singleton_method(rb_mJIT, "perf_map", RUBY_METHOD_FUNC(rb_jit_perf_map), 0);
+  rb_define_singleton_method(rb_mJIT, "code_size_limit=", RUBY_METHOD_FUNC(rb_jit_set_code_size_limit), 1);
+  rb_define_singleton_method(rb_mJIT, "code_size_limit", RUBY_METHOD_FUNC(rb_jit_code_size_limit), 0);
+  rb_define_private_method(rb_singleton_class(rb_mJIT), "free_iseq", RUBY_METHOD_FUNC(rb_jit_free_iseq), 1);
+  llrb_iseq_finalizer = rb_obj_method(rb_mJIT, ID2SYM(rb_intern("free_iseq")));
+  rb_global_variable(&llrb_iseq_finalizer);
+  llrb_preloaded_failures = Qnil;
+  rb_global_variable(&llrb_preloaded_failures);
 
   extern void Init_profiler(VALUE rb_mJIT);
   Init_profiler(rb_mJIT);
@@ -152,4 +1547,7 @@ Init_llrb(void)
 
   extern void Init_compiler(VALUE rb_mJIT);
   Init_compiler(rb_mJIT);
+
+  extern void Init_stats(VALUE rb_mJIT);
+  Init_stats(rb_mJIT);
 }
@@ -0,0 +1,54 @@
+/*
+ * native_call.h: Runs a frame pushed by CALL_METHOD or vm_invoke_block. Included by bitcode of send insns.
+ */
+
+#ifndef LLRB_NATIVE_CALL_H
+#define LLRB_NATIVE_CALL_H
+
+#include "cruby.h"
+#include "cruby_extra/insns.inc"
+
+VALUE vm_exec(rb_thread_t *th);
+void rb_vm_pop_frame(rb_thread_t *th);
+
+// If the pushed frame is JIT-ed, its native function is called directly instead of going through vm_exec
+// and opt_call_c_function. Otherwise, and if it deoptimized to YARV, the frame is run by vm_exec.
+static inline VALUE
+llrb_exec_pushed_frame(rb_thread_t *th)
+{
+  rb_control_frame_t *cfp = th->cfp;
+  const void * const *insns = rb_vm_get_insns_address_table();
+
+  if (cfp->pc[0] == (VALUE)insns[YARVINSN_opt_call_c_function]) {
+    rb_control_frame_t *(*func)(rb_thread_t *, rb_control_frame_t *) = (rb_control_frame_t *(*)(rb_thread_t *, rb_control_frame_t *))cfp->pc[1];
+    rb_control_frame_t *ret = (*func)(th, cfp);
+
+    if (ret == 0) {
+      // Same as THROW_EXCEPTION by opt_call_c_function: th->errinfo is kept for vm_exec around caller. The state is
+      // taken from the throw data when th->state is already cleared, since rb_jump_tag(0) raises "unknown longjmp status".
+      VALUE err = th->errinfo;
+      int state = th->state;
+      if (state == 0) {
+        if (RB_TYPE_P(err, T_IMEMO) && imemo_type(err) == imemo_throw_data) {
+          state = (int)((struct vm_throw_data *)err)->throw_state;
+        } else {
+          state = TAG_RAISE;
+        }
+      }
+      th->state = 0;
+      rb_jump_tag(state);
+    }
+    if (ret == cfp && cfp->pc[0] == (VALUE)insns[YARVINSN_leave]) {
+      // Same as leave insn for a frame without VM_FRAME_FLAG_FINISH.
+      VALUE val = *(cfp->sp - 1);
+      RUBY_VM_CHECK_INTS(th);
+      rb_vm_pop_frame(th);
+      return val;
+    }
+  }
+
+  VM_ENV_FLAGS_SET(th->cfp->ep, VM_FRAME_FLAG_FINISH);
+  return vm_exec(th);
+}
+
+#endif // LLRB_NATIVE_CALL_H
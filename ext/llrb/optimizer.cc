@@ -12,10 +12,19 @@
  *      doesn't depend on such APIs. So this reason can be fixed.
  *
  */
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/PatternMatch.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Pass.h"
 #include "llvm/MC/SubtargetFeature.h"
 #include "llvm/Support/CBindingWrapping.h"
 #include "llvm/Support/Host.h"
@@ -29,8 +38,17 @@
 
 #include "llvm/ADT/Statistic.h"
 
+#include "jit.h"
+
+#include <cstring>
+
+extern "C" double llrb_stats_now(void);
+
 namespace llrb {
 
+// Set by `llrb_set_pass_pipeline` with GVL while worker is idle.
+static enum llrb_pass_pipeline PassPipeline = LLRB_PIPELINE_O3;
+
 static inline std::string GetFeaturesStr()
 {
   llvm::SubtargetFeatures ret;
@@ -45,7 +63,8 @@ static inline std::string GetFeaturesStr()
   return ret.getString();
 }
 
-// Setting function attributes is required for function inlining.
+// Setting function attributes is required for function inlining. CRuby's functions are declared nounwind, like
+// clang does for C. Ruby's exception is longjmp, not unwinding. Bitcode functions have attributes inferred by opt.
 static void
 SetFunctionAttributes(llvm::Module *mod)
 {
@@ -65,11 +84,27 @@ SetFunctionAttributes(llvm::Module *mod)
 
     newAttrs = attrs.addAttributes(ctx, llvm::AttributeSet::FunctionIndex, newAttrs);
     func.setAttributes(newAttrs);
+    if (func.isDeclaration() && !func.isIntrinsic()) func.addFnAttr(llvm::Attribute::NoUnwind);
+  }
+}
+
+// Baseline tier still needs inlining of insn functions, but other passes are kept minimal.
+static void
+SetUpBuilder(llvm::PassManagerBuilder& builder, enum llrb_tier tier)
+{
+  builder.SizeLevel = 0;
+  switch (tier) {
+    case LLRB_TIER_BASELINE:
+      builder.OptLevel = 1;
+      break;
+    default:
+      builder.OptLevel = 3;
+      break;
   }
 }
 
 static void
-RunFunctionPasses(llvm::Module *mod, llvm::Function *func)
+RunFunctionPasses(llvm::Module *mod, llvm::Function *func, enum llrb_tier tier)
 {
   std::unique_ptr<llvm::legacy::FunctionPassManager> fpm;
   fpm.reset(new llvm::legacy::FunctionPassManager(mod));
@@ -77,8 +112,7 @@ RunFunctionPasses(llvm::Module *mod, llvm::Function *func)
   fpm->add(llvm::createVerifierPass());
 
   llvm::PassManagerBuilder builder;
-  builder.OptLevel  = 3;
-  builder.SizeLevel = 0;
+  SetUpBuilder(builder, tier);
   builder.populateFunctionPassManager(*fpm);
 
   fpm->doInitialization();
@@ -88,6 +122,263 @@ RunFunctionPasses(llvm::Module *mod, llvm::Function *func)
   fpm->doFinalization();
 }
 
+// Calls of llrb_self_from_cfp(cfp) are replaced with one in entry block, because cfp->self is not changed while
+// the frame lives. After inlining, GVN can't merge the loads split by calls which may write memory.
+struct HoistSelfFromCfp : public llvm::FunctionPass {
+  static char ID;
+  HoistSelfFromCfp() : llvm::FunctionPass(ID) {}
+
+  bool runOnFunction(llvm::Function &func) override {
+    llvm::SmallVector<llvm::CallInst *, 8> calls;
+    for (llvm::Instruction &inst : llvm::instructions(func)) {
+      llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(&inst);
+      if (!call || !call->getCalledFunction() || call->getCalledFunction()->getName() != "llrb_self_from_cfp") continue;
+      if (llvm::isa<llvm::Argument>(call->getArgOperand(0))) calls.push_back(call);
+    }
+    if (calls.size() < 2) return false;
+
+    llvm::DenseMap<llvm::Value *, llvm::Instruction *> hoisted; // cfp => its self
+    llvm::Instruction *insert_point = &*func.getEntryBlock().getFirstInsertionPt();
+    for (llvm::CallInst *call : calls) {
+      llvm::Instruction *&self = hoisted[call->getArgOperand(0)];
+      if (!self) {
+        self = call->clone();
+        self->insertBefore(insert_point);
+      }
+      call->replaceAllUsesWith(self);
+      call->eraseFromParent();
+    }
+    return true;
+  }
+};
+char HoistSelfFromCfp::ID = 0;
+
+// RTEST is built as `(v & ~Qnil) != 0`. When v is a select or phi of constants, like inlined comparison's
+// `cond ? Qtrue : Qfalse`, it's folded to the condition before InstCombine has to find it.
+struct FoldRTEST : public llvm::FunctionPass {
+  static char ID;
+  FoldRTEST() : llvm::FunctionPass(ID) {}
+
+  static llvm::Constant *
+  Test(llvm::Value *value, const llvm::APInt &mask)
+  {
+    llvm::ConstantInt *c = llvm::dyn_cast<llvm::ConstantInt>(value);
+    if (!c) return nullptr;
+    return llvm::ConstantInt::get(llvm::Type::getInt1Ty(value->getContext()), (c->getValue() & mask) != 0);
+  }
+
+  static llvm::Value *
+  Fold(llvm::Value *value, const llvm::APInt &mask, llvm::Instruction *rtest)
+  {
+    if (llvm::Constant *test = Test(value, mask)) return test;
+
+    if (llvm::SelectInst *select = llvm::dyn_cast<llvm::SelectInst>(value)) {
+      llvm::Constant *t = Test(select->getTrueValue(), mask), *f = Test(select->getFalseValue(), mask);
+      if (!t || !f) return nullptr;
+      if (t == f) return t;
+      if (t->isOneValue()) return select->getCondition();
+      return llvm::BinaryOperator::CreateNot(select->getCondition(), "RTEST", rtest);
+    }
+
+    if (llvm::PHINode *phi = llvm::dyn_cast<llvm::PHINode>(value)) {
+      llvm::SmallVector<llvm::Constant *, 4> tests;
+      for (llvm::Value *incoming : phi->incoming_values()) {
+        llvm::Constant *test = Test(incoming, mask);
+        if (!test) return nullptr;
+        tests.push_back(test);
+      }
+      llvm::PHINode *folded = llvm::PHINode::Create(llvm::Type::getInt1Ty(phi->getContext()),
+          phi->getNumIncomingValues(), "RTEST", phi);
+      for (unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
+        folded->addIncoming(tests[i], phi->getIncomingBlock(i));
+      }
+      return folded;
+    }
+    return nullptr;
+  }
+
+  bool runOnFunction(llvm::Function &func) override {
+    using namespace llvm::PatternMatch;
+    bool changed = false;
+    for (llvm::inst_iterator it = llvm::inst_begin(func), end = llvm::inst_end(func); it != end;) {
+      llvm::Instruction *inst = &*it++;
+      llvm::ICmpInst::Predicate pred;
+      llvm::Value *value;
+      const llvm::APInt *mask;
+      if (!match(inst, m_ICmp(pred, m_And(m_Value(value), m_APInt(mask)), m_Zero())) || pred != llvm::ICmpInst::ICMP_NE) continue;
+
+      if (llvm::Value *folded = Fold(value, *mask, inst)) {
+        inst->replaceAllUsesWith(folded);
+        inst->eraseFromParent();
+        changed = true;
+      }
+    }
+    return changed;
+  }
+};
+char FoldRTEST::ID = 0;
+
+static bool
+IsCurrentVMLoad(llvm::Value *value)
+{
+  llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(value);
+  if (!load) return false;
+  llvm::GlobalVariable *global = llvm::dyn_cast<llvm::GlobalVariable>(load->getPointerOperand());
+  return global && global->getName() == "ruby_current_vm";
+}
+
+// Returns the offset of redefined_flag[bop] from ruby_current_vm, or -1 if it's not a load of that.
+static int64_t
+RedefinedFlagOffset(llvm::LoadInst *load, const llvm::DataLayout &layout)
+{
+  if (!load->getType()->isIntegerTy(16) || load->isVolatile()) return -1; // redefined_flag is short[].
+  int64_t offset = 0;
+  llvm::Value *base = llvm::GetPointerBaseWithConstantOffset(load->getPointerOperand(), offset, layout);
+  return IsCurrentVMLoad(base) ? offset : -1;
+}
+
+// Allocation of Bignum or Float, and small helpers don't run Ruby code. So they don't redefine methods,
+// and don't move the frame's env to heap either.
+static bool
+MayRunRuby(llvm::Instruction &inst)
+{
+  llvm::CallSite call(&inst);
+  if (!call) return false;
+  if (call.onlyReadsMemory()) return false;
+  llvm::Function *callee = call.getCalledFunction();
+  if (!callee) return true;
+  if (callee->isIntrinsic()) return false;
+  llvm::StringRef name = callee->getName();
+  return !(name == "rb_int2big" || name == "rb_float_new_in_heap" || name == "llrb_set_pc" || name == "llrb_get_pc"
+      || name == "llrb_push_result" || name == "llrb_pop_result" || name == "llrb_self_from_cfp");
+}
+
+// BASIC_OP_UNREDEFINED_P loads GET_VM()->redefined_flag[bop], and inlined insn helpers load it again and again.
+// The flag is changed only by method definition, so a loaded flag is reused until a call which may run Ruby code.
+// Loads are merged in a block, and in a block having a single predecessor from the end of it.
+struct MergeBasicOpChecks : public llvm::FunctionPass {
+  static char ID;
+  MergeBasicOpChecks() : llvm::FunctionPass(ID) {}
+
+  typedef llvm::DenseMap<int64_t, llvm::LoadInst *> Flags; // offset from ruby_current_vm => loaded flag
+
+  bool runOnFunction(llvm::Function &func) override {
+    const llvm::DataLayout &layout = func.getParent()->getDataLayout();
+    llvm::DenseMap<llvm::BasicBlock *, Flags> flags_at_end;
+    bool changed = false;
+
+    llvm::ReversePostOrderTraversal<llvm::Function *> rpot(&func);
+    for (llvm::BasicBlock *block : rpot) {
+      Flags flags;
+      if (llvm::BasicBlock *pred = block->getSinglePredecessor()) {
+        auto found = flags_at_end.find(pred);
+        if (found != flags_at_end.end()) flags = found->second;
+      }
+
+      for (llvm::BasicBlock::iterator it = block->begin(); it != block->end();) {
+        llvm::Instruction &inst = *it++;
+        if (MayRunRuby(inst)) {
+          flags.clear();
+          continue;
+        }
+        llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(&inst);
+        if (!load) continue;
+        int64_t offset = RedefinedFlagOffset(load, layout);
+        if (offset < 0) continue;
+
+        llvm::LoadInst *&loaded = flags[offset];
+        if (loaded) {
+          load->replaceAllUsesWith(loaded);
+          load->eraseFromParent();
+          changed = true;
+        } else {
+          loaded = load;
+        }
+      }
+      flags_at_end[block] = flags;
+    }
+    return changed;
+  }
+};
+char MergeBasicOpChecks::ID = 0;
+
+// Tells LLVM's alias analysis what LLRB knows about VM state, so that LICM and GVN can hoist guards of inlined
+// insns out of loops. This runs after inlining, on JIT-ed functions:
+//
+//   - ruby_current_vm, and self and iseq of JIT-ed function's cfp are `!invariant.load`. They don't change while
+//     the function runs.
+//   - redefined_flag[bop] and this cfp's ep are loaded in alias scopes. Calls which don't run Ruby code have
+//     `!noalias` of them. ep can be changed only when a Proc captures the env.
+//
+// TBAA of VM structs is already attached to insn helpers by clang.
+struct AnnotateVMState : public llvm::FunctionPass {
+  static char ID;
+  AnnotateVMState() : llvm::FunctionPass(ID) {}
+
+  // Returns the field index of rb_control_frame_t loaded from JIT-ed function's cfp, or -1.
+  static int
+  CfpField(llvm::LoadInst *load, llvm::Function &func)
+  {
+    llvm::GetElementPtrInst *gep = llvm::dyn_cast<llvm::GetElementPtrInst>(load->getPointerOperand());
+    if (!gep || gep->getNumIndices() != 2 || !gep->hasAllConstantIndices()) return -1;
+    llvm::StructType *type = llvm::dyn_cast<llvm::StructType>(gep->getSourceElementType());
+    if (!type || !type->hasName() || type->getName() != "struct.rb_control_frame_struct") return -1;
+
+    llvm::Value *cfp = gep->getPointerOperand();
+    if (llvm::IntToPtrInst *cast = llvm::dyn_cast<llvm::IntToPtrInst>(cfp)) cfp = cast->getOperand(0);
+    if (cfp != &*std::next(func.arg_begin())) return -1; // JIT-ed function is (th, cfp).
+    return (int)llvm::cast<llvm::ConstantInt>(gep->getOperand(2))->getZExtValue();
+  }
+
+  bool runOnFunction(llvm::Function &func) override {
+    if (!func.getName().startswith("llrb_exec_") || func.arg_size() != 2) return false;
+
+    llvm::LLVMContext &ctx = func.getContext();
+    const llvm::DataLayout &layout = func.getParent()->getDataLayout();
+    llvm::MDBuilder builder(ctx);
+    llvm::MDNode *domain = builder.createAliasScopeDomain("llrb.vm");
+    llvm::MDNode *scopes = llvm::MDNode::get(ctx, {
+      builder.createAliasScope("llrb.vm.redefined_flag", domain),
+      builder.createAliasScope("llrb.vm.cfp_ep", domain),
+    });
+    llvm::MDNode *flag_scope = llvm::MDNode::get(ctx, scopes->getOperand(0).get());
+    llvm::MDNode *ep_scope = llvm::MDNode::get(ctx, scopes->getOperand(1).get());
+    llvm::MDNode *invariant = llvm::MDNode::get(ctx, llvm::None);
+
+    bool changed = false;
+    for (llvm::Instruction &inst : llvm::instructions(func)) {
+      if (llvm::isa<llvm::CallInst>(inst) || llvm::isa<llvm::InvokeInst>(inst)) {
+        if (!MayRunRuby(inst)) {
+          inst.setMetadata(llvm::LLVMContext::MD_noalias, scopes);
+          changed = true;
+        }
+        continue;
+      }
+      llvm::LoadInst *load = llvm::dyn_cast<llvm::LoadInst>(&inst);
+      if (!load || load->isVolatile()) continue;
+
+      int field = CfpField(load, func);
+      if (IsCurrentVMLoad(load) || field == LLRB_CFP_ISEQ || field == LLRB_CFP_SELF) {
+        load->setMetadata(llvm::LLVMContext::MD_invariant_load, invariant);
+      } else if (field == LLRB_CFP_EP) {
+        load->setMetadata(llvm::LLVMContext::MD_alias_scope, ep_scope);
+      } else if (RedefinedFlagOffset(load, layout) >= 0) {
+        load->setMetadata(llvm::LLVMContext::MD_alias_scope, flag_scope);
+      } else {
+        continue;
+      }
+      changed = true;
+    }
+    return changed;
+  }
+
+  // Field indexes of rb_control_frame_t in Ruby 2.4: pc, sp, iseq, self, ep, block_code.
+  enum { LLRB_CFP_ISEQ = 2, LLRB_CFP_SELF = 3, LLRB_CFP_EP = 4 };
+};
+char AnnotateVMState::ID = 0;
+
+// LLRB_PIPELINE_LEAN. Passes not helping YARV-shaped IR (a chain of insn helper calls operating on VALUEs) are
+// commented out.
 static void
 PopulateModulePassManager(llvm::legacy::PassManager& mpm)
 {
@@ -95,7 +386,7 @@ PopulateModulePassManager(llvm::legacy::PassManager& mpm)
 
   // addInitialAliasAnalysisPasses(MPM);
   mpm.add(llvm::createTypeBasedAAWrapperPass());
-  //mpm.add(llvm::createScopedNoAliasAAWrapperPass());
+  mpm.add(llvm::createScopedNoAliasAAWrapperPass()); // For AnnotateVMState
 
   // if (!DisableUnitAtATime)
   //mpm.add(llvm::createInferFunctionAttrsLegacyPass());
@@ -111,6 +402,7 @@ PopulateModulePassManager(llvm::legacy::PassManager& mpm)
 
   // Start of CallGraph SCC passes.
   //mpm.add(llvm::createPruneEHPass());
+  mpm.add(new HoistSelfFromCfp());
   mpm.add(llvm::createFunctionInliningPass(412));
   //mpm.add(llvm::createPostOrderFunctionAttrsPass());
   //mpm.add(llvm::createArgumentPromotionPass());   // Scalarize uninlined fn args
@@ -118,6 +410,9 @@ PopulateModulePassManager(llvm::legacy::PassManager& mpm)
   // Start of function pass.
   //mpm.add(llvm::createSROAPass()); // Break up aggregate allocas, using SSAUpdater.
   mpm.add(llvm::createEarlyCSEPass());              // Catch trivial redundancies
+  mpm.add(new MergeBasicOpChecks());
+  mpm.add(new AnnotateVMState());
+  mpm.add(new FoldRTEST());
   mpm.add(llvm::createJumpThreadingPass());         // Thread jumps.
   //mpm.add(llvm::createCorrelatedValuePropagationPass()); // Propagate conditionals
   mpm.add(llvm::createCFGSimplificationPass());     // Merge & remove BBs
@@ -239,39 +534,91 @@ PopulateModulePassManager(llvm::legacy::PassManager& mpm)
 }
 
 static void
-RunModulePasses(llvm::Module *mod)
+RunModulePasses(llvm::Module *mod, enum llrb_tier tier)
 {
   llvm::legacy::PassManager mpm;
 
-  llvm::PassManagerBuilder builder;
-  builder.OptLevel  = 3;
-  builder.SizeLevel = 0;
-  builder.Inliner = llvm::createFunctionInliningPass(412);
-  builder.populateModulePassManager(mpm);
-  if (0) PopulateModulePassManager(mpm);
+  if (tier == LLRB_TIER_OPTIMIZED && PassPipeline == LLRB_PIPELINE_LEAN) {
+    PopulateModulePassManager(mpm);
+  } else {
+    llvm::PassManagerBuilder builder;
+    SetUpBuilder(builder, tier);
+    if (tier == LLRB_TIER_BASELINE) {
+      builder.Inliner = llvm::createFunctionInliningPass(builder.OptLevel, builder.SizeLevel);
+    } else {
+      builder.Inliner = llvm::createFunctionInliningPass(412);
+    }
+    builder.addExtension(llvm::PassManagerBuilder::EP_Peephole,
+        [](const llvm::PassManagerBuilder &, llvm::legacy::PassManagerBase &pm) { pm.add(new AnnotateVMState()); });
+    builder.populateModulePassManager(mpm);
+  }
 
   mpm.add(llvm::createVerifierPass());
   mpm.run(*mod);
 }
 
+// With `time_passes`, LLVM's timing report of each pass is printed to stderr like `opt -time-passes`.
 static void
-OptimizeFunction(llvm::Module *mod, llvm::Function *func, bool enable_stats)
+OptimizeFunction(llvm::Module *mod, llvm::Function *func, enum llrb_tier tier, bool enable_stats, bool time_passes,
+    struct llrb_opt_time *time)
 {
   SetFunctionAttributes(mod);
-  RunFunctionPasses(mod, func);
+  if (time_passes) llvm::TimePassesIsEnabled = true;
+
+  double started_at = llrb_stats_now();
+  RunFunctionPasses(mod, func, tier);
+  double func_passed_at = llrb_stats_now();
   if (enable_stats) llvm::EnableStatistics();
-  RunModulePasses(mod);
+  RunModulePasses(mod, tier);
   if (enable_stats) llvm::PrintStatistics();
+
+  if (time) {
+    time->func_passes = func_passed_at - started_at;
+    time->module_passes = llrb_stats_now() - func_passed_at;
+  }
+  if (time_passes) {
+    llvm::reportAndResetTimings();
+    llvm::TimePassesIsEnabled = false;
+  }
 }
 
 } // namespace llrb
 
 extern "C" {
+// Used by llrb.c to create target machine. Returned string must be `free`d by caller.
+char *
+llrb_host_cpu_name(void)
+{
+  return strdup(llvm::sys::getHostCPUName().str().c_str());
+}
+
+// Used by llrb.c to create target machine. Returned string must be `free`d by caller.
+char *
+llrb_host_cpu_features(void)
+{
+  return strdup(llrb::GetFeaturesStr().c_str());
+}
+
+// Used by llrb.c for LLRB::JIT.pass_pipeline=. Caller must flush worker beforehand.
+void
+llrb_set_pass_pipeline(enum llrb_pass_pipeline pipeline)
+{
+  llrb::PassPipeline = pipeline;
+}
+
+enum llrb_pass_pipeline
+llrb_get_pass_pipeline(void)
+{
+  return llrb::PassPipeline;
+}
+
+// `time` can be NULL.
 void
-llrb_optimize_function(LLVMModuleRef cmod, LLVMValueRef cfunc, bool enable_stats)
+llrb_optimize_function(LLVMModuleRef cmod, LLVMValueRef cfunc, enum llrb_tier tier, bool enable_stats,
+    bool time_passes, struct llrb_opt_time *time)
 {
   llvm::Module *mod = llvm::unwrap(cmod);
   llvm::Function *func = llvm::unwrap<llvm::Function>(cfunc);
-  llrb::OptimizeFunction(mod, func, enable_stats);
+  llrb::OptimizeFunction(mod, func, tier, enable_stats, time_passes, time);
 }
 } // extern "C"
@@ -1,42 +1,89 @@
 /*
- * parser.c: Constructs Control Flow Graph from encoded YARV instructions in ISeq.
+ * parser.c: Constructs Control Flow Graph from YARV instructions decoded in llrb_iseq_snapshot (snapshot.h).
  */
 
 #include <stdio.h>
+#define USE_INSN_STACK_INCREASE // for `insn_stack_increase` in insns_info.inc
 #include "cfg.h"
 #include "cruby.h"
 
 static VALUE rb_eParseError;
 
-// Return sorted unique Ruby array of Basic Block start positions. Example: [0, 2, 8].
+// rescue, break and next entries continue at `cont` with the rescued or thrown value pushed on the stack of `sp` values.
+// Only the ones with empty stack below the value are continued by JIT-ed code. See `llrb_compile_catch_entries`.
+static bool
+llrb_catch_cont_entry_p(const struct rb_iseq_constant_body *body, const struct iseq_catch_table_entry *entry)
+{
+  return (entry->type == CATCH_TYPE_RESCUE || entry->type == CATCH_TYPE_BREAK || entry->type == CATCH_TYPE_NEXT)
+    && entry->sp == 0 && entry->cont < body->iseq_size;
+}
+
+// Destinations of opt_case_dispatch are CDHASH values and else offset, relative to `base`.
+struct llrb_case_dispatch_marker {
+  const struct rb_iseq_constant_body *body;
+  struct llrb_cfg *cfg;
+  unsigned int base;              // Position next to opt_case_dispatch insn.
+  struct llrb_basic_block *block; // Block ending with the opt_case_dispatch. Only for llrb_set_incoming_blocks_by.
+  unsigned int stack_size;        // Stack size after the opt_case_dispatch. Only for llrb_set_incoming_blocks_by.
+};
+
+// Marks a Basic Block start position in `cfg->block_index`. Its actual index is set by llrb_create_basic_blocks.
+static void
+llrb_mark_block_start(const struct rb_iseq_constant_body *body, struct llrb_cfg *cfg, unsigned int pos)
+{
+  if (pos >= body->iseq_size) {
+    rb_raise(rb_eParseError, "BasicBlock start (%d) is out of ISeq (size = %d)", pos, body->iseq_size);
+  }
+  cfg->block_index[pos] = 1;
+}
+
+static int
+llrb_mark_case_dispatch_dest_i(RB_UNUSED_VAR(VALUE key), VALUE offset, VALUE arg)
+{
+  struct llrb_case_dispatch_marker *marker = (struct llrb_case_dispatch_marker *)arg;
+  llrb_mark_block_start(marker->body, marker->cfg, marker->base + FIX2INT(offset));
+  return ST_CONTINUE;
+}
+
+// Marks Basic Block start positions in `cfg->block_index`. Then `cfg->block_index[pos]` is non-zero for a start.
 //
-// It's constructed in the following rule.
+// It's marked in the following rule.
 //   Rule 1: 0 is always included
-//   Rule 2: TS_OFFSET numers for are branch and jump instructions are included
-//   Rule 3: Positions immediately after jump instructions (jump, branchnil, branchif, branchunless, opt_case_dispatch, leave) are included
-static VALUE
-llrb_basic_block_starts(const struct rb_iseq_constant_body *body)
+//   Rule 2: TS_OFFSET numers for are branch and jump instructions (including getinlinecache), and CDHASH offsets of opt_case_dispatch are included
+//   Rule 3: Positions immediately after jump instructions (jump, branchnil, branchif, branchunless, getinlinecache, opt_case_dispatch, leave) are included
+//   Rule 4: `cont` of catch table entries satisfying `llrb_catch_cont_entry_p` are included
+static void
+llrb_mark_block_starts(const struct rb_iseq_constant_body *body, struct llrb_cfg *cfg)
 {
   // TODO: No need to check leave? leave is always in the end?
 
   // Rule 1
-  VALUE starts = rb_ary_new_capa(1); // Maybe GCed. Freeing this causes Bus Error...
-  rb_ary_push(starts, INT2FIX(0));
+  llrb_mark_block_start(body, cfg, 0);
 
   for (unsigned int i = 0; i < body->iseq_size;) {
-    int insn = rb_vm_insn_addr2insn((void *)body->iseq_encoded[i]);
+    int insn = (int)body->iseq_encoded[i];
 
     // Rule 2
     switch (insn) {
       case YARVINSN_branchif:
       case YARVINSN_branchunless:
       case YARVINSN_branchnil:
+      case YARVINSN_getinlinecache:
       case YARVINSN_jump: {
         VALUE op = body->iseq_encoded[i+1];
-        rb_ary_push(starts, INT2FIX(i+insn_len(insn)+op));
+        llrb_mark_block_start(body, cfg, i+insn_len(insn)+op);
+        break;
+      }
+      case YARVINSN_opt_case_dispatch: {
+        struct llrb_case_dispatch_marker marker = (struct llrb_case_dispatch_marker){
+          .body = body,
+          .cfg = cfg,
+          .base = i + insn_len(insn),
+        };
+        rb_hash_foreach(body->iseq_encoded[i+1], llrb_mark_case_dispatch_dest_i, (VALUE)&marker);
+        llrb_mark_block_start(body, cfg, marker.base + (rb_num_t)body->iseq_encoded[i+2]);
         break;
       }
-      //case YARVINSN_opt_case_dispatch:
     }
 
     // Rule 3
@@ -44,124 +91,195 @@ llrb_basic_block_starts(const struct rb_iseq_constant_body *body)
       case YARVINSN_branchif:
       case YARVINSN_branchunless:
       case YARVINSN_branchnil:
+      case YARVINSN_getinlinecache:
       case YARVINSN_jump:
       case YARVINSN_throw:
+      case YARVINSN_opt_case_dispatch:
         if (i+insn_len(insn) < body->iseq_size) {
-          rb_ary_push(starts, INT2FIX(i+insn_len(insn)));
+          llrb_mark_block_start(body, cfg, i+insn_len(insn));
         }
         break;
-      //case YARVINSN_opt_case_dispatch:
     }
 
     i += insn_len(insn);
   }
-  starts = rb_ary_sort_bang(starts);
-  rb_funcall(starts, rb_intern("uniq!"), 0);
-  return starts;
-}
 
-static unsigned int
-llrb_find_block_end(const struct rb_iseq_constant_body *body, unsigned int start, VALUE starts)
-{
-  unsigned int i = start;
-  while (i < body->iseq_size) {
-    int insn = rb_vm_insn_addr2insn((void *)body->iseq_encoded[i]);
-    unsigned int next_i = i + insn_len(insn);
-
-    // If next insn or end of iseq is found, it's not a block end.
-    if (RTEST(rb_ary_includes(starts, INT2FIX(next_i)))
-        || next_i == body->iseq_size) {
-      break;
+  // Rule 4
+  if (body->catch_table) {
+    for (unsigned int i = 0; i < body->catch_table->size; i++) {
+      const struct iseq_catch_table_entry *entry = &body->catch_table->entries[i];
+      if (llrb_catch_cont_entry_p(body, entry)) llrb_mark_block_start(body, cfg, entry->cont);
     }
-    i = next_i;
   }
-  return i;
 }
 
+// Creates blocks in the order of marked start positions, and makes `cfg->block_index` the index from start
+// position to the block. Each block ends right before next marked position.
 static void
 llrb_create_basic_blocks(const struct rb_iseq_constant_body *body, struct llrb_cfg *cfg)
 {
-  VALUE starts = llrb_basic_block_starts(body);
-  cfg->size = RARRAY_LEN(starts);
-  cfg->blocks = (struct llrb_basic_block *)xmalloc(cfg->size * sizeof(struct llrb_basic_block)); // freed in llrb_destruct_cfg
-
-  for (unsigned int i = 0; i < RARRAY_LEN(starts); i++) {
-    unsigned int start = (unsigned int)FIX2INT(RARRAY_AREF(starts, i));
-    cfg->blocks[i] = (struct llrb_basic_block){
-      .start = start,
-      .end = llrb_find_block_end(body, start, starts),
-      .incoming_size = 0,
-      .incoming_starts = 0,
-      .traversed = false,
-    };
+  cfg->block_index = LLRB_ARENA_ZALLOC_N(cfg->arena, unsigned int, body->iseq_size);
+  cfg->blocks = 0;
+  cfg->size = 0;
+  llrb_mark_block_starts(body, cfg);
+
+  for (unsigned int i = 0; i < body->iseq_size; i++) {
+    if (cfg->block_index[i]) cfg->size++;
+  }
+  cfg->blocks = LLRB_ARENA_ALLOC_N(cfg->arena, struct llrb_basic_block, cfg->size);
+
+  struct llrb_basic_block *block = 0;
+  for (unsigned int i = 0; i < body->iseq_size;) {
+    if (cfg->block_index[i]) {
+      block = block ? block + 1 : cfg->blocks;
+      cfg->block_index[i] = (unsigned int)(block - cfg->blocks) + 1;
+      *block = (struct llrb_basic_block){
+        .start = i,
+        .end = i,
+        .incoming_size = 0,
+        .incoming_starts = 0,
+        .stack_size = 0,
+        .catch_cont = false,
+        .traversed = false,
+      };
+    }
+    block->end = i;
+    i += insn_len((int)body->iseq_encoded[i]);
   }
-  RB_GC_GUARD(starts);
 }
 
+// Buffer is doubled when its size reaches a power of 2. Old buffer is left in arena.
 static void
-llrb_push_incoming_start(struct llrb_basic_block *block, unsigned int start)
+llrb_push_incoming_start(struct llrb_arena *arena, struct llrb_basic_block *block, unsigned int start)
 {
-  block->incoming_size++;
-  if (block->incoming_size == 1) {
-    block->incoming_starts = (unsigned int *)xmalloc(sizeof(unsigned int)); // freed in llrb_destruct_cfg
-  } else {
-    block->incoming_starts = (unsigned int *)xrealloc(
-        block->incoming_starts, block->incoming_size * sizeof(unsigned int)); // freed in llrb_destruct_cfg
+  unsigned int size = block->incoming_size;
+  if ((size & (size - 1)) == 0) { // 0, 1, 2, 4, 8, ...
+    unsigned int *starts = LLRB_ARENA_ALLOC_N(arena, unsigned int, size == 0 ? 1 : size * 2);
+    if (size > 0) memcpy(starts, block->incoming_starts, size * sizeof(unsigned int));
+    block->incoming_starts = starts;
   }
-  block->incoming_starts[block->incoming_size-1] = start;
+  block->incoming_starts[size] = start;
+  block->incoming_size++;
 }
 
 static struct llrb_basic_block *
-llrb_find_block(struct llrb_cfg *cfg, unsigned int start)
+llrb_find_block(const struct rb_iseq_constant_body *body, struct llrb_cfg *cfg, unsigned int start)
 {
-  for (unsigned int i = 0; i < cfg->size; i++) {
-    struct llrb_basic_block *block = cfg->blocks + i;
-    if (block->start == start) return block;
+  if (start >= body->iseq_size || !cfg->block_index[start]) {
+    rb_raise(rb_eParseError, "BasicBlock (start = %d) was not found in llrb_find_block", start);
   }
-  rb_raise(rb_eParseError, "BasicBlock (start = %d) was not found in llrb_find_block", start);
+  return cfg->blocks + (cfg->block_index[start] - 1);
 }
 
+static void llrb_set_incoming_blocks_by(const struct rb_iseq_constant_body *body, struct llrb_cfg *cfg, struct llrb_basic_block *block,
+    unsigned int stack_size);
+
+// CDHASH may have the same offset for multiple keys. A destination block gets this block as incoming only once.
+static void
+llrb_set_case_dispatch_incoming(struct llrb_case_dispatch_marker *marker, unsigned int dest)
+{
+  struct llrb_basic_block *dest_block = llrb_find_block(marker->body, marker->cfg, dest);
+  for (unsigned int i = 0; i < dest_block->incoming_size; i++) {
+    if (dest_block->incoming_starts[i] == marker->block->start) return;
+  }
+  llrb_push_incoming_start(marker->cfg->arena, dest_block, marker->block->start);
+  llrb_set_incoming_blocks_by(marker->body, marker->cfg, dest_block, marker->stack_size);
+}
+
+static int
+llrb_set_case_dispatch_incoming_i(RB_UNUSED_VAR(VALUE key), VALUE offset, VALUE arg)
+{
+  struct llrb_case_dispatch_marker *marker = (struct llrb_case_dispatch_marker *)arg;
+  llrb_set_case_dispatch_incoming(marker, marker->base + FIX2INT(offset));
+  return ST_CONTINUE;
+}
+
+// Returns YARV stack size after the last insn of `block`, which is the one at start of all its successors.
+static unsigned int
+llrb_end_stack_size(const struct rb_iseq_constant_body *body, const struct llrb_basic_block *block)
+{
+  int depth = (int)block->stack_size;
+  for (unsigned int i = block->start; i <= block->end;) {
+    int insn = (int)body->iseq_encoded[i];
+    depth = insn_stack_increase(depth, insn, body->iseq_encoded + (i+1));
+    if (depth < 0) {
+      rb_raise(rb_eParseError, "Stack underflow at %d in BasicBlock (start = %d)", i, block->start);
+    }
+    i += insn_len(insn);
+  }
+  return (unsigned int)depth;
+}
+
+// Traverses CFG from `block` and sets incoming blocks. Stack size at start of each block is propagated by the
+// traversal too. It must be the same for all incomings, because compiler merges every stack slot by phi nodes.
 static void
-llrb_set_incoming_blocks_by(const struct rb_iseq_constant_body *body, struct llrb_cfg *cfg, struct llrb_basic_block *block)
+llrb_set_incoming_blocks_by(const struct rb_iseq_constant_body *body, struct llrb_cfg *cfg, struct llrb_basic_block *block,
+    unsigned int stack_size)
 {
-  if (block->traversed) return;
+  if (block->traversed) {
+    if (block->stack_size != stack_size) {
+      rb_raise(rb_eParseError, "BasicBlock (start = %d) was reached with different stack sizes: %d and %d",
+          block->start, block->stack_size, stack_size);
+    }
+    return;
+  }
   block->traversed = true;
+  block->stack_size = stack_size;
+  unsigned int end_stack_size = llrb_end_stack_size(body, block);
 
   struct llrb_basic_block *next_block = 0;
   struct llrb_basic_block *last_block = cfg->blocks + (cfg->size-1);
   if (block < last_block) next_block = block + 1;
 
   // TODO: No need to check leave? leave is always in the end?
-  int end_insn = rb_vm_insn_addr2insn((void *)body->iseq_encoded[block->end]);
+  int end_insn = (int)body->iseq_encoded[block->end];
   switch (end_insn) {
     case YARVINSN_branchnil:
     case YARVINSN_branchif:
-    case YARVINSN_branchunless: {
+    case YARVINSN_branchunless:
+    case YARVINSN_getinlinecache: {
       VALUE offset = (rb_num_t)body->iseq_encoded[block->end+1];
-      struct llrb_basic_block *dest_block = llrb_find_block(cfg, block->end + insn_len(end_insn) + offset);
-      llrb_push_incoming_start(dest_block, block->start);
-      llrb_set_incoming_blocks_by(body, cfg, dest_block);
+      struct llrb_basic_block *dest_block = llrb_find_block(body, cfg, block->end + insn_len(end_insn) + offset);
+      llrb_push_incoming_start(cfg->arena, dest_block, block->start);
+      llrb_set_incoming_blocks_by(body, cfg, dest_block, end_stack_size);
 
       if (next_block) {
-        llrb_push_incoming_start(next_block, block->start);
-        llrb_set_incoming_blocks_by(body, cfg, next_block);
+        llrb_push_incoming_start(cfg->arena, next_block, block->start);
+        llrb_set_incoming_blocks_by(body, cfg, next_block, end_stack_size);
       }
       break;
     }
     case YARVINSN_jump: {
       VALUE offset = (rb_num_t)body->iseq_encoded[block->end+1];
-      struct llrb_basic_block *dest_block = llrb_find_block(cfg, block->end + insn_len(end_insn) + offset);
-      llrb_push_incoming_start(dest_block, block->start);
-      llrb_set_incoming_blocks_by(body, cfg, dest_block);
+      struct llrb_basic_block *dest_block = llrb_find_block(body, cfg, block->end + insn_len(end_insn) + offset);
+      llrb_push_incoming_start(cfg->arena, dest_block, block->start);
+      llrb_set_incoming_blocks_by(body, cfg, dest_block, end_stack_size);
       break;
     }
     case YARVINSN_throw: // TODO: should be modified when catch table is implemented
       break; // no next block
-    //case YARVINSN_opt_case_dispatch: // TODO: MUST be modified when opt_case_dispatch is implemented
+    case YARVINSN_opt_case_dispatch: {
+      struct llrb_case_dispatch_marker marker = (struct llrb_case_dispatch_marker){
+        .body = body,
+        .cfg = cfg,
+        .base = block->end + insn_len(end_insn),
+        .block = block,
+        .stack_size = end_stack_size,
+      };
+      rb_hash_foreach(body->iseq_encoded[block->end+1], llrb_set_case_dispatch_incoming_i, (VALUE)&marker);
+      llrb_set_case_dispatch_incoming(&marker, marker.base + (rb_num_t)body->iseq_encoded[block->end+2]);
+
+      // Falls through to checkmatch insns when `===` is redefined.
+      if (next_block) {
+        llrb_push_incoming_start(cfg->arena, next_block, block->start);
+        llrb_set_incoming_blocks_by(body, cfg, next_block, end_stack_size);
+      }
+      break;
+    }
     default: {
       if (next_block) {
-        llrb_push_incoming_start(next_block, block->start);
-        llrb_set_incoming_blocks_by(body, cfg, next_block);
+        llrb_push_incoming_start(cfg->arena, next_block, block->start);
+        llrb_set_incoming_blocks_by(body, cfg, next_block, end_stack_size);
       }
       break;
     }
@@ -173,12 +291,25 @@ llrb_set_incoming_blocks_by(const struct rb_iseq_constant_body *body, struct llr
 static void
 llrb_set_incoming_blocks(const struct rb_iseq_constant_body *body, struct llrb_cfg *cfg)
 {
-  llrb_set_incoming_blocks_by(body, cfg, cfg->blocks);
+  llrb_set_incoming_blocks_by(body, cfg, cfg->blocks, 0);
+
+  // A continuation reached only by catch table is left untraversed, and it's interpreted by YARV.
+  if (!body->catch_table) return;
+  for (unsigned int i = 0; i < body->catch_table->size; i++) {
+    const struct iseq_catch_table_entry *entry = &body->catch_table->entries[i];
+    if (!llrb_catch_cont_entry_p(body, entry)) continue;
+
+    struct llrb_basic_block *block = llrb_find_block(body, cfg, entry->cont);
+    if (block->catch_cont) continue;
+    block->catch_cont = true;
+    llrb_push_incoming_start(cfg->arena, block, entry->start);
+  }
 }
 
 void
-llrb_parse_iseq(const struct rb_iseq_constant_body *body, struct llrb_cfg *cfg)
+llrb_parse_iseq(const struct rb_iseq_constant_body *body, struct llrb_cfg *cfg, struct llrb_arena *arena)
 {
+  cfg->arena = arena;
   llrb_create_basic_blocks(body, cfg);
   llrb_set_incoming_blocks(body, cfg);
   if (0) llrb_dump_cfg(body, cfg);
@@ -0,0 +1,44 @@
+/*
+ * pic.h: Polymorphic inline cache of a call site in JIT-ed code, shared by compiler.c, stats.c and bitcode of
+ * llrb_pic_search.c and llrb_insn_invokesuper.c.
+ */
+
+#ifndef LLRB_PIC_H
+#define LLRB_PIC_H
+
+#include "cruby.h"
+
+#define LLRB_PIC_SIZE 4
+#define LLRB_PIC_MEGAMORPHIC (LLRB_PIC_SIZE + 1) // `size` of a site which has seen more receiver classes.
+
+// compiler.c allocates one per send and opt_send_without_block as a zero-initialized global of JIT-ed code's
+// module, so it's freed with the code. Each entry is a call cache for one receiver class, and a megamorphic site
+// uses the insn's own call cache like YARV.
+struct llrb_pic {
+  unsigned int size; // The number of filled entries, or LLRB_PIC_MEGAMORPHIC.
+  struct rb_call_cache entries[LLRB_PIC_SIZE];
+};
+
+// Same as llrb_pic for invokesuper. vm_search_super_method's result depends on the method entry of the frame too,
+// which differs for each class including a module or for an alias. So an entry is valid if its `frame_me` is the
+// frame's one, and class serial of receiver, which changes when any of its ancestors is changed, is the same.
+struct llrb_super_cache_entry {
+  const rb_callable_method_entry_t *frame_me;
+  struct rb_call_cache cc; // vm_search_super_method's result with `class_serial` and `method_state` on filling.
+  VALUE (*call)(rb_thread_t *th, rb_control_frame_t *cfp, struct rb_calling_info *calling,
+      const struct rb_call_info *ci, struct rb_call_cache *cc); // `cc.call` on filling, which a call may replace.
+};
+
+struct llrb_super_cache {
+  unsigned int size; // The number of filled entries, or LLRB_PIC_MEGAMORPHIC.
+  struct llrb_super_cache_entry entries[LLRB_PIC_SIZE];
+};
+
+// Counters of LLRB::JIT.stats[:pic]. Written by JIT-ed code with GVL.
+struct llrb_pic_stats {
+  size_t hits;   // Calls which found a valid entry.
+  size_t misses; // Calls which searched a method and filled an entry, or any call of a megamorphic site.
+  size_t sites[LLRB_PIC_MEGAMORPHIC + 1]; // sites[n] is the number of call sites whose `size` is n.
+};
+
+#endif // LLRB_PIC_H
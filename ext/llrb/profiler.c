@@ -1,28 +1,124 @@
+#include <math.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <sys/time.h>
 #include <pthread.h>
 #include "ruby.h"
 #include "ruby/debug.h"
 #include "cruby.h"
+#include "jit.h"
+#include "usdt.h"
 
+// Defaults of LLRB::JIT.start's options.
 #define LLRB_PROFILE_INTERVAL_USEC 1000
 #define LLRB_COMPILE_INTERVAL_TIMES 200
+#define LLRB_COMPILE_BATCH_SIZE 1
+#define LLRB_COMPILE_MIN_SAMPLES 1
+#define LLRB_COMPILE_WORKERS 1
+#define LLRB_PROFILE_DEPTH 16
+#define LLRB_PROFILE_MAX_DEPTH 64
+#define LLRB_CALLER_EDGES 4 // The number of callers tracked per sample. Less frequent ones are evicted.
+#define LLRB_TIER_UP_CALLS 400 // Baseline-tier iseq is recompiled if it's sampled this times more.
+#define LLRB_HOTNESS_HALF_LIFE 10000 // Samples taken before a sample's weight in hotness is halved.
+#define LLRB_HOTNESS_MAX_WEIGHT 1e150 // Hotness of all samples and the weight are scaled down beyond this.
+#define LLRB_NOT_IN_HEAP SIZE_MAX
+#define LLRB_SAMPLE_TABLE_MAX 65536 // Samples of living iseqs beyond this are pruned from the coldest one.
 #define LLRB_ENABLE_DEBUG 0
 
+// On Linux, each Ruby thread has its own CPU-time timer whose signal is delivered only to the thread. So a sample
+// is taken only when the thread holding GVL consumed CPU, not when others did in C functions without GVL or LLVM
+// worker did. Process-wide ITIMER_PROF still runs in a longer interval to give a timer to threads without it.
+#if defined(HAVE_TIMER_CREATE) && defined(SIGEV_THREAD_ID)
+# define LLRB_THREAD_TIMER 1
+# include <errno.h>
+# include <unistd.h>
+# include <sys/syscall.h>
+# ifndef sigev_notify_thread_id
+#  define sigev_notify_thread_id _sigev_un._tid
+# endif
+# define LLRB_DISCOVERY_INTERVAL_RATE 10 // ITIMER_PROF interval is this times longer than thread timers'.
+#else
+# define LLRB_THREAD_TIMER 0
+#endif
+
+#if LLRB_THREAD_TIMER
+struct llrb_thread_timer {
+  timer_t timer;
+  pid_t tid; // Native thread which the timer signals. Its timer is deleted by a sweep after it exits.
+};
+#endif
+
+// Caller of a sampled iseq and how many times it's sampled as the caller.
+struct llrb_caller_edge {
+  const rb_iseq_t *caller;
+  size_t count;
+};
+
 struct llrb_sample {
-  size_t total_calls; // Total count of stack-top occurrence
-  bool compiled;
+  size_t total_calls; // Self samples: the nearest ISeq frame from stack top, including C functions called by it
+  size_t compiled_calls; // total_calls when the iseq was compiled last time
+  enum llrb_tier tier; // Compiled tier. LLRB_TIER_MAX if it should not be compiled anymore.
+  enum llrb_tier preloaded_tier; // Tier compiled by a previous process, or of the method passing this block in async
+                                 // mode. It's compiled without waiting samples.
   const rb_callable_method_entry_t *cme;
+  const rb_iseq_t *iseq;
+  double hotness;    // Sum of `llrb_profiler.weight` at samples, i.e. exponentially decayed sampled times.
+  size_t heap_index; // Index in `llrb_profiler.heap`. LLRB_NOT_IN_HEAP if it's not known as a compile target.
+  size_t inclusive_calls; // Samples having this iseq in profiled frames. Counted once per sample for recursion.
+  size_t loop_calls;      // Self samples whose program counter is inside a loop.
+  size_t last_sampled;    // `profile_times` after the last sample having this iseq in profiled frames. For eviction.
+  bool evicted;           // Native code was evicted by code size limit. Compiled again only if it gets hot again.
+  struct llrb_loop *loops; // Backward branches found on the first sample. `xfree`d with the sample.
+  unsigned int loop_size;
+  struct llrb_caller_edge callers[LLRB_CALLER_EDGES]; // Frequent callers, kept by space-saving algorithm.
 };
 
 static struct {
   bool running;
+  bool async; // If true, optimization and code generation are done by worker.c
   size_t profile_times;
   st_table *sample_by_iseq; // { iseq => llrb_sample }
+  size_t sample_table_max;  // LLRB_SAMPLE_TABLE_MAX unless it's lowered by a spec.
+  size_t prune_threshold;   // sample_table_max, or higher after a prune which couldn't reach 3/4 of it.
+  VALUE preloaded_profile;  // { String => Integer } given by LLRB::JIT.preload_profile. Qnil if not given.
+  bool preloaded_pending;   // true if some sample may be a preloaded compile target.
+  const rb_iseq_t **preloaded_queue; // Iseqs to be compiled by preloaded profile. Freed ones are skipped on pop.
+  size_t preloaded_size, preloaded_capa;
+
+  // Max-heap of compile targets ordered by hotness. Updated by each sample, so that a target is found without
+  // scanning `sample_by_iseq`. An entry which is no longer a target is removed when it's seen at the top.
+  struct llrb_sample **heap;
+  size_t heap_size, heap_capa;
+  double weight;            // Added to hotness by a sample. It grows instead of decaying all samples' hotness.
+  double weight_growth;     // `weight` is multiplied by this per sample. Halves old samples per LLRB_HOTNESS_HALF_LIFE.
+  long fork_budget;         // The number of compilations a forked child can do. If not positive, child stops profiler.
+  long compile_budget;      // The number of compilations this process can still do. If negative, it's unlimited.
+
+  // Scheduling configured by LLRB::JIT.start.
+  long interval_usec;        // Sampling interval of ITIMER_PROF.
+  size_t compile_every;      // The number of samples in a compile window.
+  size_t batch_size;         // The number of iseqs compiled in a window at most, from the hottest one.
+  size_t batch_pending;      // The number of iseqs which can still be compiled in the current window.
+  size_t min_samples;        // Not compiled iseq is a target if it's sampled this times or more.
+  long depth;                // The number of frames profiled from stack top.
+  long max_compiles_per_sec; // Rate limit of compilations. If negative, it's unlimited.
+  double rate_window_start;  // llrb_stats_now() when the current second for `max_compiles_per_sec` started.
+  long rate_window_compiles; // The number of compilations in the current second.
+
+#if LLRB_THREAD_TIMER
+  struct llrb_thread_timer *thread_timers; // Timers of Ruby threads which have run a postponed job. Deleted by stop.
+  size_t thread_timer_size, thread_timer_capa;
+  unsigned long timer_generation; // Incremented when thread timers are deleted, so that threads create them again.
+#endif
 } llrb_profiler;
 
-static VALUE gc_hook;
+#if LLRB_THREAD_TIMER
+static __thread unsigned long llrb_thread_timer_generation = 0; // Equals to `timer_generation` if this thread has a timer.
+#endif
 
 void
 llrb_dump_iseq(const rb_iseq_t *iseq)
@@ -74,92 +170,370 @@ llrb_dump_iseq(const rb_iseq_t *iseq)
   }
 }
 
+static void
+llrb_heap_set(size_t index, struct llrb_sample *sample)
+{
+  llrb_profiler.heap[index] = sample;
+  sample->heap_index = index;
+}
+
+static void
+llrb_heap_sift_up(size_t index)
+{
+  struct llrb_sample *sample = llrb_profiler.heap[index];
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+    if (llrb_profiler.heap[parent]->hotness >= sample->hotness) break;
+    llrb_heap_set(index, llrb_profiler.heap[parent]);
+    index = parent;
+  }
+  llrb_heap_set(index, sample);
+}
+
+static void
+llrb_heap_sift_down(size_t index)
+{
+  struct llrb_sample *sample = llrb_profiler.heap[index];
+  while (true) {
+    size_t child = index * 2 + 1;
+    if (child >= llrb_profiler.heap_size) break;
+    if (child + 1 < llrb_profiler.heap_size && llrb_profiler.heap[child + 1]->hotness > llrb_profiler.heap[child]->hotness) {
+      child++;
+    }
+    if (sample->hotness >= llrb_profiler.heap[child]->hotness) break;
+    llrb_heap_set(index, llrb_profiler.heap[child]);
+    index = child;
+  }
+  llrb_heap_set(index, sample);
+}
+
+static void
+llrb_heap_push(struct llrb_sample *sample)
+{
+  if (llrb_profiler.heap_size == llrb_profiler.heap_capa) {
+    llrb_profiler.heap_capa = llrb_profiler.heap_capa == 0 ? 64 : llrb_profiler.heap_capa * 2;
+    REALLOC_N(llrb_profiler.heap, struct llrb_sample *, llrb_profiler.heap_capa);
+  }
+  llrb_heap_set(llrb_profiler.heap_size, sample);
+  llrb_profiler.heap_size++;
+  llrb_heap_sift_up(sample->heap_index);
+}
+
+static void
+llrb_heap_remove(struct llrb_sample *sample)
+{
+  size_t index = sample->heap_index;
+  if (index == LLRB_NOT_IN_HEAP) return;
+  sample->heap_index = LLRB_NOT_IN_HEAP;
+
+  llrb_profiler.heap_size--;
+  if (index == llrb_profiler.heap_size) return;
+  struct llrb_sample *moved = llrb_profiler.heap[llrb_profiler.heap_size];
+  llrb_heap_set(index, moved);
+  llrb_heap_sift_up(index);
+  llrb_heap_sift_down(moved->heap_index);
+}
+
+static int
+llrb_scale_hotness_i(RB_UNUSED_VAR(st_data_t key), st_data_t val, st_data_t arg)
+{
+  ((struct llrb_sample *)val)->hotness /= *(double *)arg;
+  return ST_CONTINUE;
+}
+
+// Scaling all samples keeps their order, so the heap is still valid. This happens once per
+// log2(LLRB_HOTNESS_MAX_WEIGHT) half lives.
+static void
+llrb_grow_weight(void)
+{
+  llrb_profiler.weight *= llrb_profiler.weight_growth;
+  if (llrb_profiler.weight > LLRB_HOTNESS_MAX_WEIGHT) {
+    st_foreach(llrb_profiler.sample_by_iseq, llrb_scale_hotness_i, (st_data_t)&llrb_profiler.weight);
+    llrb_profiler.weight = 1.0;
+  }
+}
+
+static void
+llrb_push_preloaded(const rb_iseq_t *iseq)
+{
+  if (llrb_profiler.preloaded_size == llrb_profiler.preloaded_capa) {
+    llrb_profiler.preloaded_capa = llrb_profiler.preloaded_capa == 0 ? 16 : llrb_profiler.preloaded_capa * 2;
+    REALLOC_N(llrb_profiler.preloaded_queue, const rb_iseq_t *, llrb_profiler.preloaded_capa);
+  }
+  llrb_profiler.preloaded_queue[llrb_profiler.preloaded_size] = iseq;
+  llrb_profiler.preloaded_size++;
+  llrb_profiler.preloaded_pending = true;
+}
+
+// Creates a sample of `iseq` not sampled yet. If a previous process compiled it, it's queued to be compiled.
+static struct llrb_sample *
+llrb_create_sample(const rb_iseq_t *iseq, const rb_callable_method_entry_t *cme)
+{
+  extern void llrb_watch_iseq(const rb_iseq_t *iseq);
+  extern struct llrb_loop *llrb_find_loops(const rb_iseq_t *iseq, unsigned int *size);
+  struct llrb_sample *sample = ALLOC_N(struct llrb_sample, 1); // Freed by `llrb_profiler_free_sample`.
+  *sample = (struct llrb_sample){
+    .total_calls = 0,
+    .compiled_calls = 0,
+    .tier = LLRB_TIER_NONE,
+    .preloaded_tier = LLRB_TIER_NONE,
+    .cme = cme,
+    .iseq = iseq,
+    .hotness = 0,
+    .heap_index = LLRB_NOT_IN_HEAP,
+    .inclusive_calls = 0,
+    .loop_calls = 0,
+    .last_sampled = 0,
+    .evicted = false,
+  };
+  sample->loops = llrb_find_loops(iseq, &sample->loop_size);
+  if (!NIL_P(llrb_profiler.preloaded_profile) && RHASH_SIZE(llrb_profiler.preloaded_profile) > 0) {
+    extern VALUE llrb_iseq_profile_key(const rb_iseq_t *iseq);
+    VALUE tier = rb_hash_lookup(llrb_profiler.preloaded_profile, llrb_iseq_profile_key(iseq));
+    if (FIXNUM_P(tier) && FIX2INT(tier) > LLRB_TIER_NONE && FIX2INT(tier) <= LLRB_TIER_MAX) {
+      sample->preloaded_tier = (enum llrb_tier)FIX2INT(tier);
+      llrb_push_preloaded(iseq);
+    }
+  }
+  st_insert(llrb_profiler.sample_by_iseq, (st_data_t)iseq, (st_data_t)sample);
+  llrb_watch_iseq(iseq);
+  return sample;
+}
+
 static struct llrb_sample *
 llrb_sample_for(const rb_iseq_t *iseq, const rb_control_frame_t *cfp)
 {
-  st_data_t key = (st_data_t)iseq, val = 0;
-  struct llrb_sample *sample;
+  st_data_t val = 0;
+  if (st_lookup(llrb_profiler.sample_by_iseq, (st_data_t)iseq, &val)) return (struct llrb_sample *)val;
+  return llrb_create_sample(iseq, rb_vm_frame_method_entry(cfp));
+}
 
-  if (st_lookup(llrb_profiler.sample_by_iseq, key, &val)) {
-    sample = (struct llrb_sample *)val;
-  } else {
-    sample = ALLOC_N(struct llrb_sample, 1); // Not freed
-    *sample = (struct llrb_sample){
-      .total_calls = 0,
-      .compiled = false,
-      .cme = rb_vm_frame_method_entry(cfp),
-    };
-    val = (st_data_t)sample;
-    st_insert(llrb_profiler.sample_by_iseq, key, val);
+static bool llrb_compile_target_p(const rb_iseq_t *iseq, const struct llrb_sample *sample);
+
+// Only METHOD, BLOCK and MAIN iseqs are compiled.
+static bool
+llrb_compilable_type_p(const rb_iseq_t *iseq)
+{
+  switch (iseq->body->type) {
+    case ISEQ_TYPE_METHOD:
+    case ISEQ_TYPE_BLOCK:
+    case ISEQ_TYPE_MAIN:
+      return true;
+    default:
+      return false;
   }
+}
 
-  return sample;
+static bool
+llrb_in_loop_p(const struct llrb_sample *sample, const rb_control_frame_t *cfp)
+{
+  if (!cfp->pc || sample->loop_size == 0) return false;
+  ptrdiff_t diff = cfp->pc - cfp->iseq->body->iseq_encoded;
+  if (diff < 0) return false;
+
+  unsigned int pos = (unsigned int)diff;
+  for (unsigned int i = 0; i < sample->loop_size; i++) {
+    if (sample->loops[i].start <= pos && pos <= sample->loops[i].end) return true;
+  }
+  return false;
 }
 
-// Profile only stack top.
+// Space-saving: a new caller replaces the least frequent one and inherits its count.
+static void
+llrb_record_caller(struct llrb_sample *sample, const rb_iseq_t *caller)
+{
+  struct llrb_caller_edge *min = sample->callers;
+  for (int i = 0; i < LLRB_CALLER_EDGES; i++) {
+    struct llrb_caller_edge *edge = sample->callers + i;
+    if (edge->caller == caller) {
+      edge->count++;
+      return;
+    }
+    if (edge->count < min->count) min = edge;
+  }
+  min->caller = caller;
+  min->count++;
+}
+
+void llrb_profiler_free_sample(const rb_iseq_t *iseq);
+
+static int
+llrb_collect_prunable_sample_i(RB_UNUSED_VAR(st_data_t key), st_data_t val, st_data_t arg)
+{
+  struct llrb_sample *sample = (struct llrb_sample *)val;
+  struct llrb_sample ***tail = (struct llrb_sample ***)arg;
+  if (sample->tier == LLRB_TIER_NONE && sample->preloaded_tier == LLRB_TIER_NONE && !sample->evicted) {
+    *(*tail)++ = sample;
+  }
+  return ST_CONTINUE;
+}
+
+static int
+llrb_sample_hotness_cmp(const void *a, const void *b)
+{
+  double x = (*(struct llrb_sample *const *)a)->hotness, y = (*(struct llrb_sample *const *)b)->hotness;
+  return (x > y) - (x < y);
+}
+
+// Samples are freed when their iseqs are freed, but living iseqs sampled only a few times (e.g. code run once at
+// boot) would still grow the table. When it exceeds LLRB_SAMPLE_TABLE_MAX, the coldest samples are dropped down to
+// 3/4 of it. Compiled, evicted or preloaded ones are kept, because their state decides what profiler compiles.
+// If they alone keep the table full, the next prune waits for max/4 more samples instead of rescanning every job.
+static void
+llrb_prune_samples(void)
+{
+  st_table *table = llrb_profiler.sample_by_iseq;
+  size_t max = llrb_profiler.sample_table_max;
+  if (table->num_entries <= max) llrb_profiler.prune_threshold = max;
+  if (table->num_entries <= llrb_profiler.prune_threshold) return;
+
+  struct llrb_sample **prunable = ALLOC_N(struct llrb_sample *, table->num_entries); // `xfree`d in this function.
+  struct llrb_sample **tail = prunable;
+  st_foreach(table, llrb_collect_prunable_sample_i, (st_data_t)&tail);
+  size_t size = (size_t)(tail - prunable);
+  qsort(prunable, size, sizeof(struct llrb_sample *), llrb_sample_hotness_cmp);
+
+  for (size_t i = 0; i < size && table->num_entries > max / 4 * 3; i++) {
+    llrb_profiler_free_sample(prunable[i]->iseq);
+  }
+  xfree(prunable);
+  llrb_profiler.prune_threshold = table->num_entries > max / 4 * 3 ? table->num_entries + max / 4 : max;
+}
+
+// Walks `depth` frames from stack top. The nearest ISeq frame gets a self sample, which includes time spent by
+// C functions called by it (e.g. Array#each). Callers get inclusive samples and caller->callee edges.
 static void
 llrb_profile_frame()
 {
+  llrb_prune_samples(); // Before taking samples' pointers in this function.
+
   rb_thread_t *th = GET_THREAD();
+  const rb_control_frame_t *end_cfp = RUBY_VM_END_CONTROL_FRAME(th);
+  const rb_iseq_t *profiled[LLRB_PROFILE_MAX_DEPTH];
+  long profiled_size = 0;
+  struct llrb_sample *callee = 0;
+
   rb_control_frame_t *cfp = th->cfp;
+  for (long i = 0; i < llrb_profiler.depth && RUBY_VM_VALID_CONTROL_FRAME_P(cfp, end_cfp); i++) {
+    const rb_iseq_t *iseq = cfp->iseq;
+    if (RUBY_VM_NORMAL_ISEQ_P(iseq)) {
+      struct llrb_sample *sample = llrb_sample_for(iseq, cfp);
+      sample->last_sampled = llrb_profiler.profile_times + 1; // Incremented after this loop.
+      if (callee) {
+        llrb_record_caller(callee, iseq);
+      } else {
+        sample->total_calls++;
+        LLRB_PROBE_SAMPLE(iseq->body, sample->tier, sample->total_calls);
+        sample->hotness += llrb_profiler.weight;
+        if (llrb_in_loop_p(sample, cfp)) sample->loop_calls++;
+        if (sample->heap_index != LLRB_NOT_IN_HEAP) {
+          llrb_heap_sift_up(sample->heap_index);
+        } else if (llrb_compilable_type_p(iseq) && llrb_compile_target_p(iseq, sample)) {
+          llrb_heap_push(sample);
+        }
+      }
 
-  if (cfp->iseq) {
-    struct llrb_sample *sample = llrb_sample_for(cfp->iseq, cfp);
-    sample->total_calls++;
+      bool recursive = false;
+      for (long j = 0; j < profiled_size; j++) {
+        if (profiled[j] == iseq) recursive = true;
+      }
+      if (!recursive) {
+        sample->inclusive_calls++;
+        profiled[profiled_size++] = iseq;
+      }
+      callee = sample;
+    }
+    cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp);
   }
-  cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp);
+  llrb_grow_weight();
 
+  extern void llrb_stats_increment(enum llrb_stats_counter counter);
+  llrb_stats_increment(LLRB_STATS_SAMPLED_FRAMES);
   llrb_profiler.profile_times++;
 }
 
 struct llrb_compile_target {
   const rb_iseq_t *iseq;
   struct llrb_sample* sample;
+  bool preloaded; // true if `iseq` is compiled in a previous process and not in this one yet.
 };
 
-static int
-llrb_search_compile_target_i(st_data_t key, st_data_t val, st_data_t arg)
+// Not compiled iseq, baseline-tier iseq which is still hot after compilation, or iseq whose speculation
+// has failed can be a target.
+static bool
+llrb_compile_target_p(const rb_iseq_t *iseq, const struct llrb_sample *sample)
 {
-  struct llrb_compile_target *target = (struct llrb_compile_target *)arg;
-  const rb_iseq_t *iseq = (const rb_iseq_t *)key;
-  struct llrb_sample *sample = (struct llrb_sample *)val;
+  extern bool llrb_deopted_p(const rb_iseq_t *iseq);
+  if (sample->tier != LLRB_TIER_NONE && llrb_deopted_p(iseq)) return true;
+  if (sample->tier < sample->preloaded_tier) return true;
 
-  if (sample->compiled) return ST_CONTINUE;
-
-  switch (iseq->body->type) {
-    case ISEQ_TYPE_METHOD:
-    case ISEQ_TYPE_BLOCK:
-    case ISEQ_TYPE_MAIN:
-      if (!target->iseq && !target->sample) {
-        target->iseq = iseq;
-        target->sample = sample;
-      }
-      if (sample->total_calls > target->sample->total_calls) {
-        target->iseq = iseq;
-        target->sample = sample;
-      }
-      break;
+  switch (sample->tier) {
+    case LLRB_TIER_NONE:
+      if (sample->evicted) return sample->total_calls - sample->compiled_calls >= LLRB_TIER_UP_CALLS;
+      return sample->total_calls >= llrb_profiler.min_samples;
+    case LLRB_TIER_BASELINE:
+      return sample->total_calls - sample->compiled_calls >= LLRB_TIER_UP_CALLS;
     default:
-      break;
+      return false;
   }
+}
 
-  return ST_CONTINUE;
+// Pops iseqs compiled in a previous process until one which is alive and still not compiled in its tier.
+static struct llrb_compile_target
+llrb_pop_preloaded_target(void)
+{
+  struct llrb_compile_target target = (struct llrb_compile_target){ .sample = 0, .iseq = 0, .preloaded = true };
+  while (llrb_profiler.preloaded_size > 0) {
+    llrb_profiler.preloaded_size--;
+    const rb_iseq_t *iseq = llrb_profiler.preloaded_queue[llrb_profiler.preloaded_size];
+
+    st_data_t val;
+    if (!st_lookup(llrb_profiler.sample_by_iseq, (st_data_t)iseq, &val)) continue; // Freed by GC.
+    struct llrb_sample *sample = (struct llrb_sample *)val;
+    if (BUILTIN_TYPE((VALUE)iseq) != T_IMEMO) continue; // Freed by GC and waiting for its finalizer.
+    if (sample->tier >= sample->preloaded_tier || !llrb_compilable_type_p(iseq)) continue;
+
+    target.iseq = iseq;
+    target.sample = sample;
+    break;
+  }
+  return target;
 }
 
-// Return METHOD or BLOCK iseq which is called the most
-static const rb_iseq_t *
-llrb_search_compile_target()
+// Removes heap's top until one which is still a compile target. Removed samples are pushed again when they
+// become a target by later samples.
+static struct llrb_compile_target
+llrb_pop_hot_target(void)
 {
-  struct llrb_compile_target target = (struct llrb_compile_target){
-    .sample = 0,
-    .iseq = 0,
-  };
-  st_foreach(llrb_profiler.sample_by_iseq, llrb_search_compile_target_i, (st_data_t)&target);
+  struct llrb_compile_target target = (struct llrb_compile_target){ .sample = 0, .iseq = 0, .preloaded = false };
+  while (llrb_profiler.heap_size > 0) {
+    struct llrb_sample *sample = llrb_profiler.heap[0];
+    llrb_heap_remove(sample);
+    if (BUILTIN_TYPE((VALUE)sample->iseq) != T_IMEMO) continue; // Freed by GC and waiting for its finalizer.
+    if (!llrb_compile_target_p(sample->iseq, sample)) continue;
 
+    target.iseq = sample->iseq;
+    target.sample = sample;
+    break;
+  }
+  return target;
+}
+
+// Return METHOD or BLOCK iseq which is compiled in a previous process, or the hottest one
+static struct llrb_compile_target
+llrb_search_compile_target(bool preloaded_only)
+{
+  struct llrb_compile_target target = llrb_pop_preloaded_target();
+  if (!target.iseq && !preloaded_only) target = llrb_pop_hot_target();
+
+  extern bool llrb_deopted_p(const rb_iseq_t *iseq);
   if (target.sample) {
-    target.sample->compiled = true;
+    if (!llrb_deopted_p(target.iseq)) target.sample->tier++; // Deoptimized iseq is recompiled in the same tier.
+    target.sample->compiled_calls = target.sample->total_calls;
+    if (target.sample->tier < target.sample->preloaded_tier) llrb_push_preloaded(target.iseq); // Compile next tier.
   }
-  return target.iseq;
+  llrb_profiler.preloaded_pending = llrb_profiler.preloaded_size > 0;
+  return target;
 }
 
 static VALUE
@@ -171,70 +545,285 @@ llrb_compile_error_handler(RB_UNUSED_VAR(VALUE nil), VALUE e)
   return Qnil;
 }
 
-// Compile iseq with compile error suppressed.
+// Compile iseq with compile error suppressed. In async mode, this only builds LLVM IR and enqueues it.
 static VALUE
 llrb_safe_compile_iseq(const rb_iseq_t *iseq)
 {
-  extern VALUE llrb_compile_iseq_to_method_without_stats(const rb_iseq_t *iseq);
-  return rb_rescue(llrb_compile_iseq_to_method_without_stats, (VALUE)iseq,
+  extern VALUE llrb_compile_iseq_by_profiler(const rb_iseq_t *iseq);
+  extern VALUE llrb_enqueue_iseq_by_profiler(const rb_iseq_t *iseq);
+  if (llrb_profiler.async) {
+    return rb_rescue(llrb_enqueue_iseq_by_profiler, (VALUE)iseq,
+        llrb_compile_error_handler, Qnil);
+  }
+  return rb_rescue(llrb_compile_iseq_by_profiler, (VALUE)iseq,
       llrb_compile_error_handler, Qnil);
 }
 
+static VALUE rb_jit_stop(VALUE self);
+
+// Returns true if `max_compiles_per_sec` allows one more compilation now.
+static bool
+llrb_compile_rate_available(double now)
+{
+  if (llrb_profiler.max_compiles_per_sec < 0) return true;
+  if (now - llrb_profiler.rate_window_start >= 1.0) {
+    llrb_profiler.rate_window_start = now;
+    llrb_profiler.rate_window_compiles = 0;
+  }
+  return llrb_profiler.rate_window_compiles < llrb_profiler.max_compiles_per_sec;
+}
+
 static void
 llrb_job_handler(void *data)
 {
+  extern bool llrb_dumping_iseq_p(void);
   static int in_job_handler = 0;
   if (in_job_handler) return;
-  if (!llrb_profiler.running) return;
+  if (!llrb_profiler.running || llrb_dumping_iseq_p()) return;
+
+  extern double llrb_stats_now(void);
+  extern void llrb_stats_add_time(enum llrb_stats_phase phase, double sec);
+  double started_at = llrb_stats_now();
 
   in_job_handler++;
   llrb_profile_frame();
 
-  if (llrb_profiler.profile_times % LLRB_COMPILE_INTERVAL_TIMES == 0) {
-    const rb_iseq_t *iseq = llrb_search_compile_target();
-    if (iseq) {
-      VALUE result = llrb_safe_compile_iseq(iseq);
-
-      if (LLRB_ENABLE_DEBUG) {
-        llrb_dump_iseq(iseq);
-        fprintf(stderr, " => ");
-
-        switch (result) {
-          case Qtrue:
-            fprintf(stderr, "success!");
-            break;
-          case Qfalse:
-            fprintf(stderr, "not compiled");
-            break;
-          case Qnil:
-            fprintf(stderr, "COMPILE ERROR");
-            break;
-          default:
-            fprintf(stderr, "???");
-            break;
-        }
-        fprintf(stderr, "\n");
+  // Postponed job is a safe point to replace iseq_encoded, both for invalidation and for a native function
+  // compiled by worker.
+  extern void llrb_invalidate_stale_iseqs(void);
+  extern bool llrb_worker_install(void);
+  extern bool llrb_worker_idle(void);
+  llrb_invalidate_stale_iseqs();
+  if (llrb_profiler.async) llrb_worker_install();
+
+  // Each window compiles up to `batch_size` hottest iseqs, one per job. Methods compiled by a previous process
+  // are compiled on every job until all of them are compiled.
+  struct llrb_compile_target target = (struct llrb_compile_target){ .sample = 0, .iseq = 0 };
+  if (llrb_profiler.profile_times % llrb_profiler.compile_every == 0) {
+    llrb_profiler.batch_pending = llrb_profiler.batch_size;
+  }
+  bool batch = llrb_profiler.batch_pending > 0;
+  if ((batch || llrb_profiler.preloaded_pending) && (!llrb_profiler.async || llrb_worker_idle())
+      && llrb_compile_rate_available(started_at)) {
+    target = llrb_search_compile_target(!batch);
+    if (batch && !target.preloaded) llrb_profiler.batch_pending = target.iseq ? llrb_profiler.batch_pending - 1 : 0;
+  }
+  llrb_stats_add_time(LLRB_STATS_PROFILE, llrb_stats_now() - started_at); // Compilation is measured by its phases.
+
+  const rb_iseq_t *iseq = target.iseq;
+  if (iseq && llrb_profiler.compile_budget != 0) {
+    VALUE result = llrb_safe_compile_iseq(iseq);
+    if (result != Qtrue) target.sample->tier = LLRB_TIER_MAX; // Don't retry what was rejected.
+    if (result == Qtrue && llrb_profiler.compile_budget > 0) llrb_profiler.compile_budget--;
+    if (result == Qtrue) llrb_profiler.rate_window_compiles++;
+
+    if (LLRB_ENABLE_DEBUG) {
+      llrb_dump_iseq(iseq);
+      fprintf(stderr, " => ");
+
+      switch (result) {
+        case Qtrue:
+          fprintf(stderr, llrb_profiler.async ? "enqueued" : "success!");
+          break;
+        case Qfalse:
+          fprintf(stderr, "not compiled");
+          break;
+        case Qnil:
+          fprintf(stderr, "COMPILE ERROR");
+          break;
+        default:
+          fprintf(stderr, "???");
+          break;
       }
+      fprintf(stderr, "\n");
     }
   }
   in_job_handler--;
+
+  // Sampling is no longer useful for a child which has used up its budget. Worker's job is installed by the stop.
+  if (llrb_profiler.compile_budget == 0) rb_jit_stop(Qnil);
+}
+
+#if LLRB_THREAD_TIMER
+static struct itimerspec
+llrb_timer_spec(long usec)
+{
+  struct itimerspec spec;
+  spec.it_interval.tv_sec = usec / 1000000;
+  spec.it_interval.tv_nsec = (usec % 1000000) * 1000;
+  spec.it_value = spec.it_interval;
+  return spec;
 }
 
+// Deletes timers of native threads which have exited. A timer isn't deleted with its thread, and Ruby doesn't tell
+// a C extension that a thread exits without an event hook, which would disable JIT-ed code's fast paths.
+static void
+llrb_sweep_thread_timers(void)
+{
+  pid_t pid = getpid();
+  for (size_t i = 0; i < llrb_profiler.thread_timer_size;) {
+    struct llrb_thread_timer *entry = llrb_profiler.thread_timers + i;
+    if (syscall(SYS_tgkill, pid, entry->tid, 0) == 0 || errno != ESRCH) {
+      i++;
+      continue;
+    }
+    timer_delete(entry->timer);
+    llrb_profiler.thread_timer_size--;
+    *entry = llrb_profiler.thread_timers[llrb_profiler.thread_timer_size];
+  }
+}
+
+// Creates CPU-time timer of current thread if it doesn't have one. This must be called with GVL. Timers of exited
+// threads are swept here, so that they don't grow with the number of threads created by an application.
+static void
+llrb_ensure_thread_timer(void)
+{
+  if (llrb_thread_timer_generation == llrb_profiler.timer_generation) return;
+  llrb_sweep_thread_timers();
+
+  pid_t tid = (pid_t)syscall(SYS_gettid);
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+  sev.sigev_notify_thread_id = tid;
+
+  timer_t timer;
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) != 0) return; // Sampled by ITIMER_PROF instead.
+  struct itimerspec spec = llrb_timer_spec(llrb_profiler.interval_usec);
+  timer_settime(timer, 0, &spec, NULL);
+
+  if (llrb_profiler.thread_timer_size == llrb_profiler.thread_timer_capa) {
+    llrb_profiler.thread_timer_capa = llrb_profiler.thread_timer_capa == 0 ? 8 : llrb_profiler.thread_timer_capa * 2;
+    REALLOC_N(llrb_profiler.thread_timers, struct llrb_thread_timer, llrb_profiler.thread_timer_capa);
+  }
+  struct llrb_thread_timer *entry = llrb_profiler.thread_timers + llrb_profiler.thread_timer_size;
+  *entry = (struct llrb_thread_timer){ .timer = timer, .tid = tid };
+  llrb_profiler.thread_timer_size++;
+  llrb_thread_timer_generation = llrb_profiler.timer_generation;
+}
+
+// Timers are not inherited by forked child, so child just forgets them with `delete` = false.
+static void
+llrb_forget_thread_timers(bool delete)
+{
+  for (size_t i = 0; delete && i < llrb_profiler.thread_timer_size; i++) {
+    timer_delete(llrb_profiler.thread_timers[i].timer);
+  }
+  llrb_profiler.thread_timer_size = 0;
+  llrb_profiler.timer_generation++;
+}
+
+// ITIMER_PROF's job. It samples current thread only if the thread couldn't create its own timer.
+static void
+llrb_discovery_job_handler(void *data)
+{
+  if (!llrb_profiler.running) return;
+  llrb_ensure_thread_timer();
+  if (llrb_thread_timer_generation != llrb_profiler.timer_generation) llrb_job_handler(data);
+}
+#endif
+
 static void
 llrb_signal_handler(int sig, siginfo_t *sinfo, void *ucontext)
 {
-  if (GET_VM()->running && !rb_during_gc()) {
-    rb_postponed_job_register_one(0, llrb_job_handler, 0);
+  if (!GET_VM()->running || rb_during_gc()) return;
+#if LLRB_THREAD_TIMER
+  if (sinfo->si_code != SI_TIMER) {
+    rb_postponed_job_register_one(0, llrb_discovery_job_handler, 0);
+    return;
+  }
+  // CPU time consumed without GVL is not the time of Ruby code which is sampled.
+  if (!pthread_equal(pthread_self(), GET_THREAD()->thread_id)) return;
+#endif
+  rb_postponed_job_register_one(0, llrb_job_handler, 0);
+}
+
+// Arms ITIMER_PROF, and thread timers which already exist.
+static void
+llrb_start_timer(void)
+{
+  struct itimerval timer;
+  long usec = llrb_profiler.interval_usec;
+#if LLRB_THREAD_TIMER
+  usec *= LLRB_DISCOVERY_INTERVAL_RATE;
+  struct itimerspec spec = llrb_timer_spec(llrb_profiler.interval_usec);
+  for (size_t i = 0; i < llrb_profiler.thread_timer_size; i++) {
+    timer_settime(llrb_profiler.thread_timers[i].timer, 0, &spec, NULL);
   }
+#endif
+  timer.it_interval.tv_sec = usec / 1000000;
+  timer.it_interval.tv_usec = usec % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, 0);
+}
+
+static void
+llrb_stop_timer(void)
+{
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, 0);
+#if LLRB_THREAD_TIMER
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  for (size_t i = 0; i < llrb_profiler.thread_timer_size; i++) {
+    timer_settime(llrb_profiler.thread_timers[i].timer, 0, &spec, NULL);
+  }
+#endif
+}
+
+// Returns positive integer `config[key]`, or `default_value` if it's nil or not given.
+static long
+llrb_config_positive(VALUE config, const char *key, long default_value)
+{
+  VALUE value = rb_hash_lookup(config, ID2SYM(rb_intern(key)));
+  if (NIL_P(value)) return default_value;
+
+  long num = NUM2LONG(value);
+  if (num <= 0) rb_raise(rb_eArgError, "%s must be positive but got %ld", key, num);
+  return num;
+}
+
+// Returns non-negative integer `config[key]`, or -1 (unlimited) if it's nil or not given.
+static long
+llrb_config_limit(VALUE config, const char *key)
+{
+  VALUE value = rb_hash_lookup(config, ID2SYM(rb_intern(key)));
+  if (NIL_P(value)) return -1;
+
+  long num = NUM2LONG(value);
+  if (num < 0) rb_raise(rb_eArgError, "%s must not be negative but got %ld", key, num);
+  return num;
 }
 
 static VALUE
-rb_jit_start(RB_UNUSED_VAR(VALUE self))
+rb_jit_start(RB_UNUSED_VAR(VALUE self), VALUE async, VALUE fork_budget, VALUE config)
 {
+  extern void llrb_worker_set_size(long size);
   struct sigaction sa;
-  struct itimerval timer;
 
   if (llrb_profiler.running) return Qfalse;
+  config = rb_convert_type(config, T_HASH, "Hash", "to_hash");
+  llrb_profiler.interval_usec = llrb_config_positive(config, "interval", LLRB_PROFILE_INTERVAL_USEC);
+  llrb_profiler.compile_every = (size_t)llrb_config_positive(config, "compile_every", LLRB_COMPILE_INTERVAL_TIMES);
+  llrb_profiler.batch_size = (size_t)llrb_config_positive(config, "batch", LLRB_COMPILE_BATCH_SIZE);
+  llrb_profiler.min_samples = (size_t)llrb_config_positive(config, "min_samples", LLRB_COMPILE_MIN_SAMPLES);
+  llrb_profiler.depth = llrb_config_positive(config, "depth", LLRB_PROFILE_DEPTH);
+  if (llrb_profiler.depth > LLRB_PROFILE_MAX_DEPTH) {
+    rb_raise(rb_eArgError, "depth must be %d or less but got %ld", LLRB_PROFILE_MAX_DEPTH, llrb_profiler.depth);
+  }
+  long workers = llrb_config_positive(config, "workers", LLRB_COMPILE_WORKERS);
+  llrb_profiler.max_compiles_per_sec = llrb_config_limit(config, "max_compiles_per_sec");
+  llrb_profiler.compile_budget = llrb_config_limit(config, "max_compiles");
+  llrb_profiler.batch_pending = 0;
+  llrb_profiler.rate_window_start = 0;
+  llrb_profiler.rate_window_compiles = 0;
+  if (llrb_profiler.compile_budget == 0) return Qfalse;
+
+  llrb_profiler.async = RTEST(async);
+  llrb_worker_set_size(workers);
+  llrb_profiler.fork_budget = NIL_P(fork_budget) ? -1 : NUM2LONG(fork_budget);
   if (!llrb_profiler.sample_by_iseq) {
     llrb_profiler.sample_by_iseq = st_init_numtable();
   }
@@ -243,92 +832,328 @@ rb_jit_start(RB_UNUSED_VAR(VALUE self))
   sa.sa_flags = SA_RESTART | SA_SIGINFO;
   sigemptyset(&sa.sa_mask);
   sigaction(SIGPROF, &sa, NULL);
-
-  timer.it_interval.tv_sec = 0;
-  timer.it_interval.tv_usec = LLRB_PROFILE_INTERVAL_USEC;
-  timer.it_value = timer.it_interval;
-  setitimer(ITIMER_PROF, &timer, 0);
+  llrb_start_timer();
+#if LLRB_THREAD_TIMER
+  llrb_ensure_thread_timer();
+#endif
 
   llrb_profiler.running = true;
   return Qtrue;
 }
 
+struct llrb_hot_iseqs {
+  size_t min_samples;
+  VALUE iseqs; // Array of iseq addresses as Integer, not to be marked as VALUE.
+};
+
+static int
+llrb_collect_hot_iseq_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+  const rb_iseq_t *iseq = (const rb_iseq_t *)key;
+  const struct llrb_sample *sample = (const struct llrb_sample *)val;
+  struct llrb_hot_iseqs *hot = (struct llrb_hot_iseqs *)arg;
+
+  if (BUILTIN_TYPE((VALUE)iseq) != T_IMEMO) return ST_CONTINUE; // Freed by GC and waiting for its finalizer.
+  if (sample->tier == LLRB_TIER_MAX || sample->total_calls < hot->min_samples) return ST_CONTINUE;
+  switch (iseq->body->type) {
+    case ISEQ_TYPE_METHOD:
+    case ISEQ_TYPE_BLOCK:
+    case ISEQ_TYPE_MAIN:
+      rb_ary_push(hot->iseqs, ULL2NUM((unsigned long long)key));
+      break;
+    default:
+      break;
+  }
+  return ST_CONTINUE;
+}
+
+// LLRB::JIT.compile_hot_methods
+// @param  [Integer] min_samples - iseqs sampled this times or more are compiled
+// @return [Integer] the number of compiled iseqs
+static VALUE
+rb_jit_compile_hot_methods(RB_UNUSED_VAR(VALUE self), VALUE min_samples)
+{
+  extern VALUE llrb_compile_hot_iseq(const rb_iseq_t *iseq);
+  if (!llrb_profiler.sample_by_iseq) return INT2FIX(0);
+
+  // Compilation may create samples' finalizers, so the table is not iterated while compiling.
+  struct llrb_hot_iseqs hot = (struct llrb_hot_iseqs){ .min_samples = NUM2SIZET(min_samples), .iseqs = rb_ary_new() };
+  st_foreach(llrb_profiler.sample_by_iseq, llrb_collect_hot_iseq_i, (st_data_t)&hot);
+
+  long compiled = 0;
+  for (long i = 0; i < RARRAY_LEN(hot.iseqs); i++) {
+    st_data_t key = (st_data_t)NUM2ULL(RARRAY_AREF(hot.iseqs, i)), val;
+    if (!st_lookup(llrb_profiler.sample_by_iseq, key, &val)) continue; // Freed by GC while compiling others.
+
+    const rb_iseq_t *iseq = (const rb_iseq_t *)key;
+    if (BUILTIN_TYPE((VALUE)iseq) != T_IMEMO) continue; // Freed by GC and waiting for its finalizer.
+    if (rb_rescue(llrb_compile_hot_iseq, (VALUE)iseq, llrb_compile_error_handler, Qnil) == Qtrue) compiled++;
+    ((struct llrb_sample *)val)->tier = LLRB_TIER_MAX; // Compiled in the highest tier, or rejected.
+  }
+  RB_GC_GUARD(hot.iseqs);
+  return LONG2NUM(compiled);
+}
+
+static int
+llrb_sampled_profile_i(st_data_t key, st_data_t val, st_data_t arg)
+{
+  extern VALUE llrb_iseq_profile_key(const rb_iseq_t *iseq);
+  const rb_iseq_t *iseq = (const rb_iseq_t *)key;
+  const struct llrb_sample *sample = (const struct llrb_sample *)val;
+  if (BUILTIN_TYPE((VALUE)iseq) != T_IMEMO) return ST_CONTINUE; // Freed by GC and waiting for its finalizer.
+
+  VALUE callers = rb_hash_new();
+  for (int i = 0; i < LLRB_CALLER_EDGES; i++) {
+    const struct llrb_caller_edge *edge = sample->callers + i;
+    if (edge->count == 0 || !st_lookup(llrb_profiler.sample_by_iseq, (st_data_t)edge->caller, 0)) continue; // Freed.
+    if (BUILTIN_TYPE((VALUE)edge->caller) != T_IMEMO) continue;
+    rb_hash_aset(callers, llrb_iseq_profile_key(edge->caller), SIZET2NUM(edge->count));
+  }
+
+  VALUE entry = rb_hash_new();
+  rb_hash_aset(entry, ID2SYM(rb_intern("path")), rb_str_dup(iseq->body->location.path));
+  rb_hash_aset(entry, ID2SYM(rb_intern("line")), iseq->body->location.first_lineno);
+  rb_hash_aset(entry, ID2SYM(rb_intern("label")), rb_str_dup(iseq->body->location.label));
+  rb_hash_aset(entry, ID2SYM(rb_intern("self")), SIZET2NUM(sample->total_calls));
+  rb_hash_aset(entry, ID2SYM(rb_intern("inclusive")), SIZET2NUM(sample->inclusive_calls));
+  rb_hash_aset(entry, ID2SYM(rb_intern("loop")), SIZET2NUM(sample->loop_calls));
+  rb_hash_aset(entry, ID2SYM(rb_intern("callers")), callers);
+  rb_hash_aset((VALUE)arg, llrb_iseq_profile_key(iseq), entry);
+  return ST_CONTINUE;
+}
+
+// LLRB::JIT.sampled_profile
+// @return [Hash] - { String => { path: String, line: Integer, label: String, self: Integer, inclusive: Integer,
+//                  loop: Integer, callers: { String => Integer } } }
+static VALUE
+rb_jit_sampled_profile(RB_UNUSED_VAR(VALUE self))
+{
+  VALUE profile = rb_hash_new();
+  if (llrb_profiler.sample_by_iseq) {
+    st_foreach(llrb_profiler.sample_by_iseq, llrb_sampled_profile_i, (st_data_t)profile);
+  }
+  return profile;
+}
+
+// LLRB::JIT.preload_profile
+// @param [Hash] profile - { String => Integer } returned by LLRB::JIT.compiled_profile in a previous process.
+static VALUE
+rb_jit_preload_profile(RB_UNUSED_VAR(VALUE self), VALUE profile)
+{
+  llrb_profiler.preloaded_profile = rb_hash_dup(rb_convert_type(profile, T_HASH, "Hash", "to_hash"));
+  return Qnil;
+}
+
+// LLRB::JIT.preload_iseq
+// Used when a method listed by LLRB::JIT.start's `profile:` is defined, so that it's compiled by the next postponed
+// job without waiting for the first sample.
+// @param  [RubyVM::InstructionSequence] iseqw - ISeq of the defined method
+// @return [Boolean] true if it's queued to be compiled
+static VALUE
+rb_jit_preload_iseq(RB_UNUSED_VAR(VALUE self), VALUE iseqw)
+{
+  extern const rb_iseq_t *rb_iseqw_to_iseq(VALUE iseqw);
+  const rb_iseq_t *iseq = rb_iseqw_to_iseq(iseqw);
+  if (!llrb_profiler.sample_by_iseq || st_lookup(llrb_profiler.sample_by_iseq, (st_data_t)iseq, 0)) return Qfalse;
+  if (!llrb_compilable_type_p(iseq)) return Qfalse;
+
+  const struct llrb_sample *sample = llrb_create_sample(iseq, 0);
+  return sample->preloaded_tier != LLRB_TIER_NONE ? Qtrue : Qfalse;
+}
+
+// LLRB::JIT.set_sample_table_max
+// Lowers the number of samples kept by `llrb_prune_samples` for specs.
+// @param  [Integer] max - the number of samples, or nil for LLRB_SAMPLE_TABLE_MAX
+// @return [Integer] the previous one
+static VALUE
+rb_jit_set_sample_table_max(RB_UNUSED_VAR(VALUE self), VALUE max)
+{
+  size_t prev = llrb_profiler.sample_table_max;
+  llrb_profiler.sample_table_max = NIL_P(max) ? LLRB_SAMPLE_TABLE_MAX : NUM2SIZET(max);
+  llrb_profiler.prune_threshold = llrb_profiler.sample_table_max;
+  return SIZET2NUM(prev);
+}
+
+// LLRB::JIT.sample_caller
+// Takes a sample of the caller's frames like the timer does, so that specs don't depend on when it fires.
+// Arguments are ignored, so that its Method can be a block yielded by C methods.
+// @return [Boolean] true if profiler is running and the sample is taken
+static VALUE
+rb_jit_sample_caller(RB_UNUSED_VAR(int argc), RB_UNUSED_VAR(VALUE *argv), RB_UNUSED_VAR(VALUE self))
+{
+  if (!llrb_profiler.running || !llrb_profiler.sample_by_iseq) return Qfalse;
+
+  long depth = llrb_profiler.depth;
+  llrb_profiler.depth++; // This method's frame has no ISeq, and is skipped.
+  llrb_profile_frame();
+  llrb_profiler.depth = depth;
+  return Qtrue;
+}
+
 static VALUE
 rb_jit_stop(RB_UNUSED_VAR(VALUE self))
 {
   struct sigaction sa;
-  struct itimerval timer;
 
   if (!llrb_profiler.running) return Qfalse;
   llrb_profiler.running = false;
 
-	memset(&timer, 0, sizeof(timer));
-	setitimer(ITIMER_PROF, &timer, 0);
+  llrb_stop_timer();
+#if LLRB_THREAD_TIMER
+  llrb_forget_thread_timers(true);
+#endif
 
 	sa.sa_handler = SIG_IGN;
 	sa.sa_flags = SA_RESTART;
 	sigemptyset(&sa.sa_mask);
 	sigaction(SIGPROF, &sa, NULL);
 
+  // Worker must not run LLVM after Ruby VM is shut down.
+  extern void llrb_worker_flush(void);
+  llrb_worker_flush();
+
   return Qtrue;
 }
 
-static int
-llrb_gc_mark_i(st_data_t key, st_data_t val, st_data_t arg)
+static struct llrb_sample *
+llrb_find_sample(const rb_iseq_t *iseq)
 {
-  VALUE frame = (VALUE)key;
-  rb_gc_mark(frame);
-  return ST_CONTINUE;
+  st_data_t val;
+  if (llrb_profiler.sample_by_iseq && st_lookup(llrb_profiler.sample_by_iseq, (st_data_t)iseq, &val)) {
+    return (struct llrb_sample *)val;
+  }
+  return 0;
 }
 
-static void
-llrb_gc_mark(void *data)
+// Used by llrb.c in async mode for a block passed by a method enqueued in `tier`. The block is enqueued by next jobs,
+// one per idle worker, like a method compiled by a previous process.
+void
+llrb_profiler_queue_block(const rb_iseq_t *blockiseq, enum llrb_tier tier)
 {
-  if (llrb_profiler.sample_by_iseq) {
-    st_foreach(llrb_profiler.sample_by_iseq, llrb_gc_mark_i, 0);
+  if (!llrb_profiler.sample_by_iseq || !llrb_compilable_type_p(blockiseq)) return;
+  struct llrb_sample *sample = llrb_find_sample(blockiseq);
+  if (!sample) sample = llrb_create_sample(blockiseq, 0);
+  if (sample->tier >= tier || sample->preloaded_tier >= tier) return;
+
+  sample->preloaded_tier = tier;
+  llrb_push_preloaded(blockiseq);
+}
+
+// Used by llrb.c to find least recently sampled iseqs for code size limit. 0 if iseq is never sampled.
+size_t
+llrb_profiler_last_sampled(const rb_iseq_t *iseq)
+{
+  const struct llrb_sample *sample = llrb_find_sample(iseq);
+  return sample ? sample->last_sampled : 0;
+}
+
+// Used by llrb.c after iseq's native code is evicted. It's compiled from baseline tier when it's sampled
+// LLRB_TIER_UP_CALLS times more, even if a previous process compiled it.
+void
+llrb_profiler_reset_sample(const rb_iseq_t *iseq)
+{
+  struct llrb_sample *sample = llrb_find_sample(iseq);
+  if (!sample) return;
+  sample->tier = LLRB_TIER_NONE;
+  sample->preloaded_tier = LLRB_TIER_NONE;
+  sample->compiled_calls = sample->total_calls;
+  sample->evicted = true;
+}
+
+// Used by llrb.c. Sampled iseqs are not marked, so that code unloaded by an application can be freed.
+// Their samples are freed by iseq's finalizer, or pruned by `llrb_prune_samples`.
+void
+llrb_profiler_free_sample(const rb_iseq_t *iseq)
+{
+  st_data_t key = (st_data_t)iseq, val;
+  if (llrb_profiler.sample_by_iseq && st_delete(llrb_profiler.sample_by_iseq, &key, &val)) {
+    llrb_heap_remove((struct llrb_sample *)val);
+    xfree(((struct llrb_sample *)val)->loops);
+    xfree((struct llrb_sample *)val);
   }
 }
 
 static void
 llrb_atfork_prepare(void)
 {
-  struct itimerval timer;
-  if (llrb_profiler.running) {
-    memset(&timer, 0, sizeof(timer));
-    setitimer(ITIMER_PROF, &timer, 0);
-  }
+  if (llrb_profiler.running) llrb_stop_timer();
 }
 
 static void
 llrb_atfork_parent(void)
 {
-  struct itimerval timer;
-  if (llrb_profiler.running) {
-    timer.it_interval.tv_sec = 0;
-    timer.it_interval.tv_usec = LLRB_PROFILE_INTERVAL_USEC;
-    timer.it_value = timer.it_interval;
-    setitimer(ITIMER_PROF, &timer, 0);
-  }
+  if (llrb_profiler.running) llrb_start_timer();
 }
 
+// Native code compiled before fork is shared with parent by copy-on-write, because code pages are never written
+// after compilation. Child keeps profiling only if it has a budget to compile what parent didn't.
 static void
 llrb_atfork_child(void)
 {
-  rb_jit_stop(Qnil);
+  extern void llrb_worker_atfork_child(void);
+  llrb_worker_atfork_child();
+#if LLRB_THREAD_TIMER
+  llrb_forget_thread_timers(false);
+#endif
+  if (!llrb_profiler.running) return;
+
+  if (llrb_profiler.fork_budget <= 0) {
+    rb_jit_stop(Qnil);
+    return;
+  }
+  llrb_profiler.compile_budget = llrb_profiler.fork_budget;
+  llrb_atfork_parent(); // Interval timer is not inherited by child.
+#if LLRB_THREAD_TIMER
+  llrb_ensure_thread_timer();
+#endif
 }
 
 void
 Init_profiler(VALUE rb_mJIT)
 {
-  rb_define_singleton_method(rb_mJIT, "start_internal", RUBY_METHOD_FUNC(rb_jit_start), 0);
+  rb_define_singleton_method(rb_mJIT, "start_internal", RUBY_METHOD_FUNC(rb_jit_start), 3);
+  rb_define_singleton_method(rb_mJIT, "compile_hot_methods_internal", RUBY_METHOD_FUNC(rb_jit_compile_hot_methods), 1);
   rb_define_singleton_method(rb_mJIT, "stop", RUBY_METHOD_FUNC(rb_jit_stop), 0);
+  rb_define_singleton_method(rb_mJIT, "preload_profile", RUBY_METHOD_FUNC(rb_jit_preload_profile), 1);
+  rb_define_singleton_method(rb_mJIT, "sampled_profile", RUBY_METHOD_FUNC(rb_jit_sampled_profile), 0);
+  rb_define_singleton_method(rb_mJIT, "preload_iseq", RUBY_METHOD_FUNC(rb_jit_preload_iseq), 1);
+  rb_define_singleton_method(rb_mJIT, "set_sample_table_max", RUBY_METHOD_FUNC(rb_jit_set_sample_table_max), 1);
+  rb_define_singleton_method(rb_mJIT, "sample_caller", RUBY_METHOD_FUNC(rb_jit_sample_caller), -1);
 
   llrb_profiler.running = false;
+  llrb_profiler.async = false;
   llrb_profiler.profile_times = 0;
   llrb_profiler.sample_by_iseq = 0;
-
-  gc_hook = Data_Wrap_Struct(rb_cObject, llrb_gc_mark, NULL, &llrb_profiler);
-  rb_global_variable(&gc_hook);
+  llrb_profiler.sample_table_max = LLRB_SAMPLE_TABLE_MAX;
+  llrb_profiler.prune_threshold = LLRB_SAMPLE_TABLE_MAX;
+  llrb_profiler.preloaded_profile = Qnil;
+  llrb_profiler.preloaded_pending = false;
+  llrb_profiler.preloaded_queue = 0;
+  llrb_profiler.preloaded_size = 0;
+  llrb_profiler.preloaded_capa = 0;
+  llrb_profiler.heap = 0;
+  llrb_profiler.heap_size = 0;
+  llrb_profiler.heap_capa = 0;
+  llrb_profiler.weight = 1.0;
+  llrb_profiler.weight_growth = pow(2.0, 1.0 / LLRB_HOTNESS_HALF_LIFE);
+  llrb_profiler.fork_budget = -1;
+  llrb_profiler.compile_budget = -1;
+  llrb_profiler.interval_usec = LLRB_PROFILE_INTERVAL_USEC;
+  llrb_profiler.compile_every = LLRB_COMPILE_INTERVAL_TIMES;
+  llrb_profiler.batch_size = LLRB_COMPILE_BATCH_SIZE;
+  llrb_profiler.batch_pending = 0;
+  llrb_profiler.min_samples = LLRB_COMPILE_MIN_SAMPLES;
+  llrb_profiler.depth = LLRB_PROFILE_DEPTH;
+  llrb_profiler.max_compiles_per_sec = -1;
+  llrb_profiler.rate_window_start = 0;
+  llrb_profiler.rate_window_compiles = 0;
+#if LLRB_THREAD_TIMER
+  llrb_profiler.thread_timers = 0;
+  llrb_profiler.thread_timer_size = 0;
+  llrb_profiler.thread_timer_capa = 0;
+  llrb_profiler.timer_generation = 1;
+#endif
+  rb_global_variable(&llrb_profiler.preloaded_profile);
 
   pthread_atfork(llrb_atfork_prepare, llrb_atfork_parent, llrb_atfork_child);
 }
@@ -0,0 +1,23 @@
+/*
+ * snapshot.h: ISeq data captured for one compilation, shared by llrb.c and compiler.c.
+ *
+ * llrb.c captures it by `llrb_capture_iseq` with GVL, and parser.c and compiler.c read the compiled ISeq only from
+ * it. So patching insns for OSR, recompilation or invalidation after the capture doesn't change what's compiled.
+ * Unlike `iseq_encoded`, its insns are decoded to insn numbers like `rb_iseq_original_iseq`.
+ */
+
+#ifndef LLRB_SNAPSHOT_H
+#define LLRB_SNAPSHOT_H
+
+#include "cruby.h"
+
+struct llrb_iseq_snapshot {
+  // Copy of ISeq body. `iseq_encoded` has insn numbers and operands before replacement and OSR patches, and
+  // `catch_table` is a copy too. Both buffers are owned by `pins`.
+  struct rb_iseq_constant_body body;
+  // Hidden Array of the buffers and objects referred by operands and catch table. Caller keeps it on its stack
+  // with RB_GC_GUARD until compilation finishes, and GC frees all of them after that.
+  VALUE pins;
+};
+
+#endif // LLRB_SNAPSHOT_H
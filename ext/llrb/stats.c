@@ -0,0 +1,195 @@
+/*
+ * stats.c: Collects statistics of compilation and profiling for LLRB::JIT.stats.
+ *
+ * Everything here is written with GVL. Worker thread measures its own phases, and they are
+ * added when its job is installed on Ruby thread.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include "cruby.h"
+#include "jit.h"
+#include "pic.h"
+
+#define LLRB_STATS_TIME_SAMPLES 1024 // p99 is calculated from this number of the latest samples.
+
+struct llrb_time_stat {
+  double total; // Seconds
+  size_t count;
+  double samples[LLRB_STATS_TIME_SAMPLES]; // Ring buffer indexed by count.
+};
+
+static struct {
+  size_t counters[LLRB_STATS_COUNTER_SIZE];
+  struct llrb_time_stat times[LLRB_STATS_PHASE_SIZE];
+  bool profiling;                       // true while LLRB::JIT.compile(..., profile: true) is compiling.
+  double profile[LLRB_STATS_PHASE_SIZE]; // Seconds of each phase in the compilation.
+  size_t profile_sizes[LLRB_STATS_SIZE_SIZE]; // Sizes of the compilation.
+  struct llrb_pic_stats pic;            // Written by JIT-ed code through `llrb_stats_pic`.
+} llrb_stats;
+
+static const char *llrb_phase_names[LLRB_STATS_PHASE_SIZE] = {
+  [LLRB_STATS_PARSE]         = "parse",
+  [LLRB_STATS_IR]            = "ir",
+  [LLRB_STATS_OPT]           = "opt",
+  [LLRB_STATS_FUNC_PASSES]   = "func_passes",
+  [LLRB_STATS_MODULE_PASSES] = "module_passes",
+  [LLRB_STATS_CODEGEN]       = "codegen",
+  [LLRB_STATS_BITCODE_LOAD]  = "bitcode_load",
+  [LLRB_STATS_PROFILE]       = "profile",
+};
+
+static const char *llrb_size_names[LLRB_STATS_SIZE_SIZE] = {
+  [LLRB_STATS_IR_INSNS]  = "ir_insns",
+  [LLRB_STATS_OPT_INSNS] = "opt_insns",
+  [LLRB_STATS_CODE_SIZE] = "code_size",
+};
+
+// Monotonic clock in seconds. This can be called without GVL.
+double
+llrb_stats_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void
+llrb_stats_add_time(enum llrb_stats_phase phase, double sec)
+{
+  struct llrb_time_stat *stat = &llrb_stats.times[phase];
+  stat->samples[stat->count % LLRB_STATS_TIME_SAMPLES] = sec;
+  stat->total += sec;
+  stat->count++;
+  if (llrb_stats.profiling) llrb_stats.profile[phase] += sec;
+}
+
+// Used by llrb.c. Phases measured until `llrb_stats_finish_profile` are recorded for the compilation too.
+void
+llrb_stats_start_profile(void)
+{
+  MEMZERO(llrb_stats.profile, double, LLRB_STATS_PHASE_SIZE);
+  MEMZERO(llrb_stats.profile_sizes, size_t, LLRB_STATS_SIZE_SIZE);
+  llrb_stats.profiling = true;
+}
+
+// Used by llrb.c. It's recorded only while profiling a compilation.
+void
+llrb_stats_set_size(enum llrb_stats_size size, size_t value)
+{
+  if (llrb_stats.profiling) llrb_stats.profile_sizes[size] = value;
+}
+
+// @return [Hash] - { Symbol => Float }. Seconds of each phase except profiler's, and { Symbol => Integer } of sizes.
+VALUE
+llrb_stats_finish_profile(void)
+{
+  llrb_stats.profiling = false;
+  VALUE profile = rb_hash_new();
+  for (int phase = 0; phase < LLRB_STATS_PHASE_SIZE; phase++) {
+    if (phase == LLRB_STATS_PROFILE) continue;
+    rb_hash_aset(profile, ID2SYM(rb_intern(llrb_phase_names[phase])), DBL2NUM(llrb_stats.profile[phase]));
+  }
+  for (int size = 0; size < LLRB_STATS_SIZE_SIZE; size++) {
+    rb_hash_aset(profile, ID2SYM(rb_intern(llrb_size_names[size])), SIZET2NUM(llrb_stats.profile_sizes[size]));
+  }
+  return profile;
+}
+
+void
+llrb_stats_increment(enum llrb_stats_counter counter)
+{
+  llrb_stats.counters[counter]++;
+}
+
+// Used by compiler.c. Its address is embedded to JIT-ed code, which counts polymorphic inline cache's hits there.
+struct llrb_pic_stats *
+llrb_stats_pic(void)
+{
+  return &llrb_stats.pic;
+}
+
+static int
+llrb_compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double
+llrb_time_p99(const struct llrb_time_stat *stat)
+{
+  size_t size = stat->count < LLRB_STATS_TIME_SAMPLES ? stat->count : LLRB_STATS_TIME_SAMPLES;
+  if (size == 0) return 0.0;
+
+  double sorted[LLRB_STATS_TIME_SAMPLES];
+  MEMCPY(sorted, stat->samples, double, size);
+  qsort(sorted, size, sizeof(double), llrb_compare_double);
+  return sorted[(size * 99 + 99) / 100 - 1]; // ceil(size * 0.99)-th smallest
+}
+
+static VALUE
+llrb_time_stat_hash(const struct llrb_time_stat *stat)
+{
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("count")), SIZET2NUM(stat->count));
+  rb_hash_aset(hash, ID2SYM(rb_intern("total")), DBL2NUM(stat->total));
+  rb_hash_aset(hash, ID2SYM(rb_intern("p99")), DBL2NUM(llrb_time_p99(stat)));
+  return hash;
+}
+
+static VALUE
+llrb_pic_stats_hash(const struct llrb_pic_stats *stats)
+{
+  VALUE sites = rb_hash_new();
+  for (int size = 1; size <= LLRB_PIC_SIZE; size++) {
+    rb_hash_aset(sites, INT2FIX(size), SIZET2NUM(stats->sites[size]));
+  }
+  rb_hash_aset(sites, ID2SYM(rb_intern("megamorphic")), SIZET2NUM(stats->sites[LLRB_PIC_MEGAMORPHIC]));
+
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("hits")), SIZET2NUM(stats->hits));
+  rb_hash_aset(hash, ID2SYM(rb_intern("misses")), SIZET2NUM(stats->misses));
+  rb_hash_aset(hash, ID2SYM(rb_intern("sites")), sites);
+  return hash;
+}
+
+// LLRB::JIT.stats
+// @return [Hash] See lib/llrb/jit.rb for its keys.
+static VALUE
+rb_jit_stats(RB_UNUSED_VAR(VALUE self))
+{
+  extern VALUE llrb_rejected_insns(void);
+  extern size_t llrb_checked_iseqs_count(void);
+  extern size_t llrb_code_size(void);
+
+  VALUE rejected = rb_hash_new();
+  rb_hash_aset(rejected, ID2SYM(rb_intern("not_compilable")), SIZET2NUM(llrb_stats.counters[LLRB_STATS_NOT_COMPILABLE]));
+  rb_hash_aset(rejected, ID2SYM(rb_intern("compile_error")), SIZET2NUM(llrb_stats.counters[LLRB_STATS_COMPILE_ERROR]));
+  rb_hash_aset(rejected, ID2SYM(rb_intern("insns")), llrb_rejected_insns());
+
+  VALUE times = rb_hash_new();
+  for (int phase = 0; phase < LLRB_STATS_PHASE_SIZE; phase++) {
+    rb_hash_aset(times, ID2SYM(rb_intern(llrb_phase_names[phase])), llrb_time_stat_hash(&llrb_stats.times[phase]));
+  }
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("compiled")), SIZET2NUM(llrb_stats.counters[LLRB_STATS_COMPILED]));
+  rb_hash_aset(stats, ID2SYM(rb_intern("checked")), SIZET2NUM(llrb_checked_iseqs_count()));
+  rb_hash_aset(stats, ID2SYM(rb_intern("rejected")), rejected);
+  rb_hash_aset(stats, ID2SYM(rb_intern("time")), times);
+  rb_hash_aset(stats, ID2SYM(rb_intern("sampled_frames")), SIZET2NUM(llrb_stats.counters[LLRB_STATS_SAMPLED_FRAMES]));
+  rb_hash_aset(stats, ID2SYM(rb_intern("osr_entries")), SIZET2NUM(llrb_stats.counters[LLRB_STATS_OSR_ENTRIES]));
+  rb_hash_aset(stats, ID2SYM(rb_intern("catch_entries")), SIZET2NUM(llrb_stats.counters[LLRB_STATS_CATCH_ENTRIES]));
+  rb_hash_aset(stats, ID2SYM(rb_intern("evicted")), SIZET2NUM(llrb_stats.counters[LLRB_STATS_EVICTED]));
+  rb_hash_aset(stats, ID2SYM(rb_intern("code_size")), SIZET2NUM(llrb_code_size()));
+  rb_hash_aset(stats, ID2SYM(rb_intern("pic")), llrb_pic_stats_hash(&llrb_stats.pic));
+  return stats;
+}
+
+void
+Init_stats(VALUE rb_mJIT)
+{
+  rb_define_singleton_method(rb_mJIT, "stats", RUBY_METHOD_FUNC(rb_jit_stats), 0);
+}
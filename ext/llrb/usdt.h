@@ -0,0 +1,55 @@
+/*
+ * usdt.h: LLRB's USDT probes for bpftrace, perf and SystemTap, shared by llrb.c, compiler.c, worker.c and profiler.c.
+ *
+ * Probes are compiled in only when extconf.rb finds <sys/sdt.h> (systemtap-sdt-dev on Linux). Otherwise they're
+ * no-op like cruby_extra/probes.h. First 3 arguments are ISeq body's label, path and first line number. The strings
+ * are CRuby's own, so probes don't allocate anything.
+ *
+ *   llrb:compile__start(label, path, line, tier)
+ *   llrb:compile__done(label, path, line, tier, ir_usec, opt_usec, codegen_usec, installed)
+ *   llrb:reject(label, path, line, reason)
+ *   llrb:deopt(label, path, line, reason)
+ *   llrb:sample(label, path, line, tier, self_samples)
+ *
+ * Times are in microseconds. reject's reason is "not_compilable" or "compile_error". deopt's reason is "assumption"
+ * when VM state assumed by JIT-ed code changed, "guard_failed" when the ISeq is recompiled after a guard failure, or
+ * "evicted" when its native code is freed by code size limit.
+ */
+
+#ifndef LLRB_USDT_H
+#define LLRB_USDT_H
+
+#include "cruby.h"
+
+#define LLRB_PROBE_LABEL(body) RSTRING_PTR((body)->location.label)
+#define LLRB_PROBE_PATH(body) RSTRING_PTR((body)->location.path)
+#define LLRB_PROBE_LINE(body) FIX2INT((body)->location.first_lineno)
+#define LLRB_PROBE_USEC(sec) ((long)((sec) * 1000000))
+
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+
+# define LLRB_PROBE_COMPILE_START(body, tier) \
+  DTRACE_PROBE4(llrb, compile__start, LLRB_PROBE_LABEL(body), LLRB_PROBE_PATH(body), LLRB_PROBE_LINE(body), \
+      (int)(tier))
+# define LLRB_PROBE_COMPILE_DONE(body, tier, ir_sec, opt_sec, codegen_sec, installed) \
+  DTRACE_PROBE8(llrb, compile__done, LLRB_PROBE_LABEL(body), LLRB_PROBE_PATH(body), LLRB_PROBE_LINE(body), \
+      (int)(tier), LLRB_PROBE_USEC(ir_sec), LLRB_PROBE_USEC(opt_sec), LLRB_PROBE_USEC(codegen_sec), (int)(installed))
+# define LLRB_PROBE_REJECT(body, reason) \
+  DTRACE_PROBE4(llrb, reject, LLRB_PROBE_LABEL(body), LLRB_PROBE_PATH(body), LLRB_PROBE_LINE(body), (reason))
+# define LLRB_PROBE_DEOPT(body, reason) \
+  DTRACE_PROBE4(llrb, deopt, LLRB_PROBE_LABEL(body), LLRB_PROBE_PATH(body), LLRB_PROBE_LINE(body), (reason))
+# define LLRB_PROBE_SAMPLE(body, tier, self_samples) \
+  DTRACE_PROBE5(llrb, sample, LLRB_PROBE_LABEL(body), LLRB_PROBE_PATH(body), LLRB_PROBE_LINE(body), (int)(tier), \
+      (size_t)(self_samples))
+#else
+// Arguments are still referenced, so that variables kept only for probes are not warned as unused.
+# define LLRB_PROBE_COMPILE_START(body, tier) do {} while (0)
+# define LLRB_PROBE_COMPILE_DONE(body, tier, ir_sec, opt_sec, codegen_sec, installed) \
+  do { (void)(ir_sec); (void)(opt_sec); (void)(codegen_sec); (void)(installed); } while (0)
+# define LLRB_PROBE_REJECT(body, reason) do {} while (0)
+# define LLRB_PROBE_DEOPT(body, reason) do {} while (0)
+# define LLRB_PROBE_SAMPLE(body, tier, self_samples) do {} while (0)
+#endif
+
+#endif // LLRB_USDT_H
@@ -0,0 +1,280 @@
+/*
+ * worker.c: Runs LLVM optimization and native code generation on a pool of native threads.
+ *
+ * Building LLVM IR touches Ruby VM (ISeq body, rb_intern, rb_raise), so it's done on Ruby thread.
+ * But LLVM passes and machine code generation, which take most of compilation time, don't touch it.
+ * Worker threads run them without GVL, and Ruby thread installs the native functions at the next
+ * safe point (profiler's postponed job) by `llrb_worker_install`.
+ *
+ * LLVMContext is not thread-safe. So each worker has its own context LLRB_CONTEXT_WORKER(i), and Ruby thread
+ * builds LLVM IR in it only while the worker is idle (`llrb_worker_reserve`). Each worker has one job slot,
+ * and the pool size is capped by CPU budget (`llrb_worker_set_size`). Code generation into the shared JIT
+ * stacks is serialized by llrb.c.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "llvm-c/Core.h"
+#include "llvm-c/OrcBindings.h"
+#include "cruby.h"
+#include "jit.h"
+#include "usdt.h"
+
+enum llrb_job_state {
+  LLRB_JOB_NONE,     // Worker is idle. Ruby thread can build LLVM IR in its context.
+  LLRB_JOB_QUEUED,   // Ruby thread enqueued a job and the worker will pick it.
+  LLRB_JOB_RUNNING,  // Worker is optimizing LLVM IR and generating native code.
+  LLRB_JOB_FINISHED, // Native function is ready. It will be installed by Ruby thread.
+};
+
+struct llrb_job {
+  const rb_iseq_t *iseq;
+  VALUE *new_iseq_encoded;
+  LLVMModuleRef mod;
+  char funcname[32];
+  enum llrb_tier tier;
+  double ir_time; // Seconds to build `mod` on Ruby thread. Reported by USDT probe on installation.
+  uint64_t func; // Set by worker. 0 if code generation failed.
+  LLVMOrcModuleHandle handle; // Set by worker. Used to remove the module if it's not installed.
+  size_t code_size; // Set by worker. Measured only while perf map or code size limit is enabled.
+  double opt_time, codegen_time; // Set by worker. Added to stats on installation.
+  struct llrb_opt_time passes_time; // Set by worker. Added to stats on installation.
+  bool cancelled; // Set by `llrb_worker_cancel` when `iseq` is freed. The job is dropped instead of being installed.
+};
+
+struct llrb_worker {
+  bool started;
+  pthread_t thread;
+  enum llrb_job_state state; // Protected by `llrb_pool.lock`.
+  struct llrb_job job;       // Protected by `llrb_pool.lock`.
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // Broadcast on any worker's state change.
+  int size;            // The number of workers which can be reserved. Set by `llrb_worker_set_size` with GVL.
+  struct llrb_worker workers[LLRB_WORKER_MAX];
+} llrb_pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+  .size = 1,
+};
+
+static void *
+llrb_worker_main(void *arg)
+{
+  extern void llrb_optimize_function(LLVMModuleRef cmod, LLVMValueRef cfunc, enum llrb_tier tier, bool enable_stats,
+      bool time_passes, struct llrb_opt_time *time);
+  extern uint64_t llrb_create_native_func(LLVMModuleRef mod, const char *funcname, enum llrb_tier tier, bool measure,
+      LLVMOrcModuleHandle *handle, LLVMModuleRef *clone);
+  extern size_t llrb_measure_native_code(LLVMModuleRef clone, enum llrb_tier tier);
+  extern double llrb_stats_now(void);
+  struct llrb_worker *worker = &llrb_pool.workers[(long)arg];
+
+  // Profiler's SIGPROF must interrupt Ruby threads, not this one.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  pthread_mutex_lock(&llrb_pool.lock);
+  while (true) {
+    while (worker->state != LLRB_JOB_QUEUED) {
+      pthread_cond_wait(&llrb_pool.cond, &llrb_pool.lock);
+    }
+    worker->state = LLRB_JOB_RUNNING;
+    struct llrb_job job = worker->job;
+    pthread_mutex_unlock(&llrb_pool.lock);
+
+    double started_at = llrb_stats_now();
+    struct llrb_opt_time passes_time;
+    llrb_optimize_function(job.mod, LLVMGetNamedFunction(job.mod, job.funcname), job.tier, false, false, &passes_time);
+    double optimized_at = llrb_stats_now();
+    LLVMOrcModuleHandle handle;
+    LLVMModuleRef clone;
+    uint64_t func = llrb_create_native_func(job.mod, job.funcname, job.tier, false, &handle, &clone);
+    double codegen_time = llrb_stats_now() - optimized_at;
+    size_t code_size = llrb_measure_native_code(clone, job.tier);
+
+    pthread_mutex_lock(&llrb_pool.lock);
+    worker->job.func = func;
+    worker->job.handle = handle;
+    worker->job.code_size = code_size;
+    worker->job.opt_time = optimized_at - started_at;
+    worker->job.passes_time = passes_time;
+    worker->job.codegen_time = codegen_time;
+    worker->state = LLRB_JOB_FINISHED;
+    pthread_cond_broadcast(&llrb_pool.cond);
+  }
+  return NULL;
+}
+
+// Used by profiler.c for LLRB::JIT.start. `size` is capped by LLRB_WORKER_MAX and by online CPUs except one,
+// which is left for Ruby threads. Workers beyond the new size finish their jobs, and are just not reserved.
+void
+llrb_worker_set_size(long size)
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (cpus < 1) cpus = 1;
+  if (size > cpus) size = cpus;
+  if (size > LLRB_WORKER_MAX) size = LLRB_WORKER_MAX;
+  llrb_pool.size = (int)size;
+}
+
+// Returns an idle worker's index, or -1 if all workers are busy or have a job waiting for installation.
+int
+llrb_worker_reserve(void)
+{
+  int reserved = -1;
+  pthread_mutex_lock(&llrb_pool.lock);
+  for (int i = 0; i < llrb_pool.size; i++) {
+    if (llrb_pool.workers[i].state == LLRB_JOB_NONE) {
+      reserved = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&llrb_pool.lock);
+  return reserved;
+}
+
+bool
+llrb_worker_idle(void)
+{
+  return llrb_worker_reserve() >= 0;
+}
+
+// Returns true if a job for `iseq` is not installed yet. Its compiled ISeq must not be compiled again until then.
+bool
+llrb_worker_has_job(const rb_iseq_t *iseq)
+{
+  bool found = false;
+  pthread_mutex_lock(&llrb_pool.lock);
+  for (int i = 0; i < LLRB_WORKER_MAX; i++) {
+    const struct llrb_worker *worker = &llrb_pool.workers[i];
+    if (worker->state != LLRB_JOB_NONE && !worker->job.cancelled && worker->job.iseq == iseq) found = true;
+  }
+  pthread_mutex_unlock(&llrb_pool.lock);
+  return found;
+}
+
+// `worker` must be reserved by `llrb_worker_reserve`, and `mod` must be built in its context.
+// Ownership of `mod` is moved to worker.
+void
+llrb_worker_enqueue(int index, const rb_iseq_t *iseq, VALUE *new_iseq_encoded, LLVMModuleRef mod,
+    const char *funcname, enum llrb_tier tier, double ir_time)
+{
+  struct llrb_worker *worker = &llrb_pool.workers[index];
+  if (!worker->started) {
+    if (pthread_create(&worker->thread, NULL, llrb_worker_main, (void *)(long)index) != 0) {
+      LLVMDisposeModule(mod);
+      rb_raise(rb_eRuntimeError, "Failed to start LLRB compiler thread");
+    }
+    pthread_detach(worker->thread);
+    worker->started = true;
+  }
+
+  pthread_mutex_lock(&llrb_pool.lock);
+  worker->job = (struct llrb_job){
+    .iseq = iseq,
+    .new_iseq_encoded = new_iseq_encoded,
+    .mod = mod,
+    .tier = tier,
+    .ir_time = ir_time,
+    .func = 0,
+    .cancelled = false,
+  };
+  snprintf(worker->job.funcname, sizeof(worker->job.funcname), "%s", funcname);
+  worker->state = LLRB_JOB_QUEUED;
+  pthread_cond_broadcast(&llrb_pool.cond);
+  pthread_mutex_unlock(&llrb_pool.lock);
+}
+
+// Installs finished jobs' native functions. This must be called with GVL, at a point where
+// replacing `iseq_encoded` is safe. Other workers may keep running. Cancelled jobs' functions are removed here.
+// @return true if a native function is installed
+bool
+llrb_worker_install(void)
+{
+  extern bool llrb_install_native_func(const rb_iseq_t *iseq, VALUE *new_iseq_encoded, uint64_t func,
+      LLVMOrcModuleHandle handle, enum llrb_tier tier, size_t code_size);
+  extern void llrb_remove_native_func(LLVMOrcModuleHandle handle, enum llrb_tier tier);
+  extern void llrb_stats_add_time(enum llrb_stats_phase phase, double sec);
+
+  bool installed = false;
+  for (int i = 0; i < LLRB_WORKER_MAX; i++) {
+    struct llrb_worker *worker = &llrb_pool.workers[i];
+    pthread_mutex_lock(&llrb_pool.lock);
+    if (worker->state != LLRB_JOB_FINISHED) {
+      pthread_mutex_unlock(&llrb_pool.lock);
+      continue;
+    }
+    struct llrb_job job = worker->job;
+    worker->state = LLRB_JOB_NONE;
+    pthread_mutex_unlock(&llrb_pool.lock);
+
+    if (job.cancelled) { // `job.iseq` and `job.new_iseq_encoded` are freed.
+      llrb_remove_native_func(job.handle, job.tier);
+      continue;
+    }
+    llrb_stats_add_time(LLRB_STATS_OPT, job.opt_time);
+    llrb_stats_add_time(LLRB_STATS_FUNC_PASSES, job.passes_time.func_passes);
+    llrb_stats_add_time(LLRB_STATS_MODULE_PASSES, job.passes_time.module_passes);
+    llrb_stats_add_time(LLRB_STATS_CODEGEN, job.codegen_time);
+    bool job_installed = llrb_install_native_func(job.iseq, job.new_iseq_encoded, job.func, job.handle, job.tier,
+        job.code_size);
+    if (job_installed) installed = true;
+    LLRB_PROBE_COMPILE_DONE(job.iseq->body, job.tier, job.ir_time, job.opt_time, job.codegen_time, job_installed);
+  }
+  return installed;
+}
+
+static void
+llrb_worker_wait_all(void)
+{
+  pthread_mutex_lock(&llrb_pool.lock);
+  for (int i = 0; i < LLRB_WORKER_MAX; i++) {
+    while (llrb_pool.workers[i].state == LLRB_JOB_QUEUED || llrb_pool.workers[i].state == LLRB_JOB_RUNNING) {
+      pthread_cond_wait(&llrb_pool.cond, &llrb_pool.lock);
+    }
+  }
+  pthread_mutex_unlock(&llrb_pool.lock);
+}
+
+// Waits for all running jobs and installs them. After this, no worker runs until Ruby thread enqueues a job.
+void
+llrb_worker_flush(void)
+{
+  llrb_worker_wait_all();
+  llrb_worker_install();
+}
+
+// Cancels jobs for `iseq` freed by GC. This is called by its finalizer, so it doesn't wait for workers. A running
+// job finishes, and `llrb_worker_install` removes its native function without installing it.
+void
+llrb_worker_cancel(const rb_iseq_t *iseq)
+{
+  pthread_mutex_lock(&llrb_pool.lock);
+  for (int i = 0; i < LLRB_WORKER_MAX; i++) {
+    struct llrb_worker *worker = &llrb_pool.workers[i];
+    if (worker->state != LLRB_JOB_NONE && worker->job.iseq == iseq) worker->job.cancelled = true;
+  }
+  pthread_mutex_unlock(&llrb_pool.lock);
+}
+
+// Worker threads don't exist in forked child. Jobs in flight are dropped.
+void
+llrb_worker_atfork_child(void)
+{
+  extern void llrb_jit_atfork_child(void);
+  llrb_jit_atfork_child();
+
+  pthread_mutex_init(&llrb_pool.lock, NULL);
+  pthread_cond_init(&llrb_pool.cond, NULL);
+  for (int i = 0; i < LLRB_WORKER_MAX; i++) {
+    llrb_pool.workers[i].started = false;
+    llrb_pool.workers[i].state = LLRB_JOB_NONE;
+  }
+}
@@ -0,0 +1,13 @@
+#include "cruby.h"
+
+// Guard for speculative opt_aref and opt_aset. JIT-ed code deoptimizes if this returns Qfalse.
+// Subclasses of Array and singleton classes may have their own `[]`, so only Array itself passes.
+VALUE
+llrb_array_guard(VALUE recv, VALUE obj, VALUE bop)
+{
+  if (!SPECIAL_CONST_P(recv) && RBASIC_CLASS(recv) == rb_cArray && FIXNUM_P(obj) &&
+      BASIC_OP_UNREDEFINED_P((int)bop, ARRAY_REDEFINED_OP_FLAG)) {
+    return Qtrue;
+  }
+  return Qfalse;
+}
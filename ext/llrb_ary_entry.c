@@ -0,0 +1,13 @@
+#include "cruby.h"
+
+// Array#[] with Fixnum index, after `llrb_array_guard`. It's the same as rb_ary_entry, but it's inlined to JIT-ed
+// code as loads from RARRAY_CONST_PTR with a bounds check.
+VALUE
+llrb_ary_entry(VALUE ary, VALUE index)
+{
+  long offset = FIX2LONG(index);
+  long len = RARRAY_LEN(ary);
+  if (offset < 0) offset += len;
+  if (offset < 0 || len <= offset) return Qnil;
+  return RARRAY_CONST_PTR(ary)[offset];
+}
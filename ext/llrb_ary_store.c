@@ -0,0 +1,9 @@
+#include "cruby.h"
+
+// Array#[]= with Fixnum index, after `llrb_array_guard`. Method dispatch is skipped.
+VALUE
+llrb_ary_store(VALUE ary, VALUE index, VALUE val)
+{
+  rb_ary_store(ary, FIX2LONG(index), val);
+  return val;
+}
@@ -0,0 +1,38 @@
+#include "cruby.h"
+#include "native_call.h"
+
+// vm_call_iseq_setup_normal + vm_push_frame for an ISeq method whose parameters are already set up by JIT-ed caller.
+// Receiver and callee's param.size locals, including keyword values and unspecified_bits, are pushed to cfp->sp, so
+// setup_parameters_complex is skipped.
+VALUE
+llrb_call_iseq_method(VALUE th_v, VALUE cfp_v, VALUE me_v, VALUE recv)
+{
+  rb_thread_t *th = (rb_thread_t *)th_v;
+  rb_control_frame_t *cfp = (rb_control_frame_t *)cfp_v;
+  const rb_callable_method_entry_t *me = (const rb_callable_method_entry_t *)me_v;
+  const rb_iseq_t *iseq = me->def->body.iseq.iseqptr;
+  const int param_size = iseq->body->param.size;
+  const int local_size = (int)iseq->body->local_table_size - param_size;
+
+  VALUE *sp = cfp->sp;
+  cfp->sp = sp - param_size - 1; // recv
+
+  rb_control_frame_t *const new_cfp = th->cfp - 1;
+  CHECK_VM_STACK_OVERFLOW0(new_cfp, sp, local_size + (int)iseq->body->stack_max);
+  th->cfp = new_cfp;
+  new_cfp->pc = iseq->body->iseq_encoded;
+  new_cfp->iseq = (rb_iseq_t *)iseq;
+  new_cfp->self = recv;
+  new_cfp->block_code = NULL;
+
+  for (int i = 0; i < local_size; i++) {
+    *sp++ = Qnil;
+  }
+  *sp++ = (VALUE)me;                                 // ep[-2]: method entry
+  *sp++ = VM_BLOCK_HANDLER_NONE;                     // ep[-1]: block handler
+  *sp   = VM_FRAME_MAGIC_METHOD | VM_ENV_FLAG_LOCAL; // ep[-0]: env flags
+  new_cfp->ep = sp;
+  new_cfp->sp = sp + 1;
+
+  return llrb_exec_pushed_frame(th);
+}
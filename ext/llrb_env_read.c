@@ -0,0 +1,9 @@
+#include "cruby.h"
+
+// getlocal with ep computed by `llrb_outer_ep`.
+VALUE
+llrb_env_read(VALUE ep_v, lindex_t idx)
+{
+  const VALUE *ep = (const VALUE *)ep_v;
+  return *(ep - idx);
+}
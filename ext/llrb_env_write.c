@@ -0,0 +1,8 @@
+#include "cruby.h"
+
+// setlocal with ep computed by `llrb_outer_ep`.
+void
+llrb_env_write(VALUE ep_v, lindex_t idx, VALUE val)
+{
+  llrb_vm_env_write((const VALUE *)ep_v, -(int)idx, val);
+}
@@ -0,0 +1,11 @@
+#include "cruby.h"
+
+// Guard for speculative Fixnum operation. JIT-ed code deoptimizes if this returns Qfalse.
+VALUE
+llrb_fixnum_guard(VALUE recv, VALUE obj, VALUE bop)
+{
+  if (FIXNUM_2_P(recv, obj) && BASIC_OP_UNREDEFINED_P((int)bop, INTEGER_REDEFINED_OP_FLAG)) {
+    return Qtrue;
+  }
+  return Qfalse;
+}
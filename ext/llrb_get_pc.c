@@ -0,0 +1,8 @@
+#include "cruby.h"
+
+VALUE
+llrb_get_pc(VALUE cfp_v)
+{
+  rb_control_frame_t *cfp = (rb_control_frame_t *)cfp_v;
+  return (VALUE)cfp->pc;
+}
@@ -0,0 +1,11 @@
+#include "cruby.h"
+
+// Caller must check self by `llrb_ivar_guard`. Returns Qundef if ivar is not set, to fall back to inline cache.
+VALUE
+llrb_getivar_index(VALUE obj, VALUE index)
+{
+  if (LIKELY(index < ROBJECT_NUMIV(obj))) {
+    return ROBJECT_IVPTR(obj)[index];
+  }
+  return Qundef;
+}
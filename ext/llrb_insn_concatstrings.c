@@ -1,21 +1,70 @@
-#include <stdarg.h>
 #include "cruby.h"
+#include "ruby/encoding.h"
+
+// Writes decimal digits of `fix` backward from `end`, and returns the first digit.
+static char *
+llrb_fixnum_digits(VALUE fix, char *end)
+{
+  long num = FIX2LONG(fix);
+  unsigned long abs = num < 0 ? -(unsigned long)num : (unsigned long)num;
+  char *ptr = end;
+  do {
+    *--ptr = (char)('0' + abs % 10);
+    abs /= 10;
+  } while (abs > 0);
+  if (num < 0) *--ptr = '-';
+  return ptr;
+}
 
 // https://github.com/ruby/ruby/blob/v2_4_1/insns.def#L359-L372
+// Fragments are Strings, or Symbols and Fixnums left by `llrb_tostring_fragment`. Their lengths are summed first and
+// the result is allocated once. It's the same as rb_str_concat_literals for converted ones, including encodings.
 extern VALUE rb_str_concat_literals(size_t, const VALUE*);
 VALUE
-llrb_insn_concatstrings(size_t num, ...) {
-  VALUE *args = 0;
-  va_list ar;
+llrb_insn_concatstrings(rb_num_t num, const VALUE *ptr)
+{
+  char digits[sizeof(long) * 3 + 2];
+  char *digits_end = digits + sizeof(digits);
+  long len = 0;
+  int asciicompat = 1;
+  for (rb_num_t i = 0; i < num; i++) {
+    if (FIXNUM_P(ptr[i])) {
+      len += digits_end - llrb_fixnum_digits(ptr[i], digits_end);
+    } else {
+      VALUE str = SYMBOL_P(ptr[i]) ? rb_sym2str(ptr[i]) : ptr[i];
+      len += RSTRING_LEN(str);
+      if (!rb_enc_asciicompat(rb_enc_get(str))) asciicompat = 0;
+    }
+  }
 
-  if (num > 0) {
-    args = ALLOCA_N(VALUE, num);
-    va_start(ar, num);
-    for (size_t i = 0; i < num; i++) {
-      args[i] = va_arg(ar, VALUE);
+  // Digits are written as bytes only if every fragment is ASCII-compatible. Otherwise Strings are created.
+  if (!asciicompat) {
+    VALUE *strs = ALLOCA_N(VALUE, num);
+    for (rb_num_t i = 0; i < num; i++) {
+      strs[i] = FIXNUM_P(ptr[i]) ? rb_fix2str(ptr[i], 10) : SYMBOL_P(ptr[i]) ? rb_sym_to_s(ptr[i]) : ptr[i];
     }
-    va_end(ar);
+    return rb_str_concat_literals(num, strs);
   }
 
-  return rb_str_concat_literals(num, args);
+  int usascii = rb_usascii_encindex();
+  VALUE result = rb_str_buf_new(len);
+  if (num == 0 || FIXNUM_P(ptr[0])) {
+    rb_enc_associate_index(result, usascii);
+  } else {
+    rb_enc_copy(result, SYMBOL_P(ptr[0]) ? rb_sym2str(ptr[0]) : ptr[0]);
+  }
+
+  for (rb_num_t i = 0; i < num; i++) {
+    if (FIXNUM_P(ptr[i])) {
+      char *start = llrb_fixnum_digits(ptr[i], digits_end);
+      rb_str_buf_cat(result, start, digits_end - start); // ASCII digits keep coderange of ASCII-compatible String.
+      continue;
+    }
+
+    VALUE str = SYMBOL_P(ptr[i]) ? rb_sym2str(ptr[i]) : ptr[i];
+    int encidx = ENCODING_GET(str);
+    rb_str_buf_append(result, str);
+    if (encidx != usascii && ENCODING_GET_INLINED(result) == usascii) rb_enc_set_index(result, encidx);
+  }
+  return result;
 }
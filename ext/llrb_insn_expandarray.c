@@ -0,0 +1,68 @@
+#include "cruby.h"
+
+// Same as vm_expandarray, except that cfp->sp is not moved. Expanded values are written from cfp->sp,
+// and JIT-ed code loads `num + (flag & 0x01)` values from the returned address.
+VALUE
+llrb_insn_expandarray(VALUE cfp_v, VALUE ary, VALUE num_v, VALUE flag_v)
+{
+  rb_control_frame_t *cfp = (rb_control_frame_t *)cfp_v;
+  rb_num_t num = (rb_num_t)num_v;
+  int flag = (int)flag_v;
+
+  int is_splat = flag & 0x01;
+  rb_num_t space_size = num + is_splat;
+  VALUE *base = cfp->sp;
+  const VALUE *ptr;
+  rb_num_t len;
+
+  if (!RB_TYPE_P(ary, T_ARRAY)) {
+    ary = rb_ary_to_ary(ary);
+  }
+
+  ptr = RARRAY_CONST_PTR(ary);
+  len = (rb_num_t)RARRAY_LEN(ary);
+
+  if (flag & 0x02) {
+    /* post: ..., nil ,ary[-1], ..., ary[0..-num] # top */
+    rb_num_t i = 0, j;
+    VALUE *bptr = base;
+
+    if (len < num) {
+      for (i=0; i<num-len; i++) {
+        *bptr++ = Qnil;
+      }
+    }
+    for (j=0; i<num; i++, j++) {
+      VALUE v = ptr[len - j - 1];
+      *bptr++ = v;
+    }
+    if (is_splat) {
+      *bptr = rb_ary_new4(len - j, ptr);
+    }
+  }
+  else {
+    /* normal: ary[num..-1], ary[num-2], ary[num-3], ..., ary[0] # top */
+    rb_num_t i;
+    VALUE *bptr = &base[space_size - 1];
+
+    for (i=0; i<num; i++) {
+      if (len <= i) {
+        for (; i<num; i++) {
+          *bptr-- = Qnil;
+        }
+        break;
+      }
+      *bptr-- = ptr[i];
+    }
+    if (is_splat) {
+      if (num > len) {
+        *bptr = rb_ary_new();
+      }
+      else {
+        *bptr = rb_ary_new4(len - num, ptr + num);
+      }
+    }
+  }
+  RB_GC_GUARD(ary);
+  return (VALUE)base;
+}
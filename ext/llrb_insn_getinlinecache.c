@@ -0,0 +1,16 @@
+#include "cruby.h"
+
+// Returns cached constant, or Qundef if the cache is stale. When this is inlined, a cache hit is loads of
+// ic_serial and global constant state and their comparison (plus ic_cref check).
+rb_cref_t * rb_vm_get_cref(const VALUE *ep);
+VALUE
+llrb_insn_getinlinecache(VALUE cfp_v, VALUE ic_v)
+{
+  rb_control_frame_t *cfp = (rb_control_frame_t *)cfp_v;
+  IC ic = (IC)ic_v;
+  if (LIKELY(ic->ic_serial == GET_GLOBAL_CONSTANT_STATE()) &&
+      (ic->ic_cref == NULL || ic->ic_cref == rb_vm_get_cref(cfp->ep))) {
+    return ic->ic_value.value;
+  }
+  return Qundef;
+}
@@ -1,6 +1,6 @@
 #include "cruby.h"
+#include "native_call.h"
 
-VALUE vm_exec(rb_thread_t *th);
 
 static inline void
 _llrb_push_result(rb_control_frame_t *cfp, VALUE result)
@@ -32,8 +32,7 @@ llrb_insn_invokeblock(VALUE th_v, VALUE cfp_v, VALUE ci_v, unsigned int stack_si
 
   VALUE val = vm_invoke_block(th, cfp, &calling, ci);
   if (val == Qundef) {
-    VM_ENV_FLAGS_SET(th->cfp->ep, VM_FRAME_FLAG_FINISH);
-    return vm_exec(th);
+    return llrb_exec_pushed_frame(th);
   }
   return val;
 }
@@ -1,7 +1,8 @@
 #include "cruby.h"
+#include "native_call.h"
+#include "pic.h"
 
 #define CALL_METHOD(calling, ci, cc) (*(cc)->call)(th, cfp, (calling), (ci), (cc))
-VALUE vm_exec(rb_thread_t *th);
 
 static inline void
 _llrb_push_result(rb_control_frame_t *cfp, VALUE result)
@@ -11,12 +12,73 @@ _llrb_push_result(rb_control_frame_t *cfp, VALUE result)
   cfp->sp += 1;
 }
 
+extern rb_serial_t ruby_vm_global_method_state;
 void vm_caller_setup_arg_block(const rb_thread_t *th, rb_control_frame_t *reg_cfp,
     struct rb_calling_info *calling, const struct rb_call_info *ci, rb_iseq_t *blockiseq, const int is_super);
 void vm_search_super_method(rb_thread_t *th, rb_control_frame_t *reg_cfp,
     struct rb_calling_info *calling, struct rb_call_info *ci, struct rb_call_cache *cc);
+const rb_callable_method_entry_t *rb_vm_frame_method_entry(const rb_control_frame_t *cfp);
+
+// Returns a call cache for super method from the call site's `cache` like `llrb_pic_search`. vm_search_super_method
+// fills an entry on miss, and a hit skips its ancestry search and kind_of check, which passed on filling. A call
+// through the entry may leave its own fastpath in `cc.call`, so a hit restores the one saved on filling.
+static struct rb_call_cache *
+llrb_search_super_cache(rb_thread_t *th, rb_control_frame_t *cfp, struct rb_calling_info *calling,
+    struct rb_call_info *ci, struct rb_call_cache *cc, struct llrb_super_cache *cache, struct llrb_pic_stats *stats)
+{
+  const rb_callable_method_entry_t *frame_me = rb_vm_frame_method_entry(cfp);
+  if (frame_me && cache->size != LLRB_PIC_MEGAMORPHIC) {
+    rb_serial_t class_serial = RCLASS_SERIAL(CLASS_OF(calling->recv));
+    for (unsigned int i = 0; i < cache->size; i++) {
+      struct llrb_super_cache_entry *entry = &cache->entries[i];
+      if (LIKELY(entry->frame_me == frame_me && entry->cc.class_serial == class_serial
+            && entry->cc.method_state == ruby_vm_global_method_state)) {
+        stats->hits++;
+        ci->mid = frame_me->def->original_id; // Set by vm_search_super_method.
+        entry->cc.call = entry->call;
+        return &entry->cc;
+      }
+    }
+  }
+  stats->misses++;
+  if (!frame_me || cache->size == LLRB_PIC_MEGAMORPHIC) { // vm_search_super_method raises for the former.
+    vm_search_super_method(th, cfp, calling, ci, cc);
+    return cc;
+  }
+
+  // Entries invalidated by method definition are reused before adding one.
+  struct llrb_super_cache_entry *entry = 0;
+  for (unsigned int i = 0; i < cache->size; i++) {
+    if (cache->entries[i].cc.method_state != ruby_vm_global_method_state) {
+      entry = &cache->entries[i];
+      break;
+    }
+  }
+  if (!entry) {
+    if (cache->size > 0) stats->sites[cache->size]--;
+    if (cache->size == LLRB_PIC_SIZE) {
+      cache->size = LLRB_PIC_MEGAMORPHIC;
+      stats->sites[cache->size]++;
+      vm_search_super_method(th, cfp, calling, ci, cc);
+      return cc;
+    }
+    entry = &cache->entries[cache->size++];
+    stats->sites[cache->size]++;
+  }
+
+  // The entry doesn't hit until it's filled, since vm_search_super_method may raise.
+  entry->cc.method_state = 0;
+  vm_search_super_method(th, cfp, calling, ci, &entry->cc);
+  entry->call = entry->cc.call;
+  entry->frame_me = frame_me;
+  entry->cc.class_serial = RCLASS_SERIAL(CLASS_OF(calling->recv));
+  entry->cc.method_state = ruby_vm_global_method_state;
+  return &entry->cc;
+}
+
 VALUE
-llrb_insn_invokesuper(VALUE th_v, VALUE cfp_v, VALUE ci_v, VALUE cc_v, VALUE blockiseq_v, unsigned int stack_size, ...)
+llrb_insn_invokesuper(VALUE th_v, VALUE cfp_v, VALUE ci_v, VALUE cc_v, VALUE blockiseq_v, VALUE cache_v,
+    VALUE stats_v, unsigned int stack_size, ...)
 {
   rb_thread_t *th = (rb_thread_t *)th_v;
   rb_control_frame_t *cfp = (rb_control_frame_t *)cfp_v;
@@ -36,12 +98,12 @@ llrb_insn_invokesuper(VALUE th_v, VALUE cfp_v, VALUE ci_v, VALUE cc_v, VALUE blo
 
   vm_caller_setup_arg_block(th, cfp, &calling, ci, blockiseq, 1);
   calling.recv = th->cfp->self;
-  vm_search_super_method(th, th->cfp, &calling, ci, cc);
+  cc = llrb_search_super_cache(th, th->cfp, &calling, ci, cc, (struct llrb_super_cache *)cache_v,
+      (struct llrb_pic_stats *)stats_v);
 
   VALUE result = CALL_METHOD(&calling, ci, cc);
   if (result == Qundef) {
-    VM_ENV_FLAGS_SET(th->cfp->ep, VM_FRAME_FLAG_FINISH);
-    return vm_exec(th);
+    return llrb_exec_pushed_frame(th);
   }
   return result;
 }
@@ -0,0 +1,38 @@
+#include "cruby.h"
+
+VALUE vm_once_exec(VALUE iseq);
+VALUE vm_once_clear(VALUE data);
+
+#define RUNNING_THREAD_ONCE_DONE ((rb_thread_t *)(0x1))
+
+VALUE
+llrb_insn_once(VALUE th_v, VALUE cfp_v, VALUE iseq_v, VALUE ic_v)
+{
+  rb_thread_t *th = (rb_thread_t *)th_v;
+  rb_control_frame_t *cfp = (rb_control_frame_t *)cfp_v;
+  union iseq_inline_storage_entry *is = (union iseq_inline_storage_entry *)ic_v;
+  VALUE val;
+
+retry:
+  if (is->once.running_thread == RUNNING_THREAD_ONCE_DONE) {
+    val = is->once.value;
+  }
+  else if (is->once.running_thread == NULL) {
+    is->once.running_thread = th;
+    val = is->once.value = rb_ensure(vm_once_exec, iseq_v, vm_once_clear, (VALUE)is);
+    /* is->once.running_thread is cleared by vm_once_clear() */
+    is->once.running_thread = RUNNING_THREAD_ONCE_DONE; /* success */
+    rb_iseq_add_mark_object(cfp->iseq, val);
+  }
+  else if (is->once.running_thread == th) {
+    /* recursive once */
+    val = vm_once_exec(iseq_v);
+  }
+  else {
+    /* waiting for finish */
+    RUBY_VM_CHECK_INTS(th);
+    rb_thread_schedule();
+    goto retry;
+  }
+  return val;
+}
@@ -0,0 +1,15 @@
+#include "cruby.h"
+
+// https://github.com/ruby/ruby/blob/v2_4_1/insns.def#L1953-L1971
+// `key` is the frozen literal. It's copied only when it may be seen by a method other than Hash#[].
+VALUE
+llrb_insn_opt_aref_with(VALUE recv, VALUE key)
+{
+  if (!SPECIAL_CONST_P(recv) && RBASIC_CLASS(recv) == rb_cHash &&
+      BASIC_OP_UNREDEFINED_P(BOP_AREF, HASH_REDEFINED_OP_FLAG) && rb_hash_compare_by_id_p(recv) == Qfalse) {
+    return rb_hash_aref(recv, key);
+  }
+  else {
+    return rb_funcall(recv, idAREF, 1, rb_str_resurrect(key));
+  }
+}
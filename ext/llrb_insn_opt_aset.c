@@ -14,7 +14,7 @@ llrb_insn_opt_aset(VALUE recv, VALUE obj, VALUE set)
     }
     else {
       //goto INSN_LABEL(normal_dispatch);
-      return rb_funcall(recv, '+', 2, obj, set);
+      return rb_funcall(recv, idASET, 2, obj, set);
     }
   }
   else {
@@ -23,6 +23,6 @@ llrb_insn_opt_aset(VALUE recv, VALUE obj, VALUE set)
     //PUSH(obj);
     //PUSH(set);
     //CALL_SIMPLE_METHOD(recv);
-    return rb_funcall(recv, '+', 2, obj, set);
+    return rb_funcall(recv, idASET, 2, obj, set);
   }
 }
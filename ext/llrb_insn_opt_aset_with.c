@@ -0,0 +1,16 @@
+#include "cruby.h"
+
+// https://github.com/ruby/ruby/blob/v2_4_1/insns.def#L1930-L1951
+// `key` is the frozen literal. It's copied only when it may be seen by a method other than Hash#[]=.
+VALUE
+llrb_insn_opt_aset_with(VALUE recv, VALUE key, VALUE val)
+{
+  if (!SPECIAL_CONST_P(recv) && RBASIC_CLASS(recv) == rb_cHash &&
+      BASIC_OP_UNREDEFINED_P(BOP_ASET, HASH_REDEFINED_OP_FLAG) && rb_hash_compare_by_id_p(recv) == Qfalse) {
+    rb_hash_aset(recv, key, val);
+    return val;
+  }
+  else {
+    return rb_funcall(recv, idASET, 2, rb_str_resurrect(key), val);
+  }
+}
@@ -0,0 +1,42 @@
+#include <math.h>
+#include "cruby.h"
+
+// Same as opt_case_dispatch in insns.def, but returns jump offset instead of JUMP.
+// Returns -1 when it should fall through to checkmatch insns.
+// https://github.com/ruby/ruby/blob/v2_4_1/insns.def
+long
+llrb_insn_opt_case_dispatch(CDHASH hash, OFFSET else_offset, VALUE key)
+{
+  switch (TYPE(key)) {
+    case T_FLOAT: {
+      double ival;
+      if (modf(RFLOAT_VALUE(key), &ival) == 0.0) {
+        key = FIXABLE(ival) ? LONG2FIX((long)ival) : rb_dbl2big(ival);
+      }
+    }
+    case T_SYMBOL: /* fall through */
+    case T_FIXNUM:
+    case T_BIGNUM:
+    case T_STRING:
+      if (BASIC_OP_UNREDEFINED_P(BOP_EQQ,
+                                 SYMBOL_REDEFINED_OP_FLAG |
+                                 INTEGER_REDEFINED_OP_FLAG |
+                                 FLOAT_REDEFINED_OP_FLAG |
+                                 NIL_REDEFINED_OP_FLAG    |
+                                 TRUE_REDEFINED_OP_FLAG   |
+                                 FALSE_REDEFINED_OP_FLAG  |
+                                 STRING_REDEFINED_OP_FLAG)) {
+        st_data_t val;
+        if (st_lookup(RHASH_TBL_RAW(hash), key, &val)) {
+          return FIX2LONG((VALUE)val);
+        }
+        else {
+          return else_offset;
+        }
+      }
+      break;
+    default:
+      break;
+  }
+  return -1;
+}
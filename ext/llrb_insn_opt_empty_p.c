@@ -0,0 +1,21 @@
+#include "cruby.h"
+
+VALUE
+llrb_insn_opt_empty_p(VALUE recv)
+{
+  if (!SPECIAL_CONST_P(recv)) {
+    if (RBASIC_CLASS(recv) == rb_cString &&
+        BASIC_OP_UNREDEFINED_P(BOP_EMPTY_P, STRING_REDEFINED_OP_FLAG)) {
+      return RSTRING_LEN(recv) == 0 ? Qtrue : Qfalse;
+    }
+    else if (RBASIC_CLASS(recv) == rb_cArray &&
+        BASIC_OP_UNREDEFINED_P(BOP_EMPTY_P, ARRAY_REDEFINED_OP_FLAG)) {
+      return RARRAY_LEN(recv) == 0 ? Qtrue : Qfalse;
+    }
+    else if (RBASIC_CLASS(recv) == rb_cHash &&
+        BASIC_OP_UNREDEFINED_P(BOP_EMPTY_P, HASH_REDEFINED_OP_FLAG)) {
+      return RHASH_EMPTY_P(recv) ? Qtrue : Qfalse;
+    }
+  }
+  return Qundef; // normal_dispatch is compiled by llrb_compile_unary_opt_insn_with_dispatch
+}
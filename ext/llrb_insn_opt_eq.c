@@ -1,8 +1,10 @@
 #include "cruby.h"
+#include "float_ops.h"
 
 static inline VALUE
 opt_eq_func(VALUE recv, VALUE obj)
 {
+  double x, y;
   if (FIXNUM_2_P(recv, obj) &&
     BASIC_OP_UNREDEFINED_P(BOP_EQ, INTEGER_REDEFINED_OP_FLAG)) {
     return (recv == obj) ? Qtrue : Qfalse;
@@ -11,24 +13,16 @@ opt_eq_func(VALUE recv, VALUE obj)
       BASIC_OP_UNREDEFINED_P(BOP_EQ, FLOAT_REDEFINED_OP_FLAG)) {
     return (recv == obj) ? Qtrue : Qfalse;
   }
-  //else if (!SPECIAL_CONST_P(recv) && !SPECIAL_CONST_P(obj)) {
-  //  if (RBASIC_CLASS(recv) == rb_cFloat &&
-  //    RBASIC_CLASS(obj) == rb_cFloat &&
-  //    BASIC_OP_UNREDEFINED_P(BOP_EQ, FLOAT_REDEFINED_OP_FLAG)) {
-  //    double a = RFLOAT_VALUE(recv);
-  //    double b = RFLOAT_VALUE(obj);
-
-  //    if (isnan(a) || isnan(b)) {
-  //      return Qfalse;
-  //    }
-  //    return  (a == b) ? Qtrue : Qfalse;
-  //  }
-  //  else if (RBASIC_CLASS(recv) == rb_cString &&
-  //      RBASIC_CLASS(obj) == rb_cString &&
-  //      BASIC_OP_UNREDEFINED_P(BOP_EQ, STRING_REDEFINED_OP_FLAG)) {
-  //    return rb_str_equal(recv, obj);
-  //  }
-  //}
+  else if (llrb_float_operands_p(recv, obj, BOP_EQ, 1, &x, &y)) { /* Float with Float or Fixnum. NaN is not equal. */
+    return x == y ? Qtrue : Qfalse;
+  }
+  else if (!SPECIAL_CONST_P(recv) && !SPECIAL_CONST_P(obj)) {
+    if (RBASIC_CLASS(recv) == rb_cString &&
+        RBASIC_CLASS(obj) == rb_cString &&
+        BASIC_OP_UNREDEFINED_P(BOP_EQ, STRING_REDEFINED_OP_FLAG)) {
+      return rb_str_equal(recv, obj);
+    }
+  }
 
   //{
   //  vm_search_method(ci, cc, recv);
@@ -44,14 +38,6 @@ opt_eq_func(VALUE recv, VALUE obj)
 VALUE
 llrb_insn_opt_eq(VALUE recv, VALUE obj)
 {
-  VALUE val = opt_eq_func(recv, obj);
-
-  if (val == Qundef) {
-    /* other */
-    //PUSH(recv);
-    //PUSH(obj);
-    //CALL_SIMPLE_METHOD(recv);
-    return rb_funcall(recv, rb_intern("=="), 1, obj);
-  }
-  return val;
+  // If this returns Qundef, normal_dispatch is compiled by llrb_compile_opt_insn_with_dispatch.
+  return opt_eq_func(recv, obj);
 }
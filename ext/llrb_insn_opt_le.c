@@ -1,8 +1,10 @@
 #include "cruby.h"
+#include "float_ops.h"
 
 VALUE
 llrb_insn_opt_le(VALUE recv, VALUE obj)
 {
+  double x, y;
   if (FIXNUM_2_P(recv, obj) &&
     BASIC_OP_UNREDEFINED_P(BOP_LE, INTEGER_REDEFINED_OP_FLAG)) {
     SIGNED_VALUE a = recv, b = obj;
@@ -19,11 +21,14 @@ llrb_insn_opt_le(VALUE recv, VALUE obj)
     /* flonum is not NaN */
     return RFLOAT_VALUE(recv) <= RFLOAT_VALUE(obj) ? Qtrue : Qfalse;
   }
+  else if (llrb_float_operands_p(recv, obj, BOP_LE, 1, &x, &y)) { /* Float with Float or Fixnum. NaN is also false. */
+    return x <= y ? Qtrue : Qfalse;
+  }
   else {
     /* other */
     //PUSH(recv);
     //PUSH(obj);
     //CALL_SIMPLE_METHOD(recv);
-    return rb_funcall(recv, rb_intern("<="), 1, obj);
+    return Qundef; // normal_dispatch is compiled by llrb_compile_opt_insn_with_dispatch
   }
 }
@@ -0,0 +1,21 @@
+#include "cruby.h"
+
+VALUE
+llrb_insn_opt_length(VALUE recv)
+{
+  if (!SPECIAL_CONST_P(recv)) {
+    if (RBASIC_CLASS(recv) == rb_cString &&
+        BASIC_OP_UNREDEFINED_P(BOP_LENGTH, STRING_REDEFINED_OP_FLAG)) {
+      return rb_str_length(recv);
+    }
+    else if (RBASIC_CLASS(recv) == rb_cArray &&
+        BASIC_OP_UNREDEFINED_P(BOP_LENGTH, ARRAY_REDEFINED_OP_FLAG)) {
+      return LONG2NUM(RARRAY_LEN(recv));
+    }
+    else if (RBASIC_CLASS(recv) == rb_cHash &&
+        BASIC_OP_UNREDEFINED_P(BOP_LENGTH, HASH_REDEFINED_OP_FLAG)) {
+      return INT2FIX(RHASH_SIZE(recv));
+    }
+  }
+  return Qundef; // normal_dispatch is compiled by llrb_compile_unary_opt_insn_with_dispatch
+}
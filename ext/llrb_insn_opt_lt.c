@@ -1,8 +1,10 @@
 #include "cruby.h"
+#include "float_ops.h"
 
 VALUE
 llrb_insn_opt_lt(VALUE recv, VALUE obj)
 {
+  double x, y;
   if (FIXNUM_2_P(recv, obj) &&
       BASIC_OP_UNREDEFINED_P(BOP_LT, INTEGER_REDEFINED_OP_FLAG)) {
     SIGNED_VALUE a = recv, b = obj;
@@ -19,20 +21,14 @@ llrb_insn_opt_lt(VALUE recv, VALUE obj)
     /* flonum is not NaN */
     return RFLOAT_VALUE(recv) < RFLOAT_VALUE(obj) ? Qtrue : Qfalse;
   }
-  //else if (!SPECIAL_CONST_P(recv) && !SPECIAL_CONST_P(obj)) {
-  //  if (RBASIC_CLASS(recv) == rb_cFloat && RBASIC_CLASS(obj) == rb_cFloat  &&
-  //      BASIC_OP_UNREDEFINED_P(BOP_LT, FLOAT_REDEFINED_OP_FLAG)) {
-  //    val = double_cmp_lt(RFLOAT_VALUE(recv), RFLOAT_VALUE(obj));
-  //  }
-  //  else {
-  //    goto INSN_LABEL(normal_dispatch);
-  //  }
-  //}
+  else if (llrb_float_operands_p(recv, obj, BOP_LT, 1, &x, &y)) { /* Float with Float or Fixnum. NaN is also false. */
+    return x < y ? Qtrue : Qfalse;
+  }
   else {
     //INSN_LABEL(normal_dispatch):
     //PUSH(recv);
     //PUSH(obj);
     //CALL_SIMPLE_METHOD(recv);
-    return rb_funcall(recv, '<', 1, obj);
+    return Qundef; // normal_dispatch is compiled by llrb_compile_opt_insn_with_dispatch
   }
 }
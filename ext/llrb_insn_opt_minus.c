@@ -1,8 +1,10 @@
 #include "cruby.h"
+#include "float_ops.h"
 
 VALUE
 llrb_insn_opt_minus(VALUE recv, VALUE obj)
 {
+  double x, y;
   if (FIXNUM_2_P(recv, obj) &&
       BASIC_OP_UNREDEFINED_P(BOP_MINUS, INTEGER_REDEFINED_OP_FLAG)) {
     long a, b, c;
@@ -16,21 +18,15 @@ llrb_insn_opt_minus(VALUE recv, VALUE obj)
       BASIC_OP_UNREDEFINED_P(BOP_MINUS, FLOAT_REDEFINED_OP_FLAG)) {
     return DBL2NUM(RFLOAT_VALUE(recv) - RFLOAT_VALUE(obj));
   }
-  //else if (!SPECIAL_CONST_P(recv) && !SPECIAL_CONST_P(obj)) {
-  //  if (RBASIC_CLASS(recv) == rb_cFloat && RBASIC_CLASS(obj) == rb_cFloat  &&
-  //      BASIC_OP_UNREDEFINED_P(BOP_MINUS, FLOAT_REDEFINED_OP_FLAG)) {
-  //    val = DBL2NUM(RFLOAT_VALUE(recv) - RFLOAT_VALUE(obj));
-  //  }
-  //  else {
-  //    goto INSN_LABEL(normal_dispatch);
-  //  }
-  //}
+  else if (llrb_float_operands_p(recv, obj, BOP_MINUS, 0, &x, &y)) { /* Float with Float or Fixnum */
+    return DBL2NUM(x - y);
+  }
   else {
     /* other */
     //INSN_LABEL(normal_dispatch):
     //PUSH(recv);
     //PUSH(obj);
     //CALL_SIMPLE_METHOD(recv);
-    return rb_funcall(recv, '-', 1, obj);
+    return Qundef; // normal_dispatch is compiled by llrb_compile_opt_insn_with_dispatch
   }
 }
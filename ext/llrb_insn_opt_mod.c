@@ -1,32 +1,30 @@
 #include "cruby.h"
+#include "float_ops.h"
 
 VALUE
 llrb_insn_opt_mod(VALUE recv, VALUE obj)
 {
+  double x, y;
   if (FIXNUM_2_P(recv, obj) &&
     BASIC_OP_UNREDEFINED_P(BOP_MOD, INTEGER_REDEFINED_OP_FLAG )) {
     //if (FIX2LONG(obj) == 0) goto INSN_LABEL(normal_dispatch);
-    if (FIX2LONG(obj) == 0) return rb_funcall(recv, '%', 1, obj);
+    if (FIX2LONG(obj) == 0) return Qundef; // normal_dispatch is compiled by llrb_compile_opt_insn_with_dispatch
     return rb_fix_mod_fix(recv, obj);
   }
   else if (FLONUM_2_P(recv, obj) &&
       BASIC_OP_UNREDEFINED_P(BOP_MOD, FLOAT_REDEFINED_OP_FLAG)) {
+    if (RFLOAT_VALUE(obj) == 0.0) return Qundef; // ruby_float_mod may raise ZeroDivisionError without program counter.
     return DBL2NUM(ruby_float_mod(RFLOAT_VALUE(recv), RFLOAT_VALUE(obj)));
   }
-  //else if (!SPECIAL_CONST_P(recv) && !SPECIAL_CONST_P(obj)) {
-  //  if (RBASIC_CLASS(recv) == rb_cFloat && RBASIC_CLASS(obj) == rb_cFloat &&
-  //    BASIC_OP_UNREDEFINED_P(BOP_MOD, FLOAT_REDEFINED_OP_FLAG)) {
-  //    val = DBL2NUM(ruby_float_mod(RFLOAT_VALUE(recv), RFLOAT_VALUE(obj)));
-  //  }
-  //  else {
-  //    goto INSN_LABEL(normal_dispatch);
-  //  }
-  //}
+  else if (llrb_float_operands_p(recv, obj, BOP_MOD, 0, &x, &y)) { /* Float with Float or Fixnum */
+    if (y == 0.0) return Qundef;
+    return DBL2NUM(ruby_float_mod(x, y));
+  }
   else {
     //INSN_LABEL(normal_dispatch):
     //PUSH(recv);
     //PUSH(obj);
     //CALL_SIMPLE_METHOD(recv);
   }
-  return rb_funcall(recv, '%', 1, obj);
+  return Qundef; // normal_dispatch is compiled by llrb_compile_opt_insn_with_dispatch
 }
@@ -0,0 +1,21 @@
+#include "cruby.h"
+
+// https://github.com/ruby/ruby/blob/v2_4_1/insns.def#L1034-L1065
+// Elements are on JIT-ed function's stack buffer, so Array is created only when Array#min is redefined.
+VALUE
+llrb_insn_opt_newarray_min(rb_num_t num, const VALUE *ptr)
+{
+  if (BASIC_OP_UNREDEFINED_P(BOP_MIN, ARRAY_REDEFINED_OP_FLAG)) {
+    if (num == 0) return Qnil;
+
+    struct cmp_opt_data cmp_opt = { 0, 0 };
+    VALUE result = ptr[0];
+    for (rb_num_t i = 1; i < num; i++) {
+      if (OPTIMIZED_CMP(ptr[i], result, cmp_opt) < 0) result = ptr[i];
+    }
+    return result;
+  }
+  else {
+    return rb_funcall(rb_ary_new_from_values(num, ptr), idMin, 0);
+  }
+}
@@ -0,0 +1,27 @@
+#include "cruby.h"
+
+void vm_search_method(const struct rb_call_info *ci, struct rb_call_cache *cc, VALUE recv);
+
+static inline int
+check_cfunc(const rb_callable_method_entry_t *me, VALUE (*func)())
+{
+  if (me && me->def->type == VM_METHOD_TYPE_CFUNC &&
+      me->def->body.cfunc.func == func) {
+    return 1;
+  }
+  else {
+    return 0;
+  }
+}
+
+VALUE
+llrb_insn_opt_not(VALUE recv, VALUE ci, VALUE cc)
+{
+  extern VALUE rb_obj_not(VALUE obj);
+  vm_search_method((CALL_INFO)ci, (CALL_CACHE)cc, recv);
+
+  if (check_cfunc(((CALL_CACHE)cc)->me, rb_obj_not)) {
+    return RTEST(recv) ? Qfalse : Qtrue;
+  }
+  return Qundef; // normal_dispatch is compiled by llrb_compile_unary_opt_insn_with_dispatch
+}
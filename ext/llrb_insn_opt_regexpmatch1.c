@@ -0,0 +1,12 @@
+#include "cruby.h"
+
+VALUE
+llrb_insn_opt_regexpmatch1(VALUE r, VALUE obj)
+{
+  if (BASIC_OP_UNREDEFINED_P(BOP_MATCH, REGEXP_REDEFINED_OP_FLAG)) {
+    return rb_reg_match(r, obj);
+  }
+  else {
+    return rb_funcall(r, idEqTilde, 1, obj);
+  }
+}
@@ -0,0 +1,16 @@
+#include "cruby.h"
+
+VALUE
+llrb_insn_opt_regexpmatch2(VALUE obj2, VALUE obj1)
+{
+  if (CLASS_OF(obj2) == rb_cString &&
+      BASIC_OP_UNREDEFINED_P(BOP_MATCH, STRING_REDEFINED_OP_FLAG)) {
+    return rb_reg_match(obj1, obj2);
+  }
+  else {
+    //PUSH(obj2);
+    //PUSH(obj1);
+    //CALL_SIMPLE_METHOD(obj2);
+    return rb_funcall(obj2, idEqTilde, 1, obj1);
+  }
+}
@@ -1,8 +1,8 @@
 #include "cruby.h"
+#include "native_call.h"
 
 #define CALL_METHOD(calling, ci, cc) (*(cc)->call)(th, cfp, (calling), (ci), (cc))
 void vm_search_method(const struct rb_call_info *ci, struct rb_call_cache *cc, VALUE recv);
-VALUE vm_exec(rb_thread_t *th);
 VALUE // TODO: refactor with invokesuper
 llrb_insn_opt_send_without_block(VALUE th_v, VALUE cfp_v, VALUE ci_v, VALUE cc_v, VALUE recv)
 {
@@ -20,8 +20,7 @@ llrb_insn_opt_send_without_block(VALUE th_v, VALUE cfp_v, VALUE ci_v, VALUE cc_v
 
   VALUE result = CALL_METHOD(&calling, ci, cc);
   if (result == Qundef) {
-    VM_ENV_FLAGS_SET(th->cfp->ep, VM_FRAME_FLAG_FINISH);
-    return vm_exec(th);
+    return llrb_exec_pushed_frame(th);
   }
   return result;
 }
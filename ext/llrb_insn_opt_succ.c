@@ -0,0 +1,25 @@
+#include "cruby.h"
+
+VALUE
+llrb_insn_opt_succ(VALUE recv)
+{
+  if (SPECIAL_CONST_P(recv)) {
+    if (FIXNUM_P(recv) &&
+        BASIC_OP_UNREDEFINED_P(BOP_SUCC, INTEGER_REDEFINED_OP_FLAG)) {
+      /* fixnum + INT2FIX(1) */
+      if (recv != LONG2FIX(FIXNUM_MAX)) {
+        return recv - 1 + INT2FIX(1);
+      }
+      else {
+        return LONG2NUM(FIXNUM_MAX + 1);
+      }
+    }
+  }
+  else {
+    if (RBASIC_CLASS(recv) == rb_cString &&
+        BASIC_OP_UNREDEFINED_P(BOP_SUCC, STRING_REDEFINED_OP_FLAG)) {
+      return rb_str_succ(recv);
+    }
+  }
+  return Qundef; // normal_dispatch is compiled by llrb_compile_unary_opt_insn_with_dispatch
+}
@@ -1,8 +1,8 @@
 #include "cruby.h"
+#include "native_call.h"
 
 #define CALL_METHOD(calling, ci, cc) (*(cc)->call)(th, cfp, (calling), (ci), (cc))
 void vm_search_method(const struct rb_call_info *ci, struct rb_call_cache *cc, VALUE recv);
-VALUE vm_exec(rb_thread_t *th);
 void vm_caller_setup_arg_block(const rb_thread_t *th, rb_control_frame_t *reg_cfp,
     struct rb_calling_info *calling, const struct rb_call_info *ci, rb_iseq_t *blockiseq, const int is_super);
 
@@ -42,8 +42,7 @@ llrb_insn_send(VALUE th_v, VALUE cfp_v, VALUE ci_v, VALUE cc_v, VALUE blockiseq_
 
   VALUE result = CALL_METHOD(&calling, ci, cc);
   if (result == Qundef) {
-    VM_ENV_FLAGS_SET(th->cfp->ep, VM_FRAME_FLAG_FINISH);
-    return vm_exec(th);
+    return llrb_exec_pushed_frame(th);
   }
   return result;
 }
@@ -0,0 +1,13 @@
+#include "cruby.h"
+
+const rb_cref_t * vm_get_const_key_cref(const VALUE *ep);
+void
+llrb_insn_setinlinecache(VALUE cfp_v, VALUE ic_v, VALUE val)
+{
+  rb_control_frame_t *cfp = (rb_control_frame_t *)cfp_v;
+  IC ic = (IC)ic_v;
+  ic->ic_value.value = val;
+  ic->ic_serial = GET_GLOBAL_CONSTANT_STATE() - ruby_vm_const_missing_count;
+  ic->ic_cref = vm_get_const_key_cref(cfp->ep);
+  ruby_vm_const_missing_count = 0;
+}
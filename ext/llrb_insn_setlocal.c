@@ -1,7 +1,5 @@
 #include "cruby.h"
 
-void rb_vm_env_write(const VALUE *ep, int index, VALUE v);
-
 void
 llrb_insn_setlocal(VALUE cfp_v, lindex_t idx, rb_num_t level, VALUE val)
 {
@@ -12,5 +10,5 @@ llrb_insn_setlocal(VALUE cfp_v, lindex_t idx, rb_num_t level, VALUE val)
   for (i = 0; i < lev; i++) {
     ep = GET_PREV_EP(ep);
   }
-  rb_vm_env_write(ep, -(int)idx, val);
+  llrb_vm_env_write(ep, -(int)idx, val);
 }
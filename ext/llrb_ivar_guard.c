@@ -0,0 +1,12 @@
+#include "cruby.h"
+
+// Guard for ivar access specialized by index. JIT-ed code checks this once on its entry since self doesn't change
+// in a frame. An ivar index is valid while self's class is the same one, because iv_index_tbl only grows.
+VALUE
+llrb_ivar_guard(VALUE self, VALUE serial)
+{
+  if (LIKELY(RB_TYPE_P(self, T_OBJECT)) && LIKELY(RCLASS_SERIAL(RBASIC(self)->klass) == (rb_serial_t)serial)) {
+    return Qtrue;
+  }
+  return Qfalse;
+}
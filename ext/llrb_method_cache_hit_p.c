@@ -0,0 +1,14 @@
+#include "cruby.h"
+
+extern rb_serial_t ruby_vm_global_method_state;
+
+// Guard for inlined method. It's the same as vm_search_method's cache hit, with the cache at compilation.
+VALUE
+llrb_method_cache_hit_p(VALUE recv, VALUE method_state, VALUE class_serial)
+{
+  if (LIKELY(ruby_vm_global_method_state == (rb_serial_t)method_state
+        && RCLASS_SERIAL(CLASS_OF(recv)) == (rb_serial_t)class_serial)) {
+    return Qtrue;
+  }
+  return Qfalse;
+}
@@ -0,0 +1,17 @@
+#include "cruby.h"
+
+// Array#include? of a temporary Array which doesn't escape, like `[a, b].include?(x)`. Elements are on JIT-ed
+// function's stack buffer or in a literal Array, so Array is created only when Array#include? is redefined.
+VALUE
+llrb_newarray_include_p(rb_num_t num, const VALUE *ptr, VALUE obj)
+{
+  if (rb_method_basic_definition_p(rb_cArray, rb_intern("include?"))) {
+    for (rb_num_t i = 0; i < num; i++) {
+      if (rb_equal(ptr[i], obj)) return Qtrue;
+    }
+    return Qfalse;
+  }
+  else {
+    return rb_funcall(rb_ary_new_from_values(num, ptr), rb_intern("include?"), 1, obj);
+  }
+}
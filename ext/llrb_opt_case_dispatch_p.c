@@ -0,0 +1,19 @@
+#include "cruby.h"
+
+// Returns Qtrue if JIT-ed code can dispatch Integer and Symbol keys of opt_case_dispatch by comparing VALUE.
+// The mask is the same as opt_case_dispatch's, since a redefinition for any key class makes it fall through.
+VALUE
+llrb_opt_case_dispatch_p(void)
+{
+  if (BASIC_OP_UNREDEFINED_P(BOP_EQQ,
+                             SYMBOL_REDEFINED_OP_FLAG |
+                             INTEGER_REDEFINED_OP_FLAG |
+                             FLOAT_REDEFINED_OP_FLAG |
+                             NIL_REDEFINED_OP_FLAG    |
+                             TRUE_REDEFINED_OP_FLAG   |
+                             FALSE_REDEFINED_OP_FLAG  |
+                             STRING_REDEFINED_OP_FLAG)) {
+    return Qtrue;
+  }
+  return Qfalse;
+}
@@ -0,0 +1,14 @@
+#include "cruby.h"
+
+// Used on function entry. Ep of outer scope is kept in a register, while the frame's env can't escape.
+VALUE
+llrb_outer_ep(VALUE cfp_v, rb_num_t level)
+{
+  rb_control_frame_t *cfp = (rb_control_frame_t *)cfp_v;
+  const VALUE *ep = cfp->ep;
+
+  for (rb_num_t i = 0; i < level; i++) {
+    ep = GET_PREV_EP(ep);
+  }
+  return (VALUE)ep;
+}
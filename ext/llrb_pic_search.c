@@ -0,0 +1,52 @@
+#include "cruby.h"
+#include "pic.h"
+
+extern rb_serial_t ruby_vm_global_method_state;
+void vm_search_method(const struct rb_call_info *ci, struct rb_call_cache *cc, VALUE recv);
+
+// Returns a call cache valid for `recv` from the call site's `pic`, filling an entry on miss. It's inlined to
+// JIT-ed code, so a hit is compares of up to LLRB_PIC_SIZE class serials without a call.
+VALUE
+llrb_pic_search(VALUE ci_v, VALUE cc_v, VALUE pic_v, VALUE stats_v, VALUE recv)
+{
+  const struct rb_call_info *ci = (const struct rb_call_info *)ci_v;
+  struct rb_call_cache *cc = (struct rb_call_cache *)cc_v;
+  struct llrb_pic *pic = (struct llrb_pic *)pic_v;
+  struct llrb_pic_stats *stats = (struct llrb_pic_stats *)stats_v;
+
+  if (pic->size != LLRB_PIC_MEGAMORPHIC) {
+    rb_serial_t class_serial = RCLASS_SERIAL(CLASS_OF(recv));
+    for (unsigned int i = 0; i < pic->size; i++) {
+      struct rb_call_cache *entry = &pic->entries[i];
+      if (LIKELY(entry->class_serial == class_serial && entry->method_state == ruby_vm_global_method_state)) {
+        stats->hits++;
+        return (VALUE)entry;
+      }
+    }
+  }
+  stats->misses++;
+  if (pic->size == LLRB_PIC_MEGAMORPHIC) {
+    vm_search_method(ci, cc, recv);
+    return (VALUE)cc;
+  }
+
+  // Entries invalidated by method definition are reused before adding one.
+  for (unsigned int i = 0; i < pic->size; i++) {
+    if (pic->entries[i].method_state != ruby_vm_global_method_state) {
+      vm_search_method(ci, &pic->entries[i], recv);
+      return (VALUE)&pic->entries[i];
+    }
+  }
+
+  if (pic->size > 0) stats->sites[pic->size]--;
+  if (pic->size == LLRB_PIC_SIZE) {
+    pic->size = LLRB_PIC_MEGAMORPHIC;
+    stats->sites[pic->size]++;
+    vm_search_method(ci, cc, recv);
+    return (VALUE)cc;
+  }
+  struct rb_call_cache *entry = &pic->entries[pic->size++];
+  stats->sites[pic->size]++;
+  vm_search_method(ci, entry, recv);
+  return (VALUE)entry;
+}
@@ -0,0 +1,11 @@
+#include "cruby.h"
+
+VALUE
+llrb_pop_result(VALUE cfp_v)
+{
+  rb_control_frame_t *cfp = (rb_control_frame_t *)cfp_v;
+
+  // POP()
+  cfp->sp -= 1;
+  return *(cfp->sp);
+}
@@ -0,0 +1,13 @@
+#include "cruby.h"
+
+// Caller must check self by `llrb_ivar_guard`. Returns Qfalse if ivar can't be written here, to fall back to inline
+// cache, which raises an error for frozen self or extends IVPTR.
+VALUE
+llrb_setivar_index(VALUE obj, VALUE index, VALUE val)
+{
+  if (LIKELY(!OBJ_FROZEN(obj)) && LIKELY(index < ROBJECT_NUMIV(obj))) {
+    RB_OBJ_WRITE(obj, &ROBJECT_IVPTR(obj)[index], val);
+    return Qtrue;
+  }
+  return Qfalse;
+}
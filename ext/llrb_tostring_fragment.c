@@ -0,0 +1,13 @@
+#include "cruby.h"
+
+// https://github.com/ruby/ruby/blob/v2_4_1/insns.def#L374-L387
+// Used for tostring whose result only `llrb_insn_concatstrings` reads. Symbol and Fixnum are left unconverted if
+// their #to_s is not redefined, because concatstrings writes their names and digits without creating Strings.
+VALUE
+llrb_tostring_fragment(VALUE obj)
+{
+  if (RB_TYPE_P(obj, T_STRING)) return obj;
+  if (SYMBOL_P(obj) && rb_method_basic_definition_p(rb_cSymbol, idTo_s)) return obj;
+  if (FIXNUM_P(obj) && rb_method_basic_definition_p(rb_cInteger, idTo_s)) return obj;
+  return rb_obj_as_string(obj);
+}
@@ -0,0 +1,97 @@
+#include "cruby.h"
+
+static inline int
+llrb_plain_array_p(VALUE ary)
+{
+  return !SPECIAL_CONST_P(ary) && RBASIC_CLASS(ary) == rb_cArray;
+}
+
+// Every partial sum fits in Fixnum if bound of the total's magnitude does, so the result is the same as YARV's.
+// For each element x, |x| <= m + 1 where m is OR-ed (x ^ (x >> 63)). Checks and sums are vectorized by clang.
+static VALUE
+llrb_vector_reduce_fixnum(const VALUE *a, const VALUE *b, long n, VALUE sum)
+{
+  VALUE tags = FIXNUM_FLAG;
+  long max_a = 0, max_b = 0;
+  for (long i = 0; i < n; i++) {
+    long x = (long)a[i] >> 1;
+    tags &= a[i];
+    max_a |= x ^ (x >> 63);
+  }
+  if (b) {
+    for (long i = 0; i < n; i++) {
+      long x = (long)b[i] >> 1;
+      tags &= b[i];
+      max_b |= x ^ (x >> 63);
+    }
+  }
+  if (!(tags & FIXNUM_FLAG)) return Qundef;
+
+  long s = FIX2LONG(sum);
+  long bound = max_a + 1;
+  if (b && __builtin_mul_overflow(bound, max_b + 1, &bound)) return Qundef;
+  if (__builtin_mul_overflow(bound, n, &bound) || __builtin_add_overflow(bound, s < 0 ? -s : s, &bound)) return Qundef;
+  if (bound > FIXNUM_MAX) return Qundef;
+
+  long acc = 0;
+  if (b) {
+    for (long i = 0; i < n; i++) {
+      acc += ((long)a[i] >> 1) * ((long)b[i] >> 1);
+    }
+  } else {
+    for (long i = 0; i < n; i++) {
+      acc += (long)a[i] >> 1;
+    }
+  }
+  return LONG2FIX(s + acc);
+}
+
+// Float additions are done in the same order as YARV, as reordering them for SIMD would change the result.
+// Products are separate statements not to be contracted to FMA.
+static VALUE
+llrb_vector_reduce_float(const VALUE *a, const VALUE *b, long n, VALUE sum)
+{
+  for (long i = 0; i < n; i++) {
+    if (!RB_FLOAT_TYPE_P(a[i]) || (b && !RB_FLOAT_TYPE_P(b[i]))) return Qundef;
+  }
+
+  double acc = RFLOAT_VALUE(sum);
+  for (long i = 0; i < n; i++) {
+    double x = RFLOAT_VALUE(a[i]);
+    if (b) {
+      double y = RFLOAT_VALUE(b[i]);
+      x = x * y;
+    }
+    acc = acc + x;
+  }
+  return DBL2NUM(acc);
+}
+
+// Runs `while i < n; s += a[i]; i += 1; end` or its dot product version `s += a[i] * b[i]` at once, for the loop
+// found by compiler.c. `ary2` is Qundef for sum. Returns Qundef to let the loop run as it is, if an operation may be
+// dispatched to a method or an index is out of range. Otherwise the loop's `i` becomes `n`.
+VALUE
+llrb_vector_reduce(VALUE ary, VALUE ary2, VALUE index, VALUE limit, VALUE sum)
+{
+  if (!FIXNUM_P(index) || !FIXNUM_P(limit) || !llrb_plain_array_p(ary)) return Qundef;
+  if (ary2 != Qundef && !llrb_plain_array_p(ary2)) return Qundef;
+  if (!BASIC_OP_UNREDEFINED_P(BOP_LT, INTEGER_REDEFINED_OP_FLAG) ||
+      !BASIC_OP_UNREDEFINED_P(BOP_PLUS, INTEGER_REDEFINED_OP_FLAG) ||
+      !BASIC_OP_UNREDEFINED_P(BOP_AREF, ARRAY_REDEFINED_OP_FLAG)) return Qundef;
+
+  long from = FIX2LONG(index), to = FIX2LONG(limit);
+  if (from < 0 || to <= from || RARRAY_LEN(ary) < to || (ary2 != Qundef && RARRAY_LEN(ary2) < to)) return Qundef;
+  const VALUE *a = RARRAY_CONST_PTR(ary) + from;
+  const VALUE *b = (ary2 == Qundef) ? 0 : RARRAY_CONST_PTR(ary2) + from;
+
+  if (FIXNUM_P(sum)) {
+    if (b && !BASIC_OP_UNREDEFINED_P(BOP_MULT, INTEGER_REDEFINED_OP_FLAG)) return Qundef;
+    return llrb_vector_reduce_fixnum(a, b, to - from, sum);
+  }
+  if (RB_FLOAT_TYPE_P(sum)) {
+    if (!BASIC_OP_UNREDEFINED_P(BOP_PLUS, FLOAT_REDEFINED_OP_FLAG)) return Qundef;
+    if (b && !BASIC_OP_UNREDEFINED_P(BOP_MULT, FLOAT_REDEFINED_OP_FLAG)) return Qundef;
+    return llrb_vector_reduce_float(a, b, to - from, sum);
+  }
+  return Qundef;
+}
@@ -1,4 +1,6 @@
+require 'json'
 require 'llrb/llrb'
+require 'llrb/version'
 
 module LLRB
   module JIT
@@ -7,16 +9,32 @@ module LLRB
     # @param [Object] recv - receiver of method to be compiled
     # @param [String,Symbol] method - precompiled method name
     # @param [Boolean] enable_stats - enable LLVM Pass statistics
-    # @return [Boolean] - return true if precompiled
-    def self.compile(recv, name, enable_stats: false)
-      compile_proc(recv.method(name), enable_stats: enable_stats)
+    # @param [Boolean] profile - measure each phase of this compilation. LLVM's timing report of each pass
+    #                            is printed to stderr too, like `opt -time-passes`.
+    # @return [Boolean,Hash] - return true if precompiled. With `profile: true`, return
+    #   { parse:, ir:, bitcode_load:, opt:, func_passes:, module_passes:, codegen: } in seconds instead.
+    #   `bitcode_load` is included in `ir`, and `func_passes` and `module_passes` are included in `opt`.
+    #   It has { ir_insns:, opt_insns:, code_size: } too, which are LLVM instructions of the function before and
+    #   after LLVM passes, and bytes of its native code.
+    def self.compile(recv, name, enable_stats: false, profile: false)
+      compile_proc(recv.method(name), enable_stats: enable_stats, profile: profile)
     end
 
-    def self.compile_proc(func, enable_stats: false)
+    def self.compile_proc(func, enable_stats: false, profile: false)
       iseqw = RubyVM::InstructionSequence.of(func)
       return false if iseqw.nil? # method defined with C function can't be compiled
 
-      compile_iseq(iseqw, enable_stats)
+      compile_iseq(iseqw, enable_stats, profile)
+    end
+
+    # Compile methods or procs into one LLVM module. Runtime functions are linked once, and LLVM passes and code
+    # generation run once for all of them. The ones which can't be compiled are skipped.
+    #
+    # @param [Array<Method,UnboundMethod,Proc>] funcs - methods or procs to be compiled
+    # @return [Integer] - the number of compiled ones
+    def self.compile_all(funcs)
+      iseqws = funcs.map { |func| RubyVM::InstructionSequence.of(func) }.compact
+      compile_iseqs(iseqws)
     end
 
     # Preview compiled method in LLVM IR
@@ -40,10 +58,267 @@ module LLRB
       is_compiled(iseqw)
     end
 
-    def self.start
+    # Start profiler and compile hot methods
+    #
+    # @param [Boolean] async - run LLVM optimization and code generation on a native thread
+    #                          instead of the Ruby thread which happens to be sampled
+    # @param [Integer] workers - the number of native threads compiling in parallel with async. It's capped by
+    #                            online CPUs except one, so that compilation doesn't starve Ruby threads. Only LLVM
+    #                            optimization runs in parallel: code generation shares one JIT stack per tier and
+    #                            is serialized, so more workers help only while optimization dominates.
+    # @param [String] profile_cache - path of a file to keep which methods are compiled. Methods compiled by
+    #                                 a previous process are compiled as soon as they are sampled once.
+    # @param [String] profile - path of a file written by .dump_profile. Methods compiled or sampled `min_samples`
+    #                           times there are compiled as soon as they are defined, or sampled once if they aren't
+    #                           defined by `def` after this. It's kept across Ruby versions and machines.
+    # @param [Integer] fork_budget - the number of methods a forked child can compile. Child stops profiler
+    #                                by default, and the code compiled before fork is shared with parent.
+    # @param [Integer] interval - sampling interval in microseconds
+    # @param [Integer] compile_every - the number of samples in a compile window
+    # @param [Integer] batch - the number of methods compiled in a window at most, from the hottest one
+    # @param [Integer] min_samples - a method is compiled after it's sampled this times
+    # @param [Integer] depth - the number of frames profiled from stack top, up to 64
+    # @param [Integer] max_compiles_per_sec - rate limit of compilations. Unlimited if nil.
+    # @param [Integer] max_compiles - profiler stops after this number of compilations. Unlimited if nil.
+    # @return [Boolean] - return true if started
+    def self.start(async: false, workers: 1, profile_cache: nil, profile: nil, fork_budget: nil, interval: 1000,
+                   compile_every: 200, batch: 1, min_samples: 1, depth: 16, max_compiles_per_sec: nil, max_compiles: nil)
       hook_stop
-      start_internal
+      if profile_cache || profile
+        preloaded = profile_cache ? hook_profile_cache(profile_cache) : {}
+        preloaded = preloaded.merge(load_profile(profile, min_samples)) { |_, old, new| [old, new].max } if profile
+        preload_profile(preloaded)
+      end
+      config = {
+        workers: workers,
+        interval: interval,
+        compile_every: compile_every,
+        batch: batch,
+        min_samples: min_samples,
+        depth: depth,
+        max_compiles_per_sec: max_compiles_per_sec,
+        max_compiles: max_compiles,
+      }
+      started = start_internal(async, fork_budget, config)
+      MethodPreloader.install if started && @preloaded_locations && !@preloaded_locations.empty?
+      started
+    end
+
+    # Write what profiler has found in this process, so that .start(profile: path) of a next deploy can compile the
+    # methods before they get hot. Each sampled method is identified by its path, line, label and a checksum of its
+    # insns, and has its sample counts, compiled tier and failed guards, which aren't speculated in the next process.
+    #
+    # @param [String] path - path of the JSON file, which is replaced atomically
+    # @return [Integer] - the number of written methods
+    def self.dump_profile(path)
+      compiled = compiled_profile
+      failures = guard_failures
+      paths = {}
+      entries = sampled_profile.map do |key, sample|
+        location = "#{sample[:path]}:#{sample[:line]}:#{sample[:label]}:"
+        [
+          paths[sample[:path]] ||= paths.size, sample[:line], sample[:label], key[location.size..-1],
+          compiled.fetch(key, 0), sample[:self], sample[:inclusive], sample[:loop], failures.fetch(key, []),
+        ]
+      end
+
+      tmp = "#{path}.#{Process.pid}"
+      File.write(tmp, JSON.generate(format: PROFILE_FORMAT, paths: paths.keys, entries: entries))
+      File.rename(tmp, path)
+      entries.size
+    end
+
+    PROFILE_FORMAT = 2 # Version of .dump_profile's file. Incremented when its entries are changed.
+    private_constant :PROFILE_FORMAT
+
+    # Types of an entry of .dump_profile's file: path index, line, label, checksum, compiled tier, self, inclusive and
+    # loop samples, and positions of failed guards.
+    PROFILE_ENTRY = [Integer, Integer, String, String, Integer, Integer, Integer, Integer, Array].freeze
+    private_constant :PROFILE_ENTRY
+
+    # Reads .dump_profile's file. Failed guards are preloaded here, and compiled tiers are returned to be preloaded
+    # with .start's profile_cache. A missing or broken file is ignored, like profile_cache's, and so is each entry
+    # having other than strings and non-negative integers where they're expected.
+    def self.load_profile(path, min_samples)
+      data = begin
+               JSON.parse(File.read(path))
+             rescue Errno::ENOENT, JSON::ParserError
+               nil
+             end
+      return {} unless data.is_a?(Hash) && data['format'] == PROFILE_FORMAT
+      paths = data['paths']
+      return {} unless paths.is_a?(Array) && paths.all? { |path| path.is_a?(String) } && data['entries'].is_a?(Array)
+
+      tiers = {}
+      failures = {}
+      @preloaded_locations = {}
+      data['entries'].each do |entry|
+        next unless profile_entry?(entry, paths.size)
+        path_index, line, label, checksum, tier, self_samples, _, _, failed = entry
+        path = paths[path_index]
+        key = "#{path}:#{line}:#{label}:#{checksum}"
+        tier = 1 if tier == 0 && self_samples >= min_samples # LLRB_TIER_BASELINE
+        next if tier == 0
+
+        tiers[key] = tier
+        failures[key] = failed unless failed.empty?
+        @preloaded_locations["#{path}:#{line}"] = true
+      end
+      preload_guard_failures(failures)
+      tiers
+    end
+    private_class_method :load_profile
+
+    def self.profile_entry?(entry, paths_size)
+      return false unless entry.is_a?(Array) && entry.size == PROFILE_ENTRY.size
+      return false unless entry.zip(PROFILE_ENTRY).all? { |value, type| value.is_a?(type) }
+      return false unless entry[0...-1].all? { |value| !value.is_a?(Integer) || value >= 0 } && entry[0] < paths_size
+      entry.last.all? { |pos| pos.is_a?(Integer) && pos >= 0 }
     end
+    private_class_method :profile_entry?
+
+    # Called by MethodPreloader with a method defined by `def`. Its ISeq is looked up only if a method in the
+    # profile is at the same location, and its compiled tier is found by the whole key when it's queued. Each location
+    # is preloaded once, and this returns immediately after all of them are.
+    def self.preload_method(mod, name)
+      return if @preloaded_locations.empty?
+      method = mod.instance_method(name)
+      location = method.source_location
+      return if location.nil? || !@preloaded_locations.delete(location.join(':'))
+      MethodPreloader.uninstall if @preloaded_locations.empty?
+
+      iseqw = RubyVM::InstructionSequence.of(method)
+      preload_iseq(iseqw) if iseqw
+    rescue NameError
+      nil # undefined by another method_added hook
+    end
+    private_class_method :preload_method
+
+    # Prepended to Module by .start with `profile:`. A class whose method_added doesn't call super skips this, and
+    # its methods are compiled when they're sampled once. So are singleton methods of objects other than modules.
+    # A prepended module can't be removed, so its hooks are removed once every location is preloaded.
+    module MethodPreloader
+      def self.install
+        Module.prepend(self)
+        module_eval do
+          def method_added(name)
+            super
+            LLRB::JIT.send(:preload_method, self, name)
+          end
+
+          def singleton_method_added(name)
+            super
+            LLRB::JIT.send(:preload_method, singleton_class, name)
+          end
+          private :method_added, :singleton_method_added
+        end
+      end
+
+      def self.uninstall
+        remove_method(:method_added, :singleton_method_added) if private_method_defined?(:method_added)
+      end
+    end
+    private_constant :MethodPreloader
+
+    # Write an ISeq of a method or proc with what profiler has found for it, so that its CompileError or slow
+    # compilation can be reproduced outside the application by bin/llrb-replay. Only the same Ruby can load it.
+    #
+    # @param [Method,UnboundMethod,Proc] func - method or proc to be dumped. Its blocks are dumped too.
+    # @param [String] path - path of the file, which is replaced atomically
+    # @return [Boolean] - return false if it's defined with C function
+    def self.dump_iseq(func, path)
+      iseqw = RubyVM::InstructionSequence.of(func)
+      return false if iseqw.nil?
+
+      key = profile_key(iseqw)
+      data = {
+        format: ISEQ_DUMP_FORMAT,
+        ruby: RUBY_DESCRIPTION,
+        binary: iseq_binary(iseqw),
+        location: "#{iseqw.label}@#{iseqw.path}:#{iseqw.first_lineno}",
+        tier: compiled_profile.fetch(key, 0),
+        failures: guard_failures.fetch(key, []),
+        sample: sampled_profile[key],
+      }
+      tmp = "#{path}.#{Process.pid}"
+      File.binwrite(tmp, Marshal.dump(data))
+      File.rename(tmp, path)
+      true
+    end
+
+    ISEQ_DUMP_FORMAT = 1 # Version of .dump_iseq's file. Incremented when its data is changed.
+    private_constant :ISEQ_DUMP_FORMAT
+
+    # Compile an ISeq written by .dump_iseq repeatedly. Each compilation loads a new ISeq, and guards which failed in
+    # the dumping process are not speculated for it. Call caches are empty after loading, so methods called by it are
+    # not inlined. Guard failures preloaded by .start's `profile` are replaced.
+    #
+    # @param [String] path - path of the file written by .dump_iseq
+    # @param [Integer] times - the number of compilations
+    # @return [Hash] - { location: String, tier: Integer, sample: Hash, results: Array }. `location` is
+    #   "label@path:line", and `tier` and `sample` are the ISeq's compiled tier and .sampled_profile entry (nil if
+    #   not sampled) in the dumping process. Each of `results` is .compile's result with `profile: true`, or
+    #   { error: Exception } if the compilation raised.
+    def self.replay_iseq(path, times: 1)
+      data = Marshal.load(File.binread(path))
+      unless data.is_a?(Hash) && data[:format] == ISEQ_DUMP_FORMAT
+        raise ArgumentError, "#{path} is not written by LLRB::JIT.dump_iseq"
+      end
+      if data[:ruby] != RUBY_DESCRIPTION
+        raise ArgumentError, "#{path} is dumped by #{data[:ruby]} but this is #{RUBY_DESCRIPTION}"
+      end
+
+      results = Array.new(times) do
+        iseqw = RubyVM::InstructionSequence.load_from_binary(data[:binary])
+        preload_guard_failures(profile_key(iseqw) => data[:failures])
+        begin
+          compile_iseq(iseqw, false, true)
+        rescue => e
+          { error: e }
+        end
+      end
+      { location: data[:location], tier: data[:tier], sample: data[:sample], results: results }
+    end
+
+    # Compile methods found hot by profiler in the highest tier. Call this before forking workers of a preforking
+    # server, so that they share the compiled code without warming up.
+    #
+    # @param [Integer] min_samples - methods sampled this times or more are compiled
+    # @return [Integer] - the number of compiled methods
+    def self.compile_hot_methods(min_samples: 1)
+      compile_hot_methods_internal(min_samples)
+    end
+
+    # Returns tiers cached by a previous process, which .start preloads.
+    # Native code has addresses of this process, so only the profile is cached. Then workers forked from the same
+    # application can skip sampling to find hot methods. It's discarded when Ruby or LLRB is changed.
+    def self.hook_profile_cache(path)
+      header = { 'ruby' => RUBY_DESCRIPTION, 'llrb' => LLRB::VERSION }
+      cached = read_profile_cache(path, header)
+      at_exit do
+        # Other processes may write the same file, so what they wrote after this started is merged under a lock.
+        File.open("#{path}.lock", File::RDWR | File::CREAT, 0644) do |lock|
+          lock.flock(File::LOCK_EX)
+          profile = read_profile_cache(path, header).merge(cached) { |_, old, new| [old, new].max }
+          profile = profile.merge(compiled_profile) { |_, old, new| [old, new].max }
+          tmp = "#{path}.#{Process.pid}"
+          File.write(tmp, JSON.generate(header: header, profile: profile))
+          File.rename(tmp, path)
+        end
+      end
+      cached
+    end
+    private_class_method :hook_profile_cache
+
+    # Reads hook_profile_cache's JSON file. A missing or broken file, or one written by other Ruby or LLRB, is {}.
+    def self.read_profile_cache(path, header)
+      data = JSON.parse(File.read(path))
+      return {} unless data.is_a?(Hash) && data['header'] == header && data['profile'].is_a?(Hash)
+      data['profile'].select { |key, tier| key.is_a?(String) && tier.is_a?(Integer) }
+    rescue Errno::ENOENT, JSON::ParserError
+      {}
+    end
+    private_class_method :read_profile_cache
 
     # Hook JIT stop at exit to safely shutdown Ruby VM. JIT touches Ruby VM and
     # it should not run after Ruby VM destruction. Otherwise it will cause SEGV.
@@ -56,10 +331,72 @@ module LLRB
 
     # Followings are defined in ext/llrb/llrb.cc
 
+    # .pass_pipeline= is defined in ext/llrb/llrb.c
+    # @param [Symbol] pipeline - LLVM passes used by optimized tier. :o3 (default) uses PassManagerBuilder's O3, and
+    #                            :lean uses curated passes with LLRB-specific ones, which take less compile time.
+
+    # .perf_map= is defined in ext/llrb/llrb.c
+    # @param [Boolean] enabled - write "address size label@path:line" of methods compiled after this to
+    #                            /tmp/perf-<pid>.map, so that perf and bpftrace can symbolize JIT-ed code.
+    #                            Addresses are the installed functions', and sizes are estimated like
+    #                            .code_size_limit= from the same module emitted again, since LLVM 4's Orc doesn't
+    #                            expose the loaded code. Writing a map doesn't block code generation.
+
+    # .code_size_limit= is defined in ext/llrb/llrb.c
+    # @param [Integer,nil] limit - bytes of native code which modules compiled after this can take. nil is unlimited.
+    #                              Beyond it, least recently sampled methods are reverted to the interpreter and their
+    #                              code is freed. Ones having a frame on some thread are kept, and nothing is freed
+    #                              once a thread has switched fibers. A module which still doesn't fit is refused, so
+    #                              the limit is a ceiling enforced by refusal. While set, each module is emitted
+    #                              again to measure it, because LLVM 4's Orc doesn't expose the code it has loaded. So
+    #                              sizes are estimates by the same codegen options, and measuring doesn't block codegen.
+
+    # .stats is defined in ext/llrb/stats.c
+    # @return [Hash] - {
+    #   compiled: Integer,        # native functions installed, including recompilation
+    #   checked: Integer,         # compilability checks
+    #   rejected: {
+    #     not_compilable: Integer, # rejections by the checks
+    #     compile_error: Integer,  # errors raised while building LLVM IR
+    #     insns: { String => Integer }, # same as `rejected` of .rejection_stats
+    #   },
+    #   time: { Symbol => { count: Integer, total: Float, p99: Float } }, # seconds of :parse, :ir, :opt, :codegen,
+    #                                                                      # :bitcode_load, :profile, and
+    #                                                                      # :func_passes and :module_passes in :opt
+    #   sampled_frames: Integer,  # frames sampled by profiler
+    #   osr_entries: Integer,     # interpreted frames which jumped into native code from a loop (on-stack replacement)
+    #   catch_entries: Integer,   # frames which got back to native code after rescue, break or next is caught
+    #   evicted: Integer,         # compiled methods reverted to the interpreter by .code_size_limit=
+    #   code_size: Integer,       # bytes of installed native code, counted only for modules measured by
+    #                             # .code_size_limit= or .perf_map=
+    #   pic: {                    # polymorphic inline caches of method calls and super in native code
+    #     hits: Integer,
+    #     misses: Integer,        # method searches, including every call of megamorphic sites
+    #     sites: { 1..4 => Integer, megamorphic: Integer }, # call sites by the number of cached receiver classes
+    #   },
+    # }
+    #   p99 is calculated from the latest 1024 samples of each phase.
+
+    # .sampled_profile is defined in ext/llrb/profiler.c
+    # @return [Hash] - { String => { path: String, line: Integer, label: String, self: Integer, inclusive: Integer,
+    #                  loop: Integer, callers: { String => Integer } } }
+    #   Keyed by ISeq's location and insns like .compiled_profile. `self` counts samples where the ISeq is the nearest
+    #   ISeq frame from stack top, including C functions called by it. `inclusive` counts samples having it in
+    #   profiled frames, `loop` counts self samples inside a loop, and `callers` counts samples by frequent callers.
+    #   Beyond 65536 ISeqs, the coldest ones which are not compiled are dropped.
+
+    # .rejection_stats is defined in ext/llrb/compiler.c
+    # @return [Hash] - { checked: Integer, rejected: { String => Integer } }. `checked` is the number of
+    #                  compilability checks, and `rejected` is the number of ISeqs rejected by each insn.
+
     # @param  [RubyVM::InstructionSequence] iseqw - RubyVM::InstructionSequence instance
     # @return [Boolean] return true if compiled
     private_class_method :compile_iseq
 
+    # @param  [Array<RubyVM::InstructionSequence>] iseqws - compiled into one LLVM module
+    # @return [Integer] the number of compiled ones
+    private_class_method :compile_iseqs
+
     # @param  [RubyVM::InstructionSequence] iseqw - RubyVM::InstructionSequence instance
     # @return [Boolean] return true if compiled
     private_class_method :preview_iseq
@@ -68,9 +405,49 @@ module LLRB
     # @return [Boolean] return true if compiled
     private_class_method :is_compiled
 
+    # @return [Hash] - { String => Integer }. Tiers of compiled ISeqs keyed by their location and insns.
+    private_class_method :compiled_profile
+
+    # @param [Hash] profile - { String => Integer } returned by .compiled_profile in a previous process
+    private_class_method :preload_profile
+
+    # @return [Hash] - { String => [Integer] }. Positions of failed guards of compiled ISeqs keyed like .compiled_profile.
+    private_class_method :guard_failures
+
+    # @param [Hash] failures - { String => [Integer] } returned by .guard_failures in a previous process
+    private_class_method :preload_guard_failures
+
+    # @param  [RubyVM::InstructionSequence] iseqw - RubyVM::InstructionSequence instance
+    # @return [String] - key of the ISeq in .compiled_profile, .guard_failures and .sampled_profile
+    private_class_method :profile_key
+
+    # @param  [RubyVM::InstructionSequence] iseqw - RubyVM::InstructionSequence instance
+    # @return [String] - same as RubyVM::InstructionSequence#to_binary, with insns before compilation
+    private_class_method :iseq_binary
+
+    # @param  [RubyVM::InstructionSequence] iseqw - ISeq of a method defined after .start with `profile:`
+    # @return [Boolean] return true if it's queued to be compiled
+    private_class_method :preload_iseq
+
+    # @param  [Integer,nil] max - the number of samples kept by .sampled_profile, or nil for the default 65536
+    # @return [Integer] the previous one
+    private_class_method :set_sample_table_max
+
+    # Takes a sample of the caller's frames like the profiler's timer, for specs. Arguments are ignored, so that its
+    # Method can be passed as a block to C methods.
+    # @return [Boolean] true if profiler is running and the sample is taken
+    private_class_method :sample_caller
+
     # This does not hook stop, but it may cause SEGV if JIT runs after Ruby VM is shut down.
     # To ensure JIT will be stopped on exit, you should use .start instead.
+    # @param  [Boolean] async - compile asynchronously
+    # @param  [Integer,nil] fork_budget - compilations allowed in forked child
+    # @param  [Hash] config - scheduling options of .start. Missing ones are defaults.
     # @return [Boolean] return true if started JIT
     private_class_method :start_internal
+
+    # @param  [Integer] min_samples - minimum sampled times of compiled methods
+    # @return [Integer] the number of compiled methods
+    private_class_method :compile_hot_methods_internal
   end
 end
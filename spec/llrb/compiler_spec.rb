@@ -98,6 +98,29 @@ RSpec.describe 'llrb_compile_iseq' do
     test_compile { @a = 2 }
   end
 
+  specify 'ivar insns specialized by index' do
+    klass = Class.new do
+      def test(n)
+        @sum = 0
+        n.times { |i| @sum += i } if n > 0
+        while @sum < 100
+          @sum += 1
+          @b = @sum
+        end
+        [@sum, @b, @c, @d]
+      end
+    end
+    klass.new.test(0) # fills inline caches
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+
+    expect(klass.new.test(0)).to eq([100, 100, nil, nil])
+    obj = klass.new
+    obj.instance_variable_set(:@d, 4)
+    expect(obj.test(20)).to eq([190, nil, nil, 4])
+    expect(Class.new(klass).new.test(0)).to eq([100, 100, nil, nil]) # guard fails by class
+    expect { klass.new.freeze.test(0) }.to raise_error(RuntimeError, /frozen/)
+  end
+
   # If we do this via Class.new, it prints warning...
   class LLRB::ClassVariableTest
     def self.test_getclassvariable
@@ -185,6 +208,17 @@ RSpec.describe 'llrb_compile_iseq' do
     test_compile { "h#{2}o" }
   end
 
+  specify 'string interpolation' do
+    test_compile(12, :key, -3) { |a, b, c| "#{a}:#{b}:#{c}" }
+    test_compile(2**40, 'str', nil) { |a, b, c| "#{b}#{a}#{c}" }
+    test_compile('ü', :é, 7.5) { |a, b, c| "#{a}#{b}#{c}" }
+    test_compile(1, [2]) { |a, b| "x#{a}#{b.first}#{a ? 3 : 4}" }
+    test_compile('a'.encode('UTF-16LE'), 'b'.encode('UTF-16LE')) { |a, b| "#{a}#{b}" }
+
+    klass = Class.new { def to_s; 'obj'; end }
+    test_compile(klass.new) { |a| "<#{a}>" }
+  end
+
   specify 'toregexp' do
     test_compile { /#{true}/ =~ "true" }
   end
@@ -199,9 +233,14 @@ RSpec.describe 'llrb_compile_iseq' do
     test_compile { [:foo, :bar] }
   end
 
-  #specify 'expandarray' do
-  #  test_compile { y = [ true, false, nil ]; x, = y; x }
-  #end
+  specify 'expandarray' do
+    test_compile { y = [ true, false, nil ]; x, = y; x }
+    test_compile(1, 2) { |a, b| a, b = b, a + b; [a, b] }
+    test_compile([1, 2, 3]) { |y| a, *b = y; [a, b] }
+    test_compile([1, 2, 3]) { |y| *a, b = y; [a, b] }
+    test_compile([1]) { |y| a, b, *c = y; [a, b, c] }
+    test_compile(1) { |y| a, b = y; [a, b] }
+  end
 
   specify 'concatarray' do
     test_compile { ["t", "r", *x = "u", "e"].join }
@@ -252,11 +291,11 @@ RSpec.describe 'llrb_compile_iseq' do
     end
   end
 
-  #specify 'reverse' do
-  #  test_compile do
-  #    q, (w, e), r = 1, [2, 3], 4; e == 3
-  #  end
-  #end
+  specify 'reverse' do
+    test_compile do
+      q, (w, e), r = 1, [2, 3], 4; e == 3
+    end
+  end
 
   # specify 'reput' do
 
@@ -334,6 +373,31 @@ RSpec.describe 'llrb_compile_iseq' do
     test_compile { nil }
   end
 
+  specify 'trace enabled after compilation' do
+    klass = Class.new
+    klass.send(:define_singleton_method, :test) do |a|
+      b = a + 1
+      b * 2
+    end
+    body = (__LINE__ - 3)..(__LINE__ - 2)
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+
+    lines = []
+    trace = TracePoint.new(:line) { |tp| lines << tp.lineno if tp.path == __FILE__ && body.include?(tp.lineno) }
+    result = trace.enable { klass.test(1) }
+    expect(result).to eq(4)
+    expect(lines.size).to eq(2)
+    expect(LLRB::JIT.compiled?(klass, :test)).to eq(false)
+
+    # Recompiled with trace insns while the hook is registered
+    trace.enable do
+      expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+      lines.clear
+      expect(klass.test(1)).to eq(4)
+      expect(lines.size).to eq(2)
+    end
+  end
+
   # specify 'defineclass' do
 
   specify 'send' do
@@ -381,10 +445,22 @@ RSpec.describe 'llrb_compile_iseq' do
 
   specify 'opt_newarray_max' do
     test_compile { [[], [0]].max }
+    test_compile(3, 1.5) { |a, b| [a, b, 2].max }
+    test_compile('b', 'a') { |a, b| [a, b].max }
   end
 
   specify 'opt_newarray_min' do
     test_compile { [[], [0]].min }
+    test_compile(3, 1.5) { |a, b| [a, b, 2].min }
+    test_compile('b', 'a') { |a, b| [a, b].min }
+  end
+
+  specify 'temporary array of include?' do
+    test_compile(2, 3) { |a, b| [a, b].include?(3) }
+    test_compile(2, 3) { |a, b| [a, b].include?(a + b) }
+    test_compile(:foo) { |a| [:bar, :foo].include?(a) }
+    test_compile(1) { |a| [].include?(a) }
+    test_compile(1) { |a| (b = [a]).include?(1) && b }
   end
 
   specify 'opt_send_without_block' do
@@ -406,6 +482,78 @@ RSpec.describe 'llrb_compile_iseq' do
     expect(klass.test(1)).to eq(result)
   end
 
+  specify 'inlining of opt_send_without_block' do
+    callee = Class.new {
+      attr_reader :foo
+      def initialize; @foo = 1; end
+      def bar(x); @foo + x * 2; end
+    }
+    test_compile(callee.new) { |obj| obj.foo + obj.bar(3) }
+
+    klass = Class.new
+    klass.send(:define_singleton_method, :test) { |obj| obj.bar(3) }
+    expect(klass.test(callee.new)).to eq(7)
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+    expect(klass.test(callee.new)).to eq(7)
+
+    # Guard fails for another class and after redefinition
+    other = Class.new { def bar(x); x; end }
+    expect(klass.test(other.new)).to eq(3)
+    callee.send(:define_method, :bar) { |x| x * 3 }
+    expect(klass.test(callee.new)).to eq(9)
+  end
+
+  specify 'opt_send_without_block with keywords' do
+    callee = Class.new {
+      def call(a, b:, c: 2, d: [b])
+        [a, b, c, d]
+      end
+    }
+    klass = Class.new
+    klass.send(:define_singleton_method, :test) do |obj|
+      [obj.call(0, b: 1), obj.call(0, d: 4, b: 1), obj.call(0, c: 3, b: 1, d: nil)]
+    end
+    result = klass.test(callee.new)
+    expect(result).to eq([[0, 1, 2, [1]], [0, 1, 2, 4], [0, 1, 3, nil]])
+    expect(LLRB::JIT.compile(callee, :call)).to eq(true)
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+    expect(klass.test(callee.new)).to eq(result)
+
+    # Guard fails for another class and after redefinition
+    other = Class.new { def call(a, **kw); kw.size; end }
+    expect(klass.test(other.new)).to eq([1, 2, 3])
+    callee.class_eval { def call(a, b:, c: 5, d: 6); [a, b, c, d]; end }
+    expect(klass.test(callee.new)).to eq([[0, 1, 5, 6], [0, 1, 5, 4], [0, 1, 3, nil]])
+  end
+
+  specify 'native call between JIT-ed methods' do
+    klass = Class.new {
+      def self.fib(n)
+        n < 2 ? n : fib(n - 1) + fib(n - 2)
+      end
+
+      def self.callee(a)
+        raise ArgumentError if a.nil?
+        a + 1
+      end
+
+      def self.test(a)
+        callee(a)
+      rescue ArgumentError
+        :rescued
+      end
+    }
+    expect(LLRB::JIT.compile(klass, :fib)).to eq(true)
+    expect(klass.fib(15)).to eq(610)
+
+    expect(klass.test(1)).to eq(2)
+    expect(LLRB::JIT.compile(klass, :callee)).to eq(true)
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+    expect(klass.test(1)).to eq(2)
+    expect(klass.test(nil)).to eq(:rescued)
+    expect(klass.test(1.5)).to eq(2.5) # deoptimized in callee
+  end
+
   specify 'invokesuper' do
     mod = Module.new {
       def test
@@ -424,6 +572,55 @@ RSpec.describe 'llrb_compile_iseq' do
     expect(object.test).to eq(result)
   end
 
+  specify 'invokesuper cached for each method entry and receiver class' do
+    mod = Module.new {
+      def test(a, &block)
+        [super(a, &block), super + 1]
+      end
+    }
+    base1 = Class.new { def test(a); a + (block_given? ? yield : 0); end }
+    base2 = Class.new { def test(a); a * 10; end }
+    klass1 = Class.new(base1) { include mod }
+    klass2 = Class.new(base2) { include mod }
+    sub = Class.new(klass1)
+    expect(klass1.new.test(1) { 2 }).to eq([3, 4])
+    expect(LLRB::JIT.compile(klass1.new, :test)).to eq(true)
+
+    3.times do
+      expect(klass1.new.test(1) { 2 }).to eq([3, 4]) # both supers pass the block
+      expect(klass2.new.test(1)).to eq([10, 11])      # another method entry of the same ISeq
+      expect(sub.new.test(1)).to eq([1, 2])           # another receiver class
+    end
+
+    base1.send(:define_method, :test) { |a| a - 1 }
+    expect(klass1.new.test(1)).to eq([0, 1])
+    base1.send(:prepend, Module.new { def test(a); a - 2; end })
+    expect(sub.new.test(1)).to eq([-1, 0])
+    expect(klass2.new.test(2)).to eq([20, 21])
+  end
+
+  specify 'invokesuper beyond cached method entries' do
+    mod = Module.new {
+      def test(a)
+        super + 1
+      end
+    }
+    klasses = 6.times.map do |i|
+      base = Class.new { define_method(:test) { |a| a * i } }
+      Class.new(base) { include mod }
+    end
+    expect(klasses.first.new.test(2)).to eq(1)
+    expect(LLRB::JIT.compile(klasses.first.new, :test)).to eq(true)
+
+    before = LLRB::JIT.stats[:pic]
+    3.times do
+      klasses.each_with_index do |klass, i|
+        expect(klass.new.test(2)).to eq(2 * i + 1) # 5th and 6th classes are searched on every call
+      end
+    end
+    expect(LLRB::JIT.stats[:pic][:sites][:megamorphic]).to eq(before[:sites][:megamorphic] + 1)
+  end
+
   specify 'invokeblock' do
     klass = Class.new {
       def test
@@ -460,6 +657,64 @@ RSpec.describe 'llrb_compile_iseq' do
     end
   end
 
+  specify 'throw from a block yielded by a natively called method' do
+    klass = Class.new {
+      def self.each_twice(compile = false, &block)
+        LLRB::JIT.compile_proc(block) if compile
+        yield 1
+        yield 2
+        :not_broken
+      end
+
+      def self.test_break(compile = false)
+        each_twice(compile) { |x| break x * 10 }
+      end
+
+      def self.test_return(compile = false)
+        each_twice(compile) { |x| return x * 100 }
+        :not_returned
+      end
+    }
+    expect(klass.test_break(true)).to eq(10)
+    expect(klass.test_return(true)).to eq(100)
+    [:each_twice, :test_break, :test_return].each do |method|
+      expect(LLRB::JIT.compile(klass, method)).to eq(true)
+    end
+
+    3.times do
+      expect(klass.test_break).to eq(10)   # send -> JIT each_twice -> yield -> break
+      expect(klass.test_return).to eq(100) # send -> JIT each_twice -> yield -> return
+    end
+  end
+
+  specify 'rescue in a frame whose ISeq is invalidated while it runs' do
+    klass = Class.new
+    def klass.world
+      200
+    end
+    def klass.test(trigger)
+      trigger.call
+      raise 'error'
+    rescue => e
+      [e.message, e.backtrace_locations.first.lineno]
+    end
+    raise_line = klass.method(:test).source_location.last + 2
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+
+    trace = TracePoint.new(:line) {}
+    trigger = lambda do
+      trace.enable
+      expect(LLRB::JIT.compile(klass, :world)).to eq(true) # invalidates the running method
+    end
+    begin
+      expect(klass.test(trigger)).to eq(['error', raise_line])
+    ensure
+      trace.disable
+    end
+    expect(LLRB::JIT.compiled?(klass, :test)).to eq(false)
+    expect(klass.test(-> {})).to eq(['error', raise_line])
+  end
+
   specify 'jump' do
     test_compile(true) { |a| 1 if a }
     test_compile(nil) { |a| while a; end }
@@ -635,15 +890,53 @@ RSpec.describe 'llrb_compile_iseq' do
     test_error(TypeError, nil) { |a| 1 + a&.+(3) + 2 }
   end
 
+  specify 'merging multiple stack slots' do
+    [[true, nil], [false, 1], [nil, false]].each do |args|
+      test_compile(*args) { |a, b| [1, a ? 2 : 3, b || 4, a && b, b&.to_s] }
+      test_compile(*args) do |a, b|
+        [a, (case b when 1 then :one when nil then :nil else :other end), a ? b : a]
+      end
+      test_compile(*args) { |a, b| 1 + (a ? 2 : 3) + (b ? 4 : 5) }
+    end
+  end
+
   specify 'getinlinecache' do
     test_compile { Struct }
   end
 
+  specify 'getinlinecache' do
+    test_compile { [Struct, Struct] }
+
+    begin
+      Object.const_set(:LLRB_INLINE_CACHE_TEST, 1)
+      klass = Class.new
+      klass.send(:define_singleton_method, :test) { LLRB_INLINE_CACHE_TEST }
+
+      expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+      expect(klass.test).to eq(1)
+      expect(klass.test).to eq(1)
+
+      Object.send(:remove_const, :LLRB_INLINE_CACHE_TEST)
+      Object.const_set(:LLRB_INLINE_CACHE_TEST, 2)
+      expect(klass.test).to eq(2)
+    ensure
+      Object.send(:remove_const, :LLRB_INLINE_CACHE_TEST)
+    end
+  end
+
   specify 'setinlinecache' do
     test_compile { Struct }
   end
 
-  # specify 'once' do
+  specify 'once' do
+    test_compile('foo') { |x| /#{x}/o }
+
+    klass = Class.new
+    klass.send(:define_singleton_method, :test) { |x| /#{x}/o }
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+    expect(klass.test('foo')).to eq(/foo/)
+    expect(klass.test('bar')).to eq(/foo/)
+  end
 
   specify 'opt_case_dispatch' do
     test_compile(1) do |a|
@@ -652,6 +945,29 @@ RSpec.describe 'llrb_compile_iseq' do
         2
       end
     end
+
+    [1, 2, 3, 2.0, 'a'].each do |aa|
+      test_compile(aa) do |a|
+        100 + case a
+              when 1, 3
+                10
+              when 2
+                20
+              else
+                30
+              end
+      end
+    end
+
+    [:a, :b, :c, 'a', 'b', 'c', nil].each do |aa|
+      test_compile(aa) do |a|
+        case a
+        when :a then 1
+        when 'a' then 2
+        when :b, 'b' then 3
+        end
+      end
+    end
   end
 
   specify 'opt_plus' do
@@ -661,6 +977,25 @@ RSpec.describe 'llrb_compile_iseq' do
     test_compile(2.1, 1.2) { |a, b| a+b }
   end
 
+  specify 'deoptimization of speculative Fixnum operation' do
+    klass = Class.new
+    klass.send(:define_singleton_method, :test) do |a, b|
+      x = a + b
+      x < b ? x - 1 : x + 1
+    end
+
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+    expect(klass.test(1, 2)).to eq(4)
+    expect(klass.test(-5, 2)).to eq(-4)
+    expect(klass.test(1.5, 2)).to eq(4.5)
+    expect(klass.test(2**61, 2**61)).to eq(2**62 + 1)
+
+    # Recompiled without speculation for failed insns
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+    expect(klass.test(1.5, 2)).to eq(4.5)
+    expect(klass.test(1, 2)).to eq(4)
+  end
+
   specify 'opt_minus' do
     test_compile(2, 1) { |a, b| a-b }
     test_compile(2.1, 1.2) { |a, b| a-b }
@@ -683,6 +1018,35 @@ RSpec.describe 'llrb_compile_iseq' do
     test_compile { 3 % 2 % 1 }
   end
 
+  specify 'normal dispatch of opt insns' do
+    test_compile('a', 'b') { |a, b| a + b }
+    test_compile([1], [2]) { |a, b| a == b }
+    test_error(ZeroDivisionError, 1, 0) { |a, b| a / b }
+
+    klass = Class.new
+    klass.send(:define_singleton_method, :test) do |a, b|
+      begin
+        a / b
+      rescue ZeroDivisionError
+        :rescued
+      end
+    end
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+    expect(klass.test(1, 0)).to eq(:rescued)
+  end
+
+  specify 'Float operands of opt insns' do
+    heap = 1.0e300 # not flonum
+    [[1.5, 2], [2, 1.5], [heap, 3.0], [3, heap], [heap, heap], [Float::NAN, 1.0], [2**53 + 1, (2**53).to_f]].each do |x, y|
+      test_compile(x, y) { |a, b| [a + b, a - b, a * b, a / b] }
+      test_compile(x, y) { |a, b| [a < b, a <= b, a > b, a >= b, a == b] }
+    end
+    test_compile(heap, 7) { |a, b| a % b }
+    test_compile(7, 1.5) { |a, b| a % b }
+    test_compile(1.5, 0) { |a, b| a / b }
+    test_error(ZeroDivisionError, 1.5, 0) { |a, b| a.divmod(b) }
+  end
+
   specify 'opt_eq' do
     test_compile { 2 == 2 }
     test_compile { 3 == 2 }
@@ -732,31 +1096,104 @@ RSpec.describe 'llrb_compile_iseq' do
     test_compile { [nil][0] = 1 }
   end
 
+  specify 'deoptimization of speculative Array access' do
+    klass = Class.new
+    klass.send(:define_singleton_method, :test) do |a, i|
+      a[i] = a[i - 1]
+      a[i]
+    end
+
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+    expect(klass.test([1, 2, 3], 1)).to eq(1)
+    expect(klass.test([1, 2, 3], -1)).to eq(2)
+    expect(klass.test([1, 2, 3], 5)).to eq(nil)
+    expect(klass.test({ 0 => :a }, 1)).to eq(:a)
+    expect(klass.test([1, 2], 1.0)).to eq(1)
+    expect { klass.test([1, 2].freeze, 1) }.to raise_error(RuntimeError)
+
+    # Recompiled without speculation for failed insns
+    expect(LLRB::JIT.compile(klass, :test)).to eq(true)
+    expect(klass.test({ 0 => :a }, 1)).to eq(:a)
+    expect(klass.test([1, 2, 3], 1)).to eq(1)
+  end
+
+  specify 'sum and dot product loops' do
+    sum = proc do |a|
+      s = 0; i = 0
+      while i < a.length
+        s += a[i]
+        i += 1
+      end
+      [s, i]
+    end
+    test_compile([1, 2, 3, -4], &sum)
+    test_compile([1.5, 0.1, 0.2], &sum)
+    test_compile([], &sum)
+    test_compile([2**62 - 1, 1], &sum)
+    test_error(TypeError, [1, 2.0, nil], &sum)
+
+    dot = proc do |a, b, n|
+      s = 0.0; i = 0
+      while i < n
+        s += a[i] * b[i]
+        i += 1
+      end
+      s
+    end
+    test_compile([0.1, 0.2, 0.3], [3.0, 2.0, 1.0], 3, &dot)
+    test_error(NoMethodError, [0.1, 0.2], [3.0, 2.0, 1.0], 3, &dot)
+    test_compile([1, 2, 3], [4, 5, 6], 2) do |a, b, n|
+      s = 0; i = 0
+      while i < n
+        s += a[i] * b[i]
+        i += 1
+      end
+      s
+    end
+  end
+
   specify 'opt_aset_with' do
     test_compile { {}['true'] = true }
+    test_compile({}) { |h| h['true'] = true; h.keys.first.frozen? }
+    test_compile({}.compare_by_identity) { |h| h['true'] = true; h.size }
   end
 
   specify 'opt_aref_with' do
     test_compile(100) do |x|
       { 'true' => x }['true']
     end
+    test_compile({}.compare_by_identity) { |h| h['true'] }
+    test_compile([]) { |a| a['true'] rescue :error }
   end
 
   specify 'opt_length' do
     test_compile { [1, nil, false].length }
+    test_compile('foo') { |a| a.length }
+    test_compile({ a: 1 }) { |a| a.length }
+    test_compile(1..3) { |a| a.to_a.length }
+    test_compile(Struct.new(:a).new(1)) { |a| a.length }
   end
 
   specify 'opt_size' do
     test_compile { [1, nil, false].size }
+    test_compile('foo') { |a| a.size }
+    test_compile({ a: 1 }) { |a| a.size }
+    test_compile(1..3) { |a| a.size }
   end
 
   specify 'opt_empty_p' do
     test_compile { [].empty? }
     test_compile { [1].empty? }
+    test_compile('') { |a| a.empty? }
+    test_compile({}) { |a| a.empty? }
+    test_error(NoMethodError, 1) { |a| a.empty? }
   end
 
   specify 'opt_succ' do
     test_compile { 2.succ }
+    test_compile(2**62 - 1) { |a| a.succ }
+    test_compile('az') { |a| a.succ }
+    test_compile(2**64) { |a| a.succ }
   end
 
   specify 'opt_not' do
@@ -768,14 +1205,19 @@ RSpec.describe 'llrb_compile_iseq' do
     test_compile { true.! }
     test_compile { false.! }
     test_compile { 100.! }
+
+    obj = Class.new { def !; :not; end }.new
+    test_compile(obj) { |a| !a }
   end
 
   specify 'opt_regexpmatch1' do
     test_compile { /true/ =~ 'true' }
+    test_compile { /t(r)ue/ =~ 'true'; $1 }
   end
 
   specify 'opt_regexpmatch2' do
     test_compile { 'true' =~ /true/ }
+    test_compile { 'true' =~ /t(r)ue/; $~[1] }
   end
 
   # specify 'opt_call_c_function' do
@@ -813,6 +1255,37 @@ RSpec.describe 'llrb_compile_iseq' do
       b = 3
       a - b
     end
+    test_compile(10) do |n|
+      i = 0
+      sum = 0
+      while i < n
+        sum += i
+        i += 1
+      end
+      sum
+    end
+
+    # Written back on deoptimization
+    test_compile(1.5) do |x|
+      a = 1
+      a = a + 1
+      a + x
+    end
+
+    # Escaped to binding
+    test_compile do
+      a = 1
+      a = a + 1
+      binding.local_variable_get(:a)
+    end
+
+    # Escaped to binding called by reflection
+    test_compile do
+      a = 1
+      send(:binding).local_variable_set(:a, 2)
+      __send__(:binding).local_variable_set(:a, a + 1)
+      a
+    end
   end
 
   specify 'setlocal_OP__WC__1' do
@@ -837,6 +1310,38 @@ RSpec.describe 'llrb_compile_iseq' do
     expect(compiled).to eq(true)
   end
 
+  specify 'outer locals of a block called in a loop' do
+    compiled = []
+    klass1 = Class.new
+    klass1.send(:define_singleton_method, :test) do |n, &block|
+      compiled << LLRB::JIT.compile_proc(block)
+      n.times { |i| block.call(i) }
+    end
+
+    klass2 = Class.new
+    klass2.send(:define_singleton_method, :test) do
+      sum = 0
+      count = 0
+      str = nil
+      klass1.test(100) do |i|
+        sum += i
+        count += 1
+        str = 'a' * i # Env is on heap and may be old, so this goes through write barrier.
+        GC.start if i == 50
+      end
+
+      last = nil
+      klass1.test(3) do |i|
+        count += 1
+        last = -> { sum + i } # Ep chain is followed each time while this block's env may escape.
+      end
+      [sum, count, str.size, last.call]
+    end
+
+    expect(klass2.test).to eq([4950, 103, 99, 4952])
+    expect(compiled).to eq([true, true])
+  end
+
   specify 'putobject_OP_INT2FIX_O_0_C_' do
     test_compile { 0 }
   end
@@ -12,6 +12,556 @@ RSpec.describe LLRB::JIT do
     it 'rejects to compile method defined by C' do
       expect(LLRB::JIT.compile('', :prepend)).to eq(false)
     end
+
+    it 'returns time of each phase with profile: true' do
+      klass = Class.new
+      def klass.hello
+        100
+      end
+      profile = LLRB::JIT.compile(klass, :hello, profile: true)
+      expect(profile.keys).to match_array(
+        %i[parse ir bitcode_load opt func_passes module_passes codegen ir_insns opt_insns code_size])
+      expect(profile.values).to all(be >= 0)
+      expect(profile[:ir_insns]).to be > 0
+      expect(profile[:code_size]).to be > 0
+      expect(profile[:opt]).to be >= profile[:func_passes] + profile[:module_passes]
+      expect(klass.hello).to eq(100)
+    end
+
+    it 'keeps objects in operands alive while compiling' do
+      klass = Class.new
+      def klass.hello(a)
+        case a
+        when 'x', 'y' then [1.5, :b]
+        else 'c'
+        end
+      end
+      begin
+        GC.stress = true
+        expect(LLRB::JIT.compile(klass, :hello)).to eq(true)
+      ensure
+        GC.stress = false
+      end
+      expect(klass.hello('y')).to eq([1.5, :b])
+      expect(klass.hello('z')).to eq('c')
+    end
+  end
+
+  describe '.compile_proc' do
+    it 'compiles a block which Integer#times and Array#each invoke' do
+      sum = 0
+      block = proc { |x| sum += x }
+      expect(LLRB::JIT.compile_proc(block)).to eq(true)
+      key = LLRB::JIT.send(:profile_key, RubyVM::InstructionSequence.of(block))
+      expect(LLRB::JIT.send(:compiled_profile)[key]).to be > 0
+
+      3.times(&block)
+      [10, 20].each(&block)
+      expect(sum).to eq(33)
+    end
+  end
+
+  describe '.compile_all' do
+    it 'compiles methods into one module' do
+      klass = Class.new
+      def klass.add(a, b); a + b; end
+      def klass.double(a); add(a, a) * 2; end
+
+      before = LLRB::JIT.stats[:compiled]
+      funcs = [klass.method(:add), klass.method(:double), klass.method(:add), 1.method(:+)]
+      expect(LLRB::JIT.compile_all(funcs)).to eq(2)
+      expect(LLRB::JIT.stats[:compiled]).to eq(before + 2)
+      expect(LLRB::JIT.compiled?(klass, :add)).to eq(true)
+      expect(LLRB::JIT.compiled?(klass, :double)).to eq(true)
+      expect(klass.double(3)).to eq(12)
+      expect(LLRB::JIT.compile_all([klass.method(:add)])).to eq(0)
+    end
+  end
+
+  describe 'on-stack replacement' do
+    it 'continues a running loop in native code' do
+      klass = Class.new
+      def klass.sum
+        i = 0
+        sum = 0
+        while i < 100
+          LLRB::JIT.compile(self, :sum) if i == 10
+          sum += i
+          i += 1
+        end
+        sum
+      end
+      before = LLRB::JIT.stats[:osr_entries]
+      expect(klass.sum).to eq(4950)
+      expect(LLRB::JIT.stats[:osr_entries]).to eq(before + 1)
+      expect(klass.sum).to eq(4950)
+    end
+  end
+
+  describe 'catch table continuation' do
+    it 'gets back to native code after rescue' do
+      klass = Class.new
+      def klass.sum
+        i = 0
+        sum = 0
+        while i < 10
+          x = begin
+            raise 'x' if i.odd?
+            i
+          rescue RuntimeError
+            100
+          end
+          sum = sum + x
+          i += 1
+        end
+        sum
+      end
+      expect(LLRB::JIT.compile(klass, :sum)).to eq(true)
+      before = LLRB::JIT.stats[:catch_entries]
+      expect(klass.sum).to eq(520)
+      expect(LLRB::JIT.stats[:catch_entries]).to eq(before + 5)
+    end
+  end
+
+  describe 'freed ISeq' do
+    it 'releases JIT-ed code without breaking other compiled methods' do
+      alive = Class.new
+      alive.class_eval('def self.hello; 100; end')
+      expect(LLRB::JIT.compile(alive, :hello)).to eq(true)
+
+      10.times do
+        klass = Class.new
+        klass.class_eval('def self.hello; 200; end')
+        expect(LLRB::JIT.compile(klass, :hello)).to eq(true)
+        expect(klass.hello).to eq(200)
+      end
+      GC.start
+
+      expect(alive.hello).to eq(100)
+      reloaded = Class.new
+      reloaded.class_eval('def self.hello; 300; end')
+      expect(LLRB::JIT.compile(reloaded, :hello)).to eq(true)
+      expect(reloaded.hello).to eq(300)
+    end
+  end
+
+  describe '.pass_pipeline=' do
+    after { LLRB::JIT.pass_pipeline = :o3 }
+
+    it 'compiles methods with lean pipeline' do
+      LLRB::JIT.pass_pipeline = :lean
+      expect(LLRB::JIT.pass_pipeline).to eq(:lean)
+
+      klass = Class.new
+      def klass.count(n)
+        i = 0
+        i += 1 while i < n && !nil
+        [self, i < n ? true : false]
+      end
+      expect(LLRB::JIT.compile(klass, :count)).to eq(true)
+      expect(klass.count(100)).to eq([klass, false])
+    end
+
+    it 'rejects unknown pipeline' do
+      expect { LLRB::JIT.pass_pipeline = :o2 }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe '.rejection_stats' do
+    it 'counts ISeqs rejected by unsupported insns' do
+      before = LLRB::JIT.rejection_stats
+      block = proc { class LLRBRejectionStatsTest; end }
+      expect(LLRB::JIT.compile_proc(block)).to eq(false)
+
+      after = LLRB::JIT.rejection_stats
+      expect(after[:checked]).to be > before[:checked]
+      expect(after[:rejected]['defineclass']).to eq(before[:rejected].fetch('defineclass', 0) + 1)
+    end
+  end
+
+  describe '.stats' do
+    it 'counts compilations and their time' do
+      klass = Class.new
+      def klass.hello
+        100
+      end
+      before = LLRB::JIT.stats
+      expect(LLRB::JIT.compile(klass, :hello)).to eq(true)
+
+      after = LLRB::JIT.stats
+      expect(after[:compiled]).to eq(before[:compiled] + 1)
+      %i[parse ir opt func_passes module_passes codegen].each do |phase|
+        expect(after[:time][phase][:count]).to eq(before[:time][phase][:count] + 1)
+        expect(after[:time][phase][:total]).to be >= before[:time][phase][:total]
+        expect(after[:time][phase][:p99]).to be >= 0.0
+      end
+    end
+
+    it 'counts polymorphic inline cache hits, misses and call sites' do
+      klass = Class.new
+      def klass.stringify(obj)
+        obj.to_s
+      end
+      expect(LLRB::JIT.compile(klass, :stringify)).to eq(true)
+
+      before = LLRB::JIT.stats[:pic]
+      objs = [1, 'a', :b, 1.5]
+      2.times { objs.each { |obj| klass.stringify(obj) } }
+      after = LLRB::JIT.stats[:pic]
+      expect(after[:misses]).to eq(before[:misses] + 4)
+      expect(after[:hits]).to eq(before[:hits] + 4)
+      expect(after[:sites][4]).to eq(before[:sites][4] + 1)
+
+      expect(klass.stringify(nil)).to eq('') # 5th receiver class
+      expect(LLRB::JIT.stats[:pic][:sites][:megamorphic]).to eq(before[:sites][:megamorphic] + 1)
+    end
+
+    it 'counts rejected ISeqs' do
+      before = LLRB::JIT.stats
+      expect(LLRB::JIT.compile_proc(proc { class LLRBStatsTest; end })).to eq(false)
+      expect(LLRB::JIT.stats[:rejected][:not_compilable]).to eq(before[:rejected][:not_compilable] + 1)
+    end
+  end
+
+  describe '.perf_map=' do
+    after { LLRB::JIT.perf_map = false }
+
+    it 'writes compiled methods to perf map' do
+      klass = Class.new
+      def klass.perf_mapped
+        100
+      end
+      LLRB::JIT.perf_map = true
+      expect(LLRB::JIT.perf_map).to eq(true)
+      expect(LLRB::JIT.compile(klass, :perf_mapped)).to eq(true)
+      expect(klass.perf_mapped).to eq(100)
+
+      line = klass.method(:perf_mapped).source_location.last
+      entries = File.readlines("/tmp/perf-#{Process.pid}.map")
+      expect(entries).to include(/\A\h+ \h+ perf_mapped@#{Regexp.escape(__FILE__)}:#{line}\n\z/)
+    end
+  end
+
+  describe '.code_size_limit=' do
+    after { LLRB::JIT.code_size_limit = nil }
+
+    it 'evicts compiled methods beyond the limit' do
+      klass = Class.new
+      def klass.evicted
+        100
+      end
+      def klass.kept
+        200
+      end
+      LLRB::JIT.code_size_limit = 1024 * 1024
+      expect(LLRB::JIT.code_size_limit).to eq(1024 * 1024)
+      before = LLRB::JIT.stats
+      expect(LLRB::JIT.compile(klass, :evicted)).to eq(true)
+      expect(LLRB::JIT.stats[:code_size]).to be > before[:code_size]
+
+      LLRB::JIT.code_size_limit = 1
+      expect(LLRB::JIT.compiled?(klass, :evicted)).to eq(false)
+      expect(LLRB::JIT.stats[:evicted]).to be > before[:evicted]
+      expect(klass.evicted).to eq(100)
+      expect(LLRB::JIT.compile(klass, :evicted)).to eq(false)
+
+      LLRB::JIT.code_size_limit = nil
+      expect(LLRB::JIT.compile(klass, :kept)).to eq(true)
+      expect(LLRB::JIT.compiled?(klass, :kept)).to eq(true)
+      expect(klass.kept).to eq(200)
+    end
+
+    it 'rejects zero' do
+      expect { LLRB::JIT.code_size_limit = 0 }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe '.compiled_profile' do
+    it 'has compiled methods keyed by their location and insns' do
+      klass = Class.new
+      def klass.hello
+        100
+      end
+      expect(LLRB::JIT.compile(klass, :hello)).to eq(true)
+
+      line = klass.method(:hello).source_location.last
+      keys = LLRB::JIT.send(:compiled_profile).select { |key, _| key.start_with?("#{__FILE__}:#{line}:hello:") }
+      expect(keys.values).to eq([2]) # LLRB_TIER_OPTIMIZED
+    end
+  end
+
+  describe '.start' do
+    it 'rejects invalid scheduling options' do
+      expect { LLRB::JIT.start(interval: 0) }.to raise_error(ArgumentError)
+      expect { LLRB::JIT.start(max_compiles_per_sec: -1) }.to raise_error(ArgumentError)
+    end
+
+    it 'starts with a worker pool' do
+      expect { LLRB::JIT.start(async: true, workers: 0) }.to raise_error(ArgumentError)
+      expect(LLRB::JIT.start(async: true, workers: 4)).to eq(true)
+      expect(LLRB::JIT.stop).to eq(true)
+    end
+
+    it 'samples threads and deletes timers of exited ones' do
+      klass = Class.new
+      labels = 8.times.map { |i| "threaded#{i}" }
+      labels.each do |label|
+        klass.class_eval("def self.#{label}; i = 0; i += 1 while i < 10_000; end", 'llrb_thread.rb', 1)
+      end
+      sampled = lambda do |label|
+        LLRB::JIT.sampled_profile.values.find { |s| s[:path] == 'llrb_thread.rb' && s[:label] == label }
+      end
+
+      expect(LLRB::JIT.start(interval: 100, compile_every: 1_000_000)).to eq(true)
+      deadline = Time.now + 10
+      labels.each do |label|
+        Thread.new { klass.send(label) until sampled.call(label) || Time.now > deadline }.join
+      end
+      timers = File.read('/proc/self/timers').scan(/^ID:/).size if File.exist?('/proc/self/timers')
+      expect(LLRB::JIT.stop).to eq(true)
+
+      expect(labels.map { |label| sampled.call(label) }).to all(include(self: be > 0))
+      expect(timers).to be < labels.size if timers # Only the main thread's and the last thread's are left.
+    end
+  end
+
+  describe '.dump_profile' do
+    let(:path) { "/tmp/llrb-profile-#{Process.pid}" }
+    after { File.delete(path) if File.exist?(path) }
+
+    it 'writes sampled methods which .start can load' do
+      expect(LLRB::JIT.dump_profile(path)).to eq(LLRB::JIT.sampled_profile.size)
+      expect(LLRB::JIT.start(profile: path)).to eq(true)
+      expect(LLRB::JIT.stop).to eq(true)
+    end
+
+    it 'ignores a broken file' do
+      File.binwrite(path, 'broken')
+      expect(LLRB::JIT.start(profile: path)).to eq(true)
+      expect(LLRB::JIT.stop).to eq(true)
+    end
+
+    it 'ignores malformed entries' do
+      entries = [
+        [0, '1', 'hello', 'x', 1, 1, 1, 0, []], # line isn't an integer
+        [1, 1, 'hello', 'x', 1, 1, 1, 0, []],   # path index is out of range
+        [0, 1, 'hello'],
+        'broken',
+      ]
+      File.write(path, JSON.generate(format: 2, paths: ['llrb_malformed.rb'], entries: entries))
+      expect(LLRB::JIT.start(profile: path)).to eq(true)
+      expect(LLRB::JIT.instance_variable_get(:@preloaded_locations)).to be_empty
+      expect(LLRB::JIT.stop).to eq(true)
+    end
+
+    it 'compiles a method in the profile once it is defined' do
+      source = "def hello\n  100\nend"
+      first = Class.new
+      first.class_eval(source, 'llrb_preload.rb', 1)
+      expect(LLRB::JIT.compile(first.new, :hello)).to eq(true)
+
+      prefix = 'llrb_preload.rb:1:hello:'
+      checksum = LLRB::JIT.send(:compiled_profile).keys.find { |key| key.start_with?(prefix) }[prefix.size..-1]
+      entry = [0, 1, 'hello', checksum, 0, 1, 1, 0, []] # sampled once, not compiled
+      File.write(path, JSON.generate(format: 2, paths: ['llrb_preload.rb'], entries: [entry]))
+      expect(LLRB::JIT.start(profile: path)).to eq(true)
+
+      second = Class.new
+      second.class_eval(source, 'llrb_preload.rb', 1)
+      deadline = Time.now + 10
+      second.new.hello until LLRB::JIT.compiled?(second.new, :hello) || Time.now > deadline
+      expect(LLRB::JIT.compiled?(second.new, :hello)).to eq(true)
+      expect(LLRB::JIT.stop).to eq(true)
+    end
+
+    it 'compiles a singleton method in the profile once it is defined' do
+      source = "def self.hello\n  100\nend"
+      first = Class.new
+      first.class_eval(source, 'llrb_preload_singleton.rb', 1)
+      expect(LLRB::JIT.compile(first, :hello)).to eq(true)
+
+      prefix = 'llrb_preload_singleton.rb:1:hello:'
+      checksum = LLRB::JIT.send(:compiled_profile).keys.find { |key| key.start_with?(prefix) }[prefix.size..-1]
+      entry = [0, 1, 'hello', checksum, 0, 1, 1, 0, []] # sampled once, not compiled
+      File.write(path, JSON.generate(format: 2, paths: ['llrb_preload_singleton.rb'], entries: [entry]))
+      expect(LLRB::JIT.start(profile: path)).to eq(true)
+
+      second = Class.new
+      second.class_eval(source, 'llrb_preload_singleton.rb', 1)
+      deadline = Time.now + 10
+      second.hello until LLRB::JIT.compiled?(second, :hello) || Time.now > deadline
+      expect(LLRB::JIT.compiled?(second, :hello)).to eq(true)
+      expect(LLRB::JIT.instance_variable_get(:@preloaded_locations)).to be_empty # matched by singleton_method_added
+      expect(LLRB::JIT.const_get(:MethodPreloader).private_method_defined?(:singleton_method_added)).to eq(false)
+      expect(LLRB::JIT.stop).to eq(true)
+    end
+  end
+
+  describe '.dump_iseq' do
+    let(:path) { "/tmp/llrb-iseq-#{Process.pid}" }
+    after { File.delete(path) if File.exist?(path) }
+
+    it 'writes an ISeq which .replay_iseq compiles' do
+      klass = Class.new
+      def klass.hello(a)
+        [1, 2].map { |x| x + a }
+      end
+      expect(LLRB::JIT.compile(klass, :hello)).to eq(true)
+      expect(LLRB::JIT.dump_iseq(klass.method(:hello), path)).to eq(true)
+      expect(klass.hello(1)).to eq([2, 3])
+
+      replay = LLRB::JIT.replay_iseq(path, times: 2)
+      expect(replay[:location]).to end_with("#{__FILE__}:#{__LINE__ - 8}")
+      expect(replay[:tier]).to eq(2) # LLRB_TIER_OPTIMIZED
+      expect(replay[:results].size).to eq(2)
+      expect(replay[:results]).to all(include(:ir, :codegen, :ir_insns, :code_size))
+    end
+
+    it 'returns false for a method defined with C function' do
+      expect(LLRB::JIT.dump_iseq(1.method(:+), path)).to eq(false)
+    end
+
+    it 'raises for a file not written by .dump_iseq' do
+      File.binwrite(path, Marshal.dump('broken'))
+      expect { LLRB::JIT.replay_iseq(path) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe '.sampled_profile' do
+    it 'returns samples keyed by ISeq' do
+      expect(LLRB::JIT.sampled_profile).to be_a(Hash)
+    end
+
+    it 'counts callers, loops and time in C methods of sampled methods' do
+      klass = Class.new
+      klass.class_eval(<<-RUBY, 'llrb_sampled.rb', 1)
+        def self.outer
+          inner(3)
+          via_c
+        end
+
+        def self.inner(n)
+          i = 0
+          while i < n
+            LLRB::JIT.send(:sample_caller)
+            i += 1
+          end
+        end
+
+        def self.via_c
+          [1, 2].each(&LLRB::JIT.method(:sample_caller))
+        end
+      RUBY
+      key = ->(name) { LLRB::JIT.send(:profile_key, RubyVM::InstructionSequence.of(klass.method(name))) }
+
+      # The timer doesn't fire in the spec, and each sample is taken by sample_caller.
+      expect(LLRB::JIT.start(interval: 60_000_000, compile_every: 1_000_000)).to eq(true)
+      klass.outer
+      profile = LLRB::JIT.sampled_profile
+      expect(LLRB::JIT.stop).to eq(true)
+
+      outer, inner, via_c = profile.values_at(key.(:outer), key.(:inner), key.(:via_c))
+      expect(outer).to include(self: 0, inclusive: 5)
+      expect(inner).to include(self: 3, inclusive: 3, loop: 3, callers: { key.(:outer) => 3 })
+      expect(via_c).to include(self: 2, inclusive: 2, loop: 0, callers: { key.(:outer) => 2 }) # Inside Array#each
+    end
+
+    it 'drops the coldest samples beyond its cap' do
+      klass = Class.new
+      labels = ['flush', 'hot'] + 48.times.map { |i| "cold#{i}" }
+      labels.each do |label|
+        source = "def self.#{label}(n); i = 0; while i < n; LLRB::JIT.send(:sample_caller); i += 1; end; end"
+        klass.class_eval(source, 'llrb_prune.rb', 1)
+      end
+      sampled = lambda do |label|
+        LLRB::JIT.sampled_profile.values.find { |s| s[:path] == 'llrb_prune.rb' && s[:label] == label }
+      end
+
+      # The timer doesn't fire in the spec, and each method samples itself.
+      max = LLRB::JIT.send(:set_sample_table_max, 0)
+      begin
+        expect(LLRB::JIT.start(interval: 60_000_000, compile_every: 1_000_000, depth: 1)).to eq(true)
+        klass.flush(1) # Samples of previous specs are dropped, except compiled ones.
+        kept = LLRB::JIT.sampled_profile.size
+        LLRB::JIT.send(:set_sample_table_max, (kept + 16) * 4 / 3) # About 16 new samples are left by pruning.
+
+        klass.hot(50)
+        labels.drop(2).each { |label| klass.send(label, 1) }
+        expect(LLRB::JIT.stop).to eq(true)
+      ensure
+        LLRB::JIT.send(:set_sample_table_max, max)
+      end
+
+      # Later samples weigh more, so the first cold one is dropped before the last one.
+      expect(sampled.call('hot')[:self]).to eq(50)
+      expect(sampled.call('cold0')).to eq(nil)
+      expect(sampled.call('cold47')[:self]).to eq(1)
+    end
+  end
+
+  describe '.compile_hot_methods' do
+    it 'returns the number of compiled methods' do
+      expect(LLRB::JIT.compile_hot_methods(min_samples: 1)).to be_a(Integer)
+    end
+
+    it 'compiles blocks of a hot method in the same tier' do
+      klass = Class.new
+      def klass.hot
+        [1].each { |x| x }
+        i = 0
+        i += 1 while i < 100_000
+      end
+
+      line = klass.method(:hot).source_location.last
+      sample = nil
+      expect(LLRB::JIT.start(interval: 100, compile_every: 1_000_000)).to eq(true)
+      deadline = Time.now + 10
+      until sample || Time.now > deadline
+        klass.hot
+        sample = LLRB::JIT.sampled_profile.values.find { |s| s[:line] == line && s[:label] == 'hot' }
+      end
+      expect(LLRB::JIT.stop).to eq(true)
+
+      # Only the method is hot enough, and its block is compiled along with it.
+      expect(LLRB::JIT.compile_hot_methods(min_samples: sample[:self])).to be >= 1
+      prefixes = ["#{__FILE__}:#{line}:hot:", "#{__FILE__}:#{line + 1}:block in hot:"]
+      tiers = LLRB::JIT.send(:compiled_profile).select { |key, _| key.start_with?(*prefixes) }
+      expect(tiers.size).to eq(2)
+      expect(tiers.values).to eq([2, 2]) # LLRB_TIER_OPTIMIZED
+    end
+
+    it 'compiles a hot method which a forked child runs compiled' do
+      klass = Class.new
+      def klass.forked
+        i = 0
+        i += 1 while i < 100_000
+        i
+      end
+
+      line = klass.method(:forked).source_location.last
+      sample = nil
+      expect(LLRB::JIT.start(interval: 100, compile_every: 1_000_000)).to eq(true)
+      deadline = Time.now + 10
+      until sample || Time.now > deadline
+        klass.forked
+        sample = LLRB::JIT.sampled_profile.values.find { |s| s[:line] == line && s[:label] == 'forked' }
+      end
+      expect(LLRB::JIT.stop).to eq(true)
+      expect(LLRB::JIT.compile_hot_methods(min_samples: sample[:self])).to be >= 1
+
+      reader, writer = IO.pipe
+      pid = fork do
+        reader.close
+        writer.write([LLRB::JIT.compiled?(klass, :forked), klass.forked].inspect)
+        writer.close
+        exit!(0)
+      end
+      writer.close
+      result = reader.read
+      reader.close
+      Process.wait(pid)
+      expect(result).to eq('[true, 100000]')
+    end
   end
 
   describe '.compiled?' do
@@ -24,5 +574,23 @@ RSpec.describe LLRB::JIT do
       expect(LLRB::JIT.compile(klass, :hello)).to eq(true)
       expect(LLRB::JIT.compiled?(klass, :hello)).to eq(true)
     end
+
+    it 'returns false after the method is invalidated by an event hook' do
+      klass = Class.new
+      def klass.hello
+        100
+      end
+      def klass.world
+        200
+      end
+      expect(LLRB::JIT.compile(klass, :hello)).to eq(true)
+
+      TracePoint.new(:line) {}.enable do
+        expect(LLRB::JIT.compile(klass, :world)).to eq(true) # checks invalidation
+        expect(LLRB::JIT.compiled?(klass, :hello)).to eq(false)
+        expect(klass.hello).to eq(100)
+      end
+      expect(LLRB::JIT.compile(klass, :hello)).to eq(true)
+    end
   end
 end